@@ -40,6 +40,16 @@
 #include <string.h>
 #endif
 
+/*
+ * A long that may not be aligned. Loads through a pointer to this are
+ * left to the compiler, which knows how to do them on the machine at
+ * hand: on MIPS each one is an lwl/lwr pair, on machines that don't
+ * care about alignment a plain load.
+ */
+struct unaligned_long {
+	long val;
+} __attribute__((__packed__));
+
 /*
  * C standard function - copy a block of memory.
  */
@@ -47,40 +57,78 @@
 void *
 memcpy(void *dst, const void *src, size_t len)
 {
-	size_t i;
+	char *d = dst;
+	const char *s = src;
 
 	/*
 	 * memcpy does not support overlapping buffers, so always do it
 	 * forwards. (Don't change this without adjusting memmove.)
 	 *
-	 * For speedy copying, optimize the common case where both pointers
-	 * and the length are word-aligned, and copy word-at-a-time instead
-	 * of byte-at-a-time. Otherwise, copy by bytes.
+	 * For speedy copying, anything longer than a few words is done
+	 * in three parts: bytes until the destination is word-aligned,
+	 * then the bulk of it by words, four to an iteration, then
+	 * the remaining bytes. If the source is aligned too the words
+	 * are ordinary loads; if not, they go through unaligned_long,
+	 * which is still much faster than bytes.
 	 *
 	 * The alignment logic below should be portable. We rely on
 	 * the compiler to be reasonably intelligent about optimizing
 	 * the divides and modulos out. Fortunately, it is.
 	 */
 
-	if ((uintptr_t)dst % sizeof(long) == 0 &&
-	    (uintptr_t)src % sizeof(long) == 0 &&
-	    len % sizeof(long) == 0) {
+	if (len >= 4*sizeof(long)) {
+		while ((uintptr_t)d % sizeof(long) != 0) {
+			*d++ = *s++;
+			len--;
+		}
 
-		long *d = dst;
-		const long *s = src;
+		if ((uintptr_t)s % sizeof(long) == 0) {
+			long *ld = (long *)d;
+			const long *ls = (const long *)s;
 
-		for (i=0; i<len/sizeof(long); i++) {
-			d[i] = s[i];
+			while (len >= 4*sizeof(long)) {
+				ld[0] = ls[0];
+				ld[1] = ls[1];
+				ld[2] = ls[2];
+				ld[3] = ls[3];
+				ld += 4;
+				ls += 4;
+				len -= 4*sizeof(long);
+			}
+			while (len >= sizeof(long)) {
+				*ld++ = *ls++;
+				len -= sizeof(long);
+			}
+			d = (char *)ld;
+			s = (const char *)ls;
 		}
-	}
-	else {
-		char *d = dst;
-		const char *s = src;
+		else {
+			long *ld = (long *)d;
+			const struct unaligned_long *ls =
+				(const struct unaligned_long *)s;
 
-		for (i=0; i<len; i++) {
-			d[i] = s[i];
+			while (len >= 4*sizeof(long)) {
+				ld[0] = ls[0].val;
+				ld[1] = ls[1].val;
+				ld[2] = ls[2].val;
+				ld[3] = ls[3].val;
+				ld += 4;
+				ls += 4;
+				len -= 4*sizeof(long);
+			}
+			while (len >= sizeof(long)) {
+				*ld++ = (ls++)->val;
+				len -= sizeof(long);
+			}
+			d = (char *)ld;
+			s = (const char *)ls;
 		}
 	}
 
+	while (len > 0) {
+		*d++ = *s++;
+		len--;
+	}
+
 	return dst;
 }
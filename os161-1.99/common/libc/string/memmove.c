@@ -40,6 +40,11 @@
 #include <string.h>
 #endif
 
+/* See memcpy.c. */
+struct unaligned_long {
+	long val;
+} __attribute__((__packed__));
+
 /*
  * C standard function - copy a block of memory, handling overlapping
  * regions correctly.
@@ -48,7 +53,8 @@
 void *
 memmove(void *dst, const void *src, size_t len)
 {
-	size_t i;
+	char *d;
+	const char *s;
 
 	/*
 	 * If the buffers don't overlap, it doesn't matter what direction
@@ -84,34 +90,67 @@ memmove(void *dst, const void *src, size_t len)
 	}
 
 	/*
-	 * Copy by words in the common case. Look in memcpy.c for more
+	 * Copy by words in the common case, working down from the end.
+	 * This is memcpy backwards; look in memcpy.c for more
 	 * information.
 	 */
 
-	if ((uintptr_t)dst % sizeof(long) == 0 &&
-	    (uintptr_t)src % sizeof(long) == 0 &&
-	    len % sizeof(long) == 0) {
+	d = (char *)dst + len;
+	s = (const char *)src + len;
 
-		long *d = dst;
-		const long *s = src;
+	if (len >= 4*sizeof(long)) {
+		while ((uintptr_t)d % sizeof(long) != 0) {
+			*--d = *--s;
+			len--;
+		}
 
-		/*
-		 * The reason we copy index i-1 and test i>0 is that
-		 * i is unsigned -- so testing i>=0 doesn't work.
-		 */
+		if ((uintptr_t)s % sizeof(long) == 0) {
+			long *ld = (long *)d;
+			const long *ls = (const long *)s;
 
-		for (i=len/sizeof(long); i>0; i--) {
-			d[i-1] = s[i-1];
+			while (len >= 4*sizeof(long)) {
+				ld -= 4;
+				ls -= 4;
+				ld[3] = ls[3];
+				ld[2] = ls[2];
+				ld[1] = ls[1];
+				ld[0] = ls[0];
+				len -= 4*sizeof(long);
+			}
+			while (len >= sizeof(long)) {
+				*--ld = *--ls;
+				len -= sizeof(long);
+			}
+			d = (char *)ld;
+			s = (const char *)ls;
 		}
-	}
-	else {
-		char *d = dst;
-		const char *s = src;
+		else {
+			long *ld = (long *)d;
+			const struct unaligned_long *ls =
+				(const struct unaligned_long *)s;
 
-		for (i=len; i>0; i--) {
-			d[i-1] = s[i-1];
+			while (len >= 4*sizeof(long)) {
+				ld -= 4;
+				ls -= 4;
+				ld[3] = ls[3].val;
+				ld[2] = ls[2].val;
+				ld[1] = ls[1].val;
+				ld[0] = ls[0].val;
+				len -= 4*sizeof(long);
+			}
+			while (len >= sizeof(long)) {
+				*--ld = (--ls)->val;
+				len -= sizeof(long);
+			}
+			d = (char *)ld;
+			s = (const char *)ls;
 		}
 	}
 
+	while (len > 0) {
+		*--d = *--s;
+		len--;
+	}
+
 	return dst;
 }
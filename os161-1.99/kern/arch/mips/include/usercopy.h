@@ -0,0 +1,56 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _MIPS_USERCOPY_H_
+#define _MIPS_USERCOPY_H_
+
+/*
+ * User-space copy primitives used by copyin/copyout et al., reached
+ * as <machine/usercopy.h>; here they're in usercopy.S. A fault on a bad address
+ * inside them makes them return EFAULT (mips_trap looks up the PC in
+ * its fixup table), so callers need no recovery setup of their own.
+ * The caller must still check that the user addresses are below
+ * USERSPACETOP.
+ *
+ * machdep_usercopy copies LEN bytes and returns 0 or EFAULT.
+ *
+ * machdep_usercopystr copies a null-terminated string of at most LEN
+ * bytes and stores its length (including the null) in *GOT, which
+ * must be a valid kernel pointer. It returns 0, ENAMETOOLONG if no
+ * null was found within LEN bytes, or EFAULT.
+ */
+
+int machdep_usercopy(void *dest, const void *src, size_t len);
+int machdep_usercopystr(char *dest, const char *src, size_t len, size_t *got);
+
+/* Bounds of the code covered by the fixup, and where it resumes. */
+extern char mips_usercopy_start[], mips_usercopy_end[];
+extern char mips_usercopy_fault[];
+
+#endif /* _MIPS_USERCOPY_H_ */
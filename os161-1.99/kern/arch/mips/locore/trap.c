@@ -32,6 +32,7 @@
 #include <lib.h>
 #include <mips/specialreg.h>
 #include <mips/trapframe.h>
+#include <mips/usercopy.h>
 #include <cpu.h>
 #include <spl.h>
 #include <thread.h>
@@ -39,6 +40,8 @@
 #include <vm.h>
 #include <mainbus.h>
 #include <syscall.h>
+#include <proc.h>
+#include "opt-A2.h"
 
 
 /* in exception.S */
@@ -47,6 +50,18 @@ extern void asm_usermode(struct trapframe *tf);
 /* called only from assembler, so not declared in a header */
 void mips_trap(struct trapframe *tf);
 
+/*
+ * Fault fixup table. A fatal kernel-mode fault with the PC in
+ * [start, end) resumes at fixup instead of panicking. The code in
+ * these ranges must be written so that's safe; see usercopy.S.
+ */
+static const struct {
+	const char *start, *end, *fixup;
+} faultfixups[] = {
+	{ mips_usercopy_start, mips_usercopy_end, mips_usercopy_fault },
+};
+#define NFAULTFIXUPS (sizeof(faultfixups) / sizeof(faultfixups[0]))
+
 
 /* Names for trap codes */
 #define NTRAPCODES 13
@@ -128,6 +143,7 @@ mips_trap(struct trapframe *tf)
 	uint32_t code;
 	bool isutlb, iskern;
 	int spl;
+	unsigned i;
 
 	/* The trap frame is supposed to be 37 registers long. */
 	KASSERT(sizeof(struct trapframe)==(37*4));
@@ -278,24 +294,32 @@ mips_trap(struct trapframe *tf)
 	/*
 	 * Fatal fault in kernel mode.
 	 *
-	 * If pcb_badfaultfunc is set, we do not panic; badfaultfunc is
-	 * set by copyin/copyout and related functions to signify that
-	 * the addresses they're accessing are userlevel-supplied and
-	 * not trustable. What we actually want to do is resume
-	 * execution at the function pointed to by badfaultfunc. That's 
-	 * going to be "copyfail" (see copyinout.c), which longjmps 
-	 * back to copyin/copyout or wherever and returns EFAULT.
+	 * If the faulting PC is in one of the ranges in the fixup
+	 * table, we do not panic: that code is accessing addresses
+	 * that are userlevel-supplied and not trustable (copyin,
+	 * copyout, and friends; see usercopy.S) and is arranged to be
+	 * abandoned at any instruction. Resume execution at the
+	 * range's fixup address instead, which returns EFAULT to the
+	 * caller.
 	 *
-	 * Note that we do not just *call* this function, because that
-	 * won't necessarily do anything. We want the control flow
-	 * that is currently executing in copyin (or whichever), and
-	 * is stopped while we process the exception, to *teleport* to
-	 * copyfail.
+	 * Note that we do not *call* the fixup. We want the control
+	 * flow that is currently executing in the copy, and is
+	 * stopped while we process the exception, to *teleport* to
+	 * the fixup. This is accomplished by changing tf->tf_epc and
+	 * returning from the exception handler.
 	 *
-	 * This is accomplished by changing tf->tf_epc and returning
-	 * from the exception handler.
+	 * tm_badfaultfunc is the older, per-thread form of the same
+	 * hook, for code that can't be placed in a fixup range.
 	 */
 
+	for (i=0; i<NFAULTFIXUPS; i++) {
+		if (tf->tf_epc >= (vaddr_t) faultfixups[i].start &&
+		    tf->tf_epc < (vaddr_t) faultfixups[i].end) {
+			tf->tf_epc = (vaddr_t) faultfixups[i].fixup;
+			goto done;
+		}
+	}
+
 	if (curthread != NULL &&
 	    curthread->t_machdep.tm_badfaultfunc != NULL) {
 		tf->tf_epc = (vaddr_t) curthread->t_machdep.tm_badfaultfunc;
@@ -321,6 +345,20 @@ mips_trap(struct trapframe *tf)
 	cpu_irqoff();
  done2:
 
+#if OPT_A2
+	/*
+	 * If another thread is exiting this process, don't go back to
+	 * user mode. The recorded interrupt state is already "on"
+	 * here for traps from user mode; make the real state match
+	 * before sleeping.
+	 */
+	if (!iskern && curproc != NULL && curproc->p_exiting) {
+		cpu_irqon();
+		uthread_exitcheck();
+		cpu_irqoff();
+	}
+#endif
+
 	/*
 	 * The boot thread can get here (e.g. on interrupt return) but
 	 * since it doesn't go to userlevel, it can't be returning to
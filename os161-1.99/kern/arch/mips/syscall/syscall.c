@@ -35,9 +35,251 @@
 #include <thread.h>
 #include <current.h>
 #include <syscall.h>
+#include <copyinout.h>
+#include <cpu.h>
+#include <kern/syscallstat.h>
 #include <opt-A1.h>
+#include <opt-A2.h>
 
 
+/*
+ * System call table.
+ *
+ * Each entry unpacks the arguments for one call from the trapframe
+ * and calls the in-kernel implementation. The return value goes in
+ * *retval; the function's own return is the error code.
+ */
+
+typedef int (*syscall_func)(struct trapframe *tf, int32_t *retval);
+
+struct syscall_desc {
+	const char *sd_name;
+	syscall_func sd_func;
+};
+
+#if OPT_A1
+static
+int
+sc_fork(struct trapframe *tf, int32_t *retval)
+{
+	return sys_fork((pid_t *)retval, tf);
+}
+#endif
+
+static
+int
+sc_reboot(struct trapframe *tf, int32_t *retval)
+{
+	(void)retval;
+	return sys_reboot(tf->tf_a0);
+}
+
+static
+int
+sc___time(struct trapframe *tf, int32_t *retval)
+{
+	(void)retval;
+	return sys___time((userptr_t)tf->tf_a0,
+			  (userptr_t)tf->tf_a1);
+}
+
+static
+int
+sc_execv(struct trapframe *tf, int32_t *retval)
+{
+	(void)retval;
+	return sys_execv((userptr_t) tf->tf_a0, (userptr_t) tf->tf_a1);
+}
+
+#ifdef UW
+static
+int
+sc_write(struct trapframe *tf, int32_t *retval)
+{
+	return sys_write((int)tf->tf_a0,
+			 (userptr_t)tf->tf_a1,
+			 (int)tf->tf_a2,
+			 (int *)retval);
+}
+
+static
+int
+sc__exit(struct trapframe *tf, int32_t *retval)
+{
+	(void)retval;
+	sys__exit((int)tf->tf_a0);
+	/* sys__exit does not return, execution should not get here */
+	panic("unexpected return from sys__exit");
+	return 0;
+}
+
+static
+int
+sc_getpid(struct trapframe *tf, int32_t *retval)
+{
+	(void)tf;
+	return sys_getpid((pid_t *)retval);
+}
+
+static
+int
+sc_waitpid(struct trapframe *tf, int32_t *retval)
+{
+	return sys_waitpid((pid_t)tf->tf_a0,
+			   (userptr_t)tf->tf_a1,
+			   (int)tf->tf_a2,
+			   (pid_t *)retval);
+}
+#endif // UW
+
+#if OPT_A2
+/*
+ * Fetch a 64-bit argument that did not fit in a0-a3. For calls of
+ * the form f(int, ptr, size_t, off_t) a0-a2 are taken and a3 alone
+ * is not an aligned pair, so the value lives on the user stack at
+ * sp+16, as described below.
+ */
+static
+int
+fetch_stack_off(struct trapframe *tf, off_t *ret)
+{
+	return copyin((const_userptr_t)(tf->tf_sp + 16), ret, sizeof(*ret));
+}
+
+static
+int
+sc_spawn(struct trapframe *tf, int32_t *retval)
+{
+	return sys_spawn((userptr_t)tf->tf_a0,
+			 (userptr_t)tf->tf_a1,
+			 (pid_t *)retval);
+}
+
+static
+int
+sc_pread(struct trapframe *tf, int32_t *retval)
+{
+	off_t pos;
+	int err;
+
+	err = fetch_stack_off(tf, &pos);
+	if (err) {
+		return err;
+	}
+	return sys_pread((int)tf->tf_a0,
+			 (userptr_t)tf->tf_a1,
+			 (size_t)tf->tf_a2,
+			 pos,
+			 (ssize_t *)retval);
+}
+
+static
+int
+sc_pwrite(struct trapframe *tf, int32_t *retval)
+{
+	off_t pos;
+	int err;
+
+	err = fetch_stack_off(tf, &pos);
+	if (err) {
+		return err;
+	}
+	return sys_pwrite((int)tf->tf_a0,
+			  (userptr_t)tf->tf_a1,
+			  (size_t)tf->tf_a2,
+			  pos,
+			  (ssize_t *)retval);
+}
+
+static
+int
+sc___thread_create(struct trapframe *tf, int32_t *retval)
+{
+	return sys_thread_create((userptr_t)tf->tf_a0,
+				 (userptr_t)tf->tf_a1,
+				 (userptr_t)tf->tf_a2,
+				 (int *)retval);
+}
+
+static
+int
+sc_thread_join(struct trapframe *tf, int32_t *retval)
+{
+	(void)retval;
+	return sys_thread_join((int)tf->tf_a0, (userptr_t)tf->tf_a1);
+}
+
+static
+int
+sc_thread_exit(struct trapframe *tf, int32_t *retval)
+{
+	(void)retval;
+	sys_thread_exit((int)tf->tf_a0);
+	panic("unexpected return from sys_thread_exit");
+	return 0;
+}
+
+static
+int
+sc_futex(struct trapframe *tf, int32_t *retval)
+{
+	return sys_futex((userptr_t)tf->tf_a0,
+			 (int)tf->tf_a1,
+			 (int)tf->tf_a2,
+			 (int *)retval);
+}
+#endif /* OPT_A2 */
+
+static
+int
+sc___syscallstat(struct trapframe *tf, int32_t *retval)
+{
+	(void)retval;
+	return sys___syscallstat((int)tf->tf_a0, (userptr_t)tf->tf_a1);
+}
+
+#define SC(name) [SYS_##name] = { #name, sc_##name }
+
+static const struct syscall_desc syscall_table[SYSCALLSTAT_NCALLS] = {
+#if OPT_A1
+	SC(fork),
+#endif
+	SC(execv),
+	SC(reboot),
+	SC(__time),
+#ifdef UW
+	SC(write),
+	SC(_exit),
+	SC(getpid),
+	SC(waitpid),
+#endif
+#if OPT_A2
+	SC(spawn),
+	SC(pread),
+	SC(pwrite),
+	SC(__thread_create),
+	SC(thread_join),
+	SC(thread_exit),
+	SC(futex),
+#endif
+	SC(__syscallstat),
+};
+
+#undef SC
+
+/*
+ * Return the name of system call CALLNO, or NULL if it isn't one we
+ * implement.
+ */
+const char *
+syscall_name(int callno)
+{
+	if (callno < 0 || callno >= SYSCALLSTAT_NCALLS) {
+		return NULL;
+	}
+	return syscall_table[callno].sd_name;
+}
+
 /*
  * System call dispatcher.
  *
@@ -79,9 +321,11 @@
 void
 syscall(struct trapframe *tf)
 {
+	const struct syscall_desc *sd;
 	int callno;
 	int32_t retval;
 	int err;
+	uint32_t start;
 
 	KASSERT(curthread != NULL);
 	KASSERT(curthread->t_curspl == 0);
@@ -100,52 +344,22 @@ syscall(struct trapframe *tf)
 
 	retval = 0;
 
-	switch (callno) {
-		#if OPT_A1
-		case SYS_fork:
-			err = sys_fork((pid_t *) &retval, tf);
-			break;
-		#endif
-	    case SYS_reboot:
-		err = sys_reboot(tf->tf_a0);
-		break;
-
-	    case SYS___time:
-		err = sys___time((userptr_t)tf->tf_a0,
-				 (userptr_t)tf->tf_a1);
-		break;
-
-		case SYS_execv:
-			err = sys_execv((char *) tf->tf_a0, (char **) tf->tf_a1);
-#ifdef UW
-	case SYS_write:
-	  err = sys_write((int)tf->tf_a0,
-			  (userptr_t)tf->tf_a1,
-			  (int)tf->tf_a2,
-			  (int *)(&retval));
-	  break;
-	case SYS__exit:
-	  sys__exit((int)tf->tf_a0);
-	  /* sys__exit does not return, execution should not get here */
-	  panic("unexpected return from sys__exit");
-	  break;
-	case SYS_getpid:
-	  err = sys_getpid((pid_t *)&retval);
-	  break;
-	case SYS_waitpid:
-	  err = sys_waitpid((pid_t)tf->tf_a0,
-			    (userptr_t)tf->tf_a1,
-			    (int)tf->tf_a2,
-			    (pid_t *)&retval);
-	  break;
-#endif // UW
+	if (callno < 0 || callno >= SYSCALLSTAT_NCALLS ||
+	    syscall_table[callno].sd_func == NULL) {
+		kprintf("Unknown syscall %d\n", callno);
+		err = ENOSYS;
+	}
+	else {
+		sd = &syscall_table[callno];
 
-	    /* Add stuff here */
- 
-	default:
-	  kprintf("Unknown syscall %d\n", callno);
-	  err = ENOSYS;
-	  break;
+		/*
+		 * Count the call before running it, since some calls
+		 * (_exit, successful execv) never come back here.
+		 */
+		syscallstat_enter(callno);
+		start = cpu_cycles();
+		err = sd->sd_func(tf, &retval);
+		syscallstat_exit(callno, cpu_cycles() - start);
 	}
 
 
@@ -234,3 +234,22 @@ cpu_halt(void)
 		wait();
         }
 }
+
+/*
+ * Read the cycle counter. The mips32 count register (coprocessor 0
+ * register 9) is 32 bits wide and wraps, so only differences between
+ * nearby readings mean anything.
+ */
+uint32_t
+cpu_cycles(void)
+{
+	uint32_t x;
+
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 instructions */
+		"mfc0 %0,$9;"		/* read c0_count */
+		".set pop"		/* restore assembler mode */
+		: "=r" (x));
+	return x;
+}
@@ -38,6 +38,7 @@
 #include <addrspace.h>
 #include <vm.h>
 #include <syscall.h>
+#include <slab.h>
 
 
 /*
@@ -48,7 +49,10 @@
 /* under dumbvm, always have 48k of user stack */
 #define DUMBVM_STACKPAGES    12
 #define ALLOC_POISSON -1
-#define THREAD_STACK_MAGIC 0xbaadf00d
+
+/* top of the stack for extra user thread SLOT, just below the main stack */
+#define TSTACK_TOP(slot) \
+	(USERSTACK - ((slot) + 1) * DUMBVM_STACKPAGES * PAGE_SIZE)
 
 /*
  * Wrap rma_stealmem in a spinlock.
@@ -63,18 +67,26 @@ bool physmap_ready = false;
 void
 vm_bootstrap(void)
 {
+	unsigned int npages, mappages;
+
 	ram_getsize(&lo, &hi);
-	physmap_size =  (hi-lo)/PAGE_SIZE;
-	physmap_size -= physmap_size*sizeof(unsigned int*)/PAGE_SIZE;
-	freePages = physmap_size;
-	lo += physmap_size*sizeof(unsigned int*)/PAGE_SIZE;
+	npages = (hi-lo)/PAGE_SIZE;
+	/* the map itself takes whole pages at the bottom of free memory */
+	mappages = DIVROUNDUP(npages*sizeof(unsigned int), PAGE_SIZE);
 	physmap = ((unsigned int *) PADDR_TO_KVADDR(lo));
+	lo += mappages*PAGE_SIZE;
+	physmap_size = npages - mappages;
+	freePages = physmap_size;
 	for(unsigned int i=0; i<physmap_size; i++) {
 		physmap[i] = 0;
 	}
 	physmap_ready = true;
 }
 
+/*
+ * Find NPAGES free contiguous pages in the physical map. Call with
+ * stealmem_lock held; getppages_locked takes it for you.
+ */
 static
 paddr_t
 getppages(unsigned long npages)
@@ -102,18 +114,28 @@ getppages(unsigned long npages)
 	return 0;
 }
 
+static
+paddr_t
+getppages_locked(unsigned long npages)
+{
+	paddr_t pa;
+
+	spinlock_acquire(&stealmem_lock);
+	pa = getppages(npages);
+	spinlock_release(&stealmem_lock);
+	return pa;
+}
+
 /* Allocate/free some kernel-space virtual pages */
 vaddr_t 
 alloc_kpages(int npages)
 {	
 	paddr_t pa;
 	if(physmap_ready) {
-		spinlock_acquire(&stealmem_lock);
-		pa = getppages(npages);
+		pa = getppages_locked(npages);
 		if (pa==0) {
 			return 0;
 		}
-		spinlock_release(&stealmem_lock);
 	} else {
 		spinlock_acquire(&stealmem_lock);
 		pa = ram_stealmem(npages);
@@ -122,23 +144,19 @@ alloc_kpages(int npages)
 	return PADDR_TO_KVADDR(pa);
 }
 
-void memory_leak(unsigned int a, unsigned int b) {
-	for(unsigned int i = a; i<=b && i<physmap_size; i++) {
-		//kprintf("i: %u, val[i]: %u\n", i, physmap[i]);
-		// if(physmap[i]==3131961357) {
-		// 	physmap[i] = 0;
-		// }
-	}
-}
-
 void putppages(paddr_t addr) { 
 	if(physmap_ready==false) {
 		return;
 	}
+	/* memory stolen before the map existed (or none at all) stays put */
+	if(addr < lo) {
+		return;
+	}
 	unsigned int cnt = 1;
 	unsigned int i = (addr-lo)/PAGE_SIZE;
 	unsigned int last = 1;
 
+	spinlock_acquire(&stealmem_lock);
 	unsigned int npages = physmap[i];
 	physmap[i] = 0;
 	i+=1;
@@ -153,14 +171,11 @@ void putppages(paddr_t addr) {
 	}
 	//make sure man don't leak
 	freePages+=cnt;
+	spinlock_release(&stealmem_lock);
 	// kprintf("npages: %u, cnt: %u\n", npages, cnt);
 	// kprintf("free pages sucessful for addr: 0x%x, freePages: %u\n\n", addr, freePages);
 
-	//this dumb value that's put at the bottom of the stack interferes with my size value placed at addr 0x3b000
-	//harvard pls fix
-	if(npages!=THREAD_STACK_MAGIC) {
-		KASSERT(cnt==npages);
-	}
+	KASSERT(cnt==npages);
 }
 
 void 
@@ -185,7 +200,7 @@ vm_tlbshootdown(const struct tlbshootdown *ts)
 int
 vm_fault(int faulttype, vaddr_t faultaddress)
 {
-	vaddr_t vbase1, vtop1, vbase2, vtop2, stackbase, stacktop;
+	vaddr_t vbase1, vtop1, vbase2, vtop2, stackbase, stacktop, tstackbase;
 	paddr_t paddr;
 	int i;
 	uint32_t ehi, elo;
@@ -245,6 +260,7 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	vtop2 = vbase2 + as->as_npages2 * PAGE_SIZE;
 	stackbase = USERSTACK - DUMBVM_STACKPAGES * PAGE_SIZE;
 	stacktop = USERSTACK;
+	tstackbase = TSTACK_TOP(AS_MAXTSTACKS - 1) - DUMBVM_STACKPAGES * PAGE_SIZE;
 
 
 	if (faultaddress >= vbase1 && faultaddress < vtop1) {
@@ -256,6 +272,15 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	else if (faultaddress >= stackbase && faultaddress < stacktop) {
 		paddr = (faultaddress - stackbase) + as->as_stackpbase;
 	}
+	else if (faultaddress >= tstackbase && faultaddress < stackbase) {
+		/* thread stacks are stacked downward below the main one */
+		i = (stackbase - 1 - faultaddress) / (DUMBVM_STACKPAGES * PAGE_SIZE);
+		if (!as->as_tstackused[i]) {
+			return EFAULT;
+		}
+		paddr = faultaddress - (TSTACK_TOP(i) - DUMBVM_STACKPAGES * PAGE_SIZE)
+			+ as->as_tstackpbase[i];
+	}
 	else {
 		return EFAULT;
 	}
@@ -301,10 +326,15 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	return 0;
 }
 
+/* Address spaces have no constructed state worth keeping. */
+static struct slabcache as_cache =
+	SLABCACHE_INITIALIZER("addrspace", sizeof(struct addrspace),
+			      NULL, NULL);
+
 struct addrspace *
 as_create(void)
 {
-	struct addrspace *as = kmalloc(sizeof(struct addrspace));
+	struct addrspace *as = slab_alloc(&as_cache);
 	if (as==NULL) {
 		return NULL;
 	}
@@ -316,6 +346,10 @@ as_create(void)
 	as->as_pbase2 = 0;
 	as->as_npages2 = 0;
 	as->as_stackpbase = 0;
+	for (int i = 0; i < AS_MAXTSTACKS; i++) {
+		as->as_tstackpbase[i] = 0;
+		as->as_tstackused[i] = false;
+	}
 	as->as_loaded = 0;
 
 	return as;
@@ -327,11 +361,12 @@ as_destroy(struct addrspace *as)
 	putppages(as->as_pbase1);
 	putppages(as->as_pbase2);
 	putppages(as->as_stackpbase);
-	kfree(as);
-	//don't make man leak
-	//KASSERT(freePages==physmap_size-1);
-	//kprintf("addy destroyed\n");
-	
+	for (int i = 0; i < AS_MAXTSTACKS; i++) {
+		if (as->as_tstackpbase[i] != 0) {
+			putppages(as->as_tstackpbase[i]);
+		}
+	}
+	slab_free(&as_cache, as);
 }
 
 void
@@ -417,17 +452,17 @@ as_prepare_load(struct addrspace *as)
 	KASSERT(as->as_pbase2 == 0);
 	KASSERT(as->as_stackpbase == 0);
 
-	as->as_pbase1 = getppages(as->as_npages1);
+	as->as_pbase1 = getppages_locked(as->as_npages1);
 	if (as->as_pbase1 == 0) {
 		return ENOMEM;
 	}
 
-	as->as_pbase2 = getppages(as->as_npages2);
+	as->as_pbase2 = getppages_locked(as->as_npages2);
 	if (as->as_pbase2 == 0) {
 		return ENOMEM;
 	}
 
-	as->as_stackpbase = getppages(DUMBVM_STACKPAGES);
+	as->as_stackpbase = getppages_locked(DUMBVM_STACKPAGES);
 	if (as->as_stackpbase == 0) {
 		return ENOMEM;
 	}
@@ -463,6 +498,57 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 	return 0;
 }
 
+/*
+ * Give an extra user thread its own stack. These sit one after
+ * another below the main stack, each DUMBVM_STACKPAGES long; the
+ * caller holds whatever lock keeps the slots from changing.
+ */
+int
+as_define_tstack(struct addrspace *as, int *slotret, vaddr_t *stackptr)
+{
+	int slot;
+
+	for (slot = 0; slot < AS_MAXTSTACKS; slot++) {
+		if (!as->as_tstackused[slot]) {
+			break;
+		}
+	}
+	if (slot == AS_MAXTSTACKS) {
+		return ENOMEM;
+	}
+
+	if (as->as_tstackpbase[slot] == 0) {
+		as->as_tstackpbase[slot] = getppages_locked(DUMBVM_STACKPAGES);
+		if (as->as_tstackpbase[slot] == 0) {
+			return ENOMEM;
+		}
+	}
+	as_zero_region(as->as_tstackpbase[slot], DUMBVM_STACKPAGES);
+	as->as_tstackused[slot] = true;
+
+	*slotret = slot;
+	*stackptr = TSTACK_TOP(slot);
+	return 0;
+}
+
+/*
+ * Give a stack slot back. The pages stay with the address space
+ * until it is destroyed: the process's other threads, possibly on
+ * other cpus, may still have TLB entries for the old stack, and
+ * there is no shootdown to take them back. Since a reused slot maps
+ * the same virtual pages to the same physical ones, such entries
+ * stay harmless.
+ */
+void
+as_free_tstack(struct addrspace *as, int slot)
+{
+	KASSERT(slot >= 0 && slot < AS_MAXTSTACKS);
+	KASSERT(as->as_tstackused[slot]);
+	KASSERT(as->as_tstackpbase[slot] != 0);
+
+	as->as_tstackused[slot] = false;
+}
+
 int
 as_copy(struct addrspace *old, struct addrspace **ret)
 {
@@ -499,6 +585,21 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 	memmove((void *)PADDR_TO_KVADDR(new->as_stackpbase),
 		(const void *)PADDR_TO_KVADDR(old->as_stackpbase),
 		DUMBVM_STACKPAGES*PAGE_SIZE);
+
+	for (int i = 0; i < AS_MAXTSTACKS; i++) {
+		if (!old->as_tstackused[i]) {
+			continue;
+		}
+		new->as_tstackpbase[i] = getppages_locked(DUMBVM_STACKPAGES);
+		if (new->as_tstackpbase[i] == 0) {
+			as_destroy(new);
+			return ENOMEM;
+		}
+		new->as_tstackused[i] = true;
+		memmove((void *)PADDR_TO_KVADDR(new->as_tstackpbase[i]),
+			(const void *)PADDR_TO_KVADDR(old->as_tstackpbase[i]),
+			DUMBVM_STACKPAGES*PAGE_SIZE);
+	}
 	
 	*ret = new;
 	return 0;
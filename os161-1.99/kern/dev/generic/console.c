@@ -46,8 +46,10 @@
  * and (2) if the system crashes before we find a console, no output
  * at all may appear.
  *
- * Note that we have no input buffering; characters typed too rapidly
- * will be lost.
+ * Output printed with interrupts on goes into a ring buffer that the
+ * device's write-done interrupt drains, so a writer only waits when
+ * the ring is full. Input goes into a smaller ring filled by the
+ * read interrupt; characters typed while it's full are lost.
  */
 
 #include <types.h>
@@ -57,6 +59,7 @@
 #include <thread.h>
 #include <current.h>
 #include <synch.h>
+#include <wchan.h>
 #include <generic/console.h>
 #include <vfs.h>
 #include <device.h>
@@ -111,14 +114,75 @@ flush_delay_buf(void)
 
 //////////////////////////////////////////////////
 
+/* Number of characters in the output and input rings. */
+#define OUTCOUNT(cs) ((cs)->cs_outchars_head - (cs)->cs_outchars_tail)
+#define INCOUNT(cs) ((cs)->cs_gotchars_head - (cs)->cs_gotchars_tail)
+
+/*
+ * If the device is idle, start it on the next character in the
+ * output ring. Call with cs_lock held.
+ */
+static
+void
+con_kick(struct con_softc *cs)
+{
+	unsigned char ch;
+
+	KASSERT(spinlock_do_i_hold(&cs->cs_lock));
+
+	if (cs->cs_busy || OUTCOUNT(cs) == 0) {
+		return;
+	}
+	ch = cs->cs_outchars[cs->cs_outchars_tail++ %
+			     CONSOLE_OUTPUT_BUFFER_SIZE];
+	cs->cs_busy = true;
+	cs->cs_send(cs->cs_devdata, ch);
+}
+
+/*
+ * Wake writers waiting for ring space, once it has drained to half
+ * full. Waking them per character would cost a context switch each.
+ * Call with cs_lock held.
+ */
+static
+void
+con_wakewriters(struct con_softc *cs)
+{
+	KASSERT(spinlock_do_i_hold(&cs->cs_lock));
+
+	if (cs->cs_wwaiting && OUTCOUNT(cs) <= CONSOLE_OUTPUT_BUFFER_SIZE/2) {
+		cs->cs_wwaiting = false;
+		wchan_wakeall(cs->cs_wwchan);
+	}
+}
+
+//////////////////////////////////////////////////
+
 /*
  * Print a character, using polling instead of interrupts to wait for
  * I/O completion.
+ *
+ * Anything still in the output ring goes first, so output stays in
+ * order and isn't stranded if interrupts never come back (e.g. in
+ * panic). If we got here from inside the console's own critical
+ * section, leave the ring alone rather than deadlock.
  */
 static
 void
 putch_polled(struct con_softc *cs, int ch)
 {
+	unsigned char qch;
+
+	if (OUTCOUNT(cs) > 0 && !spinlock_do_i_hold(&cs->cs_lock)) {
+		spinlock_acquire(&cs->cs_lock);
+		while (OUTCOUNT(cs) > 0) {
+			qch = cs->cs_outchars[cs->cs_outchars_tail++ %
+					      CONSOLE_OUTPUT_BUFFER_SIZE];
+			cs->cs_sendpolled(cs->cs_devdata, qch);
+		}
+		con_wakewriters(cs);
+		spinlock_release(&cs->cs_lock);
+	}
 	cs->cs_sendpolled(cs->cs_devdata, ch);
 }
 
@@ -143,14 +207,33 @@ putch_complete_polled(struct con_softc *cs)
 //////////////////////////////////////////////////
 
 /*
- * Print a character, using interrupts to wait for I/O completion.
+ * Print characters, using interrupts to wait for I/O completion.
+ *
+ * The characters are queued in the output ring; if the device is
+ * idle the first one is sent right away and con_start sends the rest
+ * as each one completes. We only sleep if the ring fills up.
  */
 static
 void
-putch_intr(struct con_softc *cs, int ch)
+putchars_intr(struct con_softc *cs, const char *buf, size_t len)
 {
-	P(cs->cs_wsem);
-	cs->cs_send(cs->cs_devdata, ch);
+	spinlock_acquire(&cs->cs_lock);
+	while (len > 0) {
+		if (OUTCOUNT(cs) == CONSOLE_OUTPUT_BUFFER_SIZE) {
+			/* Same bridge to the wchan lock as in P(). */
+			cs->cs_wwaiting = true;
+			wchan_lock(cs->cs_wwchan);
+			spinlock_release(&cs->cs_lock);
+			wchan_sleep(cs->cs_wwchan);
+			spinlock_acquire(&cs->cs_lock);
+			continue;
+		}
+		cs->cs_outchars[cs->cs_outchars_head++ %
+				CONSOLE_OUTPUT_BUFFER_SIZE] = *buf++;
+		len--;
+		con_kick(cs);
+	}
+	spinlock_release(&cs->cs_lock);
 }
 
 /*
@@ -162,49 +245,59 @@ getch_intr(struct con_softc *cs)
 {
 	unsigned char ret;
 
-	P(cs->cs_rsem);
-	ret = cs->cs_gotchars[cs->cs_gotchars_tail];
-	cs->cs_gotchars_tail =
-		(cs->cs_gotchars_tail + 1) % CONSOLE_INPUT_BUFFER_SIZE;
+	spinlock_acquire(&cs->cs_lock);
+	while (INCOUNT(cs) == 0) {
+		wchan_lock(cs->cs_rwchan);
+		spinlock_release(&cs->cs_lock);
+		wchan_sleep(cs->cs_rwchan);
+		spinlock_acquire(&cs->cs_lock);
+	}
+	ret = cs->cs_gotchars[cs->cs_gotchars_tail++ %
+			      CONSOLE_INPUT_BUFFER_SIZE];
+	spinlock_release(&cs->cs_lock);
 	return ret;
 }
 
 /*
  * Called from underlying device when a read-ready interrupt occurs.
  *
- * Note: if gotchars_head == gotchars_tail, the buffer is empty. Thus
- * if gotchars_head+1 == gotchars_tail, the buffer is full. A slightly
- * tidier way to implement this check (that avoids wasting a slot,
- * too) would be with a second semaphore used with a nonblocking P,
- * but we don't have that in OS/161.
+ * Readers only sleep when the ring is empty, so they only need
+ * waking for the first character that arrives.
  */
 void
 con_input(void *vcs, int ch)
 {
 	struct con_softc *cs = vcs;
-	unsigned nexthead;
 
-	nexthead = (cs->cs_gotchars_head + 1) % CONSOLE_INPUT_BUFFER_SIZE;
-	if (nexthead == cs->cs_gotchars_tail) {
+	spinlock_acquire(&cs->cs_lock);
+	if (INCOUNT(cs) == CONSOLE_INPUT_BUFFER_SIZE) {
 		/* overflow; drop character */
+		spinlock_release(&cs->cs_lock);
 		return;
 	}
 
-	cs->cs_gotchars[cs->cs_gotchars_head] = ch;
-	cs->cs_gotchars_head = nexthead;
-		
-	V(cs->cs_rsem);
+	cs->cs_gotchars[cs->cs_gotchars_head++ %
+			CONSOLE_INPUT_BUFFER_SIZE] = ch;
+	if (INCOUNT(cs) == 1) {
+		wchan_wakeall(cs->cs_rwchan);
+	}
+	spinlock_release(&cs->cs_lock);
 }
 
 /*
  * Called from underlying device when a write-done interrupt occurs.
+ * Send the next character from the output ring, if any.
  */
 void
 con_start(void *vcs)
 {
 	struct con_softc *cs = vcs;
 
-	V(cs->cs_wsem);
+	spinlock_acquire(&cs->cs_lock);
+	cs->cs_busy = false;
+	con_kick(cs);
+	con_wakewriters(cs);
+	spinlock_release(&cs->cs_lock);
 }
 
 //////////////////////////////////////////////////
@@ -229,7 +322,28 @@ putch(int ch)
 		putch_polled(cs, ch);
 	}
 	else {
-		putch_intr(cs, ch);
+		char c = ch;
+		putchars_intr(cs, &c, 1);
+	}
+}
+
+/*
+ * Print LEN characters, queueing them all at once if we can.
+ */
+static
+void
+putchars(const char *buf, size_t len)
+{
+	struct con_softc *cs = the_console;
+	size_t i;
+
+	if (cs != NULL && !curthread->t_in_interrupt &&
+	    curthread->t_iplhigh_count == 0) {
+		putchars_intr(cs, buf, len);
+		return;
+	}
+	for (i=0; i<len; i++) {
+		putch(buf[i]);
 	}
 }
 
@@ -298,12 +412,17 @@ con_close(struct device *dev)
 	return 0;
 }
 
+/* Bytes of user output moved into the kernel at a time. */
+#define CON_IOCHUNK 64
+
 static
 int
 con_io(struct device *dev, struct uio *uio)
 {
 	int result;
 	char ch;
+	char buf[CON_IOCHUNK], outbuf[2*CON_IOCHUNK];
+	size_t len, i, outlen;
 	struct lock *lk;
 
 	(void)dev;  // unused
@@ -334,15 +453,23 @@ con_io(struct device *dev, struct uio *uio)
 			}
 		}
 		else {
-			result = uiomove(&ch, 1, uio);
+			len = uio->uio_resid;
+			if (len > sizeof(buf)) {
+				len = sizeof(buf);
+			}
+			result = uiomove(buf, len, uio);
 			if (result) {
 				lock_release(lk);
 				return result;
 			}
-			if (ch=='\n') {
-				putch('\r');
+			outlen = 0;
+			for (i=0; i<len; i++) {
+				if (buf[i]=='\n') {
+					outbuf[outlen++] = '\r';
+				}
+				outbuf[outlen++] = buf[i];
 			}
-			putch(ch);
+			putchars(outbuf, outlen);
 		}
 	}
 	lock_release(lk);
@@ -398,7 +525,7 @@ attach_console_to_vfs(struct con_softc *cs)
 int
 config_con(struct con_softc *cs, int unit)
 {
-	struct semaphore *rsem, *wsem;
+	struct wchan *rwc, *wwc;
 	struct lock *rlk, *wlk;
 
 	/*
@@ -414,33 +541,38 @@ config_con(struct con_softc *cs, int unit)
 	}
 	KASSERT(the_console==NULL);
 
-	rsem = sem_create("console read", 0);
-	if (rsem == NULL) {
+	rwc = wchan_create("console read");
+	if (rwc == NULL) {
 		return ENOMEM;
 	}
-	wsem = sem_create("console write", 1);
-	if (wsem == NULL) {
-		sem_destroy(rsem);
+	wwc = wchan_create("console write");
+	if (wwc == NULL) {
+		wchan_destroy(rwc);
 		return ENOMEM;
 	}
 	rlk = lock_create("console-lock-read");
 	if (rlk == NULL) {
-		sem_destroy(rsem);
-		sem_destroy(wsem);
+		wchan_destroy(rwc);
+		wchan_destroy(wwc);
 		return ENOMEM;
 	}
 	wlk = lock_create("console-lock-write");
 	if (wlk == NULL) {
 		lock_destroy(rlk);
-		sem_destroy(rsem);
-		sem_destroy(wsem);
+		wchan_destroy(rwc);
+		wchan_destroy(wwc);
 		return ENOMEM;
 	}
 
-	cs->cs_rsem = rsem; 
-	cs->cs_wsem = wsem; 
+	spinlock_init(&cs->cs_lock);
+	cs->cs_rwchan = rwc;
+	cs->cs_wwchan = wwc;
 	cs->cs_gotchars_head = 0;
 	cs->cs_gotchars_tail = 0;
+	cs->cs_outchars_head = 0;
+	cs->cs_outchars_tail = 0;
+	cs->cs_busy = false;
+	cs->cs_wwaiting = false;
 
 	the_console = cs;
 	con_userlock_read = rlk;
@@ -38,6 +38,22 @@
  * This makes it unnecessary to copy the system files to the simulated
  * disk, although we recommend doing so and trying running without this
  * device as part of testing your filesystem.
+ *
+ * The device does one operation at a time through a single I/O
+ * buffer, so e_lock is held only across each operation. Everything
+ * above that is per vnode: each has its own lock, a cached file
+ * size for stat, and a small read cache so that runs of small
+ * sequential reads (like load_elf's headers) cost one device
+ * operation instead of one each. The table of loaded vnodes has its
+ * own lock too, instead of the VFS big lock.
+ *
+ * Several vnodes can name the same host file (the host hands out a
+ * new handle per open), so every write or truncate bumps a per-fs
+ * generation number and each vnode drops its cached size and data
+ * when the generation has moved since they were filled. Caches are
+ * also dropped at VOP_CLOSE. Changes the host itself makes to a file
+ * are still only noticed after that, or after a write through any
+ * vnode of this fs.
  */
 
 #include <types.h>
@@ -64,6 +80,9 @@
 /* I/O buffer offset */
 #define EMU_BUFFER    32768
 
+/* Size of the per-vnode read cache; reads smaller than this fill it */
+#define EMUFS_RACACHE 4096
+
 /* Operation codes for REG_OPER */
 #define EMU_OP_OPEN          1
 #define EMU_OP_CREATE        2
@@ -453,7 +472,13 @@ static
 int
 emufs_close(struct vnode *v)
 {
-	(void)v;
+	struct emufs_vnode *ev = v->vn_data;
+
+	/* Don't hand stale caches to whoever opens this next. */
+	lock_acquire(ev->ev_lock);
+	ev->ev_sizevalid = false;
+	ev->ev_ralen = 0;
+	lock_release(ev->ev_lock);
 	return 0;
 }
 
@@ -472,24 +497,28 @@ emufs_reclaim(struct vnode *v)
 	int result;
 
 	/*
-	 * Need both of these locks, e_lock to protect the device
-	 * and vfs_biglock to protect the fs-related material.
+	 * Hold ef_vnlock across the close and the removal from the
+	 * table, so a lookup that gets this handle number back from the
+	 * device can't find the dying vnode.
 	 */
 
-	vfs_biglock_acquire();
-	lock_acquire(ef->ef_emu->e_lock);
+	lock_acquire(ef->ef_vnlock);
 
-	if (ev->ev_v.vn_refcount != 1) {
-		lock_release(ef->ef_emu->e_lock);
-		vfs_biglock_release();
+	spinlock_acquire(&v->vn_countlock);
+	if (v->vn_refcount != 1) {
+		/* consume the reference VOP_DECREF gave us */
+		KASSERT(v->vn_refcount > 1);
+		v->vn_refcount--;
+		spinlock_release(&v->vn_countlock);
+		lock_release(ef->ef_vnlock);
 		return EBUSY;
 	}
+	spinlock_release(&v->vn_countlock);
 
 	/* emu_close retries on I/O error */
 	result = emu_close(ev->ev_emu, ev->ev_handle);
 	if (result) {
-		lock_release(ef->ef_emu->e_lock);
-		vfs_biglock_release();
+		lock_release(ef->ef_vnlock);
 		return result;
 	}
 
@@ -512,15 +541,101 @@ emufs_reclaim(struct vnode *v)
 	vnodearray_remove(ef->ef_vnodes, ix);
 	VOP_CLEANUP(&ev->ev_v);
 
-	lock_release(ef->ef_emu->e_lock);
-	vfs_biglock_release();
+	lock_release(ef->ef_vnlock);
 
+	lock_destroy(ev->ev_lock);
+	if (ev->ev_rabuf != NULL) {
+		kfree(ev->ev_rabuf);
+	}
 	kfree(ev);
 	return 0;
 }
 
+/*
+ * Note a write through EV: bump the fs's generation so every other
+ * vnode drops its caches before next use. EV's own caches were kept
+ * up to date by the caller, so mark them current unless another
+ * write raced in. Call with ev_lock held, after the write is done.
+ */
+static
+void
+emufs_bumpgen(struct emufs_vnode *ev)
+{
+	struct emufs_fs *ef = ev->ev_v.vn_fs->fs_data;
+	bool current;
+
+	KASSERT(lock_do_i_hold(ev->ev_lock));
+
+	spinlock_acquire(&ef->ef_genlock);
+	current = (ev->ev_gen == ef->ef_gen);
+	ef->ef_gen++;
+	ev->ev_gen = current ? ef->ef_gen : ef->ef_gen - 1;
+	spinlock_release(&ef->ef_genlock);
+}
+
+/*
+ * Drop EV's cached size and data if anything in the fs was written
+ * since they were filled. Call with ev_lock held, before using or
+ * refilling the caches.
+ */
+static
+void
+emufs_checkgen(struct emufs_vnode *ev)
+{
+	struct emufs_fs *ef = ev->ev_v.vn_fs->fs_data;
+	unsigned gen;
+
+	KASSERT(lock_do_i_hold(ev->ev_lock));
+
+	spinlock_acquire(&ef->ef_genlock);
+	gen = ef->ef_gen;
+	spinlock_release(&ef->ef_genlock);
+
+	if (ev->ev_gen != gen) {
+		ev->ev_sizevalid = false;
+		ev->ev_ralen = 0;
+		ev->ev_gen = gen;
+	}
+}
+
+/*
+ * Refill EV's read cache from file offset POS. Leaves ev_ralen 0 at
+ * EOF. Call with ev_lock held.
+ */
+static
+int
+emufs_fillcache(struct emufs_vnode *ev, off_t pos)
+{
+	struct iovec iov;
+	struct uio ku;
+	int result;
+
+	KASSERT(lock_do_i_hold(ev->ev_lock));
+
+	if (ev->ev_rabuf == NULL) {
+		ev->ev_rabuf = kmalloc(EMUFS_RACACHE);
+		if (ev->ev_rabuf == NULL) {
+			return ENOMEM;
+		}
+	}
+
+	ev->ev_ralen = 0;
+	uio_kinit(&iov, &ku, ev->ev_rabuf, EMUFS_RACACHE, pos, UIO_READ);
+	result = emu_read(ev->ev_emu, ev->ev_handle, EMUFS_RACACHE, &ku);
+	if (result) {
+		return result;
+	}
+	ev->ev_raoff = pos;
+	ev->ev_ralen = EMUFS_RACACHE - ku.uio_resid;
+	return 0;
+}
+
 /*
  * VOP_READ
+ *
+ * Reads that the read cache covers are copied from it. Other small
+ * reads refill the cache first; big ones go straight to the device
+ * EMU_MAXIO at a time.
  */
 static
 int
@@ -528,12 +643,44 @@ emufs_read(struct vnode *v, struct uio *uio)
 {
 	struct emufs_vnode *ev = v->vn_data;
 	uint32_t amt;
-	size_t oldresid;
-	int result;
+	size_t oldresid, skip;
+	int result = 0;
 
 	KASSERT(uio->uio_rw==UIO_READ);
 
+	lock_acquire(ev->ev_lock);
+	emufs_checkgen(ev);
+
 	while (uio->uio_resid > 0) {
+		if (uio->uio_offset >= ev->ev_raoff &&
+		    uio->uio_offset < ev->ev_raoff + (off_t)ev->ev_ralen) {
+			skip = uio->uio_offset - ev->ev_raoff;
+			amt = ev->ev_ralen - skip;
+			if (amt > uio->uio_resid) {
+				amt = uio->uio_resid;
+			}
+			result = uiomove(ev->ev_rabuf + skip, amt, uio);
+			if (result) {
+				break;
+			}
+			continue;
+		}
+
+		if (uio->uio_resid < EMUFS_RACACHE) {
+			result = emufs_fillcache(ev, uio->uio_offset);
+			if (result == 0) {
+				if (ev->ev_ralen == 0) {
+					/* EOF */
+					break;
+				}
+				continue;
+			}
+			if (result != ENOMEM) {
+				break;
+			}
+			/* no memory for the cache; just read directly */
+		}
+
 		amt = uio->uio_resid;
 		if (amt > EMU_MAXIO) {
 			amt = EMU_MAXIO;
@@ -543,7 +690,7 @@ emufs_read(struct vnode *v, struct uio *uio)
 
 		result = emu_read(ev->ev_emu, ev->ev_handle, amt, uio);
 		if (result) {
-			return result;
+			break;
 		}
 		
 		if (uio->uio_resid == oldresid) {
@@ -552,7 +699,8 @@ emufs_read(struct vnode *v, struct uio *uio)
 		}
 	}
 
-	return 0;
+	lock_release(ev->ev_lock);
+	return result;
 }
 
 /*
@@ -585,10 +733,16 @@ emufs_write(struct vnode *v, struct uio *uio)
 	struct emufs_vnode *ev = v->vn_data;
 	uint32_t amt;
 	size_t oldresid;
-	int result;
+	int result = 0;
 
 	KASSERT(uio->uio_rw==UIO_WRITE);
 
+	lock_acquire(ev->ev_lock);
+	emufs_checkgen(ev);
+
+	/* Rather than patch the read cache, just drop it. */
+	ev->ev_ralen = 0;
+
 	while (uio->uio_resid > 0) {
 		amt = uio->uio_resid;
 		if (amt > EMU_MAXIO) {
@@ -599,7 +753,11 @@ emufs_write(struct vnode *v, struct uio *uio)
 
 		result = emu_write(ev->ev_emu, ev->ev_handle, amt, uio);
 		if (result) {
-			return result;
+			break;
+		}
+
+		if (ev->ev_sizevalid && uio->uio_offset > ev->ev_size) {
+			ev->ev_size = uio->uio_offset;
 		}
 
 		if (uio->uio_resid == oldresid) {
@@ -608,7 +766,9 @@ emufs_write(struct vnode *v, struct uio *uio)
 		}
 	}
 
-	return 0;
+	emufs_bumpgen(ev);
+	lock_release(ev->ev_lock);
+	return result;
 }
 
 /*
@@ -641,10 +801,18 @@ emufs_stat(struct vnode *v, struct stat *statbuf)
 
 	bzero(statbuf, sizeof(struct stat));
 
-	result = emu_getsize(ev->ev_emu, ev->ev_handle, &statbuf->st_size);
-	if (result) {
-		return result;
+	lock_acquire(ev->ev_lock);
+	emufs_checkgen(ev);
+	if (!ev->ev_sizevalid) {
+		result = emu_getsize(ev->ev_emu, ev->ev_handle, &ev->ev_size);
+		if (result) {
+			lock_release(ev->ev_lock);
+			return result;
+		}
+		ev->ev_sizevalid = true;
 	}
+	statbuf->st_size = ev->ev_size;
+	lock_release(ev->ev_lock);
 
 	result = VOP_GETTYPE(v, &statbuf->st_mode);
 	if (result) {
@@ -717,7 +885,19 @@ int
 emufs_truncate(struct vnode *v, off_t len)
 {
 	struct emufs_vnode *ev = v->vn_data;
-	return emu_trunc(ev->ev_emu, ev->ev_handle, len);
+	int result;
+
+	lock_acquire(ev->ev_lock);
+	emufs_checkgen(ev);
+	result = emu_trunc(ev->ev_emu, ev->ev_handle, len);
+	if (result == 0) {
+		ev->ev_size = len;
+		ev->ev_sizevalid = true;
+	}
+	ev->ev_ralen = 0;
+	emufs_bumpgen(ev);
+	lock_release(ev->ev_lock);
+	return result;
 }
 
 /*
@@ -1153,8 +1333,7 @@ emufs_loadvnode(struct emufs_fs *ef, uint32_t handle, int isdir,
 	unsigned i, num;
 	int result;
 
-	vfs_biglock_acquire();
-	lock_acquire(ef->ef_emu->e_lock);
+	lock_acquire(ef->ef_vnlock);
 
 	num = vnodearray_num(ef->ef_vnodes);
 	for (i=0; i<num; i++) {
@@ -1165,8 +1344,7 @@ emufs_loadvnode(struct emufs_fs *ef, uint32_t handle, int isdir,
 
 			VOP_INCREF(&ev->ev_v);
 
-			lock_release(ef->ef_emu->e_lock);
-			vfs_biglock_release();
+			lock_release(ef->ef_vnlock);
 			*ret = ev;
 			return 0;
 		}
@@ -1176,18 +1354,31 @@ emufs_loadvnode(struct emufs_fs *ef, uint32_t handle, int isdir,
 
 	ev = kmalloc(sizeof(struct emufs_vnode));
 	if (ev==NULL) {
-		lock_release(ef->ef_emu->e_lock);
+		lock_release(ef->ef_vnlock);
 		return ENOMEM;
 	}
 
 	ev->ev_emu = ef->ef_emu;
 	ev->ev_handle = handle;
+	ev->ev_sizevalid = false;
+	ev->ev_size = 0;
+	ev->ev_rabuf = NULL;
+	ev->ev_raoff = 0;
+	ev->ev_ralen = 0;
+	ev->ev_gen = 0;
+
+	ev->ev_lock = lock_create("emufs-vnode");
+	if (ev->ev_lock == NULL) {
+		lock_release(ef->ef_vnlock);
+		kfree(ev);
+		return ENOMEM;
+	}
 
 	result = VOP_INIT(&ev->ev_v, isdir ? &emufs_dirops : &emufs_fileops,
 			   &ef->ef_fs, ev);
 	if (result) {
-		lock_release(ef->ef_emu->e_lock);
-		vfs_biglock_release();
+		lock_release(ef->ef_vnlock);
+		lock_destroy(ev->ev_lock);
 		kfree(ev);
 		return result;
 	}
@@ -1196,14 +1387,13 @@ emufs_loadvnode(struct emufs_fs *ef, uint32_t handle, int isdir,
 	if (result) {
 		/* note: VOP_CLEANUP undoes VOP_INIT - it does not kfree */
 		VOP_CLEANUP(&ev->ev_v);
-		lock_release(ef->ef_emu->e_lock);
-		vfs_biglock_release();
+		lock_release(ef->ef_vnlock);
+		lock_destroy(ev->ev_lock);
 		kfree(ev);
 		return result;
 	}
 
-	lock_release(ef->ef_emu->e_lock);
-	vfs_biglock_release();
+	lock_release(ef->ef_vnlock);
 
 	*ret = ev;
 	return 0;
@@ -1295,18 +1485,33 @@ emufs_addtovfs(struct emu_softc *sc, const char *devname)
 	ef->ef_fs.fs_getvolname = emufs_getvolname;
 	ef->ef_fs.fs_getroot = emufs_getroot;
 	ef->ef_fs.fs_unmount = emufs_unmount;
+	/* the host can change the directory behind our back */
+	ef->ef_fs.fs_namecache = false;
 	ef->ef_fs.fs_data = ef;
 
 	ef->ef_emu = sc;
 	ef->ef_root = NULL;
+	spinlock_init(&ef->ef_genlock);
+	ef->ef_gen = 0;
+	ef->ef_vnlock = lock_create("emufs-vnodes");
+	if (ef->ef_vnlock == NULL) {
+		spinlock_cleanup(&ef->ef_genlock);
+		kfree(ef);
+		return ENOMEM;
+	}
 	ef->ef_vnodes = vnodearray_create();
 	if (ef->ef_vnodes == NULL) {
+		lock_destroy(ef->ef_vnlock);
+		spinlock_cleanup(&ef->ef_genlock);
 		kfree(ef);
 		return ENOMEM;
 	}
 
 	result = emufs_loadvnode(ef, EMU_ROOTHANDLE, 1, &ef->ef_root);
 	if (result) {
+		vnodearray_destroy(ef->ef_vnodes);
+		lock_destroy(ef->ef_vnlock);
+		spinlock_cleanup(&ef->ef_genlock);
 		kfree(ef);
 		return result;
 	}
@@ -1316,6 +1521,9 @@ emufs_addtovfs(struct emu_softc *sc, const char *devname)
 	result = vfs_addfs(devname, &ef->ef_fs);
 	if (result) {
 		VOP_DECREF(&ef->ef_root->ev_v);
+		vnodearray_destroy(ef->ef_vnodes);
+		lock_destroy(ef->ef_vnlock);
+		spinlock_cleanup(&ef->ef_genlock);
 		kfree(ef);
 	}
 	return result;
@@ -35,7 +35,10 @@
 #include <kern/errno.h>
 #include <lib.h>
 #include <uio.h>
-#include <synch.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <current.h>
+#include <thread.h>
 #include <platform/bus.h>
 #include <vfs.h>
 #include <lamebus/lhd.h>
@@ -95,15 +98,258 @@ int lhd_code_to_errno(struct lhd_softc *lh, int code)
 }
 
 /*
- * Record that an I/O has completed: save the result and poke the
- * completion semaphore.
+ * Request queue.
+ *
+ * The hardware transfers one sector at a time through the on-card
+ * buffer, but there is no reason the calling thread has to be woken
+ * up for each sector. Callers describe a whole transfer (a run of
+ * sectors to or from a kernel buffer) with a struct lhd_req and put
+ * it on the queue; the interrupt handler moves the data in and out
+ * of the on-card buffer and starts the next sector itself, and only
+ * wakes the caller once its request is finished. Each request has a
+ * wait channel of its own, so only that caller wakes up; the channels
+ * are recycled through a small stock of spares.
+ *
+ * Pending requests are kept sorted by sector and dispatched in
+ * C-LOOK order: the next request is the first one at or above the
+ * current head position, wrapping around to the lowest sector when
+ * there is nothing further out. So that a steady stream of requests
+ * near the head can't starve one far away, a request that has been
+ * passed over for LHD_DEADLINE dispatches goes next regardless.
+ *
+ * A new request that starts exactly where a queued (or the active)
+ * request in the same direction ends is merged behind it, up to
+ * LHD_MAXMERGE sectors, so sequential I/O from different threads
+ * streams through without going back through the elevator. Each
+ * request finished within a run counts as a dispatch, and the active
+ * run isn't extended once it's past LHD_DEADLINE, so a long
+ * sequential stream can't hold everybody else off either.
+ */
+
+/* Dispatches a request may be passed over before it goes next */
+#define LHD_DEADLINE    32
+
+/* Maximum sectors in one merged run */
+#define LHD_MAXMERGE    128
+
+/* Sectors staged at a time for I/O that isn't to a kernel buffer */
+#define LHD_BOUNCESECTS 8
+
+struct lhd_req {
+	uint32_t lr_sector;		/* First sector */
+	uint32_t lr_nsect;		/* Number of sectors */
+	uint32_t lr_done;		/* Sectors transferred so far */
+	char *lr_data;			/* Kernel buffer */
+	bool lr_write;			/* Direction */
+	bool lr_finished;		/* Set when the request completes */
+	struct wchan *lr_wchan;		/* Where the caller waits */
+	int lr_result;			/* Result (valid once finished) */
+
+	struct lhd_req *lr_next;	/* Queue link (run heads only) */
+	struct lhd_req *lr_merge;	/* Next request in merged run */
+
+	/* Valid only in the first request of a run */
+	struct lhd_req *lr_tail;	/* Last request in merged run */
+	uint32_t lr_runsects;		/* Sectors still to do in the run */
+	unsigned lr_stamp;		/* lh_dispatches when queued */
+};
+
+/*
+ * Send the next sector of the active request to the disk.
+ */
+static
+void
+lhd_startsector(struct lhd_softc *lh)
+{
+	struct lhd_req *lr = lh->lh_active;
+	uint32_t sector, statval;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+	KASSERT(lr != NULL && lr->lr_done < lr->lr_nsect);
+
+	sector = lr->lr_sector + lr->lr_done;
+	statval = LHD_WORKING;
+	if (lr->lr_write) {
+		memcpy(lh->lh_buf, lr->lr_data + lr->lr_done * LHD_SECTSIZE,
+		       LHD_SECTSIZE);
+		statval |= LHD_ISWRITE;
+	}
+
+	lhd_wreg(lh, LHD_REG_SECT, sector);
+	lhd_wreg(lh, LHD_REG_STAT, statval);
+	lh->lh_headpos = sector;
+}
+
+/*
+ * Choose the next run to dispatch and remove it from the queue.
+ */
+static
+struct lhd_req *
+lhd_pick(struct lhd_softc *lh)
+{
+	struct lhd_req *lr, **prev, **pick, **oldest;
+	unsigned age, maxage;
+
+	if (lh->lh_queue == NULL) {
+		return NULL;
+	}
+
+	pick = NULL;
+	oldest = NULL;
+	maxage = 0;
+	for (prev = &lh->lh_queue; *prev != NULL; prev = &(*prev)->lr_next) {
+		lr = *prev;
+		if (pick == NULL && lr->lr_sector >= lh->lh_headpos) {
+			pick = prev;
+		}
+		age = lh->lh_dispatches - lr->lr_stamp;
+		if (oldest == NULL || age > maxage) {
+			oldest = prev;
+			maxage = age;
+		}
+	}
+
+	if (maxage > LHD_DEADLINE) {
+		pick = oldest;
+	}
+	else if (pick == NULL) {
+		/* Nothing beyond the head; sweep back to the start. */
+		pick = &lh->lh_queue;
+	}
+
+	lr = *pick;
+	*pick = lr->lr_next;
+	lr->lr_next = NULL;
+	return lr;
+}
+
+/*
+ * If the disk is idle, start the next run.
+ */
+static
+void
+lhd_start(struct lhd_softc *lh)
+{
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+
+	if (lh->lh_active != NULL) {
+		return;
+	}
+	lh->lh_active = lhd_pick(lh);
+	if (lh->lh_active != NULL) {
+		lh->lh_dispatches++;
+		lhd_startsector(lh);
+	}
+}
+
+/*
+ * Try to attach a new request behind the run starting at HEAD.
+ */
+static
+bool
+lhd_trymerge(struct lhd_req *head, struct lhd_req *lr)
+{
+	struct lhd_req *tail = head->lr_tail;
+
+	if (tail->lr_write != lr->lr_write ||
+	    tail->lr_sector + tail->lr_nsect != lr->lr_sector ||
+	    head->lr_runsects + lr->lr_nsect > LHD_MAXMERGE) {
+		return false;
+	}
+	tail->lr_merge = lr;
+	head->lr_tail = lr;
+	head->lr_runsects += lr->lr_nsect;
+	return true;
+}
+
+/*
+ * Add a request to the queue, merging it into an existing run if
+ * possible.
+ */
+static
+void
+lhd_enqueue(struct lhd_softc *lh, struct lhd_req *lr)
+{
+	struct lhd_req **prev;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+
+	lr->lr_next = NULL;
+	lr->lr_merge = NULL;
+	lr->lr_tail = lr;
+	lr->lr_runsects = lr->lr_nsect;
+	lr->lr_stamp = lh->lh_dispatches;
+
+	if (lh->lh_active != NULL &&
+	    lh->lh_dispatches - lh->lh_active->lr_stamp <= LHD_DEADLINE &&
+	    lhd_trymerge(lh->lh_active, lr)) {
+		return;
+	}
+
+	for (prev = &lh->lh_queue; *prev != NULL; prev = &(*prev)->lr_next) {
+		if (lhd_trymerge(*prev, lr)) {
+			return;
+		}
+		if ((*prev)->lr_sector > lr->lr_sector) {
+			break;
+		}
+	}
+	lr->lr_next = *prev;
+	*prev = lr;
+}
+
+/*
+ * Record that a sector has completed. Copy the data out if it was a
+ * read, then either go on to the next sector of the active request
+ * or finish the request and wake its owner.
  */
 static
 void
 lhd_iodone(struct lhd_softc *lh, int err)
 {
-	lh->lh_result = err;
-	V(lh->lh_done);
+	struct lhd_req *lr = lh->lh_active;
+	struct lhd_req *next;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+
+	if (lr == NULL) {
+		kprintf("lhd%d: Spurious completion\n", lh->lh_unit);
+		return;
+	}
+
+	if (err == 0) {
+		if (!lr->lr_write) {
+			memcpy(lr->lr_data + lr->lr_done * LHD_SECTSIZE,
+			       lh->lh_buf, LHD_SECTSIZE);
+		}
+		lr->lr_done++;
+		if (lr->lr_done < lr->lr_nsect) {
+			lhd_startsector(lh);
+			return;
+		}
+	}
+
+	/* This request is finished; hand the rest of the run on. */
+	next = lr->lr_merge;
+	if (next != NULL) {
+		next->lr_tail = lr->lr_tail;
+		next->lr_runsects = lr->lr_runsects - lr->lr_nsect;
+		next->lr_stamp = lr->lr_stamp;
+		/* so the queued requests keep aging */
+		lh->lh_dispatches++;
+	}
+	lh->lh_active = next;
+
+	lr->lr_result = err;
+	lr->lr_finished = true;
+	wchan_wakeone(lr->lr_wchan);
+
+	if (next != NULL) {
+		lhd_startsector(lh);
+	}
+	else {
+		lhd_start(lh);
+	}
 }
 
 /*
@@ -116,7 +362,9 @@ lhd_irq(void *vlh)
 {
 	struct lhd_softc *lh = vlh;
 	uint32_t val;
-	
+
+	spinlock_acquire(&lh->lh_lock);
+
 	val = lhd_rdreg(lh, LHD_REG_STAT);
 
 	switch (val & LHD_STATEMASK) {
@@ -130,6 +378,8 @@ lhd_irq(void *vlh)
 		lhd_iodone(lh, lhd_code_to_errno(lh, val));
 		break;
 	}
+
+	spinlock_release(&lh->lh_lock);
 }
 
 /*
@@ -193,21 +443,103 @@ lhd_reset(struct lhd_softc *lh)
 }
 #endif
 
+/*
+ * Get a wait channel for a request: a spare, or failing that a new
+ * one. Returns NULL if out of memory.
+ */
+static
+struct wchan *
+lhd_getwchan(struct lhd_softc *lh)
+{
+	struct wchan *wc = NULL;
+
+	spinlock_acquire(&lh->lh_lock);
+	if (lh->lh_nspares > 0) {
+		wc = lh->lh_spares[--lh->lh_nspares];
+	}
+	spinlock_release(&lh->lh_lock);
+
+	if (wc == NULL) {
+		wc = wchan_create("lhd");
+	}
+	return wc;
+}
+
+/*
+ * Give back a request's wait channel, keeping it if there's room.
+ */
+static
+void
+lhd_putwchan(struct lhd_softc *lh, struct wchan *wc)
+{
+	spinlock_acquire(&lh->lh_lock);
+	if (lh->lh_nspares < LHD_NSPARES) {
+		lh->lh_spares[lh->lh_nspares++] = wc;
+		wc = NULL;
+	}
+	spinlock_release(&lh->lh_lock);
+
+	if (wc != NULL) {
+		wchan_destroy(wc);
+	}
+}
+
+/*
+ * Queue a request and wait for it to finish. Returns the result.
+ */
+static
+int
+lhd_transfer(struct lhd_softc *lh, struct lhd_req *lr)
+{
+	KASSERT(curthread->t_in_interrupt == false);
+
+	lr->lr_done = 0;
+	lr->lr_finished = false;
+	lr->lr_result = 0;
+	lr->lr_wchan = lhd_getwchan(lh);
+	if (lr->lr_wchan == NULL) {
+		return ENOMEM;
+	}
+
+	spinlock_acquire(&lh->lh_lock);
+	lhd_enqueue(lh, lr);
+	lhd_start(lh);
+	while (!lr->lr_finished) {
+		/* As in P(); see synch.c. */
+		wchan_lock(lr->lr_wchan);
+		spinlock_release(&lh->lh_lock);
+		wchan_sleep(lr->lr_wchan);
+		spinlock_acquire(&lh->lh_lock);
+	}
+	spinlock_release(&lh->lh_lock);
+
+	lhd_putwchan(lh, lr->lr_wchan);
+	return lr->lr_result;
+}
+
 /*
  * I/O function (for both reads and writes)
+ *
+ * Transfers to a single kernel buffer (which is what the file system
+ * buffer cache does) go straight to and from that buffer in one
+ * request. Anything else is staged through a kernel bounce buffer
+ * LHD_BOUNCESECTS sectors at a time.
  */
 static
 int
 lhd_io(struct device *d, struct uio *uio)
 {
 	struct lhd_softc *lh = d->d_data;
+	struct lhd_req lr;
+	struct iovec *iov;
 
 	uint32_t sector = uio->uio_offset / LHD_SECTSIZE;
 	uint32_t sectoff = uio->uio_offset % LHD_SECTSIZE;
 	uint32_t len = uio->uio_resid / LHD_SECTSIZE;
 	uint32_t lenoff = uio->uio_resid % LHD_SECTSIZE;
-	uint32_t i;
-	uint32_t statval = LHD_WORKING;
+	uint32_t n;
+	size_t moved;
+	char *bounce;
 	int result;
 
 	/* Don't allow I/O that isn't sector-aligned. */
@@ -220,59 +552,64 @@ lhd_io(struct device *d, struct uio *uio)
 		return EINVAL;
 	}
 
-	/* Set up the value to write into the status register. */
-	if (uio->uio_rw==UIO_WRITE) {
-		statval |= LHD_ISWRITE;
+	if (len == 0) {
+		return 0;
 	}
 
-	/* Loop over all the sectors we were asked to do. */
-	for (i=0; i<len; i++) {
+	lr.lr_write = (uio->uio_rw == UIO_WRITE);
+
+	iov = uio->uio_iov;
+	if (uio->uio_segflg == UIO_SYSSPACE && uio->uio_iovcnt == 1 &&
+	    iov->iov_len >= uio->uio_resid) {
+		lr.lr_sector = sector;
+		lr.lr_nsect = len;
+		lr.lr_data = iov->iov_kbase;
+		result = lhd_transfer(lh, &lr);
+
+		/* Account for whatever got transferred, as uiomove would. */
+		moved = lr.lr_done * LHD_SECTSIZE;
+		iov->iov_kbase = (char *)iov->iov_kbase + moved;
+		iov->iov_len -= moved;
+		uio->uio_offset += moved;
+		uio->uio_resid -= moved;
+		return result;
+	}
 
-		/* Wait until nobody else is using the device. */
-		P(lh->lh_clear);
+	n = len < LHD_BOUNCESECTS ? len : LHD_BOUNCESECTS;
+	bounce = kmalloc(n * LHD_SECTSIZE);
+	if (bounce == NULL) {
+		return ENOMEM;
+	}
 
-		/*
-		 * Are we writing? If so, transfer the data to the
-		 * on-card buffer.
-		 */
-		if (uio->uio_rw == UIO_WRITE) {
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
+	result = 0;
+	while (len > 0) {
+		n = len < LHD_BOUNCESECTS ? len : LHD_BOUNCESECTS;
+
+		if (lr.lr_write) {
+			result = uiomove(bounce, n * LHD_SECTSIZE, uio);
 			if (result) {
-				V(lh->lh_clear);
-				return result;
+				break;
 			}
 		}
 
-		/* Tell it what sector we want... */
-		lhd_wreg(lh, LHD_REG_SECT, sector+i);
-
-		/* and start the operation. */
-		lhd_wreg(lh, LHD_REG_STAT, statval);
-
-		/* Now wait until the interrupt handler tells us we're done. */
-		P(lh->lh_done);
-
-		/* Get the result value saved by the interrupt handler. */
-		result = lh->lh_result;
+		lr.lr_sector = sector;
+		lr.lr_nsect = n;
+		lr.lr_data = bounce;
+		result = lhd_transfer(lh, &lr);
 
-		/*
-		 * Are we reading? If so, and if we succeeded,
-		 * transfer the data out of the on-card buffer.
-		 */
-		if (result==0 && uio->uio_rw==UIO_READ) {
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
+		if (result==0 && !lr.lr_write) {
+			result = uiomove(bounce, n * LHD_SECTSIZE, uio);
 		}
-
-		/* Tell another thread it's cleared to go ahead. */
-		V(lh->lh_clear);
-
-		/* If we failed, return the error. */
 		if (result) {
-			return result;
+			break;
 		}
+
+		sector += n;
+		len -= n;
 	}
 
-	return 0;
+	kfree(bounce);
+	return result;
 }
 
 /*
@@ -289,17 +626,13 @@ config_lhd(struct lhd_softc *lh, int lhdno)
 	/* Get a pointer to the on-chip buffer. */
 	lh->lh_buf = bus_map_area(lh->lh_busdata, lh->lh_buspos, LHD_BUFFER);
 
-	/* Create the semaphores. */
-	lh->lh_clear = sem_create("lhd-clear", 1);
-	if (lh->lh_clear == NULL) {
-		return ENOMEM;
-	}
-	lh->lh_done = sem_create("lhd-done", 0);
-	if (lh->lh_done == NULL) {
-		sem_destroy(lh->lh_clear);
-		lh->lh_clear = NULL;
-		return ENOMEM;
-	}
+	/* Set up the request queue. */
+	spinlock_init(&lh->lh_lock);
+	lh->lh_nspares = 0;
+	lh->lh_queue = NULL;
+	lh->lh_active = NULL;
+	lh->lh_headpos = 0;
+	lh->lh_dispatches = 0;
 
 	/* Set up the VFS device structure. */
 	lh->lh_dev.d_open = lhd_open;
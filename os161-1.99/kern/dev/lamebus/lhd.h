@@ -30,13 +30,22 @@
 #ifndef _LAMEBUS_LHD_H_
 #define _LAMEBUS_LHD_H_
 
+#include <spinlock.h>
 #include <device.h>
 
+struct wchan;
+struct lhd_req;		/* Private to lhd.c */
+
 /*
  * Our sector size
  */
 #define LHD_SECTSIZE  512
 
+/*
+ * Wait channels kept around for reuse between requests
+ */
+#define LHD_NSPARES   8
+
 /*
  * Hardware device data associated with lhd (LAMEbus hard disk)
  */
@@ -51,9 +60,13 @@ struct lhd_softc {
 	 */
 
 	void *lh_buf;			/* Pointer to on-card I/O buffer */
-	int lh_result;			/* Result from I/O operation */
-	struct semaphore *lh_clear;	/* Synchronization */
-	struct semaphore *lh_done;
+	struct spinlock lh_lock;	/* Protects everything below */
+	struct wchan *lh_spares[LHD_NSPARES]; /* Idle request wait channels */
+	unsigned lh_nspares;		/* Number of those */
+	struct lhd_req *lh_queue;	/* Pending requests, sorted by sector */
+	struct lhd_req *lh_active;	/* Request the disk is working on */
+	uint32_t lh_headpos;		/* Last sector sent to the disk */
+	unsigned lh_dispatches;		/* Requests started (for deadlines) */
 
 	struct device lh_dev;		/* VFS device structure */
 };
@@ -0,0 +1,897 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * SFS filesystem
+ *
+ * Buffer cache.
+ *
+ * All block I/O done by SFS goes through a single pool of
+ * SFS_BLOCKSIZE buffers shared by every mounted SFS volume. Buffers
+ * are named by (filesystem, block number) and found through a small
+ * hash table; the ones not currently in use are recycled in LRU
+ * order. Writes are write-back: sfs_buf_markdirty just remembers
+ * the buffer needs to go to disk, and it does so when it's evicted
+ * or when sfs_buf_sync is called (from FS_SYNC and VOP_FSYNC).
+ *
+ * A buffer handed out by sfs_buf_get is "busy" and belongs to the
+ * caller until it's given back with sfs_buf_release. Anyone else
+ * who wants the same block waits for it. The cache lock is never
+ * held across disk I/O; the busy flag is what protects a buffer
+ * while it's being read or written.
+ *
+ * Runs of dirty buffers for consecutive blocks are written with a
+ * single device request, and sfs_buf_readahead lets the file layer
+ * queue blocks it expects to need soon; a kernel thread reads those
+ * in the background, again in runs of consecutive blocks.
+ *
+ * On a volume with a journal, metadata buffers are "pinned" by
+ * sfs_buf_pin until the journal has committed them (see sfs_log.c).
+ * A pinned buffer is dirty but mustn't be written to its home
+ * location yet, so eviction and syncing pass it over.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <uio.h>
+#include <synch.h>
+#include <thread.h>
+#include <sfs.h>
+
+/* Number of buffers in the cache */
+#define SFS_NBUFS        64
+
+/* Number of hash chains; must be a power of 2 */
+#define SFS_BUFHASHSIZE  32
+
+/* Most blocks moved in one device request */
+#define SFS_CLUSTER      8
+
+/* Size of the read-ahead queue */
+#define SFS_RAQUEUE      32
+
+struct sfs_buf {
+	struct sfs_fs *sb_fs;		/* fs the block is on; NULL if free */
+	uint32_t sb_block;		/* block number */
+	bool sb_valid;			/* true if sb_data holds the block */
+	bool sb_dirty;			/* true if sb_data must be written */
+	bool sb_busy;			/* true if someone's using it */
+	bool sb_pinned;			/* true if it can't be written yet */
+	struct sfs_buf *sb_hashnext;	/* next on hash chain */
+	struct sfs_buf *sb_lruprev;	/* more recently used */
+	struct sfs_buf *sb_lrunext;	/* less recently used */
+	void *sb_data;			/* the block itself */
+};
+
+static struct sfs_buf sfs_bufs[SFS_NBUFS];
+static struct sfs_buf *sfs_bufhash[SFS_BUFHASHSIZE];
+static struct sfs_buf *sfs_lruhead;	/* most recently used */
+static struct sfs_buf *sfs_lrutail;	/* least recently used */
+static struct lock *sfs_buflock;
+static struct cv *sfs_bufcv;
+
+/* Read-ahead requests; also protected by sfs_buflock */
+static struct {
+	struct sfs_fs *ra_fs;
+	uint32_t ra_block;
+} sfs_raqueue[SFS_RAQUEUE];
+static unsigned sfs_rafirst, sfs_racount;
+static struct cv *sfs_racv;
+
+/* Statistics; protected by sfs_buflock */
+static unsigned sfs_buf_hits;
+static unsigned sfs_buf_misses;
+static unsigned sfs_buf_reads;
+static unsigned sfs_buf_writes;
+static unsigned sfs_buf_rablocks;
+static unsigned sfs_buf_clusters;
+
+////////////////////////////////////////////////////////////
+//
+// Hash table and LRU list
+
+static
+unsigned
+sfs_buf_hashfunc(struct sfs_fs *sfs, uint32_t block)
+{
+	return (block ^ ((uintptr_t)sfs >> 6)) & (SFS_BUFHASHSIZE - 1);
+}
+
+static
+struct sfs_buf *
+sfs_buf_lookup(struct sfs_fs *sfs, uint32_t block)
+{
+	struct sfs_buf *buf;
+
+	buf = sfs_bufhash[sfs_buf_hashfunc(sfs, block)];
+	while (buf != NULL) {
+		if (buf->sb_fs == sfs && buf->sb_block == block) {
+			return buf;
+		}
+		buf = buf->sb_hashnext;
+	}
+	return NULL;
+}
+
+static
+void
+sfs_buf_unhash(struct sfs_buf *buf)
+{
+	struct sfs_buf **pp;
+
+	if (buf->sb_fs == NULL) {
+		return;
+	}
+
+	pp = &sfs_bufhash[sfs_buf_hashfunc(buf->sb_fs, buf->sb_block)];
+	while (*pp != buf) {
+		KASSERT(*pp != NULL);
+		pp = &(*pp)->sb_hashnext;
+	}
+	*pp = buf->sb_hashnext;
+	buf->sb_hashnext = NULL;
+	buf->sb_fs = NULL;
+	buf->sb_valid = false;
+}
+
+static
+void
+sfs_buf_rehash(struct sfs_buf *buf, struct sfs_fs *sfs, uint32_t block)
+{
+	unsigned h;
+
+	KASSERT(!buf->sb_dirty);
+
+	sfs_buf_unhash(buf);
+	buf->sb_fs = sfs;
+	buf->sb_block = block;
+	buf->sb_valid = false;
+
+	h = sfs_buf_hashfunc(sfs, block);
+	buf->sb_hashnext = sfs_bufhash[h];
+	sfs_bufhash[h] = buf;
+}
+
+static
+void
+sfs_buf_lruremove(struct sfs_buf *buf)
+{
+	if (buf->sb_lruprev != NULL) {
+		buf->sb_lruprev->sb_lrunext = buf->sb_lrunext;
+	}
+	else {
+		sfs_lruhead = buf->sb_lrunext;
+	}
+	if (buf->sb_lrunext != NULL) {
+		buf->sb_lrunext->sb_lruprev = buf->sb_lruprev;
+	}
+	else {
+		sfs_lrutail = buf->sb_lruprev;
+	}
+	buf->sb_lruprev = buf->sb_lrunext = NULL;
+}
+
+/* Move a buffer to the most-recently-used end of the list. */
+static
+void
+sfs_buf_lrufront(struct sfs_buf *buf)
+{
+	sfs_buf_lruremove(buf);
+	buf->sb_lrunext = sfs_lruhead;
+	if (sfs_lruhead != NULL) {
+		sfs_lruhead->sb_lruprev = buf;
+	}
+	else {
+		sfs_lrutail = buf;
+	}
+	sfs_lruhead = buf;
+}
+
+/* Move a buffer to the end of the list, so it gets reused first. */
+static
+void
+sfs_buf_lruback(struct sfs_buf *buf)
+{
+	sfs_buf_lruremove(buf);
+	buf->sb_lruprev = sfs_lrutail;
+	if (sfs_lrutail != NULL) {
+		sfs_lrutail->sb_lrunext = buf;
+	}
+	else {
+		sfs_lruhead = buf;
+	}
+	sfs_lrutail = buf;
+}
+
+/*
+ * Pick a buffer to reuse: the least recently used one that isn't
+ * busy or pinned. Returns NULL if there aren't any.
+ */
+static
+struct sfs_buf *
+sfs_buf_victim(void)
+{
+	struct sfs_buf *buf;
+
+	for (buf = sfs_lrutail; buf != NULL; buf = buf->sb_lruprev) {
+		if (!buf->sb_busy && !buf->sb_pinned) {
+			return buf;
+		}
+	}
+	return NULL;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Disk I/O
+//
+// These are called on busy buffers without sfs_buflock held.
+
+/*
+ * Read or write N buffers holding consecutive blocks of the same
+ * filesystem with one device request. If that fails, fall back to
+ * doing them one at a time, so sfs_rwblock's retry logic sees a
+ * single block and a bad block doesn't take its neighbors with it.
+ */
+static
+int
+sfs_buf_clusterio(struct sfs_buf **bufs, unsigned n, enum uio_rw rw)
+{
+	struct iovec iov[SFS_CLUSTER];
+	struct uio ku;
+	unsigned i;
+	int result;
+
+	KASSERT(n > 0 && n <= SFS_CLUSTER);
+
+	for (i=0; i<n; i++) {
+		KASSERT(bufs[i]->sb_busy);
+		KASSERT(bufs[i]->sb_fs == bufs[0]->sb_fs);
+		KASSERT(bufs[i]->sb_block == bufs[0]->sb_block + i);
+		iov[i].iov_kbase = bufs[i]->sb_data;
+		iov[i].iov_len = SFS_BLOCKSIZE;
+	}
+	ku.uio_iov = iov;
+	ku.uio_iovcnt = n;
+	ku.uio_offset = ((off_t)bufs[0]->sb_block) * SFS_BLOCKSIZE;
+	ku.uio_resid = n * SFS_BLOCKSIZE;
+	ku.uio_segflg = UIO_SYSSPACE;
+	ku.uio_rw = rw;
+	ku.uio_space = NULL;
+
+	result = sfs_rwblock(bufs[0]->sb_fs, &ku);
+	if (result == 0 || n == 1) {
+		return result;
+	}
+
+	for (i=0; i<n; i++) {
+		SFSUIO(&iov[0], &ku, bufs[i]->sb_data, bufs[i]->sb_block, rw);
+		result = sfs_rwblock(bufs[i]->sb_fs, &ku);
+		if (result) {
+			return result;
+		}
+	}
+	return 0;
+}
+
+static
+int
+sfs_buf_read(struct sfs_buf *buf)
+{
+	int result;
+
+	KASSERT(!buf->sb_dirty);
+
+	result = sfs_buf_clusterio(&buf, 1, UIO_READ);
+	if (result) {
+		return result;
+	}
+	buf->sb_valid = true;
+	return 0;
+}
+
+/*
+ * Write out BUF, which must be dirty and not busy or pinned, along
+ * with any such neighbors on either side of it. Called with sfs_buflock
+ * held; drops it during the I/O.
+ */
+static
+int
+sfs_buf_flush(struct sfs_buf *buf)
+{
+	struct sfs_buf *run[SFS_CLUSTER];
+	struct sfs_buf *b;
+	struct sfs_fs *sfs = buf->sb_fs;
+	uint32_t start, block;
+	unsigned i, n;
+	int result;
+
+	KASSERT(lock_do_i_hold(sfs_buflock));
+	KASSERT(buf->sb_dirty && !buf->sb_busy && !buf->sb_pinned);
+
+	/* Find the start of the run of dirty blocks BUF is in */
+	start = buf->sb_block;
+	while (start > 0 && buf->sb_block - start < SFS_CLUSTER - 1) {
+		b = sfs_buf_lookup(sfs, start - 1);
+		if (b == NULL || b->sb_busy || !b->sb_dirty || b->sb_pinned) {
+			break;
+		}
+		start--;
+	}
+
+	/* Collect the run, claiming each buffer */
+	n = 0;
+	for (block = start; n < SFS_CLUSTER; block++) {
+		b = sfs_buf_lookup(sfs, block);
+		if (b == NULL || b->sb_busy || !b->sb_dirty || b->sb_pinned) {
+			break;
+		}
+		b->sb_busy = true;
+		run[n++] = b;
+	}
+	KASSERT(buf->sb_busy);
+
+	lock_release(sfs_buflock);
+	result = sfs_buf_clusterio(run, n, UIO_WRITE);
+	lock_acquire(sfs_buflock);
+
+	for (i=0; i<n; i++) {
+		if (result == 0) {
+			run[i]->sb_dirty = false;
+		}
+		run[i]->sb_busy = false;
+	}
+	cv_broadcast(sfs_bufcv, sfs_buflock);
+	if (result) {
+		return result;
+	}
+	sfs_buf_writes += n;
+	if (n > 1) {
+		sfs_buf_clusters++;
+	}
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Read-ahead
+
+/*
+ * Claim buffers for up to SFS_CLUSTER queued read-ahead blocks
+ * that are consecutive and not already in the cache. Returns the
+ * number claimed; they come back busy and not valid.
+ */
+static
+unsigned
+sfs_buf_ragather(struct sfs_buf **run)
+{
+	struct sfs_buf *buf;
+	struct sfs_fs *sfs;
+	uint32_t block;
+	unsigned n = 0;
+
+	while (sfs_racount > 0 && n < SFS_CLUSTER) {
+		sfs = sfs_raqueue[sfs_rafirst].ra_fs;
+		block = sfs_raqueue[sfs_rafirst].ra_block;
+		if (n > 0 && (sfs != run[0]->sb_fs ||
+			      block != run[0]->sb_block + n)) {
+			/* Doesn't continue the run; leave it for next time */
+			break;
+		}
+
+		if (sfs_buf_lookup(sfs, block) == NULL) {
+			buf = sfs_buf_victim();
+			if (buf == NULL || buf->sb_dirty) {
+				/*
+				 * Don't push anything out to make room
+				 * for blocks that are only a guess.
+				 */
+				break;
+			}
+			sfs_buf_rehash(buf, sfs, block);
+			buf->sb_busy = true;
+			sfs_buf_lrufront(buf);
+			run[n++] = buf;
+		}
+		else if (n > 0) {
+			/* Already have it; end of this run */
+			break;
+		}
+
+		sfs_rafirst = (sfs_rafirst + 1) % SFS_RAQUEUE;
+		sfs_racount--;
+	}
+	return n;
+}
+
+/*
+ * Read-ahead thread.
+ */
+static
+void
+sfs_readahead_thread(void *data1, unsigned long data2)
+{
+	struct sfs_buf *run[SFS_CLUSTER];
+	unsigned i, n;
+	int result;
+
+	(void)data1;
+	(void)data2;
+
+	while (1) {
+		lock_acquire(sfs_buflock);
+		while (sfs_racount == 0) {
+			cv_wait(sfs_racv, sfs_buflock);
+		}
+		n = sfs_buf_ragather(run);
+		if (n == 0) {
+			/* Nothing worth reading, or no room; drop the rest */
+			sfs_rafirst = sfs_racount = 0;
+			lock_release(sfs_buflock);
+			continue;
+		}
+		lock_release(sfs_buflock);
+
+		result = sfs_buf_clusterio(run, n, UIO_READ);
+
+		lock_acquire(sfs_buflock);
+		for (i=0; i<n; i++) {
+			if (result == 0) {
+				run[i]->sb_valid = true;
+			}
+			else {
+				sfs_buf_unhash(run[i]);
+				sfs_buf_lruback(run[i]);
+			}
+			run[i]->sb_busy = false;
+		}
+		if (result == 0) {
+			sfs_buf_reads += n;
+			sfs_buf_rablocks += n;
+			if (n > 1) {
+				sfs_buf_clusters++;
+			}
+		}
+		cv_broadcast(sfs_bufcv, sfs_buflock);
+		lock_release(sfs_buflock);
+	}
+}
+
+////////////////////////////////////////////////////////////
+//
+// Interface
+
+/*
+ * Set up the buffer cache. Called once at boot.
+ */
+void
+sfs_bootstrap(void)
+{
+	char *data;
+	unsigned i;
+
+	int result;
+
+	sfs_buflock = lock_create("sfs buffer cache");
+	sfs_bufcv = cv_create("sfs buffer cache");
+	sfs_racv = cv_create("sfs read-ahead");
+	data = kmalloc(SFS_NBUFS * SFS_BLOCKSIZE);
+	if (sfs_buflock == NULL || sfs_bufcv == NULL || sfs_racv == NULL ||
+	    data == NULL) {
+		panic("sfs: Could not allocate buffer cache\n");
+	}
+
+	for (i=0; i<SFS_NBUFS; i++) {
+		sfs_bufs[i].sb_fs = NULL;
+		sfs_bufs[i].sb_block = 0;
+		sfs_bufs[i].sb_valid = false;
+		sfs_bufs[i].sb_dirty = false;
+		sfs_bufs[i].sb_busy = false;
+		sfs_bufs[i].sb_pinned = false;
+		sfs_bufs[i].sb_hashnext = NULL;
+		sfs_bufs[i].sb_lruprev = NULL;
+		sfs_bufs[i].sb_lrunext = NULL;
+		sfs_bufs[i].sb_data = data + i*SFS_BLOCKSIZE;
+		sfs_buf_lruback(&sfs_bufs[i]);
+	}
+
+	result = thread_fork("sfs readahead", NULL, sfs_readahead_thread,
+			     NULL, 0);
+	if (result) {
+		panic("sfs: Could not start read-ahead thread: %s\n",
+		      strerror(result));
+	}
+}
+
+/*
+ * Get the buffer for block BLOCK of filesystem SFS, marked busy.
+ *
+ * If DOREAD is set, the buffer is read from disk if it isn't already
+ * in the cache. If not, the caller is promising to overwrite the
+ * whole block; a block that isn't already cached comes back zeroed.
+ */
+int
+sfs_buf_get(struct sfs_fs *sfs, uint32_t block, bool doread,
+	    struct sfs_buf **ret)
+{
+	struct sfs_buf *buf;
+	int result;
+
+	lock_acquire(sfs_buflock);
+ again:
+	buf = sfs_buf_lookup(sfs, block);
+	if (buf != NULL) {
+		if (buf->sb_busy) {
+			cv_wait(sfs_bufcv, sfs_buflock);
+			goto again;
+		}
+		sfs_buf_hits++;
+	}
+	else {
+		buf = sfs_buf_victim();
+		if (buf == NULL) {
+			cv_wait(sfs_bufcv, sfs_buflock);
+			goto again;
+		}
+		if (buf->sb_dirty) {
+			/*
+			 * Write the old contents back first. Things
+			 * may change while we're doing that, so
+			 * start over afterwards.
+			 */
+			result = sfs_buf_flush(buf);
+			if (result) {
+				lock_release(sfs_buflock);
+				return result;
+			}
+			goto again;
+		}
+		sfs_buf_rehash(buf, sfs, block);
+		sfs_buf_misses++;
+		if (doread) {
+			sfs_buf_reads++;
+		}
+	}
+	buf->sb_busy = true;
+	sfs_buf_lrufront(buf);
+	lock_release(sfs_buflock);
+
+	if (!buf->sb_valid) {
+		if (doread) {
+			result = sfs_buf_read(buf);
+			if (result) {
+				/* not valid, so this discards it */
+				sfs_buf_release(buf);
+				return result;
+			}
+		}
+		else {
+			bzero(buf->sb_data, SFS_BLOCKSIZE);
+			buf->sb_valid = true;
+		}
+	}
+
+	*ret = buf;
+	return 0;
+}
+
+/*
+ * Get the data in a buffer.
+ */
+void *
+sfs_buf_data(struct sfs_buf *buf)
+{
+	KASSERT(buf->sb_busy);
+	return buf->sb_data;
+}
+
+/*
+ * Note that a buffer has been modified and needs to be written out.
+ */
+void
+sfs_buf_markdirty(struct sfs_buf *buf)
+{
+	KASSERT(buf->sb_busy);
+	KASSERT(buf->sb_valid);
+	buf->sb_dirty = true;
+}
+
+/*
+ * Check whether a buffer has changes that haven't been written out.
+ */
+bool
+sfs_buf_isdirty(struct sfs_buf *buf)
+{
+	KASSERT(buf->sb_busy);
+	return buf->sb_dirty;
+}
+
+/*
+ * Throw away the contents of a clean buffer that the caller has
+ * scribbled on without finishing, so the block is read from disk
+ * again next time. It goes away when released.
+ */
+void
+sfs_buf_invalidate(struct sfs_buf *buf)
+{
+	KASSERT(buf->sb_busy);
+	KASSERT(!buf->sb_dirty);
+	buf->sb_valid = false;
+}
+
+/*
+ * Note that a buffer has been modified as part of a journal
+ * transaction: it's dirty, but stays in the cache and out of the
+ * way of sfs_buf_sync until sfs_buf_unpin is called.
+ */
+void
+sfs_buf_pin(struct sfs_buf *buf)
+{
+	KASSERT(buf->sb_busy);
+	KASSERT(buf->sb_valid);
+	buf->sb_dirty = true;
+	buf->sb_pinned = true;
+}
+
+/*
+ * Give back a buffer we got from sfs_buf_get.
+ */
+void
+sfs_buf_release(struct sfs_buf *buf)
+{
+	lock_acquire(sfs_buflock);
+	KASSERT(buf->sb_busy);
+	if (!buf->sb_valid) {
+		/* Read failed or invalidated; forget about it */
+		sfs_buf_unhash(buf);
+		sfs_buf_lruback(buf);
+	}
+	buf->sb_busy = false;
+	cv_broadcast(sfs_bufcv, sfs_buflock);
+	lock_release(sfs_buflock);
+}
+
+/*
+ * Ask for block BLOCK of filesystem SFS to be read into the cache
+ * in the background, because somebody's probably going to want it.
+ * This is only a hint; if the queue is full it's ignored.
+ */
+void
+sfs_buf_readahead(struct sfs_fs *sfs, uint32_t block)
+{
+	unsigned ix;
+
+	lock_acquire(sfs_buflock);
+	if (sfs_racount < SFS_RAQUEUE && sfs_buf_lookup(sfs, block) == NULL) {
+		ix = (sfs_rafirst + sfs_racount) % SFS_RAQUEUE;
+		sfs_raqueue[ix].ra_fs = sfs;
+		sfs_raqueue[ix].ra_block = block;
+		sfs_racount++;
+		cv_signal(sfs_racv, sfs_buflock);
+	}
+	lock_release(sfs_buflock);
+}
+
+/*
+ * Wait for the pinned buffer for block BLOCK of SFS and claim it.
+ * Called with sfs_buflock held.
+ */
+static
+struct sfs_buf *
+sfs_buf_claimpinned(struct sfs_fs *sfs, uint32_t block)
+{
+	struct sfs_buf *buf;
+
+	KASSERT(lock_do_i_hold(sfs_buflock));
+
+	while (1) {
+		buf = sfs_buf_lookup(sfs, block);
+		/* Pinned buffers can't be evicted */
+		KASSERT(buf != NULL && buf->sb_pinned);
+		if (!buf->sb_busy) {
+			break;
+		}
+		cv_wait(sfs_bufcv, sfs_buflock);
+	}
+	buf->sb_busy = true;
+	return buf;
+}
+
+/*
+ * Write the contents of the pinned buffers for blocks BLOCKS[0]
+ * through BLOCKS[N-1] of SFS, in order, to the consecutive disk
+ * blocks starting at WHERE, rather than to their own locations.
+ * This is how the journal gets written.
+ */
+int
+sfs_buf_writecopy(struct sfs_fs *sfs, const uint32_t *blocks, unsigned n,
+		  uint32_t where)
+{
+	struct sfs_buf *run[SFS_CLUSTER];
+	struct iovec iov[SFS_CLUSTER];
+	struct uio ku;
+	unsigned i, j, k;
+	int result = 0;
+
+	for (i=0; i<n && result == 0; i += k) {
+		k = n - i < SFS_CLUSTER ? n - i : SFS_CLUSTER;
+
+		lock_acquire(sfs_buflock);
+		for (j=0; j<k; j++) {
+			run[j] = sfs_buf_claimpinned(sfs, blocks[i+j]);
+		}
+		lock_release(sfs_buflock);
+
+		for (j=0; j<k; j++) {
+			iov[j].iov_kbase = run[j]->sb_data;
+			iov[j].iov_len = SFS_BLOCKSIZE;
+		}
+		ku.uio_iov = iov;
+		ku.uio_iovcnt = k;
+		ku.uio_offset = ((off_t)(where + i)) * SFS_BLOCKSIZE;
+		ku.uio_resid = k * SFS_BLOCKSIZE;
+		ku.uio_segflg = UIO_SYSSPACE;
+		ku.uio_rw = UIO_WRITE;
+		ku.uio_space = NULL;
+		result = sfs_rwblock(sfs, &ku);
+
+		lock_acquire(sfs_buflock);
+		for (j=0; j<k; j++) {
+			run[j]->sb_busy = false;
+		}
+		if (result == 0) {
+			sfs_buf_writes += k;
+			if (k > 1) {
+				sfs_buf_clusters++;
+			}
+		}
+		cv_broadcast(sfs_bufcv, sfs_buflock);
+		lock_release(sfs_buflock);
+	}
+	return result;
+}
+
+/*
+ * Unpin the buffers for blocks BLOCKS[0] through BLOCKS[N-1] of SFS,
+ * once the journal no longer needs them held back. They stay dirty.
+ */
+void
+sfs_buf_unpin(struct sfs_fs *sfs, const uint32_t *blocks, unsigned n)
+{
+	struct sfs_buf *buf;
+	unsigned i;
+
+	lock_acquire(sfs_buflock);
+	for (i=0; i<n; i++) {
+		buf = sfs_buf_claimpinned(sfs, blocks[i]);
+		buf->sb_pinned = false;
+		buf->sb_busy = false;
+	}
+	cv_broadcast(sfs_bufcv, sfs_buflock);
+	lock_release(sfs_buflock);
+}
+
+/*
+ * Write out all the dirty buffers belonging to filesystem SFS,
+ * except pinned ones.
+ */
+int
+sfs_buf_sync(struct sfs_fs *sfs)
+{
+	struct sfs_buf *buf;
+	unsigned i;
+	int result;
+
+	lock_acquire(sfs_buflock);
+	for (i=0; i<SFS_NBUFS; i++) {
+		buf = &sfs_bufs[i];
+		while (buf->sb_fs == sfs && buf->sb_busy) {
+			cv_wait(sfs_bufcv, sfs_buflock);
+		}
+		if (buf->sb_fs != sfs || !buf->sb_dirty || buf->sb_pinned) {
+			continue;
+		}
+
+		result = sfs_buf_flush(buf);
+		if (result) {
+			lock_release(sfs_buflock);
+			return result;
+		}
+	}
+	lock_release(sfs_buflock);
+	return 0;
+}
+
+/*
+ * Throw away all the buffers belonging to filesystem SFS. Used at
+ * unmount time (after syncing) and when a mount fails.
+ */
+void
+sfs_buf_dropfs(struct sfs_fs *sfs)
+{
+	struct sfs_buf *buf;
+	unsigned i, j, n;
+
+	lock_acquire(sfs_buflock);
+
+	/* Forget any read-ahead requests for it */
+	n = 0;
+	for (i=0; i<sfs_racount; i++) {
+		j = (sfs_rafirst + i) % SFS_RAQUEUE;
+		if (sfs_raqueue[j].ra_fs != sfs) {
+			sfs_raqueue[(sfs_rafirst + n) % SFS_RAQUEUE] =
+				sfs_raqueue[j];
+			n++;
+		}
+	}
+	sfs_racount = n;
+
+	for (i=0; i<SFS_NBUFS; i++) {
+		buf = &sfs_bufs[i];
+		/* The read-ahead thread might still be using it */
+		while (buf->sb_fs == sfs && buf->sb_busy) {
+			cv_wait(sfs_bufcv, sfs_buflock);
+		}
+		if (buf->sb_fs != sfs) {
+			continue;
+		}
+		KASSERT(!buf->sb_dirty);
+		sfs_buf_unhash(buf);
+		sfs_buf_lruback(buf);
+	}
+	lock_release(sfs_buflock);
+}
+
+/*
+ * Print the buffer cache statistics.
+ */
+void
+sfs_bufstats(void)
+{
+	unsigned hits, misses, reads, writes, rablocks, clusters;
+	unsigned total;
+
+	lock_acquire(sfs_buflock);
+	hits = sfs_buf_hits;
+	misses = sfs_buf_misses;
+	reads = sfs_buf_reads;
+	writes = sfs_buf_writes;
+	rablocks = sfs_buf_rablocks;
+	clusters = sfs_buf_clusters;
+	lock_release(sfs_buflock);
+
+	total = hits + misses;
+	kprintf("sfs buffer cache: %u buffers of %u bytes\n",
+		SFS_NBUFS, SFS_BLOCKSIZE);
+	kprintf("    %u lookups, %u hits, %u misses (%u%% hit rate)\n",
+		total, hits, misses, total ? (hits * 100) / total : 0);
+	kprintf("    %u blocks read, %u blocks written\n", reads, writes);
+	kprintf("    %u blocks read ahead, %u multi-block transfers\n",
+		rablocks, clusters);
+}
@@ -36,9 +36,9 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
-#include <array.h>
 #include <bitmap.h>
 #include <uio.h>
+#include <synch.h>
 #include <vfs.h>
 #include <device.h>
 #include <sfs.h>
@@ -61,8 +61,11 @@
  * device. This is ok. These sectors are supposed to be marked "in
  * use" by mksfs and never get marked "free".
  *
- * The sectors used by the superblock and the bitmap itself are
- * likewise marked in use by mksfs.
+ * The sectors used by the superblock, the bitmap itself, and the
+ * journal are likewise marked in use by mksfs.
+ *
+ * On a volume with a journal, this is only used for reading; the
+ * journal writes out the changed parts of the bitmap as it commits.
  */
 
 static
@@ -70,27 +73,38 @@ int
 sfs_mapio(struct sfs_fs *sfs, enum uio_rw rw)
 {
 	uint32_t j, mapsize;
-	char *bitdata;
+	char *rdata;
+	const char *wdata;
 	int result;
 
 	/* Number of blocks in the bitmap. */
 	mapsize = SFS_FS_BITBLOCKS(sfs);
 
-	/* Pointer to our bitmap data in memory. */
-	bitdata = bitmap_getdata(sfs->sfs_freemap);
+	/*
+	 * Pointer to our bitmap data in memory. Only reading it in
+	 * changes the bits, so only then does the bitmap need to
+	 * know.
+	 */
+	rdata = NULL;
+	wdata = NULL;
+	if (rw == UIO_READ) {
+		rdata = bitmap_getdata(sfs->sfs_freemap);
+	}
+	else {
+		wdata = bitmap_getdata_ro(sfs->sfs_freemap);
+	}
 	
 	/* For each sector in the bitmap... */
 	for (j=0; j<mapsize; j++) {
 
-		/* Get a pointer to its data */
-		void *ptr = bitdata + j*SFS_BLOCKSIZE;
-
-		/* and read or write it. The bitmap starts at sector 2. */ 
+		/* read or write it. The bitmap starts at sector 2. */ 
 		if (rw == UIO_READ) {
-			result = sfs_rblock(sfs, ptr, SFS_MAP_LOCATION+j);
+			result = sfs_rblock(sfs, rdata + j*SFS_BLOCKSIZE,
+					    SFS_MAP_LOCATION+j);
 		}
 		else {
-			result = sfs_wblock(sfs, ptr, SFS_MAP_LOCATION+j);
+			result = sfs_wblock(sfs, wdata + j*SFS_BLOCKSIZE,
+					    SFS_MAP_LOCATION+j);
 		}
 
 		/* If we failed, stop. */
@@ -111,6 +125,7 @@ int
 sfs_sync(struct fs *fs)
 {
 	struct sfs_fs *sfs; 
+	struct sfs_vnode **all;
 	unsigned i, num;
 	int result;
 
@@ -148,26 +163,49 @@ sfs_sync(struct fs *fs)
 
 	sfs = fs->fs_data;
 
-	/* Go over the array of loaded vnodes, syncing as we go. */
-	num = vnodearray_num(sfs->sfs_vnodes);
+	/*
+	 * Go over the loaded vnodes, syncing as we go. We can't hold
+	 * sfs_vnlock while syncing (that would be backwards for
+	 * directories), so get a reference to each of them first.
+	 */
+	lock_acquire(sfs->sfs_vnlock);
+	result = sfs_vntable_getall(sfs, &all, &num);
+	lock_release(sfs->sfs_vnlock);
+	if (result) {
+		vfs_biglock_release();
+		return result;
+	}
 	for (i=0; i<num; i++) {
-		struct vnode *v = vnodearray_get(sfs->sfs_vnodes, i);
-		VOP_FSYNC(v);
+		VOP_FSYNC(&all[i]->sv_v);
+		VOP_DECREF(&all[i]->sv_v);
 	}
+	kfree(all);
 
-	/* If the free block map needs to be written, write it. */
-	if (sfs->sfs_freemapdirty) {
+	/*
+	 * If the free block map needs to be written, write it. (If
+	 * there's a journal, committing it takes care of this.)
+	 */
+	lock_acquire(sfs->sfs_freemaplock);
+	if (sfs->sfs_freemapdirty && sfs->sfs_logstart == 0) {
 		result = sfs_mapio(sfs, UIO_WRITE);
 		if (result) {
+			lock_release(sfs->sfs_freemaplock);
 			vfs_biglock_release();
 			return result;
 		}
 		sfs->sfs_freemapdirty = false;
 	}
+	lock_release(sfs->sfs_freemaplock);
 
 	/* If the superblock needs to be written, write it. */
 	if (sfs->sfs_superdirty) {
+		result = sfs_log_begin(sfs);
+		if (result) {
+			vfs_biglock_release();
+			return result;
+		}
 		result = sfs_wblock(sfs, &sfs->sfs_super, SFS_SB_LOCATION);
+		sfs_log_end(sfs);
 		if (result) {
 			vfs_biglock_release();
 			return result;
@@ -175,6 +213,20 @@ sfs_sync(struct fs *fs)
 		sfs->sfs_superdirty = false;
 	}
 
+	/* Commit the journal, so the metadata buffers can be written. */
+	result = sfs_log_commit(sfs);
+	if (result) {
+		vfs_biglock_release();
+		return result;
+	}
+
+	/* Now push everything that's in the buffer cache out to disk. */
+	result = sfs_buf_sync(sfs);
+	if (result) {
+		vfs_biglock_release();
+		return result;
+	}
+
 	vfs_biglock_release();
 	return 0;
 }
@@ -212,18 +264,25 @@ sfs_unmount(struct fs *fs)
 	vfs_biglock_acquire();
 	
 	/* Do we have any files open? If so, can't unmount. */
-	if (vnodearray_num(sfs->sfs_vnodes) > 0) {
+	lock_acquire(sfs->sfs_vnlock);
+	if (sfs->sfs_nvnodes > 0) {
+		lock_release(sfs->sfs_vnlock);
 		vfs_biglock_release();
 		return EBUSY;
 	}
+	lock_release(sfs->sfs_vnlock);
 
 	/* We should have just had sfs_sync called. */
 	KASSERT(sfs->sfs_superdirty == false);
 	KASSERT(sfs->sfs_freemapdirty == false);
 
 	/* Once we start nuking stuff we can't fail. */
-	vnodearray_destroy(sfs->sfs_vnodes);
+	sfs_log_cleanup(sfs);
+	sfs_buf_dropfs(sfs);
+	sfs_vntable_cleanup(sfs);
 	bitmap_destroy(sfs->sfs_freemap);
+	lock_destroy(sfs->sfs_vnlock);
+	lock_destroy(sfs->sfs_freemaplock);
 	
 	/* The vfs layer takes care of the device for us */
 	(void)sfs->sfs_device;
@@ -289,9 +348,26 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 		return ENOMEM;
 	}
 
-	/* Allocate array */
-	sfs->sfs_vnodes = vnodearray_create();
-	if (sfs->sfs_vnodes == NULL) {
+	/* Set up the vnode table */
+	result = sfs_vntable_init(sfs);
+	if (result) {
+		kfree(sfs);
+		vfs_biglock_release();
+		return result;
+	}
+
+	/* and locks */
+	sfs->sfs_vnlock = lock_create("sfs vnodes");
+	if (sfs->sfs_vnlock == NULL) {
+		sfs_vntable_cleanup(sfs);
+		kfree(sfs);
+		vfs_biglock_release();
+		return ENOMEM;
+	}
+	sfs->sfs_freemaplock = lock_create("sfs freemap");
+	if (sfs->sfs_freemaplock == NULL) {
+		lock_destroy(sfs->sfs_vnlock);
+		sfs_vntable_cleanup(sfs);
 		kfree(sfs);
 		vfs_biglock_release();
 		return ENOMEM;
@@ -303,7 +379,10 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	/* Load superblock */
 	result = sfs_rblock(sfs, &sfs->sfs_super, SFS_SB_LOCATION);
 	if (result) {
-		vnodearray_destroy(sfs->sfs_vnodes);
+		sfs_buf_dropfs(sfs);
+		lock_destroy(sfs->sfs_freemaplock);
+		lock_destroy(sfs->sfs_vnlock);
+		sfs_vntable_cleanup(sfs);
 		kfree(sfs);
 		vfs_biglock_release();
 		return result;
@@ -316,7 +395,10 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 			"(0x%x, should be 0x%x)\n", 
 			sfs->sfs_super.sp_magic,
 			SFS_MAGIC);
-		vnodearray_destroy(sfs->sfs_vnodes);
+		sfs_buf_dropfs(sfs);
+		lock_destroy(sfs->sfs_freemaplock);
+		lock_destroy(sfs->sfs_vnlock);
+		sfs_vntable_cleanup(sfs);
 		kfree(sfs);
 		vfs_biglock_release();
 		return EINVAL;
@@ -330,18 +412,42 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	/* Ensure null termination of the volume name */
 	sfs->sfs_super.sp_volname[sizeof(sfs->sfs_super.sp_volname)-1] = 0;
 
+	/*
+	 * Set up the journal. If the system went down in the middle
+	 * of committing, this finishes the job, so it has to happen
+	 * before anything else is loaded.
+	 */
+	result = sfs_log_init(sfs);
+	if (result) {
+		sfs_buf_dropfs(sfs);
+		lock_destroy(sfs->sfs_freemaplock);
+		lock_destroy(sfs->sfs_vnlock);
+		sfs_vntable_cleanup(sfs);
+		kfree(sfs);
+		vfs_biglock_release();
+		return result;
+	}
+
 	/* Load free space bitmap */
 	sfs->sfs_freemap = bitmap_create(SFS_FS_BITMAPSIZE(sfs));
 	if (sfs->sfs_freemap == NULL) {
-		vnodearray_destroy(sfs->sfs_vnodes);
+		sfs_log_cleanup(sfs);
+		sfs_buf_dropfs(sfs);
+		lock_destroy(sfs->sfs_freemaplock);
+		lock_destroy(sfs->sfs_vnlock);
+		sfs_vntable_cleanup(sfs);
 		kfree(sfs);
 		vfs_biglock_release();
 		return ENOMEM;
 	}
 	result = sfs_mapio(sfs, UIO_READ);
 	if (result) {
+		sfs_log_cleanup(sfs);
+		sfs_buf_dropfs(sfs);
 		bitmap_destroy(sfs->sfs_freemap);
-		vnodearray_destroy(sfs->sfs_vnodes);
+		lock_destroy(sfs->sfs_freemaplock);
+		lock_destroy(sfs->sfs_vnlock);
+		sfs_vntable_cleanup(sfs);
 		kfree(sfs);
 		vfs_biglock_release();
 		return result;
@@ -352,6 +458,7 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	sfs->sfs_absfs.fs_getvolname = sfs_getvolname;
 	sfs->sfs_absfs.fs_getroot = sfs_getroot;
 	sfs->sfs_absfs.fs_unmount = sfs_unmount;
+	sfs->sfs_absfs.fs_namecache = true;
 	sfs->sfs_absfs.fs_data = sfs;
 
 	/* the other fields */
@@ -42,7 +42,8 @@
 // Note: sfs_rblock is used to read the superblock
 // early in mount, before sfs is fully (or even mostly)
 // initialized, and so may not use anything from sfs
-// except sfs_device.
+// except sfs_device. (The buffer cache uses the sfs
+// pointer itself as part of a buffer's name, which is ok.)
 
 int
 sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
@@ -50,8 +51,6 @@ sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
 	int result;
 	int tries=0;
 
-	KASSERT(vfs_biglock_do_i_hold());
-
 	DEBUG(DB_SFS, "sfs: %s %llu\n", 
 	      uio->uio_rw == UIO_READ ? "read" : "write",
 	      uio->uio_offset / SFS_BLOCKSIZE);
@@ -86,22 +85,40 @@ sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
 	return result;
 }
 
+/*
+ * Read or write a whole block by copying it into or out of the
+ * buffer cache. The write doesn't reach the disk until the buffer
+ * is synced or evicted. These are only used for metadata, so writes
+ * go through the journal, if there is one; they must then be made
+ * inside a journal operation.
+ */
 int
 sfs_rblock(struct sfs_fs *sfs, void *data, uint32_t block)
 {
-	struct iovec iov;
-	struct uio ku;
+	struct sfs_buf *buf;
+	int result;
 
-	SFSUIO(&iov, &ku, data, block, UIO_READ);
-	return sfs_rwblock(sfs, &ku);
+	result = sfs_buf_get(sfs, block, true, &buf);
+	if (result) {
+		return result;
+	}
+	memcpy(data, sfs_buf_data(buf), SFS_BLOCKSIZE);
+	sfs_buf_release(buf);
+	return 0;
 }
 
 int
-sfs_wblock(struct sfs_fs *sfs, void *data, uint32_t block)
+sfs_wblock(struct sfs_fs *sfs, const void *data, uint32_t block)
 {
-	struct iovec iov;
-	struct uio ku;
+	struct sfs_buf *buf;
+	int result;
 
-	SFSUIO(&iov, &ku, data, block, UIO_WRITE);
-	return sfs_rwblock(sfs, &ku);
+	result = sfs_buf_get(sfs, block, false, &buf);
+	if (result) {
+		return result;
+	}
+	memcpy(sfs_buf_data(buf), data, SFS_BLOCKSIZE);
+	sfs_log_write(sfs, buf, block);
+	sfs_buf_release(buf);
+	return 0;
 }
@@ -0,0 +1,814 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * SFS filesystem
+ *
+ * Metadata journal.
+ *
+ * On a volume that has a journal (see <kern/sfs.h>), every change to
+ * the filesystem's metadata - inodes, indirect blocks, directory
+ * blocks, the freemap, and the superblock - happens inside an
+ * operation bracketed by sfs_log_begin and sfs_log_end. Metadata
+ * buffers are handed to sfs_log_write instead of sfs_buf_markdirty,
+ * which pins them in the buffer cache so they can't reach their real
+ * locations early, and changes to the freemap are noted with
+ * sfs_log_freemap. Operations pile up into one transaction until
+ * it's getting full or somebody syncs; then, once no operation is
+ * halfway done, the whole transaction is committed at once:
+ *
+ *     1. the pinned buffers and the changed freemap blocks are
+ *        written to the log, in one sequential pass;
+ *     2. the log header is written listing where they all belong
+ *        (this is the commit point);
+ *     3. the buffers are unpinned and everything is written home;
+ *     4. the header is cleared.
+ *
+ * If the system goes down before step 2, none of the transaction
+ * reached the disk; after it, sfs_log_init finishes the job at the
+ * next mount. Either way the metadata on disk is consistent, and
+ * there's no need for sfsck.
+ *
+ * File data is not journaled. It goes through the buffer cache as
+ * before, so after a crash recently written parts of a file may hold
+ * old contents or zeros.
+ *
+ * Blocks freed during a transaction (with sfs_log_bfree) stay marked
+ * in the in-memory freemap, and are only noted in sfs_logfree, until
+ * the transaction commits: the committed metadata may still point at
+ * them, so nothing may reuse them for data, or zero them, before
+ * then. The freemap blocks written by the commit already show them
+ * free.
+ *
+ * An operation that causes another one - a vnode reclaimed from
+ * inside sfs_remove, say - just becomes part of the first; the
+ * nesting is counted per thread in t_sfsops.
+ *
+ * Each operation may add up to SFS_LOGOPBLOCKS blocks to the
+ * transaction; t_sfslogged counts how many it has. sfs_log_begin
+ * waits (committing if need be) until every operation running can
+ * have that many. Code that could dirty an unbounded number of
+ * blocks asks sfs_log_room first and does something cheaper if there
+ * isn't room (see sfs_dir_unlink). The slack between SFS_LOGRESERVE
+ * and SFS_LOGMAXBLOCKS covers small overruns. A transaction that
+ * fills up anyway can't be committed with an operation halfway done,
+ * and its blocks must not go home unjournaled, so that's a panic.
+ *
+ * If a commit fails, the error goes back to whoever wanted it: the
+ * syncer through sfs_log_commit, or sfs_log_begin if it was making
+ * room. A transaction that didn't reach its commit point stays open,
+ * with its buffers still pinned and its freed blocks still held, and
+ * is tried again next time. One that did is over, except that its
+ * freed blocks are held until the log is settled. Either way the next
+ * commit starts by reading the header back and finishing whatever it
+ * lists, so a committed transaction is never overwritten in the log.
+ *
+ * A volume without a journal (sp_journalblocks 0, from before there
+ * were journals) doesn't set up any of this, and all these functions
+ * do nothing: sfs_log_write just marks the buffer dirty, and
+ * sfs_log_bfree frees the block at once. A journal too small for a
+ * full transaction is refused at mount time.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <uio.h>
+#include <synch.h>
+#include <thread.h>
+#include <current.h>
+#include <bitmap.h>
+#include <sfs.h>
+
+/* Most buffers one operation may log; sfs_log_begin reserves this many */
+#define SFS_LOGOPBLOCKS   8
+
+/* Most buffers reserved at once; sfs_log_begin waits after that */
+#define SFS_LOGRESERVE    24
+
+/*
+ * Most buffers a transaction can actually have. This is the limit
+ * on pinned buffers, so it has to stay well under the size of the
+ * buffer cache.
+ */
+#define SFS_LOGMAXBLOCKS  40
+
+/* Shortcut for the size of the freemap */
+#define SFS_FS_BITBLOCKS(sfs)   SFS_BITBLOCKS((sfs)->sfs_super.sp_nblocks)
+
+////////////////////////////////////////////////////////////
+//
+// Journal I/O
+//
+// The journal itself is read and written directly, not through the
+// buffer cache.
+
+/*
+ * Read or write the journal header.
+ */
+static
+int
+sfs_log_hdrio(struct sfs_fs *sfs, enum uio_rw rw)
+{
+	struct iovec iov;
+	struct uio ku;
+
+	SFSUIO(&iov, &ku, sfs->sfs_loghdr, sfs->sfs_super.sp_journalstart, rw);
+	return sfs_rwblock(sfs, &ku);
+}
+
+/*
+ * Write freemap block MAPBLOCK from memory to disk block WHERE. (The
+ * buffer cache may still have the copy read in at mount time, but
+ * nothing looks at that again.)
+ */
+static
+int
+sfs_log_mapwrite(struct sfs_fs *sfs, uint32_t mapblock, uint32_t where)
+{
+	struct iovec iov;
+	struct uio ku;
+	const char *bitdata;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
+
+	/* the uio only reads from the bits, since this is a write */
+	bitdata = bitmap_getdata_ro(sfs->sfs_freemap);
+	SFSUIO(&iov, &ku, (char *)bitdata + mapblock*SFS_BLOCKSIZE, where,
+	       UIO_WRITE);
+	return sfs_rwblock(sfs, &ku);
+}
+
+/*
+ * Copy the blocks of the committed transaction described by the
+ * header in memory from the log to their real locations.
+ */
+static
+int
+sfs_log_copyhome(struct sfs_fs *sfs)
+{
+	struct sfs_jheader *jh = sfs->sfs_loghdr;
+	uint32_t start = sfs->sfs_super.sp_journalstart;
+	struct iovec iov;
+	struct uio ku;
+	void *data;
+	uint32_t i;
+	int result;
+
+	if (jh->jh_nblocks > SFS_JMAXBLOCKS ||
+	    jh->jh_nblocks >= sfs->sfs_super.sp_journalblocks) {
+		kprintf("sfs: %s: journal header is corrupt\n",
+			sfs->sfs_super.sp_volname);
+		return EINVAL;
+	}
+	for (i=0; i<jh->jh_nblocks; i++) {
+		if (jh->jh_blocks[i] >= sfs->sfs_super.sp_nblocks) {
+			kprintf("sfs: %s: journal entry %u is for invalid "
+				"block %u\n", sfs->sfs_super.sp_volname, i,
+				jh->jh_blocks[i]);
+			return EINVAL;
+		}
+	}
+
+	data = kmalloc(SFS_BLOCKSIZE);
+	if (data == NULL) {
+		return ENOMEM;
+	}
+	for (i=0; i<jh->jh_nblocks; i++) {
+		SFSUIO(&iov, &ku, data, start + 1 + i, UIO_READ);
+		result = sfs_rwblock(sfs, &ku);
+		if (result) {
+			kfree(data);
+			return result;
+		}
+		SFSUIO(&iov, &ku, data, jh->jh_blocks[i], UIO_WRITE);
+		result = sfs_rwblock(sfs, &ku);
+		if (result) {
+			kfree(data);
+			return result;
+		}
+	}
+	kfree(data);
+	return 0;
+}
+
+/*
+ * After a failed commit, find out what the header on disk says, and
+ * if it lists a committed transaction, put that in place; then clear
+ * the header. Until this succeeds the log can't be reused. The
+ * blocks copied hold committed contents; newer versions are still
+ * pinned in the buffer cache, and the freed blocks they might have
+ * been are still held, so nothing newer gets overwritten.
+ */
+static
+int
+sfs_log_settle(struct sfs_fs *sfs)
+{
+	struct sfs_jheader *jh = sfs->sfs_loghdr;
+	int result;
+
+	result = sfs_log_hdrio(sfs, UIO_READ);
+	if (result) {
+		return result;
+	}
+	if (jh->jh_magic == SFS_JMAGIC && jh->jh_nblocks > 0) {
+		result = sfs_log_copyhome(sfs);
+		if (result) {
+			return result;
+		}
+	}
+	jh->jh_magic = SFS_JMAGIC;
+	jh->jh_nblocks = 0;
+	return sfs_log_hdrio(sfs, UIO_WRITE);
+}
+
+/*
+ * Go over the blocks freed in the current transaction: give them
+ * back to the freemap (RELEASE true), for the commit, or take them
+ * back out again (RELEASE false) if the commit then fails. Called
+ * with sfs_freemaplock held.
+ */
+static
+void
+sfs_log_frees(struct sfs_fs *sfs, bool release)
+{
+	uint32_t i, block, end;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
+
+	for (i=0; i<SFS_FS_BITBLOCKS(sfs); i++) {
+		if (!sfs->sfs_logfreeany[i]) {
+			continue;
+		}
+		end = (i+1) * SFS_BLOCKBITS;
+		for (block = i * SFS_BLOCKBITS; block < end; block++) {
+			if (!bitmap_isset(sfs->sfs_logfree, block)) {
+				continue;
+			}
+			if (release) {
+				bitmap_unmark(sfs->sfs_freemap, block);
+			}
+			else {
+				bitmap_mark(sfs->sfs_freemap, block);
+			}
+		}
+		/* either way this freemap block has to be written again */
+		sfs->sfs_logmap[i] = true;
+		sfs->sfs_freemapdirty = true;
+	}
+}
+
+/*
+ * Forget the blocks freed in a transaction once it's safely home.
+ * Called with sfs_freemaplock held.
+ */
+static
+void
+sfs_log_clearfrees(struct sfs_fs *sfs)
+{
+	uint32_t i, block, end;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
+
+	for (i=0; i<SFS_FS_BITBLOCKS(sfs); i++) {
+		if (!sfs->sfs_logfreeany[i]) {
+			continue;
+		}
+		end = (i+1) * SFS_BLOCKBITS;
+		for (block = i * SFS_BLOCKBITS; block < end; block++) {
+			if (bitmap_isset(sfs->sfs_logfree, block)) {
+				bitmap_unmark(sfs->sfs_logfree, block);
+			}
+		}
+		sfs->sfs_logfreeany[i] = false;
+	}
+}
+
+/*
+ * Commit the current transaction. Called with sfs_loglock held, and
+ * no operations running; drops the lock during the I/O, but nobody
+ * can start an operation until we're done.
+ *
+ * On failure before the commit point, the transaction is left as it
+ * was, to be committed again later. After the commit point it's
+ * done as far as the rest of the filesystem is concerned, and the
+ * buffers are unpinned, but its freed blocks are kept back until the
+ * log is settled. Either way the next commit settles the log first.
+ */
+static
+int
+sfs_log_docommit(struct sfs_fs *sfs)
+{
+	struct sfs_jheader *jh = sfs->sfs_loghdr;
+	uint32_t start = sfs->sfs_super.sp_journalstart;
+	unsigned nmeta, n, i;
+	bool freed = false, committed = false, unpinned = false;
+	int result;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_loglock));
+	KASSERT(sfs->sfs_logops == 0);
+	KASSERT(!sfs->sfs_logcommitting);
+
+	sfs->sfs_logwanted = false;
+	nmeta = sfs->sfs_lognblocks;
+	sfs->sfs_logcommitting = true;
+	lock_release(sfs->sfs_loglock);
+
+	/* 0. Make sure the last commit didn't leave anything behind */
+	if (sfs->sfs_logsettle) {
+		result = sfs_log_settle(sfs);
+		if (result) {
+			goto fail;
+		}
+		sfs->sfs_logsettle = false;
+	}
+
+	/* 1. Write the pinned buffers to the log */
+	result = sfs_buf_writecopy(sfs, sfs->sfs_logblocks, nmeta, start + 1);
+	if (result) {
+		goto fail;
+	}
+
+	/*
+	 * ...and the freemap blocks after them, with this
+	 * transaction's freed blocks free. Nobody can allocate them
+	 * until we're done.
+	 */
+	lock_acquire(sfs->sfs_freemaplock);
+	sfs_log_frees(sfs, true);
+	freed = true;
+	n = nmeta;
+	for (i=0; i<SFS_FS_BITBLOCKS(sfs); i++) {
+		if (!sfs->sfs_logmap[i]) {
+			continue;
+		}
+		KASSERT(n < SFS_JMAXBLOCKS);
+		result = sfs_log_mapwrite(sfs, i, start + 1 + n);
+		if (result) {
+			lock_release(sfs->sfs_freemaplock);
+			goto fail;
+		}
+		jh->jh_blocks[n++] = SFS_MAP_LOCATION + i;
+	}
+
+	if (n == 0) {
+		/* Nothing happened */
+		lock_release(sfs->sfs_freemaplock);
+		goto done;
+	}
+
+	/* 2. Commit */
+	memcpy(jh->jh_blocks, sfs->sfs_logblocks, nmeta * sizeof(uint32_t));
+	jh->jh_magic = SFS_JMAGIC;
+	jh->jh_nblocks = n;
+	result = sfs_log_hdrio(sfs, UIO_WRITE);
+	if (result) {
+		lock_release(sfs->sfs_freemaplock);
+		goto fail;
+	}
+	committed = true;
+
+	/* 3. Write it all home */
+	for (i=nmeta; i<n; i++) {
+		result = sfs_log_mapwrite(sfs, jh->jh_blocks[i] -
+					  SFS_MAP_LOCATION, jh->jh_blocks[i]);
+		if (result) {
+			lock_release(sfs->sfs_freemaplock);
+			goto fail;
+		}
+		sfs->sfs_logmap[jh->jh_blocks[i] - SFS_MAP_LOCATION] = false;
+	}
+	sfs->sfs_freemapdirty = false;
+	lock_release(sfs->sfs_freemaplock);
+
+	sfs_buf_unpin(sfs, sfs->sfs_logblocks, nmeta);
+	unpinned = true;
+	result = sfs_buf_sync(sfs);
+	if (result) {
+		goto fail;
+	}
+
+	/* 4. Clear the header */
+	jh->jh_nblocks = 0;
+	result = sfs_log_hdrio(sfs, UIO_WRITE);
+	if (result) {
+		goto fail;
+	}
+
+	/* Now the freed blocks can be reused */
+	lock_acquire(sfs->sfs_freemaplock);
+	sfs_log_clearfrees(sfs);
+	lock_release(sfs->sfs_freemaplock);
+
+ done:
+	lock_acquire(sfs->sfs_loglock);
+	sfs->sfs_lognblocks = 0;
+	sfs->sfs_logcommitting = false;
+	cv_broadcast(sfs->sfs_logcv, sfs->sfs_loglock);
+	return 0;
+
+ fail:
+	if (freed) {
+		lock_acquire(sfs->sfs_freemaplock);
+		sfs_log_frees(sfs, false);
+		lock_release(sfs->sfs_freemaplock);
+	}
+	if (committed && !unpinned) {
+		sfs_buf_unpin(sfs, sfs->sfs_logblocks, nmeta);
+	}
+	sfs->sfs_logsettle = true;
+
+	lock_acquire(sfs->sfs_loglock);
+	if (committed) {
+		sfs->sfs_lognblocks = 0;
+	}
+	sfs->sfs_logcommitting = false;
+	cv_broadcast(sfs->sfs_logcv, sfs->sfs_loglock);
+	return result;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Operations
+
+/*
+ * Start an operation. Fails only if a commit needed to make room
+ * fails; then the operation mustn't go ahead.
+ */
+int
+sfs_log_begin(struct sfs_fs *sfs)
+{
+	int result;
+
+	if (sfs->sfs_logstart == 0) {
+		return 0;
+	}
+	if (curthread->t_sfsops > 0) {
+		/* Part of an operation we're already in */
+		curthread->t_sfsops++;
+		return 0;
+	}
+
+	lock_acquire(sfs->sfs_loglock);
+	while (sfs->sfs_logcommitting || sfs->sfs_logwanted ||
+	       sfs->sfs_lognblocks + (sfs->sfs_logops + 1) * SFS_LOGOPBLOCKS
+	       > SFS_LOGRESERVE) {
+		if (!sfs->sfs_logcommitting && sfs->sfs_logops == 0) {
+			/* Out of room, and nobody else to commit */
+			result = sfs_log_docommit(sfs);
+			if (result) {
+				lock_release(sfs->sfs_loglock);
+				return result;
+			}
+			continue;
+		}
+		cv_wait(sfs->sfs_logcv, sfs->sfs_loglock);
+	}
+	sfs->sfs_logops++;
+	lock_release(sfs->sfs_loglock);
+
+	curthread->t_sfsops = 1;
+	curthread->t_sfslogged = 0;
+	return 0;
+}
+
+/*
+ * Finish an operation. The last one to finish commits the
+ * transaction if it's close to full or somebody's waiting for it.
+ */
+void
+sfs_log_end(struct sfs_fs *sfs)
+{
+	int result;
+
+	if (sfs->sfs_logstart == 0) {
+		return;
+	}
+	KASSERT(curthread->t_sfsops > 0);
+	if (--curthread->t_sfsops > 0) {
+		return;
+	}
+
+	lock_acquire(sfs->sfs_loglock);
+	KASSERT(sfs->sfs_logops > 0);
+	sfs->sfs_logops--;
+	if (sfs->sfs_logops == 0 && (sfs->sfs_logwanted ||
+	    sfs->sfs_lognblocks + SFS_LOGOPBLOCKS > SFS_LOGRESERVE)) {
+		result = sfs_log_docommit(sfs);
+		if (result) {
+			/* the next sfs_log_begin or sync tries again */
+			kprintf("sfs: %s: journal commit failed: %s\n",
+				sfs->sfs_super.sp_volname, strerror(result));
+		}
+	}
+	else {
+		/* A reservation came free */
+		cv_broadcast(sfs->sfs_logcv, sfs->sfs_loglock);
+	}
+	lock_release(sfs->sfs_loglock);
+}
+
+/*
+ * Note that a metadata buffer for block BLOCK has been changed. The
+ * buffer must be busy, and we must be inside an operation.
+ */
+void
+sfs_log_write(struct sfs_fs *sfs, struct sfs_buf *buf, uint32_t block)
+{
+	unsigned i;
+
+	if (sfs->sfs_logstart == 0) {
+		sfs_buf_markdirty(buf);
+		return;
+	}
+	KASSERT(curthread->t_sfsops > 0);
+
+	lock_acquire(sfs->sfs_loglock);
+	KASSERT(!sfs->sfs_logcommitting);
+	for (i=0; i<sfs->sfs_lognblocks; i++) {
+		if (sfs->sfs_logblocks[i] == block) {
+			break;
+		}
+	}
+	if (i == sfs->sfs_lognblocks) {
+		if (i >= SFS_LOGMAXBLOCKS) {
+			/* Some operation ignored sfs_log_room */
+			panic("sfs: %s: journal transaction overrun "
+			      "logging block %u\n",
+			      sfs->sfs_super.sp_volname, block);
+		}
+		sfs->sfs_logblocks[sfs->sfs_lognblocks++] = block;
+		curthread->t_sfslogged++;
+	}
+	lock_release(sfs->sfs_loglock);
+
+	sfs_buf_pin(buf);
+}
+
+/*
+ * Return how many more blocks the current operation can add to the
+ * transaction within its reservation.
+ */
+unsigned
+sfs_log_room(struct sfs_fs *sfs)
+{
+	if (sfs->sfs_logstart == 0) {
+		/* no journal, no limit */
+		return (unsigned)-1;
+	}
+	KASSERT(curthread->t_sfsops > 0);
+
+	if (curthread->t_sfslogged >= SFS_LOGOPBLOCKS) {
+		return 0;
+	}
+	return SFS_LOGOPBLOCKS - curthread->t_sfslogged;
+}
+
+/*
+ * Note that the freemap bit for block BLOCK has changed. Called with
+ * sfs_freemaplock held.
+ */
+void
+sfs_log_freemap(struct sfs_fs *sfs, uint32_t block)
+{
+	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
+
+	if (sfs->sfs_logstart != 0) {
+		sfs->sfs_logmap[block / SFS_BLOCKBITS] = true;
+	}
+}
+
+/*
+ * Free block BLOCK, once the current transaction has committed.
+ * Called with sfs_freemaplock held, inside an operation.
+ */
+void
+sfs_log_bfree(struct sfs_fs *sfs, uint32_t block)
+{
+	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
+
+	if (sfs->sfs_logstart == 0) {
+		bitmap_unmark(sfs->sfs_freemap, block);
+		return;
+	}
+	KASSERT(curthread->t_sfsops > 0);
+
+	bitmap_mark(sfs->sfs_logfree, block);
+	sfs->sfs_logfreeany[block / SFS_BLOCKBITS] = true;
+	sfs->sfs_logmap[block / SFS_BLOCKBITS] = true;
+}
+
+/*
+ * Commit everything done so far. Used by sync and fsync; must not be
+ * called from inside an operation.
+ */
+int
+sfs_log_commit(struct sfs_fs *sfs)
+{
+	int result;
+
+	if (sfs->sfs_logstart == 0) {
+		return 0;
+	}
+	KASSERT(curthread->t_sfsops == 0);
+
+	lock_acquire(sfs->sfs_loglock);
+	while (sfs->sfs_logcommitting || sfs->sfs_logops > 0) {
+		/* Keep new operations out so they can drain */
+		sfs->sfs_logwanted = true;
+		cv_wait(sfs->sfs_logcv, sfs->sfs_loglock);
+	}
+	result = sfs_log_docommit(sfs);
+	lock_release(sfs->sfs_loglock);
+	return result;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Setup and recovery
+
+/*
+ * Replay a committed transaction found in the journal at mount time.
+ * Like the rest of the journal I/O, this bypasses the buffer cache.
+ * The superblock might be one of the blocks, so we load it again
+ * afterwards; the copy the buffer cache got when the mount code
+ * first read it is out of date then, but nothing reads it again.
+ */
+static
+int
+sfs_log_replay(struct sfs_fs *sfs)
+{
+	struct sfs_jheader *jh = sfs->sfs_loghdr;
+	struct iovec iov;
+	struct uio ku;
+	int result;
+
+	result = sfs_log_copyhome(sfs);
+	if (result) {
+		return result;
+	}
+
+	SFSUIO(&iov, &ku, &sfs->sfs_super, SFS_SB_LOCATION, UIO_READ);
+	result = sfs_rwblock(sfs, &ku);
+	if (result) {
+		return result;
+	}
+	sfs->sfs_super.sp_volname[sizeof(sfs->sfs_super.sp_volname)-1] = 0;
+
+	kprintf("sfs: %s: replayed %u blocks from journal\n",
+		sfs->sfs_super.sp_volname, jh->jh_nblocks);
+
+	jh->jh_nblocks = 0;
+	return sfs_log_hdrio(sfs, UIO_WRITE);
+}
+
+/*
+ * Set up the journal at mount time, after the superblock is loaded
+ * and before anything else is, replaying it first if need be.
+ */
+int
+sfs_log_init(struct sfs_fs *sfs)
+{
+	struct sfs_super *sp = &sfs->sfs_super;
+	uint32_t bitblocks = SFS_FS_BITBLOCKS(sfs);
+	int result;
+
+	sfs->sfs_logstart = 0;
+	sfs->sfs_loglock = NULL;
+	sfs->sfs_logcv = NULL;
+	sfs->sfs_logops = 0;
+	sfs->sfs_logcommitting = false;
+	sfs->sfs_logwanted = false;
+	sfs->sfs_lognblocks = 0;
+	sfs->sfs_logblocks = NULL;
+	sfs->sfs_logmap = NULL;
+	sfs->sfs_logfree = NULL;
+	sfs->sfs_logfreeany = NULL;
+	sfs->sfs_logsettle = false;
+	sfs->sfs_loghdr = NULL;
+
+	if (sp->sp_journalblocks == 0) {
+		/* Made before journals */
+		return 0;
+	}
+	if (sp->sp_journalstart < SFS_MAP_LOCATION + bitblocks ||
+	    sp->sp_journalstart >= sp->sp_nblocks ||
+	    sp->sp_journalblocks > sp->sp_nblocks - sp->sp_journalstart) {
+		kprintf("sfs: %s: journal location is invalid\n",
+			sp->sp_volname);
+		return EINVAL;
+	}
+	if (sp->sp_journalblocks < 1 + SFS_LOGMAXBLOCKS + bitblocks ||
+	    SFS_LOGMAXBLOCKS + bitblocks > SFS_JMAXBLOCKS) {
+		kprintf("sfs: %s: journal is too small for this volume\n",
+			sp->sp_volname);
+		return EINVAL;
+	}
+
+	sfs->sfs_loghdr = kmalloc(sizeof(struct sfs_jheader));
+	if (sfs->sfs_loghdr == NULL) {
+		return ENOMEM;
+	}
+	result = sfs_log_hdrio(sfs, UIO_READ);
+	if (result) {
+		sfs_log_cleanup(sfs);
+		return result;
+	}
+	if (sfs->sfs_loghdr->jh_magic != SFS_JMAGIC) {
+		kprintf("sfs: %s: journal header has bad magic number\n",
+			sp->sp_volname);
+		sfs_log_cleanup(sfs);
+		return EINVAL;
+	}
+	if (sfs->sfs_loghdr->jh_nblocks > 0) {
+		result = sfs_log_replay(sfs);
+		if (result) {
+			sfs_log_cleanup(sfs);
+			return result;
+		}
+	}
+
+	sfs->sfs_loglock = lock_create("sfs journal");
+	sfs->sfs_logcv = cv_create("sfs journal");
+	sfs->sfs_logblocks = kmalloc(SFS_LOGMAXBLOCKS * sizeof(uint32_t));
+	sfs->sfs_logmap = kmalloc(bitblocks * sizeof(bool));
+	sfs->sfs_logfree = bitmap_create(bitblocks * SFS_BLOCKBITS);
+	sfs->sfs_logfreeany = kmalloc(bitblocks * sizeof(bool));
+	if (sfs->sfs_loglock == NULL || sfs->sfs_logcv == NULL ||
+	    sfs->sfs_logblocks == NULL || sfs->sfs_logmap == NULL ||
+	    sfs->sfs_logfree == NULL || sfs->sfs_logfreeany == NULL) {
+		sfs_log_cleanup(sfs);
+		return ENOMEM;
+	}
+	bzero(sfs->sfs_logmap, bitblocks * sizeof(bool));
+	bzero(sfs->sfs_logfreeany, bitblocks * sizeof(bool));
+
+	sfs->sfs_logstart = sp->sp_journalstart;
+	return 0;
+}
+
+/*
+ * Tear down the journal state, at unmount time (after a final
+ * commit) or when mounting fails.
+ */
+void
+sfs_log_cleanup(struct sfs_fs *sfs)
+{
+	KASSERT(sfs->sfs_lognblocks == 0);
+	KASSERT(sfs->sfs_logops == 0);
+
+	if (sfs->sfs_loglock != NULL) {
+		lock_destroy(sfs->sfs_loglock);
+	}
+	if (sfs->sfs_logcv != NULL) {
+		cv_destroy(sfs->sfs_logcv);
+	}
+	if (sfs->sfs_logblocks != NULL) {
+		kfree(sfs->sfs_logblocks);
+	}
+	if (sfs->sfs_logmap != NULL) {
+		kfree(sfs->sfs_logmap);
+	}
+	if (sfs->sfs_logfree != NULL) {
+		bitmap_destroy(sfs->sfs_logfree);
+	}
+	if (sfs->sfs_logfreeany != NULL) {
+		kfree(sfs->sfs_logfreeany);
+	}
+	if (sfs->sfs_loghdr != NULL) {
+		kfree(sfs->sfs_loghdr);
+	}
+	sfs->sfs_logstart = 0;
+	sfs->sfs_loglock = NULL;
+	sfs->sfs_logcv = NULL;
+	sfs->sfs_logblocks = NULL;
+	sfs->sfs_logmap = NULL;
+	sfs->sfs_logfree = NULL;
+	sfs->sfs_logfreeany = NULL;
+	sfs->sfs_loghdr = NULL;
+}
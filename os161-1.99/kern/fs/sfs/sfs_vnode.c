@@ -37,7 +37,6 @@
 #include <kern/fcntl.h>
 #include <stat.h>
 #include <lib.h>
-#include <array.h>
 #include <bitmap.h>
 #include <uio.h>
 #include <synch.h>
@@ -49,6 +48,30 @@
 static int sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int type,
 			 struct sfs_vnode **ret);
 
+/* Further down */
+static int sfs_dotruncate(struct sfs_vnode *sv, off_t len);
+static int sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret);
+
+/* Number of blocks to read ahead of a sequential reader */
+#define SFS_READAHEAD 8
+
+/* Most bytes written in one journal operation (see sfs_write) */
+#define SFS_WRITECHUNK (SFS_DBPERIDB * SFS_BLOCKSIZE)
+
+/* Linear directories are made into hash tables when this many slots fill */
+#define SFS_DIRHASH_MINSLOTS 16
+
+/* Most blocks a file can have */
+#define SFS_MAXBLOCKS \
+	(SFS_NDIRECT + SFS_DBPERIDB + SFS_DBPERIDB * SFS_DBPERIDB)
+
+/* Most slots a directory can have */
+#define SFS_DIR_MAXSLOTS \
+	(SFS_MAXBLOCKS * (SFS_BLOCKSIZE/sizeof(struct sfs_dir)))
+
+/* sv_bmbase when sv_bmcache holds nothing */
+#define SFS_NOLEAF 0xffffffff
+
 ////////////////////////////////////////////////////////////
 //
 // Simple stuff
@@ -58,9 +81,37 @@ static
 int
 sfs_clearblock(struct sfs_fs *sfs, uint32_t block)
 {
-	/* static -> automatically initialized to zero */
-	static char zeros[SFS_BLOCKSIZE];
-	return sfs_wblock(sfs, zeros, block);
+	struct sfs_buf *buf;
+	int result;
+
+	result = sfs_buf_get(sfs, block, false, &buf);
+	if (result) {
+		return result;
+	}
+	bzero(sfs_buf_data(buf), SFS_BLOCKSIZE);
+	sfs_buf_markdirty(buf);
+	sfs_buf_release(buf);
+	return 0;
+}
+
+/*
+ * Mark a buffer for block BLOCK dirty after changing it on behalf of
+ * SV. Metadata (indirect blocks and directory contents) goes through
+ * the journal; file data doesn't.
+ */
+static
+void
+sfs_dirtybuf(struct sfs_vnode *sv, struct sfs_buf *buf, uint32_t block,
+	     bool meta)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+
+	if (meta && !sv->sv_nolog) {
+		sfs_log_write(sfs, buf, block);
+	}
+	else {
+		sfs_buf_markdirty(buf);
+	}
 }
 
 /* Write an on-disk inode structure back out to disk. */
@@ -68,6 +119,8 @@ static
 int
 sfs_sync_inode(struct sfs_vnode *sv)
 {
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
 	if (sv->sv_dirty) {
 		struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
 		int result = sfs_wblock(sfs, &sv->sv_i, sv->sv_ino);
@@ -84,19 +137,23 @@ sfs_sync_inode(struct sfs_vnode *sv)
 // Space allocation
 
 /*
- * Allocate a block.
+ * Allocate a block, preferably GOAL or the first free one after it.
  */
 static
 int
-sfs_balloc(struct sfs_fs *sfs, uint32_t *diskblock)
+sfs_balloc(struct sfs_fs *sfs, uint32_t goal, uint32_t *diskblock)
 {
 	int result;
 
-	result = bitmap_alloc(sfs->sfs_freemap, diskblock);
+	lock_acquire(sfs->sfs_freemaplock);
+	result = bitmap_alloc_near(sfs->sfs_freemap, goal, diskblock);
 	if (result) {
+		lock_release(sfs->sfs_freemaplock);
 		return result;
 	}
 	sfs->sfs_freemapdirty = true;
+	sfs_log_freemap(sfs, *diskblock);
+	lock_release(sfs->sfs_freemaplock);
 
 	if (*diskblock >= sfs->sfs_super.sp_nblocks) {
 		panic("sfs: balloc: invalid block %u\n", *diskblock);
@@ -107,14 +164,17 @@ sfs_balloc(struct sfs_fs *sfs, uint32_t *diskblock)
 }
 
 /*
- * Free a block.
+ * Free a block. With a journal it isn't reusable until the
+ * transaction freeing it has committed.
  */
 static
 void
 sfs_bfree(struct sfs_fs *sfs, uint32_t diskblock)
 {
-	bitmap_unmark(sfs->sfs_freemap, diskblock);
+	lock_acquire(sfs->sfs_freemaplock);
+	sfs_log_bfree(sfs, diskblock);
 	sfs->sfs_freemapdirty = true;
+	lock_release(sfs->sfs_freemaplock);
 }
 
 /*
@@ -124,44 +184,189 @@ static
 int
 sfs_bused(struct sfs_fs *sfs, uint32_t diskblock)
 {
+	int ret;
+
 	if (diskblock >= sfs->sfs_super.sp_nblocks) {
 		panic("sfs: sfs_bused called on out of range block %u\n", 
 		      diskblock);
 	}
-	return bitmap_isset(sfs->sfs_freemap, diskblock);
+
+	lock_acquire(sfs->sfs_freemaplock);
+	ret = bitmap_isset(sfs->sfs_freemap, diskblock);
+	lock_release(sfs->sfs_freemaplock);
+
+	return ret;
 }
 
 ////////////////////////////////////////////////////////////
 //
 // Block mapping/inode maintenance
 
+/*
+ * Exchange the contents (size and block pointers) of two inodes.
+ */
+static
+void
+sfs_swapblocks(struct sfs_inode *a, struct sfs_inode *b)
+{
+	uint32_t t;
+	unsigned i;
+
+	t = a->sfi_size;
+	a->sfi_size = b->sfi_size;
+	b->sfi_size = t;
+	for (i=0; i<SFS_NDIRECT; i++) {
+		t = a->sfi_direct[i];
+		a->sfi_direct[i] = b->sfi_direct[i];
+		b->sfi_direct[i] = t;
+	}
+	t = a->sfi_indirect;
+	a->sfi_indirect = b->sfi_indirect;
+	b->sfi_indirect = t;
+	t = a->sfi_dindirect;
+	a->sfi_dindirect = b->sfi_dindirect;
+	b->sfi_dindirect = t;
+}
+
+/*
+ * Pick the goal for allocating a new block of a file: just after
+ * PREV, the disk block holding the file block before it, if there is
+ * one, or else just after the inode. That way files written
+ * sequentially come out contiguous on disk even when the free space
+ * is fragmented.
+ */
+static
+uint32_t
+sfs_bgoal(struct sfs_vnode *sv, uint32_t prev)
+{
+	return (prev != 0 ? prev : sv->sv_ino) + 1;
+}
+
+/*
+ * Remember the contents of an indirect block that maps data blocks,
+ * the first of which is file block BASE, so later lookups in the same
+ * range don't need to go to the buffer cache. If we can't get memory
+ * for it we just don't.
+ */
+static
+void
+sfs_bmcache_load(struct sfs_vnode *sv, uint32_t base, const uint32_t *data)
+{
+	if (sv->sv_bmcache == NULL) {
+		sv->sv_bmcache = kmalloc(SFS_BLOCKSIZE);
+		if (sv->sv_bmcache == NULL) {
+			return;
+		}
+	}
+	memcpy(sv->sv_bmcache, data, SFS_BLOCKSIZE);
+	sv->sv_bmbase = base;
+}
+
+/*
+ * Get entry INDEX of the indirect block whose number is in *IENTRY.
+ * If DOALLOC is set, the indirect block and the entry are allocated
+ * if they don't exist yet; if the indirect block is, *IENTRY is
+ * updated and *CHANGED set, and the block goes after PREV. If
+ * LEAFBASE is not SFS_NOLEAF, this indirect block maps data blocks
+ * starting at that file block and gets loaded into the block-map
+ * cache.
+ */
+static
+int
+sfs_bmap_indirect(struct sfs_vnode *sv, uint32_t *ientry, bool *changed,
+		  uint32_t prev, uint32_t index, int doalloc,
+		  uint32_t leafbase, uint32_t *ret)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_buf *idbuf;
+	uint32_t *iddata;
+	uint32_t block;
+	int result;
+
+	KASSERT(index < SFS_DBPERIDB);
+
+	if (*ientry == 0 && !doalloc) {
+		/*
+		 * There's no indirect block allocated. We weren't
+		 * asked to allocate anything, so pretend the indirect
+		 * block was filled with all zeros.
+		 */
+		*ret = 0;
+		return 0;
+	}
+	else if (*ientry == 0) {
+		/* Allocate the indirect block */
+		result = sfs_balloc(sfs, sfs_bgoal(sv, prev), ientry);
+		if (result) {
+			return result;
+		}
+		*changed = true;
+
+		/* (sfs_balloc cleared it, so it's already all zeros) */
+	}
+
+	/* Load the indirect block. */
+	result = sfs_buf_get(sfs, *ientry, true, &idbuf);
+	if (result) {
+		return result;
+	}
+	iddata = sfs_buf_data(idbuf);
+
+	/* Get the block out of the indirect block buffer */
+	block = iddata[index];
+
+	/* If there's no block there, allocate one */
+	if (block==0 && doalloc) {
+		result = sfs_balloc(sfs, sfs_bgoal(sv, index > 0 ?
+			iddata[index-1] : *ientry), &block);
+		if (result) {
+			sfs_buf_release(idbuf);
+			return result;
+		}
+
+		/* Remember the block we allocated */
+		iddata[index] = block;
+
+		/* The indirect block is now dirty */
+		sfs_dirtybuf(sv, idbuf, *ientry, true);
+	}
+
+	if (leafbase != SFS_NOLEAF) {
+		sfs_bmcache_load(sv, leafbase, iddata);
+	}
+	sfs_buf_release(idbuf);
+
+	*ret = block;
+	return 0;
+}
+
 /*
  * Look up the disk block number (from 0 up to the number of blocks on
  * the disk) given a file and the logical block number within that
  * file. If DOALLOC is set, and no such block exists, one will be
  * allocated.
+ *
+ * The first SFS_NDIRECT blocks are mapped straight from the inode;
+ * the next SFS_DBPERIDB through the indirect block; and the rest
+ * through the indirect blocks listed in the double indirect block.
+ * The last indirect block used is kept in sv_bmcache, so sequential
+ * access only goes through the buffer cache once every SFS_DBPERIDB
+ * blocks.
  */
 static
 int
 sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 	 uint32_t *diskblock)
 {
-	/*
-	 * I/O buffer for handling indirect blocks.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
-
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
 	uint32_t block;
 	uint32_t idblock;
-	uint32_t idnum, idoff;
+	uint32_t idnum, idoff, leafbase;
+	bool changed;
 	int result;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
+	KASSERT(SFS_DBPERIDB * sizeof(uint32_t) == SFS_BLOCKSIZE);
+	KASSERT(lock_do_i_hold(sv->sv_lock));
 
 	/*
 	 * If the block we want is one of the direct blocks...
@@ -176,7 +381,8 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 		 * Do we need to allocate?
 		 */
 		if (block==0 && doalloc) {
-			result = sfs_balloc(sfs, &block);
+			result = sfs_balloc(sfs, sfs_bgoal(sv, fileblock > 0 ?
+				sv->sv_i.sfi_direct[fileblock-1] : 0), &block);
 			if (result) {
 				return result;
 			}
@@ -186,100 +392,58 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 			sv->sv_dirty = true;
 		}
 
-		/*
-		 * Hand back the block
-		 */
-		if (block != 0 && !sfs_bused(sfs, block)) {
-			panic("sfs: Data block %u (block %u of file %u) "
-			      "marked free\n", block, fileblock, sv->sv_ino);
-		}
-		*diskblock = block;
-		return 0;
+		goto done;
 	}
 
-	/*
-	 * It's not a direct block; it must be in the indirect block.
-	 * Subtract off the number of direct blocks, so FILEBLOCK is
-	 * now the offset into the indirect block space.
-	 */
-
-	fileblock -= SFS_NDIRECT;
-
-	/* Get the indirect block number and offset w/i that indirect block */
-	idnum = fileblock / SFS_DBPERIDB;
-	idoff = fileblock % SFS_DBPERIDB;
-
-	/*
-	 * We only have one indirect block. If the offset we were asked for
-	 * is too large, we can't handle it, so fail.
-	 */
-	if (idnum > 0) {
+	if (fileblock >= SFS_MAXBLOCKS) {
 		return EFBIG;
 	}
 
-	/* Get the disk block number of the indirect block. */
-	idblock = sv->sv_i.sfi_indirect;
-
-	if (idblock==0 && !doalloc) {
-		/*
-		 * There's no indirect block allocated. We weren't
-		 * asked to allocate anything, so pretend the indirect
-		 * block was filled with all zeros.
-		 */
-		*diskblock = 0;
-		return 0;
-	}
-	else if (idblock==0) {
-		/*
-		 * There's no indirect block allocated, but we need to
-		 * allocate a block whose number needs to be stored in
-		 * the indirect block. Thus, we need to allocate an
-		 * indirect block.
-		 */
-		result = sfs_balloc(sfs, &idblock);
-		if (result) {
-			return result;
+	/*
+	 * It's not a direct block. See if the indirect block it's in
+	 * is the one in the block-map cache.
+	 */
+	idoff = (fileblock - SFS_NDIRECT) % SFS_DBPERIDB;
+	leafbase = fileblock - idoff;
+	if (sv->sv_bmcache != NULL && sv->sv_bmbase == leafbase) {
+		block = sv->sv_bmcache[idoff];
+		if (block != 0 || !doalloc) {
+			goto done;
 		}
+	}
 
-		/* Remember the block we just allocated */
-		sv->sv_i.sfi_indirect = idblock;
-
-		/* Mark the inode dirty */
-		sv->sv_dirty = true;
-
-		/* Clear the indirect block buffer */
-		bzero(idbuf, sizeof(idbuf));
+	changed = false;
+	if (fileblock < SFS_NDIRECT + SFS_DBPERIDB) {
+		/* It's in the indirect block */
+		result = sfs_bmap_indirect(sv, &sv->sv_i.sfi_indirect,
+					   &changed,
+					   sv->sv_i.sfi_direct[SFS_NDIRECT-1],
+					   idoff, doalloc, leafbase, &block);
 	}
 	else {
-		/*
-		 * We already have an indirect block allocated; load it.
-		 */
-		result = sfs_rblock(sfs, idbuf, idblock);
-		if (result) {
-			return result;
+		/* Find its indirect block in the double indirect block */
+		idnum = (fileblock - SFS_NDIRECT - SFS_DBPERIDB)
+			/ SFS_DBPERIDB;
+		result = sfs_bmap_indirect(sv, &sv->sv_i.sfi_dindirect,
+					   &changed, sv->sv_i.sfi_indirect,
+					   idnum, doalloc, SFS_NOLEAF,
+					   &idblock);
+		if (result == 0) {
+			/* (if doalloc, idblock is not 0 and won't change) */
+			result = sfs_bmap_indirect(sv, &idblock, &changed,
+						   0, idoff, doalloc,
+						   leafbase, &block);
 		}
 	}
-
-	/* Get the block out of the indirect block buffer */
-	block = idbuf[idoff];
-
-	/* If there's no block there, allocate one */
-	if (block==0 && doalloc) {
-		result = sfs_balloc(sfs, &block);
-		if (result) {
-			return result;
-		}
-
-		/* Remember the block we allocated */
-		idbuf[idoff] = block;
-
-		/* The indirect block is now dirty; write it back */
-		result = sfs_wblock(sfs, idbuf, idblock);
-		if (result) {
-			return result;
-		}
+	if (changed) {
+		/* We allocated sfi_indirect or sfi_dindirect */
+		sv->sv_dirty = true;
+	}
+	if (result) {
+		return result;
 	}
 
+ done:
 	/* Hand back the result and return. */
 	if (block != 0 && !sfs_bused(sfs, block)) {
 		panic("sfs: Data block %u (block %u of file %u) marked free\n",
@@ -308,16 +472,8 @@ int
 sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	      uint32_t skipstart, uint32_t len)
 {
-	/*
-	 * I/O buffer for handling partial sectors.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static char iobuf[SFS_BLOCKSIZE];
-
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_buf *iobuf;
 	uint32_t diskblock;
 	uint32_t fileblock;
 	int result;
@@ -339,40 +495,37 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	if (diskblock == 0) {
 		/*
 		 * There was no block mapped at this point in the file.
-		 * Zero the buffer.
+		 * Hand back zeros.
 		 */
 		KASSERT(uio->uio_rw == UIO_READ);
-		bzero(iobuf, sizeof(iobuf));
-	}
-	else {
-		/*
-		 * Read the block.
-		 */
-		result = sfs_rblock(sfs, iobuf, diskblock);
-		if (result) {
-			return result;
-		}
+		return uiomovezeros(len, uio);
 	}
 
 	/*
-	 * Now perform the requested operation into/out of the buffer.
+	 * Get the block from the buffer cache. We need the old
+	 * contents even if we're writing.
 	 */
-	result = uiomove(iobuf+skipstart, len, uio);
+	result = sfs_buf_get(sfs, diskblock, true, &iobuf);
 	if (result) {
 		return result;
 	}
 
 	/*
-	 * If it was a write, write back the modified block.
+	 * Now perform the requested operation into/out of the buffer.
+	 */
+	result = uiomove((char *)sfs_buf_data(iobuf) + skipstart, len, uio);
+
+	/*
+	 * If it was a write, the block needs to go back to disk. (Even
+	 * if uiomove failed partway, the buffer may have changed.)
 	 */
 	if (uio->uio_rw == UIO_WRITE) {
-		result = sfs_wblock(sfs, iobuf, diskblock);
-		if (result) {
-			return result;
-		}
+		sfs_dirtybuf(sv, iobuf, diskblock,
+			     sv->sv_i.sfi_type == SFS_TYPE_DIR);
 	}
+	sfs_buf_release(iobuf);
 
-	return 0;
+	return result;
 }
 
 /*
@@ -383,14 +536,11 @@ int
 sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 {
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_buf *iobuf;
 	uint32_t diskblock;
 	uint32_t fileblock;
 	int result;
 	int doalloc = (uio->uio_rw==UIO_WRITE);
-	off_t saveoff;
-	off_t diskoff;
-	off_t saveres;
-	off_t diskres;
 
 	/* Get the block number within the file */
 	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
@@ -413,33 +563,85 @@ sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 	}
 
 	/*
-	 * Do the I/O directly to the uio region. Save the uio_offset,
-	 * and substitute one that makes sense to the device.
-	 */
-	saveoff = uio->uio_offset;
-	diskoff = diskblock * SFS_BLOCKSIZE;
-	uio->uio_offset = diskoff;
-
-	/*
-	 * Temporarily set the residue to be one block size.
+	 * Go through the buffer cache. If we're writing we're about
+	 * to overwrite the whole block, so there's no need to read
+	 * it first. If the copy from the user falls short, though,
+	 * the rest of the buffer may not be the block's contents
+	 * (it's zeros if the block wasn't cached). A freshly
+	 * allocated block is already in the cache, dirty, with the
+	 * zeros it really holds; otherwise a clean buffer is thrown
+	 * away and the disk keeps the old contents.
 	 */
 	KASSERT(uio->uio_resid >= SFS_BLOCKSIZE);
-	saveres = uio->uio_resid;
-	diskres = SFS_BLOCKSIZE;
-	uio->uio_resid = diskres;
-	
-	result = sfs_rwblock(sfs, uio);
+	result = sfs_buf_get(sfs, diskblock, uio->uio_rw == UIO_READ, &iobuf);
+	if (result) {
+		return result;
+	}
 
-	/*
-	 * Now, restore the original uio_offset and uio_resid and update 
-	 * them by the amount of I/O done.
-	 */
-	uio->uio_offset = (uio->uio_offset - diskoff) + saveoff;
-	uio->uio_resid = (uio->uio_resid - diskres) + saveres;
+	result = uiomove(sfs_buf_data(iobuf), SFS_BLOCKSIZE, uio);
+	if (uio->uio_rw == UIO_WRITE) {
+		if (result == 0 || sfs_buf_isdirty(iobuf)) {
+			sfs_dirtybuf(sv, iobuf, diskblock,
+				     sv->sv_i.sfi_type == SFS_TYPE_DIR);
+		}
+		else {
+			sfs_buf_invalidate(iobuf);
+		}
+	}
+	sfs_buf_release(iobuf);
 
 	return result;
 }
 
+/*
+ * Sequential read detection. If a read picked up where the last one
+ * left off, ask the buffer cache to fetch the next SFS_READAHEAD
+ * blocks of the file in the background; if not, stop reading ahead
+ * until the access pattern looks sequential again.
+ *
+ * STARTBLOCK is the first file block the read touched and ENDPOS the
+ * file offset it stopped at.
+ */
+static
+void
+sfs_readahead(struct sfs_vnode *sv, uint32_t startblock, off_t endpos)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	uint32_t lastblock, fileblock, fileblocks, diskblock;
+	int result;
+
+	lastblock = (endpos - 1) / SFS_BLOCKSIZE;
+
+	if (startblock != sv->sv_lastread && startblock != sv->sv_lastread+1) {
+		/* Not sequential */
+		sv->sv_lastread = lastblock;
+		sv->sv_rahead = lastblock + 1;
+		return;
+	}
+	sv->sv_lastread = lastblock;
+
+	/* Don't ask again for blocks we already asked for */
+	fileblock = lastblock + 1;
+	if (fileblock < sv->sv_rahead) {
+		fileblock = sv->sv_rahead;
+	}
+
+	fileblocks = DIVROUNDUP(sv->sv_i.sfi_size, SFS_BLOCKSIZE);
+	for (; fileblock <= lastblock + SFS_READAHEAD; fileblock++) {
+		if (fileblock >= fileblocks) {
+			break;
+		}
+		result = sfs_bmap(sv, fileblock, 0, &diskblock);
+		if (result) {
+			break;
+		}
+		if (diskblock != 0) {
+			sfs_buf_readahead(sfs, diskblock);
+		}
+	}
+	sv->sv_rahead = fileblock;
+}
+
 /*
  * Do I/O of a whole region of data, whether or not it's block-aligned.
  */
@@ -449,9 +651,12 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 {
 	uint32_t blkoff;
 	uint32_t nblocks, i;
+	uint32_t startblock;
 	int result = 0;
 	uint32_t extraresid = 0;
 
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
 	/*
 	 * If reading, check for EOF. If we can read a partial area,
 	 * remember how much extra there was in EXTRARESID so we can
@@ -473,6 +678,8 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 		}
 	}
 
+	startblock = uio->uio_offset / SFS_BLOCKSIZE;
+
 	/*
 	 * First, do any leading partial block.
 	 */
@@ -527,6 +734,12 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 
  out:
 
+	/* If reading sequentially, get the next few blocks coming */
+	if (uio->uio_rw == UIO_READ && result == 0 &&
+	    uio->uio_offset > (off_t)startblock * SFS_BLOCKSIZE) {
+		sfs_readahead(sv, startblock, uio->uio_offset);
+	}
+
 	/* If writing, adjust file length */
 	if (uio->uio_rw == UIO_WRITE && 
 	    uio->uio_offset > (off_t)sv->sv_i.sfi_size) {
@@ -636,10 +849,121 @@ sfs_dir_nentries(struct sfs_vnode *sv)
 	return size / sizeof(struct sfs_dir);
 }
 
+/*
+ * Check if a directory is a hash table. (See <kern/sfs.h>.)
+ */
+static
+bool
+sfs_dir_ishashed(struct sfs_vnode *sv)
+{
+	return (sv->sv_i.sfi_flags & SFS_IFLAG_HASHDIR) != 0;
+}
+
+/*
+ * Hash a name for a hashed directory.
+ */
+static
+uint32_t
+sfs_dir_hash(const char *name)
+{
+	uint32_t hash = SFS_DIRHASH_BASIS;
+
+	while (*name) {
+		hash = (hash ^ (unsigned char)*name) * SFS_DIRHASH_PRIME;
+		name++;
+	}
+	return hash;
+}
+
+/*
+ * Count the entries in use in a directory. This is only needed for
+ * hashed directories, to know when they're getting full, and is
+ * remembered in sv_dircount once computed.
+ */
+static
+int
+sfs_dir_count(struct sfs_vnode *sv, int *ret)
+{
+	struct sfs_dir tsd;
+	int nentries = sfs_dir_nentries(sv);
+	int i, count, result;
+
+	if (sv->sv_dircount >= 0) {
+		*ret = sv->sv_dircount;
+		return 0;
+	}
+
+	count = 0;
+	for (i=0; i<nentries; i++) {
+		result = sfs_readdir(sv, &tsd, i);
+		if (result) {
+			return result;
+		}
+		if (tsd.sfd_ino != SFS_NOINO) {
+			count++;
+		}
+	}
+	sv->sv_dircount = count;
+	*ret = count;
+	return 0;
+}
+
+/*
+ * Probe the first NSLOTS slots of a directory as a hash table for
+ * NAME. If found, hand back its inode number and slot; if not, hand
+ * back the empty slot where it would be inserted. The table is
+ * normally the whole directory; sfs_dir_rehash also uses this on a
+ * table that's under construction.
+ */
+static
+int
+sfs_dir_probe(struct sfs_vnode *sv, int nslots, const char *name,
+	      uint32_t *ino, int *slot, int *emptyslot)
+{
+	struct sfs_dir tsd;
+	int i, n, result;
+
+	KASSERT(nslots > 0);
+
+	i = sfs_dir_hash(name) % nslots;
+	for (n=0; n<nslots; n++) {
+		result = sfs_readdir(sv, &tsd, i);
+		if (result) {
+			return result;
+		}
+		if (tsd.sfd_ino == SFS_NOINO) {
+			if (emptyslot != NULL) {
+				*emptyslot = i;
+			}
+			return ENOENT;
+		}
+
+		/* Ensure null termination, just in case */
+		tsd.sfd_name[sizeof(tsd.sfd_name)-1] = 0;
+		if (!strcmp(tsd.sfd_name, name)) {
+			if (slot != NULL) {
+				*slot = i;
+			}
+			if (ino != NULL) {
+				*ino = tsd.sfd_ino;
+			}
+			return 0;
+		}
+
+		i = (i + 1) % nslots;
+	}
+
+	/* The table is completely full and it isn't there */
+	return ENOENT;
+}
+
 /*
  * Search a directory for a particular filename in a directory, and
  * return its inode number, its slot, and/or the slot number of an
  * empty directory slot if one is found.
+ *
+ * For a hashed directory the empty slot is the one the name should
+ * be inserted into.
  */
 
 static
@@ -652,6 +976,10 @@ sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 	int nentries = sfs_dir_nentries(sv);
 	int i, result;
 
+	if (sfs_dir_ishashed(sv)) {
+		return sfs_dir_probe(sv, nentries, name, ino, slot, emptyslot);
+	}
+
 	/* For each slot... */
 	for (i=0; i<nentries; i++) {
 
@@ -688,6 +1016,165 @@ sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 	return found ? 0 : ENOENT;
 }
 
+/*
+ * Rebuild a directory as a hash table of NEWSLOTS slots.
+ *
+ * The new table is built in a scratch inode that nothing refers to,
+ * so the directory isn't touched in the meantime, and the journal
+ * needn't hear about it (which is as well, since it can be any size).
+ * Once the table is safely on disk, the two inodes trade contents,
+ * which is an ordinary small metadata update, and the scratch inode,
+ * now holding the old blocks, is thrown away. If we fail before the
+ * trade, the directory is just as it was.
+ */
+static
+int
+sfs_dir_rehash(struct sfs_vnode *sv, int newslots)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_vnode *tmp;
+	struct sfs_dir sd;
+	int oldslots = sfs_dir_nentries(sv);
+	int i, emptyslot, count, result;
+
+	KASSERT(newslots > 0);
+	KASSERT(newslots <= (int)SFS_DIR_MAXSLOTS);
+
+	result = sfs_makeobj(sfs, SFS_TYPE_DIR, &tmp);
+	if (result) {
+		return result;
+	}
+	lock_acquire(tmp->sv_lock);
+	tmp->sv_nolog = true;
+
+	/* Lay out the new table, empty */
+	bzero(&sd, sizeof(sd));
+	sd.sfd_ino = SFS_NOINO;
+	for (i=0; i<newslots; i++) {
+		result = sfs_writedir(tmp, &sd, i);
+		if (result) {
+			goto out;
+		}
+	}
+
+	/* Insert each entry into it */
+	count = 0;
+	for (i=0; i<oldslots; i++) {
+		result = sfs_readdir(sv, &sd, i);
+		if (result) {
+			goto out;
+		}
+		if (sd.sfd_ino == SFS_NOINO) {
+			continue;
+		}
+		sd.sfd_name[sizeof(sd.sfd_name)-1] = 0;
+
+		result = sfs_dir_probe(tmp, newslots, sd.sfd_name,
+				       NULL, NULL, &emptyslot);
+		if (result != ENOENT) {
+			/* (names are unique, so it can't be there already) */
+			KASSERT(result != 0);
+			goto out;
+		}
+		result = sfs_writedir(tmp, &sd, emptyslot);
+		if (result) {
+			goto out;
+		}
+		count++;
+	}
+
+	/* It has to be on disk before anything refers to it */
+	result = sfs_buf_sync(sfs);
+	if (result) {
+		goto out;
+	}
+
+	/* Trade */
+	sfs_swapblocks(&sv->sv_i, &tmp->sv_i);
+	sv->sv_bmbase = SFS_NOLEAF;
+	tmp->sv_bmbase = SFS_NOLEAF;
+	sv->sv_i.sfi_flags |= SFS_IFLAG_HASHDIR;
+	sv->sv_dirty = true;
+	tmp->sv_dirty = true;
+	sv->sv_dircount = count;
+
+ out:
+	lock_release(tmp->sv_lock);
+
+	/* It has no links, so this frees it and whatever it holds */
+	VOP_DECREF(&tmp->sv_v);
+	return result;
+}
+
+/*
+ * Called when about to add NAME to a directory, once we know it
+ * isn't already there. EMPTYSLOT is the slot sfs_dir_findname found;
+ * this grows a hashed directory that's getting full, or makes a
+ * full linear directory into a hashed one, and updates EMPTYSLOT to
+ * match. A directory that can't be grown any further as a hash table
+ * just goes back to being linear, which only requires clearing the
+ * flag.
+ *
+ * Failing to rehash isn't fatal: we fall back to whatever room the
+ * directory already has.
+ */
+static
+int
+sfs_dir_makeroom(struct sfs_vnode *sv, const char *name, int *emptyslot)
+{
+	int nslots = sfs_dir_nentries(sv);
+	int maxslots = SFS_DIR_MAXSLOTS;
+	int count, newslots, result;
+
+	if (sfs_dir_ishashed(sv)) {
+		result = sfs_dir_count(sv, &count);
+		if (result) {
+			return result;
+		}
+		if ((count+1)*4 <= nslots*3 && *emptyslot >= 0) {
+			/* still less than 3/4 full */
+			return 0;
+		}
+		newslots = nslots * 2;
+		if (newslots > maxslots) {
+			newslots = maxslots;
+		}
+	}
+	else {
+		if (*emptyslot >= 0 || nslots < SFS_DIRHASH_MINSLOTS) {
+			return 0;
+		}
+		newslots = SFS_DIRHASH_MINSLOTS;
+		while (newslots < (nslots+1)*2) {
+			newslots *= 2;
+		}
+		if (newslots > maxslots) {
+			/* too big to convert; stay linear */
+			return 0;
+		}
+	}
+
+	if (newslots > nslots && sfs_dir_rehash(sv, newslots) == 0) {
+		*emptyslot = -1;
+		result = sfs_dir_probe(sv, newslots, name,
+				       NULL, NULL, emptyslot);
+		if (result != ENOENT) {
+			/* (it can't be there; the caller already checked) */
+			KASSERT(result != 0);
+			return result;
+		}
+		return 0;
+	}
+
+	if (sfs_dir_ishashed(sv) && *emptyslot < 0) {
+		/* Full, and can't grow; the entries are fine as is */
+		sv->sv_i.sfi_flags &= ~SFS_IFLAG_HASHDIR;
+		sv->sv_dirty = true;
+		sv->sv_dircount = -1;
+	}
+	return 0;
+}
+
 /*
  * Create a link in a directory to the specified inode by number, with
  * the specified name, and optionally hand back the slot.
@@ -713,6 +1200,12 @@ sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 		return ENAMETOOLONG;
 	}
 
+	/* Grow or convert the directory if needed. */
+	result = sfs_dir_makeroom(sv, name, &emptyslot);
+	if (result) {
+		return result;
+	}
+
 	/* If we didn't get an empty slot, add the entry at the end. */
 	if (emptyslot < 0) {
 		emptyslot = sfs_dir_nentries(sv);
@@ -727,27 +1220,135 @@ sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 	if (slot) {
 		*slot = emptyslot;
 	}
-
-	/* Write the entry. */
-	return sfs_writedir(sv, &sd, emptyslot);
-	
+
+	/* Write the entry. */
+	result = sfs_writedir(sv, &sd, emptyslot);
+	if (result) {
+		return result;
+	}
+	if (sv->sv_dircount >= 0) {
+		sv->sv_dircount++;
+	}
+	return 0;
+}
+
+/*
+ * Count the directory blocks holding SLOT and the rest of its run of
+ * occupied slots in a hashed directory; these are the blocks
+ * sfs_dir_unlink may have to write.
+ */
+static
+int
+sfs_dir_runblocks(struct sfs_vnode *sv, int slot, unsigned *ret)
+{
+	struct sfs_dir sd;
+	int nslots, i, blk, prevblk;
+	unsigned count;
+	int result;
+
+	nslots = sfs_dir_nentries(sv);
+	prevblk = slot * sizeof(struct sfs_dir) / SFS_BLOCKSIZE;
+	count = 1;
+	for (i = (slot + 1) % nslots; i != slot; i = (i + 1) % nslots) {
+		result = sfs_readdir(sv, &sd, i);
+		if (result) {
+			return result;
+		}
+		if (sd.sfd_ino == SFS_NOINO) {
+			break;
+		}
+		blk = i * sizeof(struct sfs_dir) / SFS_BLOCKSIZE;
+		if (blk != prevblk) {
+			count++;
+			prevblk = blk;
+		}
+	}
+	*ret = count;
+	return 0;
 }
 
 /*
  * Unlink a name in a directory, by slot number.
+ *
+ * In a hashed directory, entries after the hole that can no longer
+ * be reached from their starting slot are moved back into it (Knuth's
+ * algorithm R), so that the table never needs tombstones. This can
+ * move other entries to different slots.
+ *
+ * A long enough run of entries after the hole could dirty more
+ * blocks than the journal allows one operation. In that case the
+ * directory goes back to being linear instead, like sfs_dir_makeroom
+ * does when it's full, and the hole is just left; it's rehashed
+ * later on when it fills up again.
  */
 static
 int
 sfs_dir_unlink(struct sfs_vnode *sv, int slot)
 {
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
 	struct sfs_dir sd;
+	int nslots, hole, i, home;
+	unsigned nblocks;
+	int result;
+
+	if (sfs_dir_ishashed(sv)) {
+		result = sfs_dir_runblocks(sv, slot, &nblocks);
+		if (result) {
+			return result;
+		}
+		/* (and leave one for the directory's inode) */
+		if (nblocks + 1 > sfs_log_room(sfs)) {
+			sv->sv_i.sfi_flags &= ~SFS_IFLAG_HASHDIR;
+			sv->sv_dirty = true;
+			sv->sv_dircount = -1;
+		}
+	}
+
+	if (sfs_dir_ishashed(sv)) {
+		nslots = sfs_dir_nentries(sv);
+		hole = slot;
+		i = slot;
+		while (1) {
+			i = (i + 1) % nslots;
+			if (i == hole) {
+				break;
+			}
+			result = sfs_readdir(sv, &sd, i);
+			if (result) {
+				return result;
+			}
+			if (sd.sfd_ino == SFS_NOINO) {
+				break;
+			}
+			sd.sfd_name[sizeof(sd.sfd_name)-1] = 0;
+			home = sfs_dir_hash(sd.sfd_name) % nslots;
+
+			/* Can stay only if home is cyclically in (hole, i] */
+			if (hole < i ? (home <= hole || home > i)
+			    : (home <= hole && home > i)) {
+				result = sfs_writedir(sv, &sd, hole);
+				if (result) {
+					return result;
+				}
+				hole = i;
+			}
+		}
+		slot = hole;
+	}
 
 	/* Initialize a suitable directory entry... */ 
 	bzero(&sd, sizeof(sd));
 	sd.sfd_ino = SFS_NOINO;
 
 	/* ... and write it */
-	return sfs_writedir(sv, &sd, slot);
+	result = sfs_writedir(sv, &sd, slot);
+	if (result) {
+		return result;
+	}
+	if (sv->sv_dircount > 0) {
+		sv->sv_dircount--;
+	}
+	return 0;
 }
 
 /*
@@ -774,10 +1375,12 @@ sfs_lookonce(struct sfs_vnode *sv, const char *name,
 		return result;
 	}
 
+	lock_acquire((*ret)->sv_lock);
 	if ((*ret)->sv_i.sfi_linkcount == 0) {
 		panic("sfs: Link count of file %u found in dir %u is 0\n",
 		      (*ret)->sv_ino, sv->sv_ino);
 	}
+	lock_release((*ret)->sv_lock);
 
 	return 0;
 }
@@ -801,7 +1404,7 @@ sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret)
 	 * number is the block number, so just get a block.)
 	 */
 
-	result = sfs_balloc(sfs, &ino);
+	result = sfs_balloc(sfs, 0, &ino);
 	if (result) {
 		return result;
 	}
@@ -875,8 +1478,24 @@ static
 int
 sfs_close(struct vnode *v)
 {
-	/* Sync it. */
-	return VOP_FSYNC(v);
+	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
+	int result;
+
+	/*
+	 * Put the inode in the buffer cache. It goes to disk the
+	 * next time the filesystem is synced.
+	 */
+	result = sfs_log_begin(sfs);
+	if (result) {
+		return result;
+	}
+	lock_acquire(sv->sv_lock);
+	result = sfs_sync_inode(sv);
+	lock_release(sv->sv_lock);
+	sfs_log_end(sfs);
+
+	return result;
 }
 
 /*
@@ -890,31 +1509,43 @@ sfs_reclaim(struct vnode *v)
 {
 	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_fs *sfs = v->vn_fs->fs_data;
-	unsigned ix, i, num;
 	int result;
 
-	vfs_biglock_acquire();
+	/* Erasing the file (below) needs to be journaled */
+	result = sfs_log_begin(sfs);
+	if (result) {
+		return result;
+	}
 
 	/*
-	 * Make sure someone else hasn't picked up the vnode since the
-	 * decision was made to reclaim it. (You must also synchronize
-	 * this with sfs_loadvnode.)
+	 * Holding sfs_vnlock keeps sfs_loadvnode from handing out new
+	 * references. Make sure someone else hasn't picked up the vnode
+	 * since the decision was made to reclaim it.
 	 */
+	lock_acquire(sfs->sfs_vnlock);
+	spinlock_acquire(&v->vn_countlock);
 	if (v->vn_refcount != 1) {
 
 		/* consume the reference VOP_DECREF gave us */
 		KASSERT(v->vn_refcount>1);
 		v->vn_refcount--;
 
-		vfs_biglock_release();
+		spinlock_release(&v->vn_countlock);
+		lock_release(sfs->sfs_vnlock);
+		sfs_log_end(sfs);
 		return EBUSY;
 	}
+	spinlock_release(&v->vn_countlock);
+
+	lock_acquire(sv->sv_lock);
 
 	/* If there are no on-disk references to the file either, erase it. */
 	if (sv->sv_i.sfi_linkcount==0) {
-		result = VOP_TRUNCATE(&sv->sv_v, 0);
+		result = sfs_dotruncate(sv, 0);
 		if (result) {
-			vfs_biglock_release();
+			lock_release(sv->sv_lock);
+			lock_release(sfs->sfs_vnlock);
+			sfs_log_end(sfs);
 			return result;
 		}
 	}
@@ -922,37 +1553,33 @@ sfs_reclaim(struct vnode *v)
 	/* Sync the inode to disk */
 	result = sfs_sync_inode(sv);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
+		lock_release(sfs->sfs_vnlock);
+		sfs_log_end(sfs);
 		return result;
 	}
 
+	lock_release(sv->sv_lock);
+
 	/* If there are no on-disk references, discard the inode */
 	if (sv->sv_i.sfi_linkcount==0) {
 		sfs_bfree(sfs, sv->sv_ino);
 	}
 
 	/* Remove the vnode structure from the table in the struct sfs_fs. */
-	num = vnodearray_num(sfs->sfs_vnodes);
-	ix = num;
-	for (i=0; i<num; i++) {
-		struct vnode *v2 = vnodearray_get(sfs->sfs_vnodes, i);
-		struct sfs_vnode *sv2 = v2->vn_data;
-		if (sv2 == sv) {
-			ix = i;
-			break;
-		}
-	}
-	if (ix == num) {
-		panic("sfs: reclaim vnode %u not in vnode pool\n",
-		      sv->sv_ino);
-	}
-	vnodearray_remove(sfs->sfs_vnodes, ix);
+	sfs_vntable_remove(sfs, sv);
 
-	VOP_CLEANUP(&sv->sv_v);
+	lock_release(sfs->sfs_vnlock);
+	sfs_log_end(sfs);
 
-	vfs_biglock_release();
+	/* Nobody can find it now; tear it down. */
+	VOP_CLEANUP(&sv->sv_v);
+	lock_destroy(sv->sv_lock);
 
 	/* Release the storage for the vnode structure itself. */
+	if (sv->sv_bmcache != NULL) {
+		kfree(sv->sv_bmcache);
+	}
 	kfree(sv);
 
 	/* Done */
@@ -971,28 +1598,57 @@ sfs_read(struct vnode *v, struct uio *uio)
 
 	KASSERT(uio->uio_rw==UIO_READ);
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
 	result = sfs_io(sv, uio);
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
 
 	return result;
 }
 
 /*
  * Called for write(). sfs_io() does the work.
+ *
+ * Big writes are done in pieces of SFS_WRITECHUNK bytes, each its own
+ * journal operation; a piece can need at most two leaf indirect
+ * blocks, plus the indirect, double indirect, and inode blocks. The
+ * inode goes into the same operation as the blocks it now points to.
  */
 static
 int
 sfs_write(struct vnode *v, struct uio *uio)
 {
 	struct sfs_vnode *sv = v->vn_data;
-	int result;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
+	size_t len, rest;
+	int result = 0, result2;
 
 	KASSERT(uio->uio_rw==UIO_WRITE);
 
-	vfs_biglock_acquire();
-	result = sfs_io(sv, uio);
-	vfs_biglock_release();
+	while (uio->uio_resid > 0 && result == 0) {
+		/* Hide everything past this piece from sfs_io */
+		len = uio->uio_resid;
+		if (len > SFS_WRITECHUNK) {
+			len = SFS_WRITECHUNK;
+		}
+		rest = uio->uio_resid - len;
+		uio->uio_resid = len;
+
+		result = sfs_log_begin(sfs);
+		if (result) {
+			uio->uio_resid += rest;
+			break;
+		}
+		lock_acquire(sv->sv_lock);
+		result = sfs_io(sv, uio);
+		result2 = sfs_sync_inode(sv);
+		lock_release(sv->sv_lock);
+		sfs_log_end(sfs);
+
+		if (result == 0) {
+			result = result2;
+		}
+		uio->uio_resid += rest;
+	}
 
 	return result;
 }
@@ -1033,7 +1689,9 @@ sfs_stat(struct vnode *v, struct stat *statbuf)
 		return result;
 	}
 
+	lock_acquire(sv->sv_lock);
 	statbuf->st_size = sv->sv_i.sfi_size;
+	lock_release(sv->sv_lock);
 
 	/* We don't support these yet; you get to implement them */
 	statbuf->st_nlink = 0;
@@ -1053,16 +1711,13 @@ sfs_gettype(struct vnode *v, uint32_t *ret)
 {
 	struct sfs_vnode *sv = v->vn_data;
 
-	vfs_biglock_acquire();
-
+	/* The type never changes once the vnode is loaded; no lock needed */
 	switch (sv->sv_i.sfi_type) {
 	case SFS_TYPE_FILE:
 		*ret = S_IFREG;
-		vfs_biglock_release();
 		return 0;
 	case SFS_TYPE_DIR:
 		*ret = S_IFDIR;
-		vfs_biglock_release();
 		return 0;
 	}
 	panic("sfs: gettype: Invalid inode type (inode %u, type %u)\n",
@@ -1100,11 +1755,28 @@ int
 sfs_fsync(struct vnode *v)
 {
 	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
 	int result;
 
-	vfs_biglock_acquire();
+	result = sfs_log_begin(sfs);
+	if (result) {
+		return result;
+	}
+	lock_acquire(sv->sv_lock);
 	result = sfs_sync_inode(sv);
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
+	sfs_log_end(sfs);
+	if (result == 0) {
+		/*
+		 * The cache doesn't know which buffers are ours, so
+		 * commit the journal and write out everything dirty
+		 * on this volume.
+		 */
+		result = sfs_log_commit(sfs);
+	}
+	if (result == 0) {
+		result = sfs_buf_sync(sfs);
+	}
 
 	return result;
 }
@@ -1121,35 +1793,109 @@ sfs_mmap(struct vnode *v   /* add stuff as needed */)
 }
 
 /*
- * Called for ftruncate() and from sfs_reclaim.
+ * Free the blocks mapped by the indirect block whose number is in
+ * *IENTRY that are at or past file block BLOCKLEN, and the indirect
+ * block itself if that leaves it empty, in which case *IENTRY is
+ * cleared and *CHANGED set. BASEBLOCK is the first file block it
+ * maps; INDIRECTION is 1 for an indirect block and 2 for a double
+ * indirect block.
  */
 static
 int
-sfs_truncate(struct vnode *v, off_t len)
+sfs_truncate_indirect(struct sfs_vnode *sv, uint32_t *ientry,
+		      uint32_t baseblock, int indirection,
+		      uint32_t blocklen, bool *changed)
 {
-	/*
-	 * I/O buffer for handling the indirect block.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_buf *idbuf;
+	uint32_t *iddata;
+	uint32_t j, span;
+	bool hasnonzero, iddirty, subchanged;
+	int result;
 
-	struct sfs_vnode *sv = v->vn_data;
+	/* Number of file blocks each entry maps */
+	span = (indirection > 1) ? SFS_DBPERIDB : 1;
+
+	if (*ientry == 0 || blocklen >= baseblock + span*SFS_DBPERIDB) {
+		/* Nothing here, or it's all before the new EOF */
+		return 0;
+	}
+
+	/* We're past the proposed EOF; may need to free stuff */
+
+	/* Read the indirect block */
+	result = sfs_buf_get(sfs, *ientry, true, &idbuf);
+	if (result) {
+		return result;
+	}
+	iddata = sfs_buf_data(idbuf);
+
+	hasnonzero = false;
+	iddirty = false;
+	for (j=0; j<SFS_DBPERIDB; j++) {
+		if (indirection > 1) {
+			/* Trim the indirect block this entry points to */
+			subchanged = false;
+			result = sfs_truncate_indirect(sv, &iddata[j],
+						       baseblock + j*span,
+						       indirection-1,
+						       blocklen, &subchanged);
+			if (subchanged) {
+				iddirty = true;
+			}
+			if (result) {
+				break;
+			}
+		}
+		else if (blocklen <= baseblock+j && iddata[j] != 0) {
+			/* Discard any blocks that are past the new EOF */
+			sfs_bfree(sfs, iddata[j]);
+			iddata[j] = 0;
+			iddirty = true;
+		}
+		/* Remember if we see any nonzero blocks in here */
+		if (iddata[j]!=0) {
+			hasnonzero = true;
+		}
+	}
+
+	if (!hasnonzero && result == 0) {
+		/* The whole indirect block is empty now; free it */
+		sfs_bfree(sfs, *ientry);
+		*ientry = 0;
+		*changed = true;
+	}
+	else if (iddirty) {
+		/* The indirect block is dirty */
+		sfs_dirtybuf(sv, idbuf, *ientry, true);
+	}
+	sfs_buf_release(idbuf);
+
+	return result;
+}
+
+/*
+ * Truncate a file; the guts of sfs_truncate, also used by
+ * sfs_reclaim. Called with the vnode locked.
+ */
+static
+int
+sfs_dotruncate(struct sfs_vnode *sv, off_t len)
+{
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
 
 	/* Length in blocks (divide rounding up) */
 	uint32_t blocklen = DIVROUNDUP(len, SFS_BLOCKSIZE);
 
-	uint32_t i, j, block;
-	uint32_t idblock, baseblock, highblock;
+	uint32_t i, block;
+	bool changed;
 	int result;
-	int hasnonzero, iddirty;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
+	KASSERT(SFS_DBPERIDB * sizeof(uint32_t) == SFS_BLOCKSIZE);
+	KASSERT(lock_do_i_hold(sv->sv_lock));
 
-	vfs_biglock_acquire();
+	/* The cached block map is about to be out of date */
+	sv->sv_bmbase = SFS_NOLEAF;
 
 	/*
 	 * Go through the direct blocks. Discard any that are
@@ -1164,54 +1910,20 @@ sfs_truncate(struct vnode *v, off_t len)
 		}
 	}
 
-	/* Indirect block number */
-	idblock = sv->sv_i.sfi_indirect;
-
-	/* The lowest block in the indirect block */
-	baseblock = SFS_NDIRECT;
-
-	/* The highest block in the indirect block */
-	highblock = baseblock + SFS_DBPERIDB - 1;
-
-	if (blocklen < highblock && idblock != 0) {
-		/* We're past the proposed EOF; may need to free stuff */
-
-		/* Read the indirect block */
-		result = sfs_rblock(sfs, idbuf, idblock);
-		if (result) {
-			vfs_biglock_release();
-			return result;
-		}
-		
-		hasnonzero = 0;
-		iddirty = 0;
-		for (j=0; j<SFS_DBPERIDB; j++) {
-			/* Discard any blocks that are past the new EOF */
-			if (blocklen < baseblock+j && idbuf[j] != 0) {
-				sfs_bfree(sfs, idbuf[j]);
-				idbuf[j] = 0;
-				iddirty = 1;
-			}
-			/* Remember if we see any nonzero blocks in here */
-			if (idbuf[j]!=0) {
-				hasnonzero=1;
-			}
-		}
-
-		if (!hasnonzero) {
-			/* The whole indirect block is empty now; free it */
-			sfs_bfree(sfs, idblock);
-			sv->sv_i.sfi_indirect = 0;
-			sv->sv_dirty = true;
-		}
-		else if (iddirty) {
-			/* The indirect block is dirty; write it back */
-			result = sfs_wblock(sfs, idbuf, idblock);
-			if (result) {
-				vfs_biglock_release();
-				return result;
-			}
-		}
+	/* Then the indirect and double indirect blocks */
+	changed = false;
+	result = sfs_truncate_indirect(sv, &sv->sv_i.sfi_indirect,
+				       SFS_NDIRECT, 1, blocklen, &changed);
+	if (result == 0) {
+		result = sfs_truncate_indirect(sv, &sv->sv_i.sfi_dindirect,
+					       SFS_NDIRECT + SFS_DBPERIDB, 2,
+					       blocklen, &changed);
+	}
+	if (changed) {
+		sv->sv_dirty = true;
+	}
+	if (result) {
+		return result;
 	}
 
 	/* Set the file size */
@@ -1220,10 +1932,33 @@ sfs_truncate(struct vnode *v, off_t len)
 	/* Mark the inode dirty */
 	sv->sv_dirty = true;
 
-	vfs_biglock_release();
 	return 0;
 }
 
+/*
+ * Called for ftruncate().
+ */
+static
+int
+sfs_truncate(struct vnode *v, off_t len)
+{
+	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
+	int result, result2;
+
+	result = sfs_log_begin(sfs);
+	if (result) {
+		return result;
+	}
+	lock_acquire(sv->sv_lock);
+	result = sfs_dotruncate(sv, len);
+	result2 = sfs_sync_inode(sv);
+	lock_release(sv->sv_lock);
+	sfs_log_end(sfs);
+
+	return result ? result : result2;
+}
+
 /*
  * Get the full pathname for a file. This only needs to work on directories.
  * Since we don't support subdirectories, assume it's the root directory
@@ -1250,8 +1985,8 @@ sfs_namefile(struct vnode *vv, struct uio *uio)
  */
 static
 int
-sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
-	  struct vnode **ret)
+sfs_docreat(struct vnode *v, const char *name, bool excl, mode_t mode,
+	    struct vnode **ret)
 {
 	struct sfs_fs *sfs = v->vn_fs->fs_data;
 	struct sfs_vnode *sv = v->vn_data;
@@ -1259,18 +1994,18 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	uint32_t ino;
 	int result;
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
 
 	/* Look up the name */
 	result = sfs_dir_findname(sv, name, &ino, NULL, NULL);
 	if (result!=0 && result!=ENOENT) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
 	/* If it exists and we didn't want it to, fail */
 	if (result==0 && excl) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return EEXIST;
 	}
 
@@ -1278,18 +2013,18 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 		/* We got a file; load its vnode and return */
 		result = sfs_loadvnode(sfs, ino, SFS_TYPE_INVAL, &newguy);
 		if (result) {
-			vfs_biglock_release();
+			lock_release(sv->sv_lock);
 			return result;
 		}
 		*ret = &newguy->sv_v;
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return 0;
 	}
 
 	/* Didn't exist - create it */
 	result = sfs_makeobj(sfs, SFS_TYPE_FILE, &newguy);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
@@ -1300,19 +2035,28 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	result = sfs_dir_link(sv, name, newguy->sv_ino, NULL);
 	if (result) {
 		VOP_DECREF(&newguy->sv_v);
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
+	vfs_ncache_remove(&sv->sv_v, name);
 
 	/* Update the linkcount of the new file */
+	lock_acquire(newguy->sv_lock);
 	newguy->sv_i.sfi_linkcount++;
 
 	/* and consequently mark it dirty. */
 	newguy->sv_dirty = true;
+	result = sfs_sync_inode(newguy);
+	lock_release(newguy->sv_lock);
+	if (result) {
+		VOP_DECREF(&newguy->sv_v);
+		lock_release(sv->sv_lock);
+		return result;
+	}
 
 	*ret = &newguy->sv_v;
 	
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
 	return 0;
 }
 
@@ -1323,7 +2067,7 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
  */
 static
 int
-sfs_link(struct vnode *dir, const char *name, struct vnode *file)
+sfs_dolink(struct vnode *dir, const char *name, struct vnode *file)
 {
 	struct sfs_vnode *sv = dir->vn_data;
 	struct sfs_vnode *f = file->vn_data;
@@ -1331,21 +2075,33 @@ sfs_link(struct vnode *dir, const char *name, struct vnode *file)
 
 	KASSERT(file->vn_fs == dir->vn_fs);
 
-	vfs_biglock_acquire();
+	/*
+	 * No hard links to directories. This also keeps us from
+	 * taking the same lock twice below when FILE is DIR.
+	 */
+	if (f->sv_i.sfi_type == SFS_TYPE_DIR) {
+		return EINVAL;
+	}
+
+	lock_acquire(sv->sv_lock);
 
 	/* Just create a link */
 	result = sfs_dir_link(sv, name, f->sv_ino, NULL);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
+	vfs_ncache_remove(&sv->sv_v, name);
 
 	/* and update the link count, marking the inode dirty */
+	lock_acquire(f->sv_lock);
 	f->sv_i.sfi_linkcount++;
 	f->sv_dirty = true;
+	result = sfs_sync_inode(f);
+	lock_release(f->sv_lock);
 
-	vfs_biglock_release();
-	return 0;
+	lock_release(sv->sv_lock);
+	return result;
 }
 
 /*
@@ -1353,19 +2109,19 @@ sfs_link(struct vnode *dir, const char *name, struct vnode *file)
  */
 static
 int
-sfs_remove(struct vnode *dir, const char *name)
+sfs_doremove(struct vnode *dir, const char *name)
 {
 	struct sfs_vnode *sv = dir->vn_data;
 	struct sfs_vnode *victim;
 	int slot;
 	int result;
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
 
 	/* Look for the file and fetch a vnode for it. */
 	result = sfs_lookonce(sv, name, &victim, &slot);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
@@ -1373,15 +2129,21 @@ sfs_remove(struct vnode *dir, const char *name)
 	result = sfs_dir_unlink(sv, slot);
 	if (result==0) {
 		/* If we succeeded, decrement the link count. */
+		lock_acquire(victim->sv_lock);
 		KASSERT(victim->sv_i.sfi_linkcount > 0);
 		victim->sv_i.sfi_linkcount--;
 		victim->sv_dirty = true;
+		result = sfs_sync_inode(victim);
+		lock_release(victim->sv_lock);
+
+		/* The name cache may be holding a reference too */
+		vfs_ncache_remove(&sv->sv_v, name);
 	}
 
 	/* Discard the reference that sfs_lookonce got us */
 	VOP_DECREF(&victim->sv_v);
 
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
 	return result;
 }
 
@@ -1393,15 +2155,15 @@ sfs_remove(struct vnode *dir, const char *name)
  */
 static
 int
-sfs_rename(struct vnode *d1, const char *n1, 
-	   struct vnode *d2, const char *n2)
+sfs_dorename(struct vnode *d1, const char *n1, 
+	     struct vnode *d2, const char *n2)
 {
 	struct sfs_vnode *sv = d1->vn_data;
 	struct sfs_vnode *g1;
 	int slot1, slot2;
 	int result, result2;
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
 
 	KASSERT(d1==d2);
 	KASSERT(sv->sv_ino == SFS_ROOT_LOCATION);
@@ -1409,7 +2171,7 @@ sfs_rename(struct vnode *d1, const char *n1,
 	/* Look up the old name of the file and get its inode and slot number*/
 	result = sfs_lookonce(sv, n1, &g1, &slot1);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
@@ -1430,8 +2192,16 @@ sfs_rename(struct vnode *d1, const char *n1,
 	}
 	
 	/* Increment the link count, and mark inode dirty */
+	lock_acquire(g1->sv_lock);
 	g1->sv_i.sfi_linkcount++;
 	g1->sv_dirty = true;
+	lock_release(g1->sv_lock);
+
+	/* Linking may have rehashed the directory; find the old slot again */
+	result = sfs_dir_findname(sv, n1, NULL, &slot1, NULL);
+	if (result) {
+		goto puke_harder;
+	}
 
 	/* Unlink the old slot */
 	result = sfs_dir_unlink(sv, slot1);
@@ -1443,32 +2213,125 @@ sfs_rename(struct vnode *d1, const char *n1,
 	 * Decrement the link count again, and mark the inode dirty again,
 	 * in case it's been synced behind our back.
 	 */
+	lock_acquire(g1->sv_lock);
 	KASSERT(g1->sv_i.sfi_linkcount>0);
 	g1->sv_i.sfi_linkcount--;
 	g1->sv_dirty = true;
+	lock_release(g1->sv_lock);
+
+	vfs_ncache_remove(&sv->sv_v, n1);
+	vfs_ncache_remove(&sv->sv_v, n2);
 
 	/* Let go of the reference to g1 */
 	VOP_DECREF(&g1->sv_v);
 
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
 	return 0;
 
  puke_harder:
 	/*
-	 * Error recovery: try to undo what we already did
+	 * Error recovery: try to undo what we already did. (Entries
+	 * in a hashed directory can move, so look up slot2 again.)
 	 */
-	result2 = sfs_dir_unlink(sv, slot2);
+	result2 = sfs_dir_findname(sv, n2, NULL, &slot2, NULL);
+	if (result2 == 0) {
+		result2 = sfs_dir_unlink(sv, slot2);
+	}
 	if (result2) {
 		kprintf("sfs: rename: %s\n", strerror(result));
 		kprintf("sfs: rename: while cleaning up: %s\n", 
 			strerror(result2));
 		panic("sfs: rename: Cannot recover\n");
 	}
+	lock_acquire(g1->sv_lock);
 	g1->sv_i.sfi_linkcount--;
+	lock_release(g1->sv_lock);
  puke:
 	/* Let go of the reference to g1 */
 	VOP_DECREF(&g1->sv_v);
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
+	return result;
+}
+
+/*
+ * Directory operations, each done as one journal operation. Whatever
+ * they did to the directory's inode has to be in the same transaction
+ * as the rest of their changes, so it's written back before the
+ * operation ends. (If that fails, the inode just stays dirty and
+ * goes out later.)
+ */
+static
+void
+sfs_dirop_end(struct vnode *dir)
+{
+	struct sfs_vnode *sv = dir->vn_data;
+	struct sfs_fs *sfs = dir->vn_fs->fs_data;
+
+	lock_acquire(sv->sv_lock);
+	(void)sfs_sync_inode(sv);
+	lock_release(sv->sv_lock);
+	sfs_log_end(sfs);
+}
+
+static
+int
+sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
+	  struct vnode **ret)
+{
+	int result;
+
+	result = sfs_log_begin(v->vn_fs->fs_data);
+	if (result) {
+		return result;
+	}
+	result = sfs_docreat(v, name, excl, mode, ret);
+	sfs_dirop_end(v);
+	return result;
+}
+
+static
+int
+sfs_link(struct vnode *dir, const char *name, struct vnode *file)
+{
+	int result;
+
+	result = sfs_log_begin(dir->vn_fs->fs_data);
+	if (result) {
+		return result;
+	}
+	result = sfs_dolink(dir, name, file);
+	sfs_dirop_end(dir);
+	return result;
+}
+
+static
+int
+sfs_remove(struct vnode *dir, const char *name)
+{
+	int result;
+
+	result = sfs_log_begin(dir->vn_fs->fs_data);
+	if (result) {
+		return result;
+	}
+	result = sfs_doremove(dir, name);
+	sfs_dirop_end(dir);
+	return result;
+}
+
+static
+int
+sfs_rename(struct vnode *d1, const char *n1, 
+	   struct vnode *d2, const char *n2)
+{
+	int result;
+
+	result = sfs_log_begin(d1->vn_fs->fs_data);
+	if (result) {
+		return result;
+	}
+	result = sfs_dorename(d1, n1, d2, n2);
+	sfs_dirop_end(d1);
 	return result;
 }
 
@@ -1486,15 +2349,12 @@ sfs_lookparent(struct vnode *v, char *path, struct vnode **ret,
 {
 	struct sfs_vnode *sv = v->vn_data;
 
-	vfs_biglock_acquire();
-
+	/* (sfi_type never changes, so this doesn't need the lock) */
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
-		vfs_biglock_release();
 		return ENOTDIR;
 	}
 
 	if (strlen(path)+1 > buflen) {
-		vfs_biglock_release();
 		return ENAMETOOLONG;
 	}
 	strcpy(buf, path);
@@ -1502,7 +2362,6 @@ sfs_lookparent(struct vnode *v, char *path, struct vnode **ret,
 	VOP_INCREF(&sv->sv_v);
 	*ret = &sv->sv_v;
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -1520,22 +2379,20 @@ sfs_lookup(struct vnode *v, char *path, struct vnode **ret)
 	struct sfs_vnode *final;
 	int result;
 
-	vfs_biglock_acquire();
-
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
-		vfs_biglock_release();
 		return ENOTDIR;
 	}
 	
+	lock_acquire(sv->sv_lock);
 	result = sfs_lookonce(sv, path, &final, NULL);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
 	*ret = &final->sv_v;
 
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
 	return 0;
 }
 
@@ -1651,42 +2508,42 @@ int
 sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		 struct sfs_vnode **ret)
 {
-	struct vnode *v;
 	struct sfs_vnode *sv;
 	const struct vnode_ops *ops = NULL;
-	unsigned i, num;
 	int result;
 
-	/* Look in the vnodes table */
-	num = vnodearray_num(sfs->sfs_vnodes);
-
-	/* Linear search. Is this too slow? You decide. */
-	for (i=0; i<num; i++) {
-		v = vnodearray_get(sfs->sfs_vnodes, i);
-		sv = v->vn_data;
+	lock_acquire(sfs->sfs_vnlock);
 
+	/* Look in the vnodes table */
+	sv = sfs_vntable_find(sfs, ino);
+	if (sv != NULL) {
 		/* Every inode in memory must be in an allocated block */
 		if (!sfs_bused(sfs, sv->sv_ino)) {
 			panic("sfs: Found inode %u in unallocated block\n",
 			      sv->sv_ino);
 		}
 
-		if (sv->sv_ino==ino) {
-			/* Found */
-
-			/* May only be set when creating new objects */
-			KASSERT(forcetype==SFS_TYPE_INVAL);
+		/* May only be set when creating new objects */
+		KASSERT(forcetype==SFS_TYPE_INVAL);
 
-			VOP_INCREF(&sv->sv_v);
-			*ret = sv;
-			return 0;
-		}
+		VOP_INCREF(&sv->sv_v);
+		lock_release(sfs->sfs_vnlock);
+		*ret = sv;
+		return 0;
 	}
 
 	/* Didn't have it loaded; load it */
 
 	sv = kmalloc(sizeof(struct sfs_vnode));
 	if (sv==NULL) {
+		lock_release(sfs->sfs_vnlock);
+		return ENOMEM;
+	}
+
+	sv->sv_lock = lock_create("sfs vnode");
+	if (sv->sv_lock == NULL) {
+		kfree(sv);
+		lock_release(sfs->sfs_vnlock);
 		return ENOMEM;
 	}
 
@@ -1699,13 +2556,29 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Read the block the inode is in */
 	result = sfs_rblock(sfs, &sv->sv_i, ino);
 	if (result) {
+		lock_destroy(sv->sv_lock);
 		kfree(sv);
+		lock_release(sfs->sfs_vnlock);
 		return result;
 	}
 
 	/* Not dirty yet */
 	sv->sv_dirty = false;
 
+	/* No reads yet */
+	sv->sv_lastread = 0;
+	sv->sv_rahead = 0;
+
+	/* Not counted yet */
+	sv->sv_dircount = -1;
+
+	/* No block map cached yet */
+	sv->sv_bmcache = NULL;
+	sv->sv_bmbase = SFS_NOLEAF;
+
+	/* Journaled like anything else */
+	sv->sv_nolog = false;
+
 	/*
 	 * FORCETYPE is set if we're creating a new file, because the
 	 * block on disk will have been zeroed out and thus the type
@@ -1736,7 +2609,9 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Call the common vnode initializer */
 	result = VOP_INIT(&sv->sv_v, ops, &sfs->sfs_absfs, sv);
 	if (result) {
+		lock_destroy(sv->sv_lock);
 		kfree(sv);
+		lock_release(sfs->sfs_vnlock);
 		return result;
 	}
 
@@ -1744,12 +2619,9 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	sv->sv_ino = ino;
 
 	/* Add it to our table */
-	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_v, NULL);
-	if (result) {
-		VOP_CLEANUP(&sv->sv_v);
-		kfree(sv);
-		return result;
-	}
+	sfs_vntable_add(sfs, sv);
+
+	lock_release(sfs->sfs_vnlock);
 
 	/* Hand it back */
 	*ret = sv;
@@ -1767,14 +2639,10 @@ sfs_getroot(struct fs *fs)
 	struct sfs_vnode *sv;
 	int result;
 
-	vfs_biglock_acquire();
-
 	result = sfs_loadvnode(sfs, SFS_ROOT_LOCATION, SFS_TYPE_INVAL, &sv);
 	if (result) {
 		panic("sfs: getroot: Cannot load root vnode\n");
 	}
 
-	vfs_biglock_release();
-
 	return &sv->sv_v;
 }
@@ -0,0 +1,232 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * SFS filesystem
+ *
+ * Table of vnodes loaded into memory.
+ *
+ * This is a hash table keyed by inode number, chained through
+ * sv_hashnext. It doubles in size when the average chain gets longer
+ * than SFS_VNTABLE_LOAD and halves when the table gets mostly empty.
+ * If there's no memory to grow it, it just stays the size it is;
+ * lookups get slower but nothing fails.
+ *
+ * All of these are called with sfs_vnlock held.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <synch.h>
+#include <sfs.h>
+
+/* Smallest (and initial) table size; must be a power of 2 */
+#define SFS_VNTABLE_MINSIZE  16
+
+/* Average chain length that triggers growing the table */
+#define SFS_VNTABLE_LOAD     2
+
+static
+unsigned
+sfs_vntable_hash(unsigned tablesize, uint32_t ino)
+{
+	/* Inode numbers are block numbers; the low bits spread fine */
+	return ino & (tablesize - 1);
+}
+
+/*
+ * Move everything into a table of size NEWSIZE, if we can get the
+ * memory for it.
+ */
+static
+void
+sfs_vntable_resize(struct sfs_fs *sfs, unsigned newsize)
+{
+	struct sfs_vnode **newtable;
+	struct sfs_vnode *sv, *next;
+	unsigned i, h;
+
+	newtable = kmalloc(newsize * sizeof(struct sfs_vnode *));
+	if (newtable == NULL) {
+		return;
+	}
+	for (i=0; i<newsize; i++) {
+		newtable[i] = NULL;
+	}
+
+	for (i=0; i<sfs->sfs_vntablesize; i++) {
+		for (sv = sfs->sfs_vntable[i]; sv != NULL; sv = next) {
+			next = sv->sv_hashnext;
+			h = sfs_vntable_hash(newsize, sv->sv_ino);
+			sv->sv_hashnext = newtable[h];
+			newtable[h] = sv;
+		}
+	}
+
+	kfree(sfs->sfs_vntable);
+	sfs->sfs_vntable = newtable;
+	sfs->sfs_vntablesize = newsize;
+}
+
+/*
+ * Set up an empty table.
+ */
+int
+sfs_vntable_init(struct sfs_fs *sfs)
+{
+	unsigned i;
+
+	sfs->sfs_vntable = kmalloc(SFS_VNTABLE_MINSIZE *
+				   sizeof(struct sfs_vnode *));
+	if (sfs->sfs_vntable == NULL) {
+		return ENOMEM;
+	}
+	for (i=0; i<SFS_VNTABLE_MINSIZE; i++) {
+		sfs->sfs_vntable[i] = NULL;
+	}
+	sfs->sfs_vntablesize = SFS_VNTABLE_MINSIZE;
+	sfs->sfs_nvnodes = 0;
+	return 0;
+}
+
+/*
+ * Destroy the table, which must be empty.
+ */
+void
+sfs_vntable_cleanup(struct sfs_fs *sfs)
+{
+	KASSERT(sfs->sfs_nvnodes == 0);
+	kfree(sfs->sfs_vntable);
+	sfs->sfs_vntable = NULL;
+	sfs->sfs_vntablesize = 0;
+}
+
+/*
+ * Find the vnode for inode INO, or NULL if it isn't loaded.
+ */
+struct sfs_vnode *
+sfs_vntable_find(struct sfs_fs *sfs, uint32_t ino)
+{
+	struct sfs_vnode *sv;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	sv = sfs->sfs_vntable[sfs_vntable_hash(sfs->sfs_vntablesize, ino)];
+	while (sv != NULL && sv->sv_ino != ino) {
+		sv = sv->sv_hashnext;
+	}
+	return sv;
+}
+
+/*
+ * Add a vnode; there must not already be one for the same inode.
+ */
+void
+sfs_vntable_add(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	unsigned h;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+	KASSERT(sfs_vntable_find(sfs, sv->sv_ino) == NULL);
+
+	h = sfs_vntable_hash(sfs->sfs_vntablesize, sv->sv_ino);
+	sv->sv_hashnext = sfs->sfs_vntable[h];
+	sfs->sfs_vntable[h] = sv;
+	sfs->sfs_nvnodes++;
+
+	if (sfs->sfs_nvnodes > sfs->sfs_vntablesize * SFS_VNTABLE_LOAD) {
+		sfs_vntable_resize(sfs, sfs->sfs_vntablesize * 2);
+	}
+}
+
+/*
+ * Remove a vnode.
+ */
+void
+sfs_vntable_remove(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	struct sfs_vnode **pp;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	pp = &sfs->sfs_vntable[sfs_vntable_hash(sfs->sfs_vntablesize,
+						sv->sv_ino)];
+	while (*pp != sv) {
+		if (*pp == NULL) {
+			panic("sfs: vnode %u not in vnode table\n",
+			      sv->sv_ino);
+		}
+		pp = &(*pp)->sv_hashnext;
+	}
+	*pp = sv->sv_hashnext;
+	sv->sv_hashnext = NULL;
+
+	KASSERT(sfs->sfs_nvnodes > 0);
+	sfs->sfs_nvnodes--;
+
+	if (sfs->sfs_vntablesize > SFS_VNTABLE_MINSIZE &&
+	    sfs->sfs_nvnodes < sfs->sfs_vntablesize / 8) {
+		sfs_vntable_resize(sfs, sfs->sfs_vntablesize / 2);
+	}
+}
+
+/*
+ * Get references to all the loaded vnodes, for sfs_sync. Hands back
+ * a kmalloc'd array, which the caller frees after dropping the
+ * references with VOP_DECREF.
+ */
+int
+sfs_vntable_getall(struct sfs_fs *sfs, struct sfs_vnode ***ret,
+		   unsigned *num)
+{
+	struct sfs_vnode **all;
+	struct sfs_vnode *sv;
+	unsigned i, n;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	all = kmalloc((sfs->sfs_nvnodes + 1) * sizeof(struct sfs_vnode *));
+	if (all == NULL) {
+		return ENOMEM;
+	}
+
+	n = 0;
+	for (i=0; i<sfs->sfs_vntablesize; i++) {
+		for (sv = sfs->sfs_vntable[i]; sv != NULL;
+		     sv = sv->sv_hashnext) {
+			VOP_INCREF(&sv->sv_v);
+			all[n++] = sv;
+		}
+	}
+	KASSERT(n == sfs->sfs_nvnodes);
+
+	*ret = all;
+	*num = n;
+	return 0;
+}
@@ -39,6 +39,9 @@
 
 struct vnode;
 
+/* Number of stacks available for additional user-level threads. */
+#define AS_MAXTSTACKS 16
+
 
 /* 
  * Address space - data structure associated with the virtual memory
@@ -55,6 +58,8 @@ struct addrspace {
   paddr_t as_pbase2;
   size_t as_npages2;
   paddr_t as_stackpbase;
+  paddr_t as_tstackpbase[AS_MAXTSTACKS]; /* extra user thread stacks */
+  bool as_tstackused[AS_MAXTSTACKS];     /* slot belongs to a live thread */
   bool as_loaded; 
 };
 
@@ -92,6 +97,14 @@ struct addrspace {
  *    as_define_stack - set up the stack region in the address space.
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
+ *
+ *    as_define_tstack - set up a stack for an additional user-level
+ *                thread, below the main stack. Hands back the slot
+ *                number (for as_free_tstack) and initial stack pointer.
+ *
+ *    as_free_tstack - release a stack from as_define_tstack. The
+ *                pages may stay with the address space for the next
+ *                thread to use the slot.
  */
 
 struct addrspace *as_create(void);
@@ -108,6 +121,9 @@ int               as_define_region(struct addrspace *as,
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
+int               as_define_tstack(struct addrspace *as, int *slotret,
+                                   vaddr_t *initstackptr);
+void              as_free_tstack(struct addrspace *as, int slot);
 
 
 /*
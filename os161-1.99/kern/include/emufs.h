@@ -45,13 +45,25 @@ struct emufs_vnode {
 	struct vnode ev_v;		/* abstract vnode structure */
 	struct emu_softc *ev_emu;	/* device */
 	uint32_t ev_handle;		/* file handle */
+
+	/* Cached state, protected by ev_lock */
+	struct lock *ev_lock;		/* serializes I/O on this vnode */
+	bool ev_sizevalid;		/* ev_size is known */
+	off_t ev_size;			/* file size */
+	char *ev_rabuf;			/* read cache (or NULL) */
+	off_t ev_raoff;			/* file offset of ev_rabuf */
+	size_t ev_ralen;		/* valid bytes in ev_rabuf */
+	unsigned ev_gen;		/* ef_gen the cache was filled at */
 };
 
 struct emufs_fs {
 	struct fs ef_fs;		/* abstract filesystem structure */
 	struct emu_softc *ef_emu;	/* device */
 	struct emufs_vnode *ef_root;	/* root vnode */
+	struct lock *ef_vnlock;		/* protects ef_vnodes */
 	struct vnodearray *ef_vnodes;	/* table of loaded vnodes */
+	struct spinlock ef_genlock;	/* protects ef_gen */
+	unsigned ef_gen;		/* bumped by every write */
 };
 
 
@@ -58,6 +58,11 @@
  * however, the filesystem object and all storage associated with the
  * filesystem should have been discarded/released.
  *
+ * fs_namecache is true if the VFS layer may cache the results of
+ * VOP_LOOKUP on this filesystem (see vfsncache.c). A filesystem that
+ * sets it must call vfs_ncache_remove whenever it adds or removes a
+ * name in a directory.
+ *
  * fs_data is a pointer to filesystem-specific data.
  */
 
@@ -67,6 +72,7 @@ struct fs {
 	struct vnode *(*fs_getroot)(struct fs *);
 	int           (*fs_unmount)(struct fs *);
 
+	bool fs_namecache;
 	void *fs_data;
 };
 
@@ -64,6 +64,9 @@
 #define SFS_TYPE_FILE     1
 #define SFS_TYPE_DIR      2
 
+/* Flags for sfi_flags */
+#define SFS_IFLAG_HASHDIR 0x00000001  /* directory is a hash table */
+
 /*
  * On-disk superblock
  */
@@ -71,7 +74,35 @@ struct sfs_super {
 	uint32_t sp_magic;		/* Magic number, should be SFS_MAGIC */
 	uint32_t sp_nblocks;			/* Number of blocks in fs */
 	char sp_volname[SFS_VOLNAME_SIZE];	/* Name of this volume */
-	uint32_t reserved[118];
+	uint32_t sp_journalstart;		/* First block of journal */
+	uint32_t sp_journalblocks;		/* Size of journal, or 0 */
+	uint32_t reserved[116];
+};
+
+/*
+ * Journal
+ *
+ * A volume with nonzero sp_journalblocks has a write-ahead log of
+ * that many blocks starting at sp_journalstart, marked in use in the
+ * freemap. The first is a struct sfs_jheader and the rest hold copies
+ * of metadata blocks. A batch of updates is written to the log
+ * first; then the header, listing where each copy belongs; then the
+ * blocks themselves; and then the header again with jh_nblocks set
+ * back to 0. So if jh_nblocks isn't 0 when the volume is next looked
+ * at, the updates may have been cut short, and are completed by
+ * copying log block i+1 to block jh_blocks[i] for each i less than
+ * jh_nblocks. Doing that more than once does no harm.
+ *
+ * Volumes made before there was a journal have 0 in both fields.
+ */
+#define SFS_JMAGIC        0x4a524e4c    /* "JRNL" */
+#define SFS_JMAXBLOCKS    (SFS_BLOCKSIZE/sizeof(uint32_t) - 2)
+#define SFS_JOURNALSIZE   (1 + SFS_JMAXBLOCKS)  /* size made by mksfs */
+
+struct sfs_jheader {
+	uint32_t jh_magic;			/* Should be SFS_JMAGIC */
+	uint32_t jh_nblocks;			/* # of log blocks to replay */
+	uint32_t jh_blocks[SFS_JMAXBLOCKS];	/* Where each one goes */
 };
 
 /*
@@ -83,9 +114,18 @@ struct sfs_inode {
 	uint16_t sfi_linkcount;			/* # hard links to this file */
 	uint32_t sfi_direct[SFS_NDIRECT];	/* Direct blocks */
 	uint32_t sfi_indirect;			/* Indirect block */
-	uint32_t sfi_waste[128-3-SFS_NDIRECT];	/* unused space, set to 0 */
+	uint32_t sfi_flags;			/* SFS_IFLAG_* above */
+	uint32_t sfi_dindirect;			/* Double indirect block */
+	uint32_t sfi_waste[128-5-SFS_NDIRECT];	/* unused space, set to 0 */
 };
 
+/*
+ * The double indirect block holds SFS_DBPERIDB indirect blocks, and
+ * maps the file blocks after those mapped by sfi_indirect. (This is
+ * for the benefit of sfsck; see the HAS_DIDIRECT code there.)
+ */
+#define HAS_DIDIRECT
+
 /*
  * On-disk directory entry
  */
@@ -94,5 +134,27 @@ struct sfs_dir {
 	char sfd_name[SFS_NAMELEN];		/* Filename */
 };
 
+/*
+ * Hashed directories
+ *
+ * A directory with SFS_IFLAG_HASHDIR set is an open-addressed hash
+ * table of sfi_size/sizeof(struct sfs_dir) slots. The entry for a
+ * name is found by starting at slot (hash % nslots) and stepping
+ * forward one slot at a time, wrapping at the end, until the name
+ * turns up or an empty slot (sfd_ino == SFS_NOINO) is reached. Every
+ * entry must therefore be reachable from its starting slot without
+ * crossing an empty slot. The entries themselves are ordinary
+ * directory entries, so code that just scans a directory from one
+ * end to the other needn't know about any of this.
+ *
+ * The hash is 32-bit FNV-1a over the bytes of the name, not including
+ * the terminating null:
+ *
+ *     hash = SFS_DIRHASH_BASIS;
+ *     for each byte c: hash = (hash ^ c) * SFS_DIRHASH_PRIME;
+ */
+#define SFS_DIRHASH_BASIS 2166136261U
+#define SFS_DIRHASH_PRIME 16777619U
+
 
 #endif /* _KERN_SFS_H_ */
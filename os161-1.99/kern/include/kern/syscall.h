@@ -197,6 +197,14 @@
 #define SYS_reboot       119
 //#define SYS___sysctl   120
 
+//                              -- OS/161 extensions --
+#define SYS_spawn        121
+#define SYS___syscallstat 122
+#define SYS___thread_create 123
+#define SYS_thread_join  124
+#define SYS_thread_exit  125
+#define SYS_futex        126
+
 /*CALLEND*/
 
 
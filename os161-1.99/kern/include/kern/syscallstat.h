@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2003, 2008
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef _KERN_SYSCALLSTAT_H_
+#define _KERN_SYSCALLSTAT_H_
+
+/*
+ * Per-system-call statistics, as returned by __syscallstat().
+ *
+ * The kernel counts every call to each system call number and
+ * measures its latency in cycles. Latencies are kept in a log2
+ * histogram: ss_hist[i] counts calls that took between 2^i and
+ * 2^(i+1)-1 cycles (bucket 0 also holds calls that took 0 cycles).
+ * Calls that do not return, like _exit and successful execv, are
+ * counted but have no latency.
+ */
+
+/* One more than the highest system call number tracked. */
+#define SYSCALLSTAT_NCALLS	128
+
+#define SYSCALLSTAT_NBUCKETS	32
+#define SYSCALLSTAT_NAMELEN	16
+
+struct syscallstat {
+	char ss_name[SYSCALLSTAT_NAMELEN];	/* "" if not implemented */
+	__u32 ss_calls;				/* times called */
+	__u32 ss_timed;				/* times returned */
+	__u64 ss_cycles;			/* total cycles of ss_timed */
+	__u32 ss_hist[SYSCALLSTAT_NBUCKETS];	/* log2 latency */
+};
+
+#endif /* _KERN_SYSCALLSTAT_H_ */
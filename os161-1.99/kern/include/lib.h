@@ -127,6 +127,17 @@ void *kmalloc(size_t size);
 void kfree(void *ptr);
 void kheap_printstats(void);
 
+/*
+ * Allocation tracking; these only do something with options kmtrack.
+ *
+ * kheap_nextgeneration starts a new generation of allocations.
+ * kheap_dump prints live blocks grouped by the caller of kmalloc.
+ * kheap_leakreport prints live blocks from after boot (for shutdown).
+ */
+void kheap_nextgeneration(void);
+void kheap_dump(void);
+void kheap_leakreport(void);
+
 /*
  * C string functions. 
  *
@@ -185,6 +196,21 @@ void kgets(char *buf, size_t maxbuflen);
 
 void kprintf_bootstrap(void);
 
+/*
+ * Kernel log rings (options klog).
+ *
+ * klog_bootstrap switches kprintf to logging into per-CPU rings that
+ * a kernel thread copies to the console; call it once threads work.
+ * klog_tick is called by the timer to kick that thread. klog_flush
+ * prints what's pending and goes back to printing directly, for
+ * shutdown. klog_dump prints everything still in the rings, printed
+ * or not. Without the option these do nothing (klog_dump says so).
+ */
+void klog_bootstrap(void);
+void klog_tick(void);
+void klog_flush(void);
+void klog_dump(void);
+
 /*
  * Other miscellaneous stuff
  */
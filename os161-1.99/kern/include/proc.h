@@ -39,12 +39,29 @@
 #include <spinlock.h>
 #include <thread.h> /* required for struct threadarray */
 #include "opt-A1.h"
+#include "opt-A2.h"
 
 struct addrspace;
 struct vnode;
 #ifdef UW
 struct semaphore;
 #endif // UW
+#if OPT_A2
+struct lock;
+struct cv;
+
+/*
+ * Record of a user-level thread created by thread_create, kept so
+ * thread_join can find its exit status. The process's first thread
+ * has no record (it is thread id 0) and cannot be joined.
+ */
+struct uthread {
+	int ut_tid;			/* thread id */
+	struct thread *ut_thread;	/* kernel thread, NULL once exited */
+	int ut_stackslot;		/* as_define_tstack slot */
+	int ut_status;			/* exit status once exited */
+};
+#endif
 
 /*
  * Process structure.
@@ -62,12 +79,22 @@ struct proc {
 
 #if OPT_A1
 	int p_pid;
-	struct array *p_children;
+	struct array *p_children;	/* protected by p_lock */
 	struct proc *p_parent;
 	int p_exitcode;
 	int p_exitstatus;
 #endif
 
+#if OPT_A2
+	/* user-level threads (see thread_create/thread_join) */
+	struct lock *p_uthread_lock;	/* protects the fields below */
+	struct cv *p_uthread_cv;	/* signalled when a thread exits */
+	struct array *p_uthreads;	/* struct uthread, for joining */
+	unsigned p_nuthreads;		/* live user threads */
+	int p_nexttid;			/* next thread id to hand out */
+	bool p_exiting;			/* a thread is exiting the process */
+#endif
+
 #ifdef UW
   /* a vnode to refer to the console device */
   /* this is a quick-and-dirty way to get console writes working */
@@ -109,6 +136,7 @@ struct addrspace *curproc_getas(void);
 /* Change the address space of the current process, and return the old one. */
 struct addrspace *curproc_setas(struct addrspace *);
 
-userptr_t argcopy_out_2(unsigned int stackptr, char *cpout, size_t size);
+/* Change the address space seen by the current thread only. */
+void curthread_setas(struct addrspace *);
 
 #endif /* _PROC_H_ */
@@ -48,11 +48,38 @@
  */
 #include <kern/sfs.h>
 
+/*
+ * Locking: sv_lock protects everything in a struct sfs_vnode below
+ * sv_ino; sfs_vnlock protects the vnode table (including each
+ * vnode's sv_hashnext); sfs_freemaplock protects
+ * the freemap. When more than one is needed they are taken in this
+ * order:
+ *
+ *     directory's sv_lock
+ *     sfs_vnlock
+ *     file's sv_lock
+ *     sfs_freemaplock
+ *
+ * and the buffer cache's lock comes after all of them. None of them
+ * may be held while acquiring vfs_biglock, or when starting a journal
+ * operation with sfs_log_begin. sfs_loglock protects the journal
+ * fields of struct sfs_fs, and is never held while taking any other
+ * lock.
+ */
+
 struct sfs_vnode {
 	struct vnode sv_v;              /* abstract vnode structure */
 	struct sfs_inode sv_i;		/* on-disk inode */
 	uint32_t sv_ino;                /* inode number */
+	struct sfs_vnode *sv_hashnext;  /* next in vnode table chain */
+	struct lock *sv_lock;           /* lock for the fields below */
 	bool sv_dirty;                  /* true if sv_i modified */
+	uint32_t sv_lastread;           /* last file block read */
+	uint32_t sv_rahead;             /* read-ahead requested up to here */
+	int sv_dircount;                /* entries in directory, or -1 */
+	uint32_t *sv_bmcache;           /* copy of one indirect block, or NULL */
+	uint32_t sv_bmbase;             /* file block sv_bmcache[0] maps */
+	bool sv_nolog;                  /* true if not to be journaled */
 };
 
 struct sfs_fs {
@@ -60,9 +87,32 @@ struct sfs_fs {
 	struct sfs_super sfs_super;	/* on-disk superblock */
 	bool sfs_superdirty;            /* true if superblock modified */
 	struct device *sfs_device;      /* device mounted on */
-	struct vnodearray *sfs_vnodes;  /* vnodes loaded into memory */
+	struct lock *sfs_vnlock;        /* lock for the vnode table */
+	struct sfs_vnode **sfs_vntable; /* loaded vnodes, hashed by inode */
+	unsigned sfs_vntablesize;       /* number of chains in sfs_vntable */
+	unsigned sfs_nvnodes;           /* number of vnodes loaded */
+	struct lock *sfs_freemaplock;   /* lock for the freemap */
 	struct bitmap *sfs_freemap;     /* blocks in use are marked 1 */
 	bool sfs_freemapdirty;          /* true if freemap modified */
+
+	/* Journal (see sfs_log.c); sfs_logstart is 0 if there isn't one */
+	uint32_t sfs_logstart;          /* first block of journal */
+	struct lock *sfs_loglock;       /* lock for the fields below */
+	struct cv *sfs_logcv;           /* for waiting on the journal */
+	unsigned sfs_logops;            /* operations in progress */
+	bool sfs_logcommitting;         /* true while committing */
+	bool sfs_logwanted;             /* true if a commit is wanted */
+	unsigned sfs_lognblocks;        /* blocks in current transaction */
+	uint32_t *sfs_logblocks;        /* ...and their block numbers */
+	bool *sfs_logmap;               /* freemap blocks changed; these
+					   are under sfs_freemaplock */
+	struct bitmap *sfs_logfree;     /* blocks freed, not yet reusable */
+	bool *sfs_logfreeany;           /* freemap blocks with bits in
+					   sfs_logfree (also under
+					   sfs_freemaplock) */
+	bool sfs_logsettle;             /* last commit failed; check the
+					   header before reusing the log */
+	struct sfs_jheader *sfs_loghdr; /* space for the journal header */
 };
 
 /*
@@ -70,6 +120,13 @@ struct sfs_fs {
  */
 int sfs_mount(const char *device);
 
+/*
+ * Set up the SFS buffer cache (called once at boot), and print
+ * its statistics.
+ */
+void sfs_bootstrap(void);
+void sfs_bufstats(void);
+
 
 /*
  * Internal functions
@@ -82,7 +139,44 @@ int sfs_mount(const char *device);
 /* Convenience functions for block I/O */
 int sfs_rwblock(struct sfs_fs *sfs, struct uio *uio);
 int sfs_rblock(struct sfs_fs *sfs, void *data, uint32_t block);
-int sfs_wblock(struct sfs_fs *sfs, void *data, uint32_t block);
+int sfs_wblock(struct sfs_fs *sfs, const void *data, uint32_t block);
+
+/* Buffer cache */
+struct sfs_buf;		/* Opaque. */
+int sfs_buf_get(struct sfs_fs *sfs, uint32_t block, bool doread,
+		struct sfs_buf **ret);
+void *sfs_buf_data(struct sfs_buf *buf);
+void sfs_buf_markdirty(struct sfs_buf *buf);
+bool sfs_buf_isdirty(struct sfs_buf *buf);
+void sfs_buf_invalidate(struct sfs_buf *buf);
+void sfs_buf_pin(struct sfs_buf *buf);
+void sfs_buf_release(struct sfs_buf *buf);
+void sfs_buf_readahead(struct sfs_fs *sfs, uint32_t block);
+int sfs_buf_sync(struct sfs_fs *sfs);
+int sfs_buf_writecopy(struct sfs_fs *sfs, const uint32_t *blocks,
+		      unsigned n, uint32_t where);
+void sfs_buf_unpin(struct sfs_fs *sfs, const uint32_t *blocks, unsigned n);
+void sfs_buf_dropfs(struct sfs_fs *sfs);
+
+/* Metadata journal */
+int sfs_log_init(struct sfs_fs *sfs);
+void sfs_log_cleanup(struct sfs_fs *sfs);
+int sfs_log_begin(struct sfs_fs *sfs);
+void sfs_log_end(struct sfs_fs *sfs);
+void sfs_log_write(struct sfs_fs *sfs, struct sfs_buf *buf, uint32_t block);
+unsigned sfs_log_room(struct sfs_fs *sfs);
+void sfs_log_freemap(struct sfs_fs *sfs, uint32_t block);
+void sfs_log_bfree(struct sfs_fs *sfs, uint32_t block);
+int sfs_log_commit(struct sfs_fs *sfs);
+
+/* Table of loaded vnodes */
+int sfs_vntable_init(struct sfs_fs *sfs);
+void sfs_vntable_cleanup(struct sfs_fs *sfs);
+struct sfs_vnode *sfs_vntable_find(struct sfs_fs *sfs, uint32_t ino);
+void sfs_vntable_add(struct sfs_fs *sfs, struct sfs_vnode *sv);
+void sfs_vntable_remove(struct sfs_fs *sfs, struct sfs_vnode *sv);
+int sfs_vntable_getall(struct sfs_fs *sfs, struct sfs_vnode ***ret,
+		       unsigned *num);
 
 /* Get root vnode */
 struct vnode *sfs_getroot(struct fs *fs);
@@ -0,0 +1,106 @@
+/*
+ * Copyright (c) 2000, 2001
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _SLAB_H_
+#define _SLAB_H_
+
+/*
+ * Slab object caches.
+ *
+ * A slab cache hands out objects of one exact size, carved out of
+ * whole pages. Objects are kept in a constructed state: the optional
+ * constructor runs once when a page of objects is created, and the
+ * optional destructor runs when the page is given back, not on every
+ * alloc and free. So whatever a constructor sets up (spinlocks, wait
+ * channels, arrays, ...) must be back in that state when the object
+ * is freed.
+ *
+ * The constructor returns 0 or an error code; if it fails the cache
+ * doesn't grow and slab_alloc returns NULL.
+ *
+ * Functions:
+ *     slab_create  - allocate and set up a new cache.
+ *     slab_init    - set up a cache in caller-provided memory.
+ *     slab_destroy - release a cache made with slab_create. All its
+ *                    objects must have been freed.
+ *     slab_alloc   - get an object. Returns NULL if out of memory.
+ *     slab_free    - give an object back.
+ *     slab_printstats - print usage for every cache in use.
+ *
+ * Caches needed before anything else is running (for the basic
+ * kernel objects) can be statically allocated with
+ * SLABCACHE_INITIALIZER. Caches are laid out the first time they're
+ * used.
+ */
+
+#include <spinlock.h>
+
+struct slab;	/* Private to slab.c */
+
+struct slabcache {
+	/* Set up by the creator */
+	const char *sc_name;		/* for stats */
+	size_t sc_size;			/* object size */
+	int (*sc_ctor)(void *obj);	/* constructor, or NULL */
+	void (*sc_dtor)(void *obj);	/* destructor, or NULL */
+
+	/* Private to slab.c; protected by sc_lock */
+	struct spinlock sc_lock;
+	bool sc_ready;			/* layout has been computed */
+	size_t sc_stride;		/* distance between objects */
+	size_t sc_objoffset;		/* offset of first object in page */
+	unsigned sc_perslab;		/* objects per page */
+	struct slab *sc_slabs;		/* pages with free objects */
+	unsigned sc_nslabs;		/* pages in the cache */
+	unsigned sc_nempty;		/* pages with nothing allocated */
+	unsigned sc_inuse;		/* objects allocated */
+	unsigned long sc_allocs;	/* total slab_alloc calls */
+	unsigned long sc_grows;		/* total pages constructed */
+	struct slabcache *sc_next;	/* all ready caches (for stats) */
+};
+
+#define SLABCACHE_INITIALIZER(name, size, ctor, dtor) { \
+	.sc_name = (name),				\
+	.sc_size = (size),				\
+	.sc_ctor = (ctor),				\
+	.sc_dtor = (dtor),				\
+	.sc_lock = SPINLOCK_INITIALIZER,		\
+	.sc_ready = false,				\
+}
+
+struct slabcache *slab_create(const char *name, size_t size,
+			      int (*ctor)(void *), void (*dtor)(void *));
+void slab_init(struct slabcache *sc, const char *name, size_t size,
+	       int (*ctor)(void *), void (*dtor)(void *));
+void slab_destroy(struct slabcache *sc);
+void *slab_alloc(struct slabcache *sc);
+void slab_free(struct slabcache *sc, void *obj);
+void slab_printstats(void);
+
+#endif /* _SLAB_H_ */
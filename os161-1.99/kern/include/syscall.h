@@ -30,6 +30,7 @@
 #ifndef _SYSCALL_H_
 #define _SYSCALL_H_
 
+#include "opt-A2.h"
 
 struct trapframe; /* from <machine/trapframe.h> */
 
@@ -46,6 +47,29 @@ void syscall(struct trapframe *tf);
 /* Helper for fork(). You write this. */
 void enter_forked_process(struct trapframe *tf, unsigned long data2);
 
+/* Name of a system call number, or NULL if not implemented. */
+const char *syscall_name(int callno);
+
+/* Record the start and completion (with latency) of a system call. */
+void syscallstat_enter(int callno);
+void syscallstat_exit(int callno, uint32_t cycles);
+
+#if OPT_A2
+/* Leave if another thread is exiting the process; on return to user. */
+void uthread_exitcheck(void);
+/* Stop all other user threads of curproc, for _exit and execv. */
+bool uthread_stopothers(void);
+
+/* Set up the futex wait queues. */
+void futex_bootstrap(void);
+/* Kick every futex sleeper into rechecking its state. */
+void futex_wakeall(void);
+#endif
+
+/* Pack a user argv into a kmalloc'd arena, and lay it out on a new stack. */
+int argpack_in(userptr_t uargv, char **arenaret, size_t *lenret, int *argcret);
+int argpack_out(char *arena, size_t len, int argc, vaddr_t *stackptr);
+
 /* Enter user mode. Does not return. */
 void enter_new_process(int argc, userptr_t argv, vaddr_t stackptr,
 		       vaddr_t entrypoint);
@@ -57,6 +81,7 @@ void enter_new_process(int argc, userptr_t argv, vaddr_t stackptr,
 
 int sys_reboot(int code);
 int sys___time(userptr_t user_seconds, userptr_t user_nanoseconds);
+int sys___syscallstat(int callno, userptr_t statbuf);
 
 #ifdef UW
 int sys_write(int fdesc,userptr_t ubuf,unsigned int nbytes,int *retval);
@@ -66,9 +91,21 @@ int sys_waitpid(pid_t pid, userptr_t status, int options, pid_t *retval);
 
 #endif // UW
 
+#if OPT_A2
+int sys_pread(int fdesc, userptr_t ubuf, size_t nbytes, off_t pos,
+	      ssize_t *retval);
+int sys_pwrite(int fdesc, userptr_t ubuf, size_t nbytes, off_t pos,
+	       ssize_t *retval);
+int sys_thread_create(userptr_t entry, userptr_t func, userptr_t arg,
+		      int *retval);
+int sys_thread_join(int tid, userptr_t status);
+void sys_thread_exit(int status);
+int sys_futex(userptr_t uaddr, int op, int val, int *retval);
+#endif /* OPT_A2 */
 
 int sys_fork(int *retval, struct trapframe *tf);
-int sys_execv(char *progname, char **argv);
+int sys_execv(userptr_t progname, userptr_t argv);
+int sys_spawn(userptr_t progname, userptr_t argv, pid_t *retval);
 
 
 #endif /* _SYSCALL_H_ */
@@ -51,6 +51,8 @@ int traffic_simulation(int, char **);
 /* lib tests */
 int arraytest(int, char **);
 int bitmaptest(int, char **);
+int slabtest(int, char **);
+int memcpytest(int, char **);
 int queuetest(int, char **);
 
 /* thread tests */
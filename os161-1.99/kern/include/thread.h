@@ -41,6 +41,7 @@
 #include <threadlist.h>
 
 struct cpu;
+struct addrspace;
 
 /* get machine-dependent defs */
 #include <machine/thread.h>
@@ -105,6 +106,10 @@ struct thread {
 	 * Public fields
 	 */
 
+	unsigned t_sfsops;		/* SFS journal operations we're in */
+	unsigned t_sfslogged;		/* Blocks they've added to the journal */
+	struct addrspace *t_loadas;	/* Image being built, if any */
+
 	/* add more here as needed */
 };
 
@@ -81,6 +81,31 @@ int vfs_lookup(char *path, struct vnode **result);
 int vfs_lookparent(char *path, struct vnode **result,
 		   char *buf, size_t buflen);
 
+/*
+ * Name cache (see vfsncache.c)
+ *
+ *    vfs_ncache_bootstrap - Set up the cache; called from vfs_bootstrap.
+ *    vfs_ncache_lookup - Look up NAME in DIR. Returns true with *RESULT
+ *                        set (NULL if NAME is known not to exist) if
+ *                        cached; otherwise returns false and sets *GEN.
+ *    vfs_ncache_enter  - Record the result of a VOP_LOOKUP that missed,
+ *                        passing the GEN from vfs_ncache_lookup.
+ *    vfs_ncache_remove - Forget NAME in DIR. Filesystems that set
+ *                        fs_namecache call this when they add or
+ *                        remove directory entries.
+ *    vfs_ncache_purgefs - Forget everything on a filesystem.
+ *    vfs_ncache_stats  - Print hit/miss counts.
+ */
+
+void vfs_ncache_bootstrap(void);
+bool vfs_ncache_lookup(struct vnode *dir, const char *name,
+		       struct vnode **result, unsigned *gen);
+void vfs_ncache_enter(struct vnode *dir, const char *name,
+		      struct vnode *vn, unsigned gen);
+void vfs_ncache_remove(struct vnode *dir, const char *name);
+void vfs_ncache_purgefs(struct fs *fs);
+void vfs_ncache_stats(void);
+
 /*
  * VFS layer high-level operations on pathnames
  * Because namei may destroy pathnames, these all may too.
@@ -56,7 +56,6 @@ vaddr_t alloc_kpages(int npages);
 void free_kpages(vaddr_t addr);
 
 void putppages(paddr_t addr);
-void memory_leak(unsigned int, unsigned int);
 
 /* TLB shootdown handling called from interprocessor_interrupt */
 void vm_tlbshootdown_all(void);
@@ -30,6 +30,7 @@
 #ifndef _VNODE_H_
 #define _VNODE_H_
 
+#include <spinlock.h>
 
 struct uio;
 struct stat;
@@ -50,10 +51,16 @@ struct stat;
  * vn_opencount is managed using VOP_INCOPEN and VOP_DECOPEN by
  * vfs_open() and vfs_close(). Code above the VFS layer should not
  * need to worry about it.
+ *
+ * vn_countlock protects vn_refcount and vn_opencount. A filesystem's
+ * reclaim routine must recheck vn_refcount under it (while holding
+ * whatever lock keeps its own lookups from handing out new
+ * references) before destroying the vnode.
  */
 struct vnode {
 	int vn_refcount;                /* Reference count */
 	int vn_opencount;
+	struct spinlock vn_countlock;   /* Lock for the two counts */
 
 	struct fs *vn_fs;               /* Filesystem vnode belongs to */
 
@@ -89,7 +96,9 @@ struct vnode {
  *
  *    vop_reclaim     - Called when vnode is no longer in use. Note that
  *                      this may be substantially after vop_close is
- *                      called.
+ *                      called. Must recheck vn_refcount; if another
+ *                      reference has appeared, drop the caller's and
+ *                      return EBUSY.
  *
  *****************************************
  *
@@ -47,9 +47,38 @@
 #define WORD_TYPE       unsigned char
 #define WORD_ALLBITS    (0xff)
 
+/*
+ * We can, however, still look at the bits 32 at a time when searching
+ * for a clear one, since whether they're all ones doesn't depend on
+ * the byte order. The storage is allocated as CHUNK_TYPEs so it's
+ * suitably aligned.
+ */
+#define CHUNK_TYPE      uint32_t
+#define CHUNK_WORDS     (sizeof(CHUNK_TYPE) / sizeof(WORD_TYPE))
+#define CHUNK_ALLBITS   (0xffffffff)
+
+/*
+ * The bits are also divided into groups of GROUP_BITS, and we keep a
+ * count of the clear bits in each group so that allocation can skip
+ * over full groups without looking at them. The storage is padded out
+ * to a whole number of groups with bits that are always set.
+ *
+ * Since bitmap_getdata hands out the raw bits, which the caller may
+ * then change (e.g. by reading them from disk), it throws the counts
+ * away; they're recomputed on the next allocation. Callers that only
+ * look at the bits (e.g. to write them out) use bitmap_getdata_ro,
+ * which leaves the counts alone.
+ */
+#define GROUP_BITS      256
+#define GROUP_WORDS     (GROUP_BITS / BITS_PER_WORD)
+
 struct bitmap {
         unsigned nbits;
         WORD_TYPE *v;
+        CHUNK_TYPE *chunks;     /* same storage as v */
+        unsigned ngroups;
+        uint16_t *groupfree;    /* number of clear bits in each group */
+        bool groupvalid;        /* false if groupfree must be recomputed */
 };
 
 
@@ -57,18 +86,28 @@ struct bitmap *
 bitmap_create(unsigned nbits)
 {
         struct bitmap *b; 
-        unsigned words;
+        unsigned words, allwords;
 
         words = DIVROUNDUP(nbits, BITS_PER_WORD);
         b = kmalloc(sizeof(struct bitmap));
         if (b == NULL) {
                 return NULL;
         }
-        b->v = kmalloc(words*sizeof(WORD_TYPE));
-        if (b->v == NULL) {
+        b->ngroups = DIVROUNDUP(nbits, GROUP_BITS);
+        allwords = b->ngroups * GROUP_WORDS;
+        b->chunks = kmalloc(allwords*sizeof(WORD_TYPE));
+        if (b->chunks == NULL) {
                 kfree(b);
                 return NULL;
         }
+        b->v = (WORD_TYPE *)b->chunks;
+        b->groupfree = kmalloc(b->ngroups*sizeof(uint16_t));
+        if (b->groupfree == NULL) {
+                kfree(b->chunks);
+                kfree(b);
+                return NULL;
+        }
+        b->groupvalid = false;
 
         bzero(b->v, words*sizeof(WORD_TYPE));
         b->nbits = nbits;
@@ -86,40 +125,137 @@ bitmap_create(unsigned nbits)
                 }
         }
 
+        /* And likewise the padding out to the end of the last group */
+        for (; words < allwords; words++) {
+                b->v[words] = WORD_ALLBITS;
+        }
+
         return b;
 }
 
 void *
 bitmap_getdata(struct bitmap *b)
 {
+        b->groupvalid = false;
         return b->v;
 }
 
-int
-bitmap_alloc(struct bitmap *b, unsigned *index)
+const void *
+bitmap_getdata_ro(const struct bitmap *b)
 {
-        unsigned ix;
-        unsigned maxix = DIVROUNDUP(b->nbits, BITS_PER_WORD);
-        unsigned offset;
+        return b->v;
+}
+
+/*
+ * Recompute the clear-bit count of every group.
+ */
+static
+void
+bitmap_summarize(struct bitmap *b)
+{
+        /* Number of clear bits in each value of a 4-bit nibble */
+        static const unsigned char nibblezeros[16] = {
+                4, 3, 3, 2, 3, 2, 2, 1, 3, 2, 2, 1, 2, 1, 1, 0
+        };
+        unsigned g, ix, end, count;
+        WORD_TYPE w;
+
+        KASSERT(BITS_PER_WORD == 8);
 
-        for (ix=0; ix<maxix; ix++) {
-                if (b->v[ix]!=WORD_ALLBITS) {
-                        for (offset = 0; offset < BITS_PER_WORD; offset++) {
-                                WORD_TYPE mask = ((WORD_TYPE)1) << offset;
+        for (g=0; g<b->ngroups; g++) {
+                count = 0;
+                end = (g+1) * GROUP_WORDS;
+                for (ix = g * GROUP_WORDS; ix < end; ix++) {
+                        w = b->v[ix];
+                        count += nibblezeros[w & 0xf] + nibblezeros[w >> 4];
+                }
+                b->groupfree[g] = count;
+        }
+        b->groupvalid = true;
+}
 
-                                if ((b->v[ix] & mask)==0) {
-                                        b->v[ix] |= mask;
-                                        *index = (ix*BITS_PER_WORD)+offset;
-                                        KASSERT(*index < b->nbits);
-                                        return 0;
+/*
+ * Find a clear bit at or after bit START, but in the same group.
+ * Returns false if there isn't one.
+ */
+static
+bool
+bitmap_findingroup(struct bitmap *b, unsigned start, unsigned *index)
+{
+        unsigned ix, end, offset;
+        WORD_TYPE w;
+
+        ix = start / BITS_PER_WORD;
+        offset = start % BITS_PER_WORD;
+        end = (start / GROUP_BITS + 1) * GROUP_WORDS;
+
+        while (ix < end) {
+                /* Skip over whole chunks that are full */
+                if (offset == 0 && ix % CHUNK_WORDS == 0 &&
+                    b->chunks[ix / CHUNK_WORDS] == CHUNK_ALLBITS) {
+                        ix += CHUNK_WORDS;
+                        continue;
+                }
+
+                w = b->v[ix];
+                if (w != WORD_ALLBITS) {
+                        for (; offset < BITS_PER_WORD; offset++) {
+                                if ((w & ((WORD_TYPE)1 << offset)) == 0) {
+                                        *index = ix*BITS_PER_WORD + offset;
+                                        return true;
                                 }
                         }
-                        KASSERT(0);
                 }
+                offset = 0;
+                ix++;
+        }
+        return false;
+}
+
+int
+bitmap_alloc_near(struct bitmap *b, unsigned goal, unsigned *index)
+{
+        unsigned g, n, start;
+
+        if (b->ngroups == 0) {
+                return ENOSPC;
+        }
+        if (!b->groupvalid) {
+                bitmap_summarize(b);
+        }
+
+        if (goal >= b->nbits) {
+                goal = 0;
+        }
+        g = goal / GROUP_BITS;
+        start = goal;
+
+        /*
+         * Look from the goal to the end of its group, then through
+         * the other groups, then finally back at the start of the
+         * goal's group again.
+         */
+        for (n=0; n <= b->ngroups; n++) {
+                if (b->groupfree[g] > 0 &&
+                    bitmap_findingroup(b, start, index)) {
+                        KASSERT(*index < b->nbits);
+                        b->v[*index / BITS_PER_WORD] |=
+                                ((WORD_TYPE)1) << (*index % BITS_PER_WORD);
+                        b->groupfree[g]--;
+                        return 0;
+                }
+                g = (g + 1) % b->ngroups;
+                start = g * GROUP_BITS;
         }
         return ENOSPC;
 }
 
+int
+bitmap_alloc(struct bitmap *b, unsigned *index)
+{
+        return bitmap_alloc_near(b, 0, index);
+}
+
 static
 inline
 void
@@ -142,6 +278,9 @@ bitmap_mark(struct bitmap *b, unsigned index)
 
         KASSERT((b->v[ix] & mask)==0);
         b->v[ix] |= mask;
+        if (b->groupvalid) {
+                b->groupfree[index / GROUP_BITS]--;
+        }
 }
 
 void
@@ -155,6 +294,9 @@ bitmap_unmark(struct bitmap *b, unsigned index)
 
         KASSERT((b->v[ix] & mask)!=0);
         b->v[ix] &= ~mask;
+        if (b->groupvalid) {
+                b->groupfree[index / GROUP_BITS]++;
+        }
 }
 
 
@@ -171,6 +313,7 @@ bitmap_isset(struct bitmap *b, unsigned index)
 void
 bitmap_destroy(struct bitmap *b)
 {
-        kfree(b->v);
+        kfree(b->groupfree);
+        kfree(b->chunks);
         kfree(b);
 }
@@ -32,11 +32,14 @@
 #include <stdarg.h>
 #include <lib.h>
 #include <spl.h>
+#include <cpu.h>
 #include <thread.h>
 #include <current.h>
 #include <synch.h>
+#include <wchan.h>
 #include <mainbus.h>
 #include <vfs.h>          // for vfs_sync()
+#include "opt-klog.h"
 
 
 /* Flags word for DEBUG() macro. */
@@ -88,13 +91,13 @@ console_send(void *junk, const char *data, size_t len)
 }
 
 /*
- * Printf to the console.
+ * Printf to the console, synchronously.
  */
+static
 int
-kprintf(const char *fmt, ...)
+console_vprintf(const char *fmt, va_list ap)
 {
 	int chars;
-	va_list ap;
 	bool dolock;
 
 	dolock = kprintf_lock != NULL
@@ -109,9 +112,7 @@ kprintf(const char *fmt, ...)
 	}
 	putch_prepare();
 
-	va_start(ap, fmt);
 	chars = __vprintf(console_send, NULL, fmt, ap);
-	va_end(ap);
 
 	putch_complete();
 	if (dolock) {
@@ -124,6 +125,446 @@ kprintf(const char *fmt, ...)
 	return chars;
 }
 
+////////////////////////////////////////////////////////////
+// Kernel log rings (options klog).
+
+#if OPT_KLOG
+
+/*
+ * Once klog_bootstrap has run, kprintf doesn't print: it appends the
+ * message to a ring belonging to the current CPU, and a kernel thread
+ * copies the rings to the console. Each ring is only written by its
+ * own CPU with interrupts off, so logging takes no locks and never
+ * waits for the console, even in interrupt handlers. The drain
+ * thread is the only reader of unprinted data; it takes messages
+ * from all the CPUs in timestamp order.
+ *
+ * A message is a struct klog_hdr followed by its text, stored
+ * contiguously modulo KLOG_SIZE. The positions are byte counts that
+ * run freely. Printed messages stay in the ring until overwritten,
+ * so klog_dump can show recent history; kl_oldest is the first one
+ * still intact.
+ *
+ * If a CPU logs faster than the console can keep up, messages that
+ * don't fit are truncated, or dropped and counted in kl_lost, and
+ * the drain thread reports the count.
+ */
+
+#define KLOG_MAXCPUS	8	/* higher-numbered CPUs print directly */
+#define KLOG_SIZE	4096	/* bytes per CPU; must be a power of 2 */
+
+struct klog_hdr {
+	uint32_t kh_stamp;		/* cpu_cycles() when logged */
+	uint32_t kh_len;		/* length of text that follows */
+};
+
+struct klog {
+	char kl_buf[KLOG_SIZE];
+	unsigned kl_oldest;		/* first intact message */
+	volatile unsigned kl_tail;	/* first unprinted message */
+	volatile unsigned kl_head;	/* end of logged messages */
+	volatile unsigned kl_lost;	/* messages dropped */
+	unsigned kl_lostseen;		/* kl_lost already reported */
+};
+
+/* State for klog_send, the __vprintf backend. */
+struct klog_put {
+	struct klog *kp_log;
+	unsigned kp_pos;		/* next byte to write */
+	unsigned kp_limit;		/* can't write here or beyond */
+};
+
+static struct klog klogs[KLOG_MAXCPUS];
+static volatile bool klog_active;
+static volatile bool klog_sleeping;
+static struct wchan *klog_wchan;
+
+/*
+ * Copy LEN bytes at position POS in KL's ring out to BUF.
+ */
+static
+void
+klog_read(const struct klog *kl, unsigned pos, void *buf, size_t len)
+{
+	char *cbuf = buf;
+	size_t i;
+
+	for (i=0; i<len; i++) {
+		cbuf[i] = kl->kl_buf[(pos + i) % KLOG_SIZE];
+	}
+}
+
+/*
+ * Make position POS in KL's ring free to write, retiring the oldest
+ * message(s) if POS lands on them. Those have always been printed
+ * already, because the writer never gets KLOG_SIZE ahead of the tail.
+ */
+static
+void
+klog_claim(struct klog *kl, unsigned pos)
+{
+	struct klog_hdr kh;
+
+	while (pos - kl->kl_oldest >= KLOG_SIZE) {
+		klog_read(kl, kl->kl_oldest, &kh, sizeof(kh));
+		kl->kl_oldest += sizeof(kh) + kh.kh_len;
+	}
+}
+
+/*
+ * Append formatted text to the message being logged, truncating it
+ * if the ring fills up.
+ */
+static
+void
+klog_send(void *vkp, const char *data, size_t len)
+{
+	struct klog_put *kp = vkp;
+	struct klog *kl = kp->kp_log;
+	size_t i;
+
+	for (i=0; i<len && kp->kp_pos != kp->kp_limit; i++) {
+		klog_claim(kl, kp->kp_pos);
+		kl->kl_buf[kp->kp_pos % KLOG_SIZE] = data[i];
+		kp->kp_pos++;
+	}
+}
+
+/*
+ * Log a message to the current CPU's ring.
+ */
+static
+int
+klog_vprintf(const char *fmt, va_list ap)
+{
+	struct klog *kl;
+	struct klog_put kp;
+	struct klog_hdr kh;
+	unsigned start, i;
+	bool canwake;
+	int spl, chars;
+
+	/* Only wake the drain thread from a context that may do so. */
+	canwake = curthread->t_in_interrupt == false
+		&& curthread->t_iplhigh_count == 0;
+
+	spl = splhigh();
+	if (curcpu->c_number >= KLOG_MAXCPUS) {
+		splx(spl);
+		return console_vprintf(fmt, ap);
+	}
+	kl = &klogs[curcpu->c_number];
+
+	start = kl->kl_head;
+	kp.kp_log = kl;
+	kp.kp_pos = start + sizeof(kh);
+	kp.kp_limit = kl->kl_tail + KLOG_SIZE;
+
+	if (kp.kp_limit - start < sizeof(kh)) {
+		/* No room even for the header; count it and toss it. */
+		kl->kl_lost++;
+		splx(spl);
+		return 0;
+	}
+	for (i=0; i<sizeof(kh); i++) {
+		klog_claim(kl, start + i);
+	}
+
+	chars = __vprintf(klog_send, &kp, fmt, ap);
+
+	kh.kh_stamp = cpu_cycles();
+	kh.kh_len = kp.kp_pos - start - sizeof(kh);
+	for (i=0; i<sizeof(kh); i++) {
+		kl->kl_buf[(start + i) % KLOG_SIZE] = ((char *)&kh)[i];
+	}
+	/* Publish it. */
+	kl->kl_head = kp.kp_pos;
+	splx(spl);
+
+	if (canwake && klog_sleeping) {
+		wchan_wakeone(klog_wchan);
+	}
+	return chars;
+}
+
+/*
+ * True if any ring has something the drain thread hasn't printed.
+ */
+static
+bool
+klog_pending(void)
+{
+	unsigned i;
+
+	for (i=0; i<KLOG_MAXCPUS; i++) {
+		if (klogs[i].kl_tail != klogs[i].kl_head ||
+		    klogs[i].kl_lostseen != klogs[i].kl_lost) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Print a string with putch; kprintf might just log it.
+ */
+static
+void
+klog_puts(const char *str)
+{
+	while (*str) {
+		putch(*str++);
+	}
+}
+
+/*
+ * Print the message at position POS in KL's ring with putch.
+ * Returns the position of the next message.
+ */
+static
+unsigned
+klog_putmsg(const struct klog *kl, unsigned pos)
+{
+	struct klog_hdr kh;
+	unsigned i;
+
+	klog_read(kl, pos, &kh, sizeof(kh));
+	pos += sizeof(kh);
+	for (i=0; i<kh.kh_len; i++) {
+		putch(kl->kl_buf[(pos + i) % KLOG_SIZE]);
+	}
+	return pos + kh.kh_len;
+}
+
+/*
+ * Print everything logged so far that hasn't been printed, oldest
+ * first across all the rings. The caller serializes calls.
+ */
+static
+void
+klog_printpending(void)
+{
+	struct klog *kl, *best;
+	struct klog_hdr kh, bestkh;
+	char msg[64];
+	unsigned i, lost;
+
+	while (1) {
+		best = NULL;
+		for (i=0; i<KLOG_MAXCPUS; i++) {
+			kl = &klogs[i];
+			lost = kl->kl_lost;
+			if (lost != kl->kl_lostseen) {
+				snprintf(msg, sizeof(msg),
+					 "klog: cpu%u dropped %u messages\n",
+					 i, lost - kl->kl_lostseen);
+				klog_puts(msg);
+				kl->kl_lostseen = lost;
+			}
+			if (kl->kl_tail == kl->kl_head) {
+				continue;
+			}
+			klog_read(kl, kl->kl_tail, &kh, sizeof(kh));
+			if (best == NULL ||
+			    (int32_t)(kh.kh_stamp - bestkh.kh_stamp) < 0) {
+				best = kl;
+				bestkh = kh;
+			}
+		}
+		if (best == NULL) {
+			break;
+		}
+		best->kl_tail = klog_putmsg(best, best->kl_tail);
+	}
+}
+
+/*
+ * The drain thread.
+ */
+static
+void
+klog_thread(void *junk1, unsigned long junk2)
+{
+	(void)junk1;
+	(void)junk2;
+
+	while (1) {
+		/*
+		 * Set klog_sleeping before looking, so a message logged
+		 * after the check is sure to see it and wake us.
+		 */
+		klog_sleeping = true;
+		wchan_lock(klog_wchan);
+		if (!klog_pending()) {
+			wchan_sleep(klog_wchan);
+			continue;
+		}
+		wchan_unlock(klog_wchan);
+		klog_sleeping = false;
+
+		lock_acquire(kprintf_lock);
+		klog_printpending();
+		lock_release(kprintf_lock);
+	}
+}
+
+#endif /* OPT_KLOG */
+
+/*
+ * Start logging kprintf output to the per-CPU rings, and the thread
+ * that prints it. Called at the end of boot.
+ */
+void
+klog_bootstrap(void)
+{
+#if OPT_KLOG
+	int result;
+
+	KASSERT(kprintf_lock != NULL);
+
+	klog_wchan = wchan_create("klog");
+	if (klog_wchan == NULL) {
+		panic("klog_bootstrap: Out of memory\n");
+	}
+	result = thread_fork("klog", NULL, klog_thread, NULL, 0);
+	if (result) {
+		panic("klog_bootstrap: thread_fork: %s\n", strerror(result));
+	}
+	klog_active = true;
+#endif
+}
+
+/*
+ * Called by the timer. Messages logged in interrupt handlers or with
+ * spinlocks held can't wake the drain thread themselves, so do it
+ * here.
+ */
+void
+klog_tick(void)
+{
+#if OPT_KLOG
+	if (klog_active && klog_sleeping && klog_pending()) {
+		wchan_wakeone(klog_wchan);
+	}
+#endif
+}
+
+/*
+ * Go back to printing synchronously, after printing anything still
+ * in the rings. Called at shutdown.
+ */
+void
+klog_flush(void)
+{
+#if OPT_KLOG
+	if (!klog_active) {
+		return;
+	}
+	klog_active = false;
+	lock_acquire(kprintf_lock);
+	klog_printpending();
+	lock_release(kprintf_lock);
+#endif
+}
+
+/*
+ * Panic-time version of klog_flush. Interrupts are off and other
+ * CPUs are halted, maybe holding locks, so just print.
+ */
+static
+void
+klog_panicflush(void)
+{
+#if OPT_KLOG
+	if (!klog_active) {
+		return;
+	}
+	klog_active = false;
+	putch_prepare();
+	klog_printpending();
+	putch_complete();
+#endif
+}
+
+/*
+ * Print the contents of every ring, including messages already
+ * printed, for the menu.
+ */
+void
+klog_dump(void)
+{
+#if OPT_KLOG
+	struct klog *kl, *copy;
+	char msg[32];
+	unsigned i, pos, head, oldest;
+
+	copy = kmalloc(sizeof(*copy));
+	if (copy == NULL) {
+		kprintf("klog_dump: Out of memory\n");
+		return;
+	}
+
+	lock_acquire(kprintf_lock);
+	for (i=0; i<KLOG_MAXCPUS; i++) {
+		kl = &klogs[i];
+
+		/*
+		 * The CPU may be logging while we copy. Take the head
+		 * first, then the data, then the oldest intact
+		 * message: anything before that may have been
+		 * overwritten during the copy, but nothing after it
+		 * was.
+		 */
+		head = kl->kl_head;
+		if (head == 0) {
+			continue;
+		}
+		memcpy(copy->kl_buf, kl->kl_buf, KLOG_SIZE);
+		oldest = kl->kl_oldest;
+		if ((int)(head - oldest) < 0) {
+			/* lapped us completely */
+			oldest = head;
+		}
+
+		snprintf(msg, sizeof(msg), "--- cpu%u ---\n", i);
+		klog_puts(msg);
+		for (pos = oldest; pos != head; ) {
+			pos = klog_putmsg(copy, pos);
+		}
+	}
+	lock_release(kprintf_lock);
+
+	kfree(copy);
+#else
+	kprintf("Enable options klog in the kernel config to use this.\n");
+#endif
+}
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Printf to the console, or to the log rings if they're in use.
+ */
+int
+kprintf(const char *fmt, ...)
+{
+	int chars;
+	va_list ap;
+
+	va_start(ap, fmt);
+#if OPT_KLOG
+	if (klog_active) {
+		chars = klog_vprintf(fmt, ap);
+		va_end(ap);
+		return chars;
+	}
+#endif
+	chars = console_vprintf(fmt, ap);
+	va_end(ap);
+
+	return chars;
+}
+
 /*
  * panic() is for fatal errors. It prints the printf arguments it's
  * passed and then halts the system.
@@ -169,6 +610,9 @@ panic(const char *fmt, ...)
 	if (evil == 2) {
 		evil = 3;
 
+		/* Get out anything still waiting in the log rings. */
+		klog_panicflush();
+
 		/* Print the message. */
 		kprintf("panic: ");
 		putch_prepare();
@@ -49,6 +49,8 @@
 #include <vnode.h>
 #include <vfs.h>
 #include <synch.h>
+#include <slab.h>
+#include <kern/errno.h>
 #include <kern/fcntl.h>  
 #include "opt-A1.h"
 #include <limits.h>
@@ -79,6 +81,74 @@ static struct semaphore *pid_count_mutex;
 #endif
 
 
+/*
+ * Proc structures come from a slab cache. The constructed state has
+ * the thread array, spinlock, and (with OPT_A1/OPT_A2) the child and
+ * user thread arrays and the user thread lock and CV already set up
+ * and empty, so proc_create only has to fill in the plain fields.
+ */
+static
+void
+proc_dtor(void *obj)
+{
+	struct proc *proc = obj;
+
+	threadarray_cleanup(&proc->p_threads);
+	spinlock_cleanup(&proc->p_lock);
+#if OPT_A1
+	if (proc->p_children != NULL) {
+		array_destroy(proc->p_children);
+	}
+#endif
+#if OPT_A2
+	if (proc->p_uthreads != NULL) {
+		array_destroy(proc->p_uthreads);
+	}
+	if (proc->p_uthread_cv != NULL) {
+		cv_destroy(proc->p_uthread_cv);
+	}
+	if (proc->p_uthread_lock != NULL) {
+		lock_destroy(proc->p_uthread_lock);
+	}
+#endif
+}
+
+static
+int
+proc_ctor(void *obj)
+{
+	struct proc *proc = obj;
+
+	threadarray_init(&proc->p_threads);
+	spinlock_init(&proc->p_lock);
+#if OPT_A1
+	proc->p_children = array_create();
+#endif
+#if OPT_A2
+	proc->p_uthread_lock = lock_create("p_uthread_lock");
+	proc->p_uthread_cv = cv_create("p_uthread_cv");
+	proc->p_uthreads = array_create();
+#endif
+#if OPT_A1
+	if (proc->p_children == NULL) {
+		proc_dtor(proc);
+		return ENOMEM;
+	}
+#endif
+#if OPT_A2
+	if (proc->p_uthread_lock == NULL || proc->p_uthread_cv == NULL ||
+	    proc->p_uthreads == NULL) {
+		proc_dtor(proc);
+		return ENOMEM;
+	}
+#endif
+	return 0;
+}
+
+static struct slabcache proc_cache =
+	SLABCACHE_INITIALIZER("proc", sizeof(struct proc),
+			      proc_ctor, proc_dtor);
+
 /*
  * Create a proc structure.
  */
@@ -88,38 +158,35 @@ proc_create(const char *name)
 {
 	struct proc *proc;
 
-	proc = kmalloc(sizeof(*proc));
+	proc = slab_alloc(&proc_cache);
 	if (proc == NULL) {
 		return NULL;
 	}
 	proc->p_name = kstrdup(name);
 	if (proc->p_name == NULL) {
-		kfree(proc);
+		slab_free(&proc_cache, proc);
 		return NULL;
 	}
 
-	threadarray_init(&proc->p_threads);
-	spinlock_init(&proc->p_lock);
-
 	/* VM fields */
 	proc->p_addrspace = NULL;
 
 	/* VFS fields */
 	proc->p_cwd = NULL;
 
-#if OPT_A1
-
-#endif
-
 #ifdef UW
 	proc->console = NULL;
 #endif // UW
 #if OPT_A1
-	proc->p_children =  array_create();
 	proc->p_exitcode = 0;
 	proc->p_exitstatus = 0;
 	proc->p_parent = NULL;
 #endif
+#if OPT_A2
+	proc->p_nuthreads = 1;
+	proc->p_nexttid = 1;
+	proc->p_exiting = false;
+#endif
 	
 	return proc;
 }
@@ -181,15 +248,21 @@ proc_destroy(struct proc *proc)
 	}
 #endif // UW
 
-	threadarray_cleanup(&proc->p_threads);
-	spinlock_cleanup(&proc->p_lock);
+	/* Put it back in its constructed state for the cache. */
+	KASSERT(threadarray_num(&proc->p_threads) == 0);
 
 	kfree(proc->p_name);
 #if OPT_A1
-	array_destroy(proc->p_children);
+	array_setsize(proc->p_children, 0);
+#endif
+#if OPT_A2
+	while (array_num(proc->p_uthreads) > 0) {
+		kfree(array_get(proc->p_uthreads, 0));
+		array_remove(proc->p_uthreads, 0);
+	}
 #endif
 	
-	kfree(proc);
+	slab_free(&proc_cache, proc);
 #ifdef UW
 	/* decrement the process count */
         /* note: kproc is not included in the process count, but proc_destroy
@@ -367,11 +440,18 @@ proc_remthread(struct thread *t)
  * Fetch the address space of the current process. Caution: it isn't
  * refcounted. If you implement multithreaded processes, make sure to
  * set up a refcount scheme or some other method to make this safe.
+ *
+ * A thread building a new program image (see curthread_setas) sees
+ * that image instead.
  */
 struct addrspace *
 curproc_getas(void)
 {
 	struct addrspace *as;
+
+	if (curthread->t_loadas != NULL) {
+		return curthread->t_loadas;
+	}
 #ifdef UW
         /* Until user processes are created, threads used in testing 
          * (i.e., kernel threads) have no process or address space.
@@ -403,3 +483,15 @@ curproc_setas(struct addrspace *newas)
 	spinlock_release(&proc->p_lock);
 	return oldas;
 }
+
+/*
+ * Make NEWAS the address space seen by the current thread only, or
+ * with NULL go back to the process's own. The process's other
+ * threads are not affected, so exec and spawn can load an image
+ * while they keep running. The caller does the as_activate.
+ */
+void
+curthread_setas(struct addrspace *newas)
+{
+	curthread->t_loadas = newas;
+}
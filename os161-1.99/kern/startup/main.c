@@ -46,10 +46,13 @@
 #include <mainbus.h>
 #include <vfs.h>
 #include <device.h>
+#include <sfs.h>
 #include <syscall.h>
 #include <test.h>
 #include <version.h>
 #include "autoconf.h"  // for pseudoconfig
+#include "opt-A2.h"
+#include "opt-sfs.h"
 
 
 /*
@@ -124,6 +127,12 @@ boot(void)
 	/* Late phase of initialization. */
 	vm_bootstrap();
 	kprintf_bootstrap();
+#if OPT_A2
+	futex_bootstrap();
+#endif
+#if OPT_SFS
+	sfs_bootstrap();
+#endif
 	thread_start_cpus();
 
 	/* Default bootfs - but ignore failure, in case emu0 doesn't exist */
@@ -135,6 +144,12 @@ boot(void)
 	 */
 	COMPILE_ASSERT(sizeof(userptr_t) == sizeof(char *));
 	COMPILE_ASSERT(sizeof(*(userptr_t)0) == sizeof(char));
+
+	/* From here on kprintf output goes through the log rings. */
+	klog_bootstrap();
+
+	/* Anything allocated from here on shows up in the leak report. */
+	kheap_nextgeneration();
 }
 
 /*
@@ -151,6 +166,9 @@ shutdown(void)
 	vfs_clearcurdir();
 	vfs_unmountall();
 
+	kheap_leakreport();
+	klog_flush();
+
 	thread_shutdown();
 
 	splhigh();
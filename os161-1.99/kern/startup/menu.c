@@ -38,6 +38,7 @@
 #include <thread.h>
 #include <proc.h>
 #include <synch.h>
+#include <slab.h>
 #include <vfs.h>
 #include <sfs.h>
 #include <syscall.h>
@@ -398,6 +399,74 @@ cmd_kheapstats(int nargs, char **args)
 	return 0;
 }
 
+static
+int
+cmd_kheapdump(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	kheap_dump();
+	return 0;
+}
+
+static
+int
+cmd_klogdump(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	klog_dump();
+	return 0;
+}
+
+static
+int
+cmd_kheapnextgen(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	kheap_nextgeneration();
+	return 0;
+}
+
+static
+int
+cmd_slabstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	slab_printstats();
+	return 0;
+}
+
+#if OPT_SFS
+static
+int
+cmd_bufstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	sfs_bufstats();
+	return 0;
+}
+#endif
+
+static
+int
+cmd_ncstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	vfs_ncache_stats();
+	return 0;
+}
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -456,6 +525,8 @@ cmd_opsmenu(int n, char **a)
 static const char *testmenu[] = {
 	"[at]  Array test                    ",
 	"[bt]  Bitmap test                   ",
+	"[slt] Slab cache test               ",
+	"[mct] memcpy/bzero check and bench  ",
 	"[km1] Kernel malloc test            ",
 	"[km2] kmalloc stress test           ",
 	"[tt1] Thread test 1                 ",
@@ -507,6 +578,14 @@ static const char *mainmenu[] = {
 #endif /* UW */
 #endif
 	"[kh] Kernel heap stats              ",
+	"[khdump] Kernel heap by caller      ",
+	"[khgen] Next kernel heap generation ",
+	"[sl] Slab cache stats               ",
+	"[klog] Dump kernel log rings        ",
+#if OPT_SFS
+	"[bc] SFS buffer cache stats         ",
+#endif
+	"[nc] VFS name cache stats           ",
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -564,10 +643,20 @@ static struct {
 
 	/* stats */
 	{ "kh",         cmd_kheapstats },
+	{ "khdump",     cmd_kheapdump },
+	{ "khgen",      cmd_kheapnextgen },
+	{ "klog",       cmd_klogdump },
+	{ "sl",         cmd_slabstats },
+#if OPT_SFS
+	{ "bc",         cmd_bufstats },
+#endif
+	{ "nc",         cmd_ncstats },
 
 	/* base system tests */
 	{ "at",		arraytest },
 	{ "bt",		bitmaptest },
+	{ "slt",	slabtest },
+	{ "mct",	memcpytest },
 	{ "km1",	malloctest },
 	{ "km2",	mallocstress },
 #if OPT_NET
@@ -8,6 +8,7 @@
 #include <vfs.h>
 #include <current.h>
 #include <proc.h>
+#include "opt-A2.h"
 
 /* handler for write() system call                  */
 /*
@@ -58,3 +59,86 @@ sys_write(int fdesc,userptr_t ubuf,unsigned int nbytes,int *retval)
   KASSERT(*retval >= 0);
   return 0;
 }
+
+#if OPT_A2
+/*
+ * Shared code for pread() and pwrite().
+ *
+ * The offset comes from the caller and goes straight into the uio;
+ * no per-file offset is consulted or updated. That means positional
+ * I/O never needs to take the offset lock, so several threads or
+ * processes can work on disjoint ranges of the same file at once.
+ *
+ * n.b. like write(), this only knows about the console descriptors.
+ * The console ignores uio_offset, but it is still validated and
+ * passed through so that real files can be plugged in here later.
+ */
+static
+int
+positional_io(int fdesc, userptr_t ubuf, size_t nbytes, off_t pos,
+	      enum uio_rw rw, ssize_t *retval)
+{
+  struct iovec iov;
+  struct uio u;
+  int res;
+
+  if (rw == UIO_READ) {
+    if (fdesc != STDIN_FILENO) {
+      return EUNIMP;
+    }
+  }
+  else {
+    if (!((fdesc==STDOUT_FILENO)||(fdesc==STDERR_FILENO))) {
+      return EUNIMP;
+    }
+  }
+  if (pos < 0) {
+    return EINVAL;
+  }
+  KASSERT(curproc != NULL);
+  KASSERT(curproc->console != NULL);
+  KASSERT(curproc->p_addrspace != NULL);
+
+  iov.iov_ubase = ubuf;
+  iov.iov_len = nbytes;
+  u.uio_iov = &iov;
+  u.uio_iovcnt = 1;
+  u.uio_offset = pos;
+  u.uio_resid = nbytes;
+  u.uio_segflg = UIO_USERSPACE;
+  u.uio_rw = rw;
+  u.uio_space = curproc->p_addrspace;
+
+  if (rw == UIO_READ) {
+    res = VOP_READ(curproc->console,&u);
+  }
+  else {
+    res = VOP_WRITE(curproc->console,&u);
+  }
+  if (res) {
+    return res;
+  }
+
+  *retval = nbytes - u.uio_resid;
+  KASSERT(*retval >= 0);
+  return 0;
+}
+
+/* handler for pread() system call */
+int
+sys_pread(int fdesc, userptr_t ubuf, size_t nbytes, off_t pos, ssize_t *retval)
+{
+  DEBUG(DB_SYSCALL,"Syscall: pread(%d,%x,%d,%lld)\n",
+	fdesc,(unsigned int)ubuf,nbytes,pos);
+  return positional_io(fdesc, ubuf, nbytes, pos, UIO_READ, retval);
+}
+
+/* handler for pwrite() system call */
+int
+sys_pwrite(int fdesc, userptr_t ubuf, size_t nbytes, off_t pos, ssize_t *retval)
+{
+  DEBUG(DB_SYSCALL,"Syscall: pwrite(%d,%x,%d,%lld)\n",
+	fdesc,(unsigned int)ubuf,nbytes,pos);
+  return positional_io(fdesc, ubuf, nbytes, pos, UIO_WRITE, retval);
+}
+#endif /* OPT_A2 */
@@ -0,0 +1,248 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Futexes: user-level locks that only enter the kernel to sleep.
+ *
+ * A futex is any aligned 32-bit word of user memory, identified by
+ * (address space, virtual address). Waiters hash to one of a fixed
+ * number of buckets. Each bucket has a spinlock protecting a list of
+ * waiter records (which live on the waiters' kernel stacks) and a
+ * wait channel the waiters sleep on.
+ *
+ * FUTEX_WAIT(uaddr, val) sleeps as long as *uaddr == val; that
+ * check is made after the waiter is on the bucket list, so a WAKE
+ * that changes the word and then wakes cannot be missed.
+ * FUTEX_WAKE(uaddr, n) marks up to n matching waiters woken and
+ * wakes the bucket. Since buckets are shared between keys, sleepers
+ * that were not picked just go back to sleep; user code never sees
+ * those wakeups.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/futex.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <current.h>
+#include <proc.h>
+#include <copyinout.h>
+#include <syscall.h>
+#include "opt-A2.h"
+
+#if OPT_A2
+
+#define FUTEX_HASHBITS 6
+#define FUTEX_NBUCKETS (1 << FUTEX_HASHBITS)
+
+struct futex_waiter {
+	struct addrspace *fw_as;
+	vaddr_t fw_addr;
+	bool fw_woken;
+	struct futex_waiter *fw_next;
+};
+
+struct futex_bucket {
+	struct spinlock fb_lock;		/* protects fb_waiters */
+	struct futex_waiter *fb_waiters;	/* unordered */
+	struct wchan *fb_wchan;
+};
+
+static struct futex_bucket futex_buckets[FUTEX_NBUCKETS];
+
+void
+futex_bootstrap(void)
+{
+	unsigned i;
+
+	for (i=0; i<FUTEX_NBUCKETS; i++) {
+		spinlock_init(&futex_buckets[i].fb_lock);
+		futex_buckets[i].fb_waiters = NULL;
+		futex_buckets[i].fb_wchan = wchan_create("futex");
+		if (futex_buckets[i].fb_wchan == NULL) {
+			panic("futex_bootstrap: out of memory\n");
+		}
+	}
+}
+
+static
+struct futex_bucket *
+futex_hash(struct addrspace *as, vaddr_t addr)
+{
+	uint32_t h;
+
+	h = (uint32_t)as ^ (addr >> 2);
+	h *= 2654435761U;	/* Knuth's multiplicative hash */
+	return &futex_buckets[h >> (32 - FUTEX_HASHBITS)];
+}
+
+/*
+ * Take a waiter off its bucket's list, if it is still there.
+ * Caller holds fb_lock.
+ */
+static
+void
+futex_unlink(struct futex_bucket *fb, struct futex_waiter *fw)
+{
+	struct futex_waiter **pp;
+
+	for (pp = &fb->fb_waiters; *pp != NULL; pp = &(*pp)->fw_next) {
+		if (*pp == fw) {
+			*pp = fw->fw_next;
+			return;
+		}
+	}
+}
+
+static
+int
+futex_wait(struct addrspace *as, userptr_t uaddr, int val)
+{
+	struct futex_bucket *fb;
+	struct futex_waiter fw;
+	int cur, result;
+
+	fw.fw_as = as;
+	fw.fw_addr = (vaddr_t)uaddr;
+	fw.fw_woken = false;
+	fb = futex_hash(as, fw.fw_addr);
+
+	spinlock_acquire(&fb->fb_lock);
+	fw.fw_next = fb->fb_waiters;
+	fb->fb_waiters = &fw;
+	spinlock_release(&fb->fb_lock);
+
+	/* now that we're listed, look at the word */
+	result = copyin(uaddr, &cur, sizeof(cur));
+	if (result == 0 && cur != val) {
+		result = EAGAIN;
+	}
+	if (result) {
+		spinlock_acquire(&fb->fb_lock);
+		futex_unlink(fb, &fw);
+		spinlock_release(&fb->fb_lock);
+		/* if a wake already picked us, don't swallow it */
+		return fw.fw_woken ? 0 : result;
+	}
+
+	while (1) {
+		/*
+		 * Hold the channel lock from the check until we're
+		 * asleep; the waker needs it to wake us.
+		 */
+		wchan_lock(fb->fb_wchan);
+		spinlock_acquire(&fb->fb_lock);
+		if (fw.fw_woken) {
+			spinlock_release(&fb->fb_lock);
+			wchan_unlock(fb->fb_wchan);
+			return 0;
+		}
+		if (curproc->p_exiting) {
+			/* let _exit proceed */
+			futex_unlink(fb, &fw);
+			spinlock_release(&fb->fb_lock);
+			wchan_unlock(fb->fb_wchan);
+			return EINTR;
+		}
+		spinlock_release(&fb->fb_lock);
+		wchan_sleep(fb->fb_wchan);
+	}
+}
+
+static
+int
+futex_wake(struct addrspace *as, userptr_t uaddr, int n, int *retval)
+{
+	struct futex_bucket *fb;
+	struct futex_waiter **pp, *fw;
+	int woken;
+
+	fb = futex_hash(as, (vaddr_t)uaddr);
+	woken = 0;
+
+	spinlock_acquire(&fb->fb_lock);
+	pp = &fb->fb_waiters;
+	while (*pp != NULL && woken < n) {
+		fw = *pp;
+		if (fw->fw_as == as && fw->fw_addr == (vaddr_t)uaddr) {
+			*pp = fw->fw_next;
+			fw->fw_woken = true;
+			woken++;
+		}
+		else {
+			pp = &fw->fw_next;
+		}
+	}
+	spinlock_release(&fb->fb_lock);
+
+	if (woken > 0) {
+		wchan_wakeall(fb->fb_wchan);
+	}
+	*retval = woken;
+	return 0;
+}
+
+/*
+ * Wake every futex sleeper so that threads of exiting processes can
+ * notice. Used by _exit; the others go straight back to sleep.
+ */
+void
+futex_wakeall(void)
+{
+	unsigned i;
+
+	for (i=0; i<FUTEX_NBUCKETS; i++) {
+		wchan_wakeall(futex_buckets[i].fb_wchan);
+	}
+}
+
+int
+sys_futex(userptr_t uaddr, int op, int val, int *retval)
+{
+	struct addrspace *as;
+
+	if ((vaddr_t)uaddr % sizeof(int) != 0) {
+		return EINVAL;
+	}
+	as = curproc->p_addrspace;
+
+	switch (op) {
+	    case FUTEX_WAIT:
+		return futex_wait(as, uaddr, val);
+	    case FUTEX_WAKE:
+		if (val < 0) {
+			return EINVAL;
+		}
+		return futex_wake(as, uaddr, val, retval);
+	}
+	return EINVAL;
+}
+
+#endif /* OPT_A2 */
@@ -11,79 +11,208 @@
 #include <copyinout.h>
 #include <mips/trapframe.h>
 #include "opt-A1.h"
+#include "opt-A2.h"
 #include <clock.h>
 #include <vfs.h>
 #include <types.h>
 #include <kern/errno.h>
 #include <kern/fcntl.h>
 #include <limits.h>
+#include <vm.h>
+
+/*
+ * Argument passing for execv.
+ *
+ * The argument strings are copied in back to back, each padded to a
+ * pointer boundary, into one arena. The arena starts at a page and
+ * grows a page at a time when an argument doesn't fit, so a small
+ * argv never needs a large contiguous allocation. Once the new
+ * address space is ready, the strings are slid up to make room for
+ * the argv pointer array, the pointers are filled in, and the whole
+ * block goes out to the user stack with a single copyout. Strings
+ * plus pointers are bounded by ARG_MAX (E2BIG past that).
+ */
+
+/*
+ * Grow the arena *ARENAP of *SIZEP bytes, USED of them in use, by a
+ * page.
+ */
+static
+int
+argpack_grow(char **arenap, size_t *sizep, size_t used)
+{
+  char *bigger;
 
-// void **args_alloc(size_t size) {
-//   char ** arr = kmalloc(sizeof(char * )*(size+1));
-//   arr[size] = NULL;
-// }
-
-// void args_free(char **args) {
-//   size_t i = 0;
-//   while(args[i]!=NULL) {
-//     free(args[i]);
-//     i++;
-//   }
-//   free(args);
-// }
-
-// int argcopy_in(char **args, size_t size) {
-//   char **user_args = kmalloc(sizeof(vaddr_t) * (size+1));
-//   for(size_t i =0; i<size; i++) {
-//     copyinstr(args[i], user_args[i], strlen(args[i]+1), NULL);
-//   }
-// }
-
-
-//to-do: free memory
-userptr_t argcopy_out_2(unsigned int stackptr, char *cpout, size_t size) {
-	stackptr -= (unsigned int) size;
-	stackptr = (unsigned int) (stackptr - (stackptr % 4)); 
-	copyoutstr(cpout, (userptr_t) stackptr, size, NULL);
-	return (userptr_t) stackptr;
+  if (*sizep >= ARG_MAX) {
+    return E2BIG;
+  }
+  bigger = kmalloc(*sizep + PAGE_SIZE);
+  if (bigger == NULL) {
+    return ENOMEM;
+  }
+  memcpy(bigger, *arenap, used);
+  kfree(*arenap);
+  *arenap = bigger;
+  *sizep += PAGE_SIZE;
+  return 0;
 }
 
-int sys_execv(char *progname, char **argv) {
-    struct addrspace *as;
-    struct vnode *v;
-    vaddr_t entrypoint, stackptr;
+/*
+ * Copy the user's argv vector into a new arena, handed back in
+ * *ARENARET for the caller to kfree. Returns the number of string
+ * bytes used (with padding) in *lenret and the argument count in
+ * *argcret. The arena always has room left for the argv pointers.
+ */
+int
+argpack_in(userptr_t uargv, char **arenaret, size_t *lenret, int *argcret)
+{
+  userptr_t uarg;
+  char *arena;
+  size_t size, used, got, ptrspace;
+  int argc, result;
+
+  size = PAGE_SIZE;
+  arena = kmalloc(size);
+  if (arena == NULL) {
+    return ENOMEM;
+  }
+
+  used = 0;
+  argc = 0;
+  while (1) {
+    result = copyin(uargv + argc * sizeof(userptr_t), &uarg, sizeof(uarg));
+    if (result) {
+      goto fail;
+    }
+    if (uarg == NULL) {
+      break;
+    }
+
+    /* keep room for this argument's pointer and the terminating NULL */
+    ptrspace = (argc + 2) * sizeof(userptr_t);
+    while (1) {
+      if (used + ptrspace < size) {
+        result = copyinstr(uarg, arena + used, size - ptrspace - used, &got);
+        if (result != ENAMETOOLONG) {
+          break;
+        }
+      }
+      result = argpack_grow(&arena, &size, used);
+      if (result) {
+        goto fail;
+      }
+    }
+    if (result) {
+      goto fail;
+    }
+    /* the padding goes out to userland too; don't leak heap through it */
+    bzero(arena + used + got, ROUNDUP(got, sizeof(userptr_t)) - got);
+    used += ROUNDUP(got, sizeof(userptr_t));
+    argc++;
+  }
+
+  *arenaret = arena;
+  *lenret = used;
+  *argcret = argc;
+  return 0;
+
+ fail:
+  kfree(arena);
+  return result;
+}
+
+/*
+ * Lay out an arena filled by argpack_in (LEN bytes of strings, ARGC
+ * arguments) on the user stack below *stackptr. On success *stackptr
+ * is the new stack pointer, which is also the user address of argv.
+ * The arena contents are rearranged in place, in the room argpack_in
+ * left for the pointers.
+ */
+int
+argpack_out(char *arena, size_t len, int argc, vaddr_t *stackptr)
+{
+  userptr_t *uargs;
+  size_t ptrsize, total, off;
+  vaddr_t base;
+  int i;
+
+  ptrsize = (argc + 1) * sizeof(userptr_t);
+  total = ptrsize + len;
+  KASSERT(total <= ARG_MAX);
+
+  /* 8-byte alignment keeps doubles on the stack happy */
+  base = (*stackptr - total) & ~(vaddr_t)7;
+
+  memmove(arena + ptrsize, arena, len);
+  uargs = (userptr_t *)arena;
+  off = ptrsize;
+  for (i = 0; i < argc; i++) {
+    uargs[i] = (userptr_t)(base + off);
+    off += ROUNDUP(strlen(arena + off) + 1, sizeof(userptr_t));
+  }
+  uargs[argc] = NULL;
+  KASSERT(off == total);
+
+  *stackptr = base;
+  return copyout(arena, (userptr_t)base, total);
+}
+
+/*
+ * Copy in a program path and its argv. On success the caller owns
+ * *progret (PATH_MAX bytes) and *argsret (an argpack_in arena).
+ */
+static
+int
+image_args_in(userptr_t progname, userptr_t argv, char **progret,
+              char **argsret, size_t *argslenret, int *argcret)
+{
+    char *prog;
     int result;
 
-    char *prog = (char *) kmalloc(sizeof(char) * PATH_MAX); 
+    if (progname == NULL || argv == NULL) {
+      return EFAULT;
+    }
+
+    prog = kmalloc(PATH_MAX);
     if (prog == NULL) {
-        return(ENOMEM); 
-    } else {
-        //kprintf("arg: %s\n", progname);
-        result = copyinstr((const_userptr_t) progname, prog, PATH_MAX, NULL); 
+      return ENOMEM;
+    }
+
+    result = copyinstr((const_userptr_t) progname, prog, PATH_MAX, NULL);
+    if (result == 0) {
+      result = argpack_in(argv, argsret, argslenret, argcret);
     }
-    
-    /* Open the file. */
-    result = vfs_open(prog, O_RDONLY, 0, &v);
     if (result) {
+      kfree(prog);
       return result;
     }
-    
-    
-    size_t siz = 0;
-    while(argv[siz]!=NULL) {
-      siz += 1;
-    }
 
-    //copy args from old userspace to kernel space
-    char **kern_args = (char **) kmalloc(sizeof(vaddr_t) * (siz+1));
-    kern_args[siz] = NULL;
-    for(size_t i =0; i<siz; i++) {
-      kern_args[i] = kmalloc(sizeof(vaddr_t) * (strlen(argv[i])+1));
-      copyinstr((userptr_t) argv[i], kern_args[i], (strlen(argv[i])+1), NULL);
-    }
-    kern_args[siz] = NULL;
+    *progret = prog;
+    return 0;
+}
 
-    as_destroy(curproc_getas());
+/*
+ * Build a fresh address space holding program PROG with the packed
+ * arguments on its stack, and hand it back in *asret. Only the
+ * current thread sees the new address space while it is being
+ * built (load_elf and copyout work on the current address space),
+ * so the process's other threads carry on in the old one.
+ */
+static
+int
+image_load(char *prog, char *args, size_t argslen, int argc,
+           struct addrspace **asret, vaddr_t *entrypoint,
+           vaddr_t *stackptr)
+{
+    struct addrspace *as;
+    struct vnode *v;
+    int result;
+
+    /* Open the file. */
+    result = vfs_open(prog, O_RDONLY, 0, &v);
+    if (result) {
+      return result;
+    }
 
     /* Create a new address space. */
     as = as_create();
@@ -92,49 +221,184 @@ int sys_execv(char *progname, char **argv) {
       return ENOMEM;
     }
 
-    
-    /* Switch to it and activate it. */
-    curproc_setas(as);
+    /* Switch this thread to it and activate it. */
+    curthread_setas(as);
     as_activate();
-    
+
     /* Load the executable. */
-    result = load_elf(v, &entrypoint);
-    if (result) {
-      /* p_addrspace will go away when curproc is destroyed */
-      vfs_close(v);
-      return result;
-    }
+    result = load_elf(v, entrypoint);
 
     /* Done with the file now. */
     vfs_close(v);
 
     /* Define the user stack in the address space */
-    result = as_define_stack(as, &stackptr);
+    if (result == 0) {
+      result = as_define_stack(as, stackptr);
+    }
+    if (result == 0) {
+      result = argpack_out(args, argslen, argc, stackptr);
+    }
+
+    /* back to the process's own address space */
+    curthread_setas(NULL);
+    as_activate();
+
     if (result) {
-      /* p_addrspace will go away when curproc is destroyed */
+      as_destroy(as);
       return result;
     }
 
-    //copy args from kernel to new userspace
-    //TO-DO: Free used memory
-    vaddr_t *userArgs = (vaddr_t *) kmalloc((siz+1)*sizeof(vaddr_t));
-    userArgs[siz] = (vaddr_t) NULL;
-    userptr_t newStackPtr = (userptr_t) stackptr;
-    for(size_t i=0; i<siz; i++) {
-      size_t size = strlen(kern_args[i])+1;
-      newStackPtr = argcopy_out_2((unsigned int) newStackPtr, (char *) kern_args[i], (size_t) size);
-      userArgs[i] = (vaddr_t) newStackPtr;
-	  }
-    int argsSize = sizeof(vaddr_t) * (siz+1);
-    newStackPtr -= (unsigned int) (argsSize); 
-    newStackPtr = (userptr_t) (newStackPtr - ((unsigned int) newStackPtr % 4));
-    copyout(userArgs, (userptr_t) newStackPtr, argsSize);
+    *asret = as;
+    return 0;
+}
+
+int sys_execv(userptr_t progname, userptr_t argv) {
+    struct addrspace *as, *oldas;
+    vaddr_t entrypoint, stackptr;
+    char *prog, *args;
+    size_t argslen;
+    int argc;
+    int result;
+
+    /* copy everything in while the old address space is still live */
+    result = image_args_in(progname, argv, &prog, &args, &argslen, &argc);
+    if (result) {
+      return result;
+    }
+
+    result = image_load(prog, args, argslen, argc,
+                        &as, &entrypoint, &stackptr);
+    kfree(prog);
+    kfree(args);
+    if (result) {
+      return result;
+    }
+
+#if OPT_A2
+    /* the exec can't fail now; the other user threads go away with
+       the old image */
+    if (!uthread_stopothers()) {
+      as_destroy(as);
+      return EINTR;
+    }
+#endif
+
+    oldas = curproc_setas(as);
+    as_activate();
+    as_destroy(oldas);
+
     /* Warp to user mode. */
+    enter_new_process(argc, (userptr_t) stackptr,
+          stackptr, entrypoint);
+
+    /* enter_new_process does not return. */
+    panic("enter_new_process returned\n");
+    return EINVAL;
+}
+
+/*
+ * spawn: create a child running a new program, without fork+exec.
+ *
+ * Fork-then-exec copies the whole parent image in as_copy() only to
+ * throw it away in execv. Instead, the child's address space is
+ * built here from the ELF file by image_load, and then handed to a
+ * new process whose thread just enters user mode. Errors from
+ * loading come back to the caller directly.
+ */
+
+struct spawn_entry {
+  vaddr_t se_entrypoint;
+  vaddr_t se_stackptr;
+  int se_argc;
+};
+
+static
+void
+enter_spawned_process(void *data1, unsigned long data2)
+{
+  struct spawn_entry se = *(struct spawn_entry *)data1;
+
+  (void)data2;
+  kfree(data1);
+  enter_new_process(se.se_argc, (userptr_t) se.se_stackptr,
+                    se.se_stackptr, se.se_entrypoint);
+}
+
+int
+sys_spawn(userptr_t progname, userptr_t argv, pid_t *retval)
+{
+  struct addrspace *as;
+  struct proc *newProc;
+  struct spawn_entry *se;
+  char *prog, *args;
+  size_t argslen;
+  int result;
+
+  se = kmalloc(sizeof(*se));
+  if (se == NULL) {
+    return ENOMEM;
+  }
 
+  result = image_args_in(progname, argv, &prog, &args, &argslen, &se->se_argc);
+  if (result) {
+    kfree(se);
+    return result;
+  }
+
+  newProc = proc_create_runprogram(prog);
+  if (newProc == NULL) {
+    kfree(prog);
+    kfree(args);
+    kfree(se);
+    return ENOMEM;
+  }
+
+  result = image_load(prog, args, argslen, se->se_argc,
+                      &as, &se->se_entrypoint, &se->se_stackptr);
+  kfree(prog);
+  kfree(args);
+  if (result) {
+    proc_destroy(newProc);
+    kfree(se);
+    return result;
+  }
 
-    enter_new_process(siz, newStackPtr,
-          (vaddr_t) newStackPtr, entrypoint);
-	  return EINVAL;
+  newProc->p_addrspace = as;
+
+  newProc->p_parent = curproc;
+  /* p_lock: other threads of this process may be forking or waiting */
+  spinlock_acquire(&curproc->p_lock);
+  result = array_add(curproc->p_children, newProc, NULL);
+  spinlock_release(&curproc->p_lock);
+  if (result) {
+    goto fail;
+  }
+
+  result = thread_fork("spawn_thread", newProc, enter_spawned_process, se, 0);
+  if (result) {
+    unsigned i;
+
+    spinlock_acquire(&curproc->p_lock);
+    for (i = 0; i < array_num(curproc->p_children); i++) {
+      if (array_get(curproc->p_children, i) == newProc) {
+        array_remove(curproc->p_children, i);
+        break;
+      }
+    }
+    spinlock_release(&curproc->p_lock);
+    goto fail;
+  }
+
+  *retval = newProc->p_pid;
+  return 0;
+
+ fail:
+  /* proc_destroy leaves the address space to sys__exit */
+  as_destroy(newProc->p_addrspace);
+  newProc->p_addrspace = NULL;
+  proc_destroy(newProc);
+  kfree(se);
+  return result;
 }
 
   /* this implementation of sys__exit does not do anything with the exit code */
@@ -150,6 +414,14 @@ void sys__exit(int exitcode) {
 
   DEBUG(DB_SYSCALL,"Syscall: _exit(%d)\n",exitcode);
 
+#if OPT_A2
+  /* take the other user threads down first; if someone beat us to
+     it, we are just one of the threads being taken down */
+  if (!uthread_stopothers()) {
+    sys_thread_exit(0);
+  }
+#endif
+
   KASSERT(curproc->p_addrspace != NULL);
   as_deactivate();
   /*
@@ -161,9 +433,11 @@ void sys__exit(int exitcode) {
    */
   as = curproc_setas(NULL);
   as_destroy(as);
+  spinlock_acquire(&curproc->p_lock);
   while(array_num(curproc->p_children)!=0) {
     struct proc *temp_child = array_get(curproc->p_children, 0);
     array_remove(curproc->p_children, 0);
+    spinlock_release(&curproc->p_lock);
     spinlock_acquire(&temp_child->p_lock);
     if(temp_child->p_exitstatus==1) {
       spinlock_release(&temp_child->p_lock);
@@ -172,7 +446,9 @@ void sys__exit(int exitcode) {
       temp_child->p_parent = NULL;
       spinlock_release(&temp_child->p_lock);
     }
+    spinlock_acquire(&curproc->p_lock);
   }
+  spinlock_release(&curproc->p_lock);
 
 
 
@@ -221,7 +497,9 @@ sys_getpid(pid_t *retval)
 int sys_fork(pid_t *retval, struct trapframe *tf) {
   struct proc *newProc = proc_create_runprogram("child");
   newProc->p_parent = curproc;
+  spinlock_acquire(&curproc->p_lock);
   array_add(curproc->p_children, newProc, NULL);
+  spinlock_release(&curproc->p_lock);
   as_copy(curproc_getas(), &newProc->p_addrspace);
   struct trapframe *newTF = kmalloc(sizeof(struct trapframe));
   memcpy(newTF, tf, sizeof(struct trapframe));
@@ -256,6 +534,7 @@ sys_waitpid(pid_t pid,
     return(EINVAL);
   }
   struct proc *temp_child = NULL;
+  spinlock_acquire(&curproc->p_lock);
   for(unsigned int i = 0; i<array_num(curproc->p_children); i++) {
     temp_child = array_get(curproc->p_children, i);
     if(temp_child->p_pid == pid) {
@@ -264,6 +543,7 @@ sys_waitpid(pid_t pid,
     }
     temp_child = NULL;
   }
+  spinlock_release(&curproc->p_lock);
   if(temp_child==NULL) {
     return(ESRCH);
   }
@@ -0,0 +1,233 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * System call statistics: per-call counts and log2 latency
+ * histograms, fed by the dispatcher in syscall() and read out by
+ * the __syscallstat() system call.
+ *
+ * The counters are kept per CPU so the dispatcher never touches a
+ * shared lock or cache line: each CPU gets its own table the first
+ * time it makes a system call, updates it only at splhigh, and
+ * __syscallstat() sums the tables. The sum is taken without stopping
+ * the other CPUs, so it may be a call or two behind. CPUs past
+ * SYSCALLSTAT_MAXCPUS, or whose table could not be allocated, fall
+ * back to a shared table under a spinlock.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/syscallstat.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <spl.h>
+#include <cpu.h>
+#include <current.h>
+#include <copyinout.h>
+#include <syscall.h>
+
+#define SYSCALLSTAT_MAXCPUS 32
+
+static struct syscallstat *syscallstats_percpu[SYSCALLSTAT_MAXCPUS];
+
+static struct syscallstat syscallstats[SYSCALLSTAT_NCALLS];
+static struct spinlock syscallstats_lock = SPINLOCK_INITIALIZER;
+
+/*
+ * Histogram bucket for a latency: floor(log2(cycles)), with 0 going
+ * in bucket 0.
+ */
+static
+unsigned
+syscallstat_bucket(uint32_t cycles)
+{
+	unsigned b;
+
+	b = 0;
+	while (cycles > 1) {
+		cycles >>= 1;
+		b++;
+	}
+	KASSERT(b < SYSCALLSTAT_NBUCKETS);
+	return b;
+}
+
+/*
+ * Give the current cpu a table if it doesn't have one yet. kmalloc
+ * can't be called at splhigh, so allocate first and install the
+ * table (or throw it away, if we moved cpus and the new one has
+ * one already) at splhigh.
+ */
+static
+void
+syscallstat_cpuinit(void)
+{
+	struct syscallstat *table;
+	unsigned num;
+	int spl;
+
+	num = curcpu->c_number;
+	if (num >= SYSCALLSTAT_MAXCPUS || syscallstats_percpu[num] != NULL) {
+		return;
+	}
+
+	table = kmalloc(SYSCALLSTAT_NCALLS * sizeof(*table));
+	if (table == NULL) {
+		return;
+	}
+	bzero(table, SYSCALLSTAT_NCALLS * sizeof(*table));
+
+	spl = splhigh();
+	num = curcpu->c_number;
+	if (num < SYSCALLSTAT_MAXCPUS && syscallstats_percpu[num] == NULL) {
+		syscallstats_percpu[num] = table;
+		table = NULL;
+	}
+	splx(spl);
+
+	if (table != NULL) {
+		kfree(table);
+	}
+}
+
+/*
+ * Get the current cpu's table, or NULL if it has to use the shared
+ * one. Interrupts must be off.
+ */
+static
+struct syscallstat *
+syscallstat_get(void)
+{
+	unsigned num;
+
+	num = curcpu->c_number;
+	if (num >= SYSCALLSTAT_MAXCPUS) {
+		return NULL;
+	}
+	return syscallstats_percpu[num];
+}
+
+static
+void
+syscallstat_add(struct syscallstat *ss, uint32_t cycles, unsigned b)
+{
+	ss->ss_timed++;
+	ss->ss_cycles += cycles;
+	ss->ss_hist[b]++;
+}
+
+void
+syscallstat_enter(int callno)
+{
+	struct syscallstat *table;
+	int spl;
+
+	KASSERT(callno >= 0 && callno < SYSCALLSTAT_NCALLS);
+
+	syscallstat_cpuinit();
+
+	spl = splhigh();
+	table = syscallstat_get();
+	if (table != NULL) {
+		table[callno].ss_calls++;
+	}
+	splx(spl);
+
+	if (table == NULL) {
+		spinlock_acquire(&syscallstats_lock);
+		syscallstats[callno].ss_calls++;
+		spinlock_release(&syscallstats_lock);
+	}
+}
+
+void
+syscallstat_exit(int callno, uint32_t cycles)
+{
+	struct syscallstat *table;
+	unsigned b;
+	int spl;
+
+	KASSERT(callno >= 0 && callno < SYSCALLSTAT_NCALLS);
+	b = syscallstat_bucket(cycles);
+
+	spl = splhigh();
+	table = syscallstat_get();
+	if (table != NULL) {
+		syscallstat_add(&table[callno], cycles, b);
+	}
+	splx(spl);
+
+	if (table == NULL) {
+		spinlock_acquire(&syscallstats_lock);
+		syscallstat_add(&syscallstats[callno], cycles, b);
+		spinlock_release(&syscallstats_lock);
+	}
+}
+
+/*
+ * Copy out the statistics for system call CALLNO.
+ */
+int
+sys___syscallstat(int callno, userptr_t statbuf)
+{
+	struct syscallstat ss;
+	const struct syscallstat *table;
+	const char *name;
+	unsigned i, b;
+
+	if (callno < 0 || callno >= SYSCALLSTAT_NCALLS) {
+		return EINVAL;
+	}
+
+	spinlock_acquire(&syscallstats_lock);
+	ss = syscallstats[callno];
+	spinlock_release(&syscallstats_lock);
+
+	for (i=0; i<SYSCALLSTAT_MAXCPUS; i++) {
+		table = syscallstats_percpu[i];
+		if (table == NULL) {
+			continue;
+		}
+		ss.ss_calls += table[callno].ss_calls;
+		ss.ss_timed += table[callno].ss_timed;
+		ss.ss_cycles += table[callno].ss_cycles;
+		for (b=0; b<SYSCALLSTAT_NBUCKETS; b++) {
+			ss.ss_hist[b] += table[callno].ss_hist[b];
+		}
+	}
+
+	name = syscall_name(callno);
+	bzero(ss.ss_name, sizeof(ss.ss_name));
+	if (name != NULL) {
+		KASSERT(strlen(name) < sizeof(ss.ss_name));
+		strcpy(ss.ss_name, name);
+	}
+
+	return copyout(&ss, statbuf, sizeof(ss));
+}
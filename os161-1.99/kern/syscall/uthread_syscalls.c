@@ -0,0 +1,311 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * User-level threads.
+ *
+ * Every thread of a process shares its struct addrspace; each extra
+ * thread gets its own stack from as_define_tstack and its own kernel
+ * thread from thread_fork. thread_exit ends one thread (or, for the
+ * last one, the whole process), while _exit ends the process: it
+ * sets p_exiting and waits for the other threads to notice at their
+ * next return to user mode (see uthread_exitcheck, called from
+ * mips_trap) and leave.
+ *
+ * Caveat: a thread asleep in the kernel on something that never
+ * happens (e.g. reading an idle console) holds up _exit until it
+ * wakes.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <array.h>
+#include <synch.h>
+#include <current.h>
+#include <proc.h>
+#include <thread.h>
+#include <addrspace.h>
+#include <copyinout.h>
+#include <syscall.h>
+#include "opt-A2.h"
+
+#if OPT_A2
+
+static void uthread_exit(int status);
+
+/* What a new user thread needs to get going. */
+struct uthread_start {
+	struct uthread *us_ut;
+	vaddr_t us_entry;
+	userptr_t us_func;
+	userptr_t us_arg;
+	vaddr_t us_stackptr;
+};
+
+/*
+ * First code run by a new user thread: claim the thread record and
+ * go to user mode at the libc trampoline, with func and arg in a0/a1.
+ */
+static
+void
+enter_uthread(void *data1, unsigned long data2)
+{
+	struct uthread_start us = *(struct uthread_start *)data1;
+	struct proc *p = curproc;
+
+	(void)data2;
+	kfree(data1);
+
+	lock_acquire(p->p_uthread_lock);
+	us.us_ut->ut_thread = curthread;
+	if (p->p_exiting) {
+		lock_release(p->p_uthread_lock);
+		uthread_exit(0);
+	}
+	lock_release(p->p_uthread_lock);
+
+	/* enter_new_process's argc/argv slots are just a0 and a1 */
+	enter_new_process((int)us.us_func, us.us_arg, us.us_stackptr,
+			  us.us_entry);
+}
+
+/*
+ * Find the record for a thread id, or the current thread's record
+ * if TID is -1. Returns the array index, or -1. Caller holds
+ * p_uthread_lock.
+ */
+static
+int
+uthread_find(struct proc *p, int tid)
+{
+	struct uthread *ut;
+	unsigned i, num;
+
+	KASSERT(lock_do_i_hold(p->p_uthread_lock));
+
+	num = array_num(p->p_uthreads);
+	for (i=0; i<num; i++) {
+		ut = array_get(p->p_uthreads, i);
+		if (tid < 0 ? ut->ut_thread == curthread : ut->ut_tid == tid) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/*
+ * End the current user thread. If it is the last one, and nobody
+ * is already taking the process down, this is a process exit.
+ */
+static
+void
+uthread_exit(int status)
+{
+	struct proc *p = curproc;
+	struct uthread *ut;
+	int ix;
+
+	lock_acquire(p->p_uthread_lock);
+	if (!p->p_exiting && p->p_nuthreads == 1) {
+		lock_release(p->p_uthread_lock);
+		sys__exit(status);
+	}
+
+	ix = uthread_find(p, -1);
+	if (ix >= 0) {
+		ut = array_get(p->p_uthreads, ix);
+		ut->ut_thread = NULL;
+		ut->ut_status = status;
+		as_free_tstack(p->p_addrspace, ut->ut_stackslot);
+		ut->ut_stackslot = -1;
+	}
+	KASSERT(p->p_nuthreads > 1);
+	p->p_nuthreads--;
+	cv_broadcast(p->p_uthread_cv, p->p_uthread_lock);
+	lock_release(p->p_uthread_lock);
+
+	proc_remthread(curthread);
+	thread_exit();
+}
+
+/*
+ * Called on the way back to user mode. If another thread is exiting
+ * the process, leave instead of returning.
+ */
+void
+uthread_exitcheck(void)
+{
+	struct proc *p = curproc;
+
+	if (p == NULL || p == kproc || !p->p_exiting) {
+		return;
+	}
+	uthread_exit(0);
+}
+
+/*
+ * Make the current thread the only thread in its process, for
+ * _exit and execv. Returns false if some other thread got there
+ * first, in which case the caller is about to be stopped itself.
+ */
+bool
+uthread_stopothers(void)
+{
+	struct proc *p = curproc;
+
+	lock_acquire(p->p_uthread_lock);
+	if (p->p_exiting) {
+		lock_release(p->p_uthread_lock);
+		return false;
+	}
+	p->p_exiting = true;
+	/* wake any joiners and futex sleepers so they notice */
+	cv_broadcast(p->p_uthread_cv, p->p_uthread_lock);
+	futex_wakeall();
+	while (p->p_nuthreads > 1) {
+		cv_wait(p->p_uthread_cv, p->p_uthread_lock);
+	}
+	p->p_exiting = false;
+	lock_release(p->p_uthread_lock);
+	return true;
+}
+
+int
+sys_thread_create(userptr_t entry, userptr_t func, userptr_t arg,
+		  int *retval)
+{
+	struct proc *p = curproc;
+	struct uthread_start *us;
+	struct uthread *ut;
+	vaddr_t stacktop;
+	int result;
+
+	us = kmalloc(sizeof(*us));
+	ut = kmalloc(sizeof(*ut));
+	if (us == NULL || ut == NULL) {
+		kfree(us);
+		kfree(ut);
+		return ENOMEM;
+	}
+
+	lock_acquire(p->p_uthread_lock);
+	if (p->p_exiting) {
+		result = EINTR;
+		goto fail;
+	}
+	result = as_define_tstack(p->p_addrspace, &ut->ut_stackslot, &stacktop);
+	if (result) {
+		goto fail;
+	}
+	ut->ut_tid = p->p_nexttid++;
+	ut->ut_thread = NULL;
+	ut->ut_status = 0;
+	result = array_add(p->p_uthreads, ut, NULL);
+	if (result) {
+		as_free_tstack(p->p_addrspace, ut->ut_stackslot);
+		goto fail;
+	}
+
+	us->us_ut = ut;
+	us->us_entry = (vaddr_t)entry;
+	us->us_func = func;
+	us->us_arg = arg;
+	/* leave the callee its 16-byte argument save area */
+	us->us_stackptr = stacktop - 16;
+
+	p->p_nuthreads++;
+	result = thread_fork("uthread", p, enter_uthread, us, 0);
+	if (result) {
+		p->p_nuthreads--;
+		array_remove(p->p_uthreads, array_num(p->p_uthreads) - 1);
+		as_free_tstack(p->p_addrspace, ut->ut_stackslot);
+		goto fail;
+	}
+	*retval = ut->ut_tid;
+	lock_release(p->p_uthread_lock);
+	return 0;
+
+ fail:
+	lock_release(p->p_uthread_lock);
+	kfree(us);
+	kfree(ut);
+	return result;
+}
+
+int
+sys_thread_join(int tid, userptr_t status)
+{
+	struct proc *p = curproc;
+	struct uthread *ut;
+	int ix, exitstatus;
+
+	lock_acquire(p->p_uthread_lock);
+	while (1) {
+		/* look it up each time; another joiner may reap it */
+		ix = uthread_find(p, tid);
+		if (ix < 0) {
+			lock_release(p->p_uthread_lock);
+			return ESRCH;
+		}
+		ut = array_get(p->p_uthreads, ix);
+		if (ut->ut_thread == curthread) {
+			lock_release(p->p_uthread_lock);
+			return EINVAL;
+		}
+		/* the stack goes away when the thread exits */
+		if (ut->ut_stackslot < 0) {
+			break;
+		}
+		if (p->p_exiting) {
+			lock_release(p->p_uthread_lock);
+			return EINTR;
+		}
+		cv_wait(p->p_uthread_cv, p->p_uthread_lock);
+	}
+
+	exitstatus = ut->ut_status;
+	array_remove(p->p_uthreads, ix);
+	lock_release(p->p_uthread_lock);
+	kfree(ut);
+
+	if (status != NULL) {
+		return copyout(&exitstatus, status, sizeof(exitstatus));
+	}
+	return 0;
+}
+
+void
+sys_thread_exit(int status)
+{
+	uthread_exit(status);
+	panic("return from uthread_exit\n");
+}
+
+#endif /* OPT_A2 */
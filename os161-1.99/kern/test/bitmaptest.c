@@ -40,7 +40,7 @@ bitmaptest(int nargs, char **args)
 	struct bitmap *b;
 	char data[TESTSIZE];
 	uint32_t x;
-	int i;
+	int i, result;
 
 	(void)nargs;
 	(void)args;
@@ -101,6 +101,24 @@ bitmaptest(int nargs, char **args)
 		KASSERT(data[i]==0);
 	}
 
+	/* Free every 7th bit and allocate near goals, with wraparound */
+	for (i=0; i<TESTSIZE; i+=7) {
+		bitmap_unmark(b, i);
+	}
+	result = bitmap_alloc_near(b, 100, &x);
+	KASSERT(result == 0 && x == 105);
+	result = bitmap_alloc_near(b, 100, &x);
+	KASSERT(result == 0 && x == 112);
+	result = bitmap_alloc_near(b, 530, &x);
+	KASSERT(result == 0 && x == 532);
+	result = bitmap_alloc_near(b, 530, &x);
+	KASSERT(result == 0 && x == 0);
+	result = bitmap_alloc_near(b, TESTSIZE, &x);
+	KASSERT(result == 0 && x == 7);
+	for (i=0; i<TESTSIZE; i++) {
+		KASSERT(bitmap_isset(b, i) || i%7==0);
+	}
+
 	kprintf("Bitmap test complete\n");
 	return 0;
 }
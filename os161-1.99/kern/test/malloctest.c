@@ -31,6 +31,7 @@
  * Test code for kmalloc.
  */
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <thread.h>
 #include <synch.h>
@@ -45,12 +46,36 @@
  *
  * mallocstress does the same thing, but from NTHREADS different
  * threads at once.
+ *
+ * Both take an optional size argument to use instead of ITEMSIZE, to
+ * exercise the smaller (per-cpu cached) sizes.
  */
 
 #define NTRIES   1200
 #define ITEMSIZE  997
 #define NTHREADS  8
 
+static size_t itemsize;
+
+static
+int
+setitemsize(int nargs, char **args)
+{
+	itemsize = ITEMSIZE;
+	if (nargs > 2) {
+		kprintf("Usage: %s [size]\n", args[0]);
+		return EINVAL;
+	}
+	if (nargs == 2) {
+		itemsize = atoi(args[1]);
+		if (itemsize == 0) {
+			kprintf("%s: Invalid size %s\n", args[0], args[1]);
+			return EINVAL;
+		}
+	}
+	return 0;
+}
+
 static
 void
 mallocthread(void *sm, unsigned long num)
@@ -62,7 +87,7 @@ mallocthread(void *sm, unsigned long num)
 	int i;
 
 	for (i=0; i<NTRIES; i++) {
-		ptr = kmalloc(ITEMSIZE);
+		ptr = kmalloc(itemsize);
 		if (ptr==NULL) {
 			if (sem) {
 				kprintf("thread %lu: kmalloc returned NULL\n",
@@ -93,8 +118,12 @@ mallocthread(void *sm, unsigned long num)
 int
 malloctest(int nargs, char **args)
 {
-	(void)nargs;
-	(void)args;
+	int result;
+
+	result = setitemsize(nargs, args);
+	if (result) {
+		return result;
+	}
 
 	kprintf("Starting kmalloc test...\n");
 	mallocthread(NULL, 0);
@@ -109,8 +138,10 @@ mallocstress(int nargs, char **args)
 	struct semaphore *sem;
 	int i, result;
 
-	(void)nargs;
-	(void)args;
+	result = setitemsize(nargs, args);
+	if (result) {
+		return result;
+	}
 
 	sem = sem_create("mallocstress", 0);
 	if (sem == NULL) {
@@ -0,0 +1,228 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * memcpy/memmove/bzero check and throughput benchmark.
+ *
+ * For each of several sizes and source/destination misalignments,
+ * first checks the result against a byte-at-a-time copy, then times
+ * enough repetitions to move BENCHBYTES and prints MB/s.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <clock.h>
+#include <test.h>
+
+#define BUFSIZE   (4096 + 16)
+#define BENCHBYTES (256*1024)
+
+static const size_t sizes[] = { 8, 32, 128, 512, 4096 };
+#define NSIZES (sizeof(sizes) / sizeof(sizes[0]))
+
+static const struct {
+	unsigned dofs, sofs;
+} offsets[] = {
+	{ 0, 0 },	/* both aligned */
+	{ 1, 1 },	/* same misalignment */
+	{ 0, 1 },	/* source misaligned */
+	{ 3, 0 },	/* destination misaligned */
+};
+#define NOFFSETS (sizeof(offsets) / sizeof(offsets[0]))
+
+enum memop { OP_MEMCPY, OP_MEMMOVE, OP_BZERO };
+static const char *const opnames[] = { "memcpy", "memmove", "bzero" };
+
+static
+void
+fillbuf(char *buf, unsigned seed)
+{
+	unsigned i;
+
+	for (i=0; i<BUFSIZE; i++) {
+		buf[i] = (char)(seed + i*7);
+	}
+}
+
+static
+void
+doop(enum memop op, char *dst, const char *src, size_t len)
+{
+	switch (op) {
+	    case OP_MEMCPY: memcpy(dst, src, len); break;
+	    case OP_MEMMOVE: memmove(dst, src, len); break;
+	    case OP_BZERO: bzero(dst, len); break;
+	}
+}
+
+/*
+ * Check one operation against the obvious bytewise version, including
+ * that nothing outside the destination was touched. For memmove, also
+ * try both overlapping directions within one buffer.
+ */
+static
+void
+checkop(enum memop op, char *a, char *b, char *ref, size_t len,
+	unsigned dofs, unsigned sofs)
+{
+	size_t i;
+
+	fillbuf(a, 1);
+	fillbuf(b, 2);
+	fillbuf(ref, 2);
+	for (i=0; i<len; i++) {
+		ref[dofs+i] = (op == OP_BZERO) ? 0 : a[sofs+i];
+	}
+	doop(op, b+dofs, a+sofs, len);
+	for (i=0; i<BUFSIZE; i++) {
+		KASSERT(b[i] == ref[i]);
+	}
+
+	if (op != OP_MEMMOVE || len + 8 > BUFSIZE) {
+		return;
+	}
+
+	/* overlapping, destination above source */
+	fillbuf(a, 3);
+	fillbuf(ref, 3);
+	for (i=len; i>0; i--) {
+		ref[dofs+5+i-1] = ref[sofs+i-1];
+	}
+	memmove(a+dofs+5, a+sofs, len);
+	for (i=0; i<BUFSIZE; i++) {
+		KASSERT(a[i] == ref[i]);
+	}
+
+	/* overlapping, destination below source */
+	fillbuf(a, 4);
+	fillbuf(ref, 4);
+	for (i=0; i<len; i++) {
+		ref[dofs+i] = ref[sofs+5+i];
+	}
+	memmove(a+dofs, a+sofs+5, len);
+	for (i=0; i<BUFSIZE; i++) {
+		KASSERT(a[i] == ref[i]);
+	}
+}
+
+/*
+ * Return MB/s for doing OP on LEN bytes until BENCHBYTES have been
+ * moved.
+ */
+static
+unsigned
+benchop(enum memop op, char *dst, const char *src, size_t len)
+{
+	time_t secs1, secs2, rsecs;
+	uint32_t nsecs1, nsecs2, rnsecs;
+	unsigned i, reps;
+	uint64_t ns;
+
+	reps = BENCHBYTES / len;
+
+	gettime(&secs1, &nsecs1);
+	for (i=0; i<reps; i++) {
+		doop(op, dst, src, len);
+	}
+	gettime(&secs2, &nsecs2);
+	getinterval(secs1, nsecs1, secs2, nsecs2, &rsecs, &rnsecs);
+
+	ns = (uint64_t)rsecs * 1000000000 + rnsecs;
+	if (ns == 0) {
+		return 0;
+	}
+	/* bytes per ns * 1000 = MB/s (decimal megabytes) */
+	return (unsigned)((uint64_t)reps * len * 1000 / ns);
+}
+
+int
+memcpytest(int nargs, char **args)
+{
+	char *a, *b, *ref;
+	char hdr[16];
+	unsigned op, s, o;
+
+	(void)nargs;
+	(void)args;
+
+	a = kmalloc(BUFSIZE);
+	b = kmalloc(BUFSIZE);
+	ref = kmalloc(BUFSIZE);
+	if (a == NULL || b == NULL || ref == NULL) {
+		kfree(a);
+		kfree(b);
+		kfree(ref);
+		kprintf("memcpytest: Out of memory\n");
+		return ENOMEM;
+	}
+
+	kprintf("Starting memcpy test...\n");
+
+	for (op=OP_MEMCPY; op<=OP_BZERO; op++) {
+		for (s=0; s<NSIZES; s++) {
+			for (o=0; o<NOFFSETS; o++) {
+				checkop(op, a, b, ref, sizes[s],
+					offsets[o].dofs, offsets[o].sofs);
+			}
+		}
+	}
+
+	kprintf("%-8s %5s", "MB/s", "size");
+	for (o=0; o<NOFFSETS; o++) {
+		snprintf(hdr, sizeof(hdr), "d+%u/s+%u",
+			 offsets[o].dofs, offsets[o].sofs);
+		kprintf("%11s", hdr);
+	}
+	kprintf("\n");
+
+	for (op=OP_MEMCPY; op<=OP_BZERO; op++) {
+		for (s=0; s<NSIZES; s++) {
+			kprintf("%-8s %5u", opnames[op], sizes[s]);
+			for (o=0; o<NOFFSETS; o++) {
+				if (op == OP_BZERO && offsets[o].sofs != 0) {
+					kprintf("%11s", "-");
+					continue;
+				}
+				kprintf("%11u",
+					benchop(op, b + offsets[o].dofs,
+						a + offsets[o].sofs,
+						sizes[s]));
+			}
+			kprintf("\n");
+		}
+	}
+
+	kfree(a);
+	kfree(b);
+	kfree(ref);
+
+	kprintf("memcpy test complete\n");
+	return 0;
+}
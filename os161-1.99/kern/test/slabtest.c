@@ -0,0 +1,129 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <slab.h>
+#include <test.h>
+
+/*
+ * Slab cache test: check that objects come back constructed, that
+ * constructors and destructors run once per object per page, and
+ * that objects don't overlap.
+ */
+
+#define TESTOBJS  300
+#define OBJMAGIC  0x51ab0b1e
+
+struct testobj {
+	uint32_t to_magic;	/* set by constructor */
+	unsigned to_index;	/* set by user */
+	char to_pad[37];	/* odd size on purpose */
+};
+
+static unsigned nctor, ndtor;
+
+static
+int
+testobj_ctor(void *obj)
+{
+	struct testobj *to = obj;
+
+	to->to_magic = OBJMAGIC;
+	nctor++;
+	return 0;
+}
+
+static
+void
+testobj_dtor(void *obj)
+{
+	struct testobj *to = obj;
+
+	KASSERT(to->to_magic == OBJMAGIC);
+	ndtor++;
+}
+
+int
+slabtest(int nargs, char **args)
+{
+	struct slabcache *sc;
+	struct testobj *objs[TESTOBJS];
+	unsigned i, j, grows;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting slab test...\n");
+
+	nctor = ndtor = 0;
+	sc = slab_create("slabtest", sizeof(struct testobj),
+			 testobj_ctor, testobj_dtor);
+	KASSERT(sc != NULL);
+
+	for (i=0; i<TESTOBJS; i++) {
+		objs[i] = slab_alloc(sc);
+		KASSERT(objs[i] != NULL);
+		KASSERT(objs[i]->to_magic == OBJMAGIC);
+		objs[i]->to_index = i;
+	}
+	for (i=0; i<TESTOBJS; i++) {
+		KASSERT(objs[i]->to_index == i);
+		for (j=0; j<i; j++) {
+			KASSERT(objs[i] != objs[j]);
+		}
+	}
+	KASSERT(nctor >= TESTOBJS);
+	KASSERT(ndtor == 0);
+
+	/* Free every other one and reallocate; no new pages needed. */
+	grows = sc->sc_grows;
+	for (i=0; i<TESTOBJS; i+=2) {
+		slab_free(sc, objs[i]);
+	}
+	for (i=0; i<TESTOBJS; i+=2) {
+		objs[i] = slab_alloc(sc);
+		KASSERT(objs[i] != NULL);
+		KASSERT(objs[i]->to_magic == OBJMAGIC);
+		objs[i]->to_index = i;
+	}
+	KASSERT(sc->sc_grows == grows);
+
+	for (i=0; i<TESTOBJS; i++) {
+		KASSERT(objs[i]->to_index == i);
+		slab_free(sc, objs[i]);
+	}
+	KASSERT(sc->sc_inuse == 0);
+
+	slab_destroy(sc);
+	KASSERT(nctor == ndtor);
+
+	kprintf("Slab test complete\n");
+	return 0;
+}
@@ -101,6 +101,8 @@ timerclock(void)
 {
 	/* Broadcast on minibolt */
 	wchan_wakeall(minibolt);
+	/* Get any output logged from interrupt handlers printed */
+	klog_tick();
 	/* Broadcast on lbolt if a second has elapsed */
 	if (--minicount <= 0) {
 	  minicount = MINI_PER_SECOND;
@@ -33,17 +33,53 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <spinlock.h>
 #include <wchan.h>
 #include <thread.h>
 #include <current.h>
+#include <slab.h>
 #include <synch.h>
 
 ////////////////////////////////////////////////////////////
 //
 // Semaphore.
 
+/*
+ * Semaphores, locks, and CVs come from slab caches and keep their
+ * wait channel (and spinlock) across reuse; only the name is set up
+ * each time, and the wchan is renamed to match.
+ */
+
+static
+int
+sem_ctor(void *obj)
+{
+	struct semaphore *sem = obj;
+
+	sem->sem_wchan = wchan_create("sem");
+	if (sem->sem_wchan == NULL) {
+		return ENOMEM;
+	}
+	spinlock_init(&sem->sem_lock);
+	return 0;
+}
+
+static
+void
+sem_dtor(void *obj)
+{
+	struct semaphore *sem = obj;
+
+	spinlock_cleanup(&sem->sem_lock);
+	wchan_destroy(sem->sem_wchan);
+}
+
+static struct slabcache sem_cache =
+	SLABCACHE_INITIALIZER("semaphore", sizeof(struct semaphore),
+			      sem_ctor, sem_dtor);
+
 struct semaphore *
 sem_create(const char *name, int initial_count)
 {
@@ -51,25 +87,18 @@ sem_create(const char *name, int initial_count)
 
         KASSERT(initial_count >= 0);
 
-        sem = kmalloc(sizeof(struct semaphore));
+        sem = slab_alloc(&sem_cache);
         if (sem == NULL) {
                 return NULL;
         }
 
         sem->sem_name = kstrdup(name);
         if (sem->sem_name == NULL) {
-                kfree(sem);
+                slab_free(&sem_cache, sem);
                 return NULL;
         }
 
-	sem->sem_wchan = wchan_create(sem->sem_name);
-	if (sem->sem_wchan == NULL) {
-		kfree(sem->sem_name);
-		kfree(sem);
-		return NULL;
-	}
-
-	spinlock_init(&sem->sem_lock);
+	wchan_setname(sem->sem_wchan, sem->sem_name);
         sem->sem_count = initial_count;
 
         return sem;
@@ -80,11 +109,11 @@ sem_destroy(struct semaphore *sem)
 {
         KASSERT(sem != NULL);
 
-	/* wchan_cleanup will assert if anyone's waiting on it */
-	spinlock_cleanup(&sem->sem_lock);
-	wchan_destroy(sem->sem_wchan);
+	/* The wchan must be empty to go back in the cache */
+	KASSERT(wchan_isempty(sem->sem_wchan));
+	wchan_setname(sem->sem_wchan, "sem");
         kfree(sem->sem_name);
-        kfree(sem);
+        slab_free(&sem_cache, sem);
 }
 
 void 
@@ -147,23 +176,50 @@ V(struct semaphore *sem)
 //
 // Lock.
 
+static
+int
+lock_ctor(void *obj)
+{
+	struct lock *lock = obj;
+
+	lock->lk_wchan = wchan_create("lock");
+	if (lock->lk_wchan == NULL) {
+		return ENOMEM;
+	}
+	spinlock_init(&lock->lk_spnlk);
+	return 0;
+}
+
+static
+void
+lock_dtor(void *obj)
+{
+	struct lock *lock = obj;
+
+	spinlock_cleanup(&lock->lk_spnlk);
+	wchan_destroy(lock->lk_wchan);
+}
+
+static struct slabcache lock_cache =
+	SLABCACHE_INITIALIZER("lock", sizeof(struct lock),
+			      lock_ctor, lock_dtor);
+
 struct lock *
 lock_create(const char *name)
 {
         struct lock *lock;
 
-        lock = kmalloc(sizeof(struct lock));
+        lock = slab_alloc(&lock_cache);
         if (lock == NULL) {
                 return NULL;
         }
 
         lock->lk_name = kstrdup(name);
         if (lock->lk_name == NULL) {
-                kfree(lock);
+                slab_free(&lock_cache, lock);
                 return NULL;
         }
-        lock->lk_wchan = wchan_create(lock->lk_name);
-        spinlock_init(&lock->lk_spnlk);
+        wchan_setname(lock->lk_wchan, lock->lk_name);
         lock->lk_held = false;
         lock->lk_owner = NULL;
         
@@ -176,10 +232,10 @@ lock_destroy(struct lock *lock)
         KASSERT(lock != NULL);
 
         // add stuff here as needed
-        spinlock_cleanup(&lock->lk_spnlk);
-        wchan_destroy(lock->lk_wchan);
+        KASSERT(wchan_isempty(lock->lk_wchan));
+        wchan_setname(lock->lk_wchan, "lock");
         kfree(lock->lk_name);
-        kfree(lock);
+        slab_free(&lock_cache, lock);
 }
 
 void
@@ -223,23 +279,48 @@ lock_do_i_hold(struct lock *lock)
 // CV
 
 
+static
+int
+cv_ctor(void *obj)
+{
+	struct cv *cv = obj;
+
+	cv->cv_chan = wchan_create("cv");
+	if (cv->cv_chan == NULL) {
+		return ENOMEM;
+	}
+	return 0;
+}
+
+static
+void
+cv_dtor(void *obj)
+{
+	struct cv *cv = obj;
+
+	wchan_destroy(cv->cv_chan);
+}
+
+static struct slabcache cv_cache =
+	SLABCACHE_INITIALIZER("cv", sizeof(struct cv), cv_ctor, cv_dtor);
+
 struct cv *
 cv_create(const char *name)
 {
         struct cv *cv;
 
-        cv = kmalloc(sizeof(struct cv));
+        cv = slab_alloc(&cv_cache);
         if (cv == NULL) {
                 return NULL;
         }
 
         cv->cv_name = kstrdup(name);
         if (cv->cv_name==NULL) {
-                kfree(cv);
+                slab_free(&cv_cache, cv);
                 return NULL;
         }
         
-        cv->cv_chan = wchan_create(cv->cv_name);        
+        wchan_setname(cv->cv_chan, cv->cv_name);
         return cv;
 }
 
@@ -248,10 +329,10 @@ cv_destroy(struct cv *cv)
 {
         KASSERT(cv != NULL);
 
-        // not sure if cv_chan need's to be freed
-        kfree(cv->cv_chan);        
+        KASSERT(wchan_isempty(cv->cv_chan));
+        wchan_setname(cv->cv_chan, "cv");
         kfree(cv->cv_name);
-        kfree(cv);
+        slab_free(&cv_cache, cv);
 }
 
 void
@@ -50,6 +50,7 @@
 #include <addrspace.h>
 #include <mainbus.h>
 #include <vnode.h>
+#include <slab.h>
 
 #include "opt-synchprobs.h"
 
@@ -64,6 +65,23 @@ struct wchan {
 	struct spinlock wc_lock;	/* lock for mutual exclusion */
 };
 
+/*
+ * Slab caches for threads and wait channels. The constructed state
+ * is an unlinked list node, and an empty list and free spinlock,
+ * respectively.
+ */
+static int thread_ctor(void *);
+static void thread_dtor(void *);
+static int wchan_ctor(void *);
+static void wchan_dtor(void *);
+
+static struct slabcache thread_cache =
+	SLABCACHE_INITIALIZER("thread", sizeof(struct thread),
+			      thread_ctor, thread_dtor);
+static struct slabcache wchan_cache =
+	SLABCACHE_INITIALIZER("wchan", sizeof(struct wchan),
+			      wchan_ctor, wchan_dtor);
+
 /* Master array of CPUs. */
 DECLARRAY(cpu);
 DEFARRAY(cpu, /*no inline*/ );
@@ -112,6 +130,102 @@ thread_checkstack(struct thread *thread)
 	}
 }
 
+/*
+ * Kernel stack cache.
+ *
+ * Threads come and go a lot more often than the number of them alive
+ * at once changes, so rather than going back to the page allocator
+ * for every thread_fork and exorcise, keep up to THREAD_STACKCACHE
+ * dead threads' stacks on a list and hand them out again. Stacks are
+ * checked (thread_checkstack) before going on the list and get fresh
+ * magic numbers when they come off it, so overflow detection works
+ * the same as with new stacks. The list link lives in the top word
+ * of the stack, well away from the magic numbers at the bottom.
+ */
+
+#define THREAD_STACKCACHE 16
+
+static struct spinlock stackcache_lock = SPINLOCK_INITIALIZER;
+static void *stackcache;		/* list of free stacks */
+static unsigned stackcache_count;	/* length of stackcache */
+
+#define STACK_LINK(stack) \
+	(((void **)((char *)(stack) + STACK_SIZE))[-1])
+
+/*
+ * Get a stack for THREAD and put the magic numbers on it.
+ */
+static
+int
+thread_stack_get(struct thread *thread)
+{
+	void *stack;
+
+	spinlock_acquire(&stackcache_lock);
+	stack = stackcache;
+	if (stack != NULL) {
+		stackcache = STACK_LINK(stack);
+		stackcache_count--;
+	}
+	spinlock_release(&stackcache_lock);
+
+	if (stack == NULL) {
+		stack = kmalloc(STACK_SIZE);
+		if (stack == NULL) {
+			return ENOMEM;
+		}
+	}
+
+	thread->t_stack = stack;
+	thread_checkstack_init(thread);
+	return 0;
+}
+
+/*
+ * Give back THREAD's stack, after checking it wasn't overflowed.
+ */
+static
+void
+thread_stack_put(struct thread *thread)
+{
+	void *stack = thread->t_stack;
+
+	thread_checkstack(thread);
+	thread->t_stack = NULL;
+
+	spinlock_acquire(&stackcache_lock);
+	if (stackcache_count < THREAD_STACKCACHE) {
+		STACK_LINK(stack) = stackcache;
+		stackcache = stack;
+		stackcache_count++;
+		stack = NULL;
+	}
+	spinlock_release(&stackcache_lock);
+
+	if (stack != NULL) {
+		kfree(stack);
+	}
+}
+
+static
+int
+thread_ctor(void *obj)
+{
+	struct thread *thread = obj;
+
+	threadlistnode_init(&thread->t_listnode, thread);
+	return 0;
+}
+
+static
+void
+thread_dtor(void *obj)
+{
+	struct thread *thread = obj;
+
+	threadlistnode_cleanup(&thread->t_listnode);
+}
+
 /*
  * Create a thread. This is used both to create a first thread
  * for each CPU and to create subsequent forked threads.
@@ -124,22 +238,21 @@ thread_create(const char *name)
 
 	DEBUGASSERT(name != NULL);
 
-	thread = kmalloc(sizeof(*thread));
+	thread = slab_alloc(&thread_cache);
 	if (thread == NULL) {
 		return NULL;
 	}
 
 	thread->t_name = kstrdup(name);
 	if (thread->t_name == NULL) {
-		kfree(thread);
+		slab_free(&thread_cache, thread);
 		return NULL;
 	}
 	thread->t_wchan_name = "NEW";
 	thread->t_state = S_READY;
 
-	/* Thread subsystem fields */
+	/* Thread subsystem fields (t_listnode is set up by thread_ctor) */
 	thread_machdep_init(&thread->t_machdep);
-	threadlistnode_init(&thread->t_listnode, thread);
 	thread->t_stack = NULL;
 	thread->t_context = NULL;
 	thread->t_cpu = NULL;
@@ -150,6 +263,11 @@ thread_create(const char *name)
 	thread->t_curspl = IPL_HIGH;
 	thread->t_iplhigh_count = 1; /* corresponding to t_curspl */
 
+	/* Public fields */
+	thread->t_sfsops = 0;
+	thread->t_sfslogged = 0;
+	thread->t_loadas = NULL;
+
 	/* If you add to struct thread, be sure to initialize here */
 
 	return thread;
@@ -215,11 +333,9 @@ cpu_create(unsigned hardware_number)
 		/*c->c_curthread->t_stack = ... */
 	}
 	else {
-		c->c_curthread->t_stack = kmalloc(STACK_SIZE);
-		if (c->c_curthread->t_stack == NULL) {
+		if (thread_stack_get(c->c_curthread)) {
 			panic("cpu_create: couldn't allocate stack");
 		}
-		thread_checkstack_init(c->c_curthread);
 	}
 	c->c_curthread->t_cpu = c;
 
@@ -251,16 +367,17 @@ thread_destroy(struct thread *thread)
 	/* Thread subsystem fields */
 	KASSERT(thread->t_proc == NULL);
 	if (thread->t_stack != NULL) {
-		kfree(thread->t_stack);
+		thread_stack_put(thread);
 	}
-	threadlistnode_cleanup(&thread->t_listnode);
+	KASSERT(thread->t_listnode.tln_prev == NULL);
+	KASSERT(thread->t_listnode.tln_next == NULL);
 	thread_machdep_cleanup(&thread->t_machdep);
 
 	/* sheer paranoia */
 	thread->t_wchan_name = "DESTROYED";
 
 	kfree(thread->t_name);
-	kfree(thread);
+	slab_free(&thread_cache, thread);
 }
 
 /*
@@ -494,12 +611,10 @@ thread_fork(const char *name,
 	}
 
 	/* Allocate a stack */
-	newthread->t_stack = kmalloc(STACK_SIZE);
-	if (newthread->t_stack == NULL) {
+	if (thread_stack_get(newthread)) {
 		thread_destroy(newthread);
 		return ENOMEM;
 	}
-	thread_checkstack_init(newthread);
 
 	/*
 	 * Now we clone various fields from the parent thread.
@@ -964,6 +1079,31 @@ thread_consider_migration(void)
  * Wait channel functions
  */
 
+/*
+ * Slab cache constructor and destructor for wait channels.
+ */
+static
+int
+wchan_ctor(void *obj)
+{
+	struct wchan *wc = obj;
+
+	spinlock_init(&wc->wc_lock);
+	threadlist_init(&wc->wc_threads);
+	wc->wc_name = NULL;
+	return 0;
+}
+
+static
+void
+wchan_dtor(void *obj)
+{
+	struct wchan *wc = obj;
+
+	spinlock_cleanup(&wc->wc_lock);
+	threadlist_cleanup(&wc->wc_threads);
+}
+
 /*
  * Create a wait channel. NAME is a symbolic string name for it.
  * This is what's displayed by ps -alx in Unix.
@@ -977,26 +1117,38 @@ wchan_create(const char *name)
 {
 	struct wchan *wc;
 
-	wc = kmalloc(sizeof(*wc));
+	wc = slab_alloc(&wchan_cache);
 	if (wc == NULL) {
 		return NULL;
 	}
-	spinlock_init(&wc->wc_lock);
-	threadlist_init(&wc->wc_threads);
 	wc->wc_name = name;
 	return wc;
 }
 
+/*
+ * Change the name of a wait channel. Only for use while nobody can
+ * be sleeping on it, e.g. by objects that keep a wchan across reuse
+ * and give each incarnation a new name.
+ */
+void
+wchan_setname(struct wchan *wc, const char *name)
+{
+	KASSERT(threadlist_isempty(&wc->wc_threads));
+	wc->wc_name = name;
+}
+
 /*
  * Destroy a wait channel. Must be empty and unlocked.
- * (The corresponding cleanup functions require this.)
+ * (The corresponding cleanup functions require this; the wchan goes
+ * back to its cache in that state.)
  */
 void
 wchan_destroy(struct wchan *wc)
 {
-	spinlock_cleanup(&wc->wc_lock);
-	threadlist_cleanup(&wc->wc_threads);
-	kfree(wc);
+	KASSERT(threadlist_isempty(&wc->wc_threads));
+	KASSERT(!spinlock_do_i_hold(&wc->wc_lock));
+	wc->wc_name = NULL;
+	slab_free(&wchan_cache, wc);
 }
 
 /*
@@ -75,13 +75,21 @@ dev_close(struct vnode *v)
 
 /*
  * Called when the vnode refcount reaches zero.
- * Do nothing; devices are permanent.
+ * Do nothing; devices are permanent. If someone picked up a new
+ * reference meanwhile, consume the one we were handed.
  */
 static
 int
 dev_reclaim(struct vnode *v)
 {
-	(void)v;
+	spinlock_acquire(&v->vn_countlock);
+	if (v->vn_refcount > 1) {
+		v->vn_refcount--;
+		spinlock_release(&v->vn_countlock);
+		return EBUSY;
+	}
+	spinlock_release(&v->vn_countlock);
+
 	/* nothing - device continues to exist even when not in use */
 	return 0;
 }
@@ -265,6 +265,7 @@ int
 vfs_lookup(char *path, struct vnode **retval)
 {
 	struct vnode *startvn;
+	unsigned gen;
 	int result;
 
 	vfs_biglock_acquire();
@@ -281,7 +282,28 @@ vfs_lookup(char *path, struct vnode **retval)
 		return 0;
 	}
 
-	result = VOP_LOOKUP(startvn, path, retval);
+	/*
+	 * Single names (no slashes) go through the name cache. Note
+	 * that VOP_LOOKUP doesn't modify a path with no slashes in it,
+	 * so it's still intact to enter afterwards.
+	 */
+	if (strchr(path, '/') == NULL) {
+		if (vfs_ncache_lookup(startvn, path, retval, &gen)) {
+			result = (*retval == NULL) ? ENOENT : 0;
+		}
+		else {
+			result = VOP_LOOKUP(startvn, path, retval);
+			if (result == 0) {
+				vfs_ncache_enter(startvn, path, *retval, gen);
+			}
+			else if (result == ENOENT) {
+				vfs_ncache_enter(startvn, path, NULL, gen);
+			}
+		}
+	}
+	else {
+		result = VOP_LOOKUP(startvn, path, retval);
+	}
 
 	VOP_DECREF(startvn);
 	vfs_biglock_release();
@@ -0,0 +1,432 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * VFS name cache.
+ *
+ * This remembers the results of recent VOP_LOOKUP calls, keyed by
+ * (directory vnode, name), so that repeated lookups of the same names
+ * (e.g. exec'ing the same programs over and over from a shell) don't
+ * have to scan the directory again each time. Failed lookups are
+ * remembered too, as negative entries, because searching for a name
+ * that isn't there costs a full scan of the directory.
+ *
+ * Only filesystems that set fs_namecache are cached. Such a
+ * filesystem must call vfs_ncache_remove for every name it adds to or
+ * removes from a directory, before anyone can see the change.
+ *
+ * Each entry holds a reference to its directory and (unless it's a
+ * negative entry) to the vnode it names. The entries are kept in a
+ * fixed-size pool, hashed on (directory, name) and on an LRU list
+ * for replacement. Everything is covered by one spinlock; since
+ * dropping a vnode reference can sleep (it may reclaim the vnode),
+ * references are only ever released after the spinlock is dropped.
+ *
+ * A lookup that misses the cache goes off to the filesystem without
+ * holding the spinlock, so the directory can change underneath it.
+ * To keep from entering a stale result, every invalidation bumps a
+ * generation count; the lookup notes the count when it misses and
+ * vfs_ncache_enter discards the result if the count has moved.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vfs.h>
+#include <fs.h>
+#include <vnode.h>
+
+/* Longest name we cache, including the terminating nul. */
+#define NC_NAMELEN	32
+
+/* Number of entries in the pool. */
+#define NC_NENTRIES	128
+
+/* Number of hash buckets; must be a power of 2. */
+#define NC_HASHSIZE	64
+
+struct ncentry {
+	struct vnode *nc_dir;		/* directory; NULL if entry unused */
+	struct vnode *nc_vn;		/* vnode named; NULL if negative */
+	char nc_name[NC_NAMELEN];	/* the name */
+	struct ncentry *nc_hashnext;	/* hash chain */
+	struct ncentry *nc_lruprev;	/* LRU list (more recently used) */
+	struct ncentry *nc_lrunext;	/* LRU list (less recently used) */
+};
+
+static struct ncentry ncache[NC_NENTRIES];
+static struct ncentry *ncache_hash[NC_HASHSIZE];
+static struct ncentry *ncache_lruhead, *ncache_lrutail;
+static unsigned ncache_gen;
+static struct spinlock ncache_lock = SPINLOCK_INITIALIZER;
+
+/* Statistics */
+static unsigned ncache_hits, ncache_neghits, ncache_misses;
+
+////////////////////////////////////////////////////////////
+// LRU list and hash table handling
+
+/*
+ * Hash function on (directory, name).
+ */
+static
+unsigned
+ncache_hashfunc(struct vnode *dir, const char *name)
+{
+	unsigned hash;
+
+	hash = (unsigned)(uintptr_t)dir >> 4;
+	while (*name) {
+		hash = hash*33 + (unsigned char)*name;
+		name++;
+	}
+	return hash & (NC_HASHSIZE - 1);
+}
+
+/*
+ * Take an entry off the LRU list.
+ */
+static
+void
+ncache_lruremove(struct ncentry *nc)
+{
+	if (nc->nc_lruprev != NULL) {
+		nc->nc_lruprev->nc_lrunext = nc->nc_lrunext;
+	}
+	else {
+		ncache_lruhead = nc->nc_lrunext;
+	}
+	if (nc->nc_lrunext != NULL) {
+		nc->nc_lrunext->nc_lruprev = nc->nc_lruprev;
+	}
+	else {
+		ncache_lrutail = nc->nc_lruprev;
+	}
+	nc->nc_lruprev = nc->nc_lrunext = NULL;
+}
+
+/*
+ * Put an entry at the most-recently-used end of the LRU list.
+ */
+static
+void
+ncache_lrufront(struct ncentry *nc)
+{
+	nc->nc_lruprev = NULL;
+	nc->nc_lrunext = ncache_lruhead;
+	if (ncache_lruhead != NULL) {
+		ncache_lruhead->nc_lruprev = nc;
+	}
+	else {
+		ncache_lrutail = nc;
+	}
+	ncache_lruhead = nc;
+}
+
+/*
+ * Put an entry at the least-recently-used end of the LRU list, so
+ * it's the next one reused.
+ */
+static
+void
+ncache_lruback(struct ncentry *nc)
+{
+	nc->nc_lrunext = NULL;
+	nc->nc_lruprev = ncache_lrutail;
+	if (ncache_lrutail != NULL) {
+		ncache_lrutail->nc_lrunext = nc;
+	}
+	else {
+		ncache_lruhead = nc;
+	}
+	ncache_lrutail = nc;
+}
+
+/*
+ * Find the entry for (DIR, NAME), or return NULL.
+ */
+static
+struct ncentry *
+ncache_find(struct vnode *dir, const char *name)
+{
+	struct ncentry *nc;
+
+	KASSERT(spinlock_do_i_hold(&ncache_lock));
+
+	nc = ncache_hash[ncache_hashfunc(dir, name)];
+	while (nc != NULL) {
+		if (nc->nc_dir == dir && !strcmp(nc->nc_name, name)) {
+			return nc;
+		}
+		nc = nc->nc_hashnext;
+	}
+	return NULL;
+}
+
+/*
+ * Discard an entry: take it out of the hash table, mark it unused,
+ * and move it to the back of the LRU list. The references it held
+ * are handed back through DIRRET and VNRET for the caller to release
+ * once it has dropped the spinlock.
+ */
+static
+void
+ncache_drop(struct ncentry *nc, struct vnode **dirret, struct vnode **vnret)
+{
+	struct ncentry **pp;
+
+	KASSERT(spinlock_do_i_hold(&ncache_lock));
+	KASSERT(nc->nc_dir != NULL);
+
+	pp = &ncache_hash[ncache_hashfunc(nc->nc_dir, nc->nc_name)];
+	while (*pp != nc) {
+		KASSERT(*pp != NULL);
+		pp = &(*pp)->nc_hashnext;
+	}
+	*pp = nc->nc_hashnext;
+	nc->nc_hashnext = NULL;
+
+	*dirret = nc->nc_dir;
+	*vnret = nc->nc_vn;
+	nc->nc_dir = NULL;
+	nc->nc_vn = NULL;
+	nc->nc_name[0] = 0;
+
+	ncache_lruremove(nc);
+	ncache_lruback(nc);
+}
+
+/*
+ * Release the references returned by ncache_drop.
+ */
+static
+void
+ncache_release(struct vnode *dir, struct vnode *vn)
+{
+	if (vn != NULL) {
+		VOP_DECREF(vn);
+	}
+	if (dir != NULL) {
+		VOP_DECREF(dir);
+	}
+}
+
+/*
+ * Check if a lookup of NAME in DIR is something we cache.
+ */
+static
+bool
+ncache_cacheable(struct vnode *dir, const char *name)
+{
+	if (dir->vn_fs == NULL || !dir->vn_fs->fs_namecache) {
+		return false;
+	}
+	if (strlen(name) >= NC_NAMELEN) {
+		return false;
+	}
+	return true;
+}
+
+////////////////////////////////////////////////////////////
+// Interface
+
+/*
+ * Set up the entries.
+ */
+void
+vfs_ncache_bootstrap(void)
+{
+	unsigned i;
+
+	for (i=0; i<NC_HASHSIZE; i++) {
+		ncache_hash[i] = NULL;
+	}
+	ncache_lruhead = ncache_lrutail = NULL;
+	for (i=0; i<NC_NENTRIES; i++) {
+		ncache[i].nc_dir = NULL;
+		ncache[i].nc_vn = NULL;
+		ncache[i].nc_name[0] = 0;
+		ncache[i].nc_hashnext = NULL;
+		ncache_lruback(&ncache[i]);
+	}
+	ncache_gen = 0;
+}
+
+/*
+ * Look up NAME in DIR. Returns true if the cache knows the answer,
+ * in which case *RET is set to the vnode (with a reference added)
+ * or to NULL if the name is known not to exist. Otherwise returns
+ * false and stores in *GEN the generation to pass to vfs_ncache_enter
+ * with the filesystem's answer.
+ */
+bool
+vfs_ncache_lookup(struct vnode *dir, const char *name,
+		  struct vnode **ret, unsigned *gen)
+{
+	struct ncentry *nc;
+
+	if (!ncache_cacheable(dir, name)) {
+		*gen = 0;
+		return false;
+	}
+
+	spinlock_acquire(&ncache_lock);
+	nc = ncache_find(dir, name);
+	if (nc == NULL) {
+		ncache_misses++;
+		*gen = ncache_gen;
+		spinlock_release(&ncache_lock);
+		return false;
+	}
+
+	ncache_lruremove(nc);
+	ncache_lrufront(nc);
+	if (nc->nc_vn != NULL) {
+		VOP_INCREF(nc->nc_vn);
+		ncache_hits++;
+	}
+	else {
+		ncache_neghits++;
+	}
+	*ret = nc->nc_vn;
+	spinlock_release(&ncache_lock);
+	return true;
+}
+
+/*
+ * Record that NAME in DIR is VN, or doesn't exist if VN is NULL. GEN
+ * is what vfs_ncache_lookup handed back when it missed; if anything
+ * was invalidated since, the answer may already be stale and is
+ * thrown away.
+ */
+void
+vfs_ncache_enter(struct vnode *dir, const char *name, struct vnode *vn,
+		 unsigned gen)
+{
+	struct ncentry *nc;
+	struct vnode *olddir = NULL, *oldvn = NULL;
+
+	if (!ncache_cacheable(dir, name)) {
+		return;
+	}
+
+	spinlock_acquire(&ncache_lock);
+	if (gen != ncache_gen || ncache_find(dir, name) != NULL) {
+		/* stale, or someone else got here first */
+		spinlock_release(&ncache_lock);
+		return;
+	}
+
+	nc = ncache_lrutail;
+	KASSERT(nc != NULL);
+	if (nc->nc_dir != NULL) {
+		ncache_drop(nc, &olddir, &oldvn);
+	}
+
+	VOP_INCREF(dir);
+	if (vn != NULL) {
+		VOP_INCREF(vn);
+	}
+	nc->nc_dir = dir;
+	nc->nc_vn = vn;
+	strcpy(nc->nc_name, name);
+
+	nc->nc_hashnext = ncache_hash[ncache_hashfunc(dir, name)];
+	ncache_hash[ncache_hashfunc(dir, name)] = nc;
+	ncache_lruremove(nc);
+	ncache_lrufront(nc);
+	spinlock_release(&ncache_lock);
+
+	ncache_release(olddir, oldvn);
+}
+
+/*
+ * Forget whatever we know about NAME in DIR. Called by the filesystem
+ * whenever it creates or removes a directory entry.
+ */
+void
+vfs_ncache_remove(struct vnode *dir, const char *name)
+{
+	struct ncentry *nc;
+	struct vnode *olddir = NULL, *oldvn = NULL;
+
+	spinlock_acquire(&ncache_lock);
+	ncache_gen++;
+	nc = ncache_find(dir, name);
+	if (nc != NULL) {
+		ncache_drop(nc, &olddir, &oldvn);
+	}
+	spinlock_release(&ncache_lock);
+
+	ncache_release(olddir, oldvn);
+}
+
+/*
+ * Drop all entries for filesystem FS, so the references they hold
+ * don't keep it from being unmounted.
+ */
+void
+vfs_ncache_purgefs(struct fs *fs)
+{
+	struct vnode *olddir, *oldvn;
+	unsigned i;
+
+	spinlock_acquire(&ncache_lock);
+	ncache_gen++;
+	for (i=0; i<NC_NENTRIES; i++) {
+		if (ncache[i].nc_dir == NULL || ncache[i].nc_dir->vn_fs != fs) {
+			continue;
+		}
+		ncache_drop(&ncache[i], &olddir, &oldvn);
+		spinlock_release(&ncache_lock);
+
+		ncache_release(olddir, oldvn);
+
+		spinlock_acquire(&ncache_lock);
+	}
+	spinlock_release(&ncache_lock);
+}
+
+/*
+ * Print statistics.
+ */
+void
+vfs_ncache_stats(void)
+{
+	unsigned hits, neghits, misses;
+
+	spinlock_acquire(&ncache_lock);
+	hits = ncache_hits;
+	neghits = ncache_neghits;
+	misses = ncache_misses;
+	spinlock_release(&ncache_lock);
+
+	kprintf("vfs name cache: %u hits, %u negative hits, %u misses\n",
+		hits, neghits, misses);
+}
@@ -30,7 +30,11 @@
 #include <types.h>
 #include <lib.h>
 #include <spinlock.h>
+#include <spl.h>
+#include <cpu.h>
+#include <current.h>
 #include <vm.h>
+#include "opt-kmtrack.h"
 
 /*
  * Kernel malloc.
@@ -189,16 +193,111 @@ static struct pageref *allbase;
 ////////////////////////////////////////
 
 /*
- * Use one spinlock for the whole thing. Making parts of the kmalloc
- * logic per-cpu is worthwhile for scalability; however, for the time
- * being at least we won't, because it adds a lot of complexity and in
- * OS/161 performance and scalability aren't super-critical.
+ * Use one spinlock for all the shared state. The common cases don't
+ * get this far; see the per-cpu caches below.
  */
 
 static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
 
 ////////////////////////////////////////
 
+/*
+ * Page map.
+ *
+ * For each page of physical memory (up to KMALLOC_MAPPAGES of them)
+ * record which pageref, if any, manages it: 0 for none, otherwise the
+ * index into pagerefs[] plus one. This lets kfree find the pageref
+ * for a block without walking allbase under the lock.
+ *
+ * Entries are only changed with kmalloc_spinlock held, when a page
+ * is handed to or taken away from the subpage allocator. A page with
+ * a live block on it can't be taken away, so kfree can read the entry
+ * for the block it's freeing without the lock.
+ *
+ * Pages above the end of the map fall back to the list walk.
+ */
+
+#define KMALLOC_MAPPAGES 4096	/* 16M */
+static uint16_t kmalloc_pagemap[KMALLOC_MAPPAGES];
+
+static
+inline
+bool
+kmalloc_pagemapped(vaddr_t addr, unsigned *index)
+{
+	paddr_t pa = KVADDR_TO_PADDR(addr);
+
+	*index = pa / PAGE_SIZE;
+	return *index < KMALLOC_MAPPAGES;
+}
+
+static
+void
+kmalloc_setpagemap(vaddr_t prpage, struct pageref *pr)
+{
+	unsigned index;
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+	if (kmalloc_pagemapped(prpage, &index)) {
+		kmalloc_pagemap[index] = pr == NULL ? 0 : (pr - pagerefs) + 1;
+	}
+}
+
+////////////////////////////////////////
+
+/*
+ * Per-cpu caches.
+ *
+ * Each cpu keeps a short freelist of blocks for each of the smaller
+ * block sizes. kmalloc and kfree work on the current cpu's list with
+ * interrupts off, which is enough to keep other threads on this cpu
+ * out and keeps us from migrating; other cpus never touch it. So the
+ * common case needs no lock at all.
+ *
+ * When a list runs dry it is refilled with kmcache_batch[] blocks
+ * taken from the pagerefs under kmalloc_spinlock in one go; when it
+ * grows past twice that, a batch is handed back the same way. The
+ * larger sizes aren't cached (batch 0), since a handful of those per
+ * cpu would tie up a lot of memory.
+ *
+ * Blocks sitting in a cache count as allocated as far as the pagerefs
+ * are concerned, so pages can stay around until the cache gives the
+ * blocks back.
+ */
+
+#define KMCACHE_MAXCPUS 32
+
+static const unsigned kmcache_batch[NSIZES] = { 16, 16, 8, 8, 4, 2, 0, 0 };
+
+struct kmcache {
+	struct freelist *kc_list[NSIZES];
+	unsigned kc_count[NSIZES];
+};
+
+static struct kmcache kmcaches[KMCACHE_MAXCPUS];
+
+/*
+ * Get the current cpu's cache, or NULL if there isn't one (early in
+ * boot, or too many cpus). Interrupts must be off.
+ */
+static
+struct kmcache *
+kmcache_get(void)
+{
+	struct cpu *c;
+
+	if (!CURCPU_EXISTS()) {
+		return NULL;
+	}
+	c = curcpu;
+	if (c == NULL || c->c_number >= KMCACHE_MAXCPUS) {
+		return NULL;
+	}
+	return &kmcaches[c->c_number];
+}
+
+////////////////////////////////////////
+
 /* SLOWER implies SLOW */
 #ifdef SLOWER
 #ifndef SLOW
@@ -334,6 +433,7 @@ void
 kheap_printstats(void)
 {
 	struct pageref *pr;
+	unsigned i, j;
 
 	/* print the whole thing with interrupts off */
 	spinlock_acquire(&kmalloc_spinlock);
@@ -344,6 +444,17 @@ kheap_printstats(void)
 		dumpsubpage(pr);
 	}
 
+	/* Other cpus' counts may be slightly stale; that's fine here. */
+	for (i=0; i<KMCACHE_MAXCPUS; i++) {
+		for (j=0; j<NSIZES; j++) {
+			if (kmcaches[i].kc_count[j] > 0) {
+				kprintf("cpu%u: %u blocks of size %lu cached\n",
+					i, kmcaches[i].kc_count[j],
+					(unsigned long) sizes[j]);
+			}
+		}
+	}
+
 	spinlock_release(&kmalloc_spinlock);
 }
 
@@ -392,6 +503,113 @@ int blocktype(size_t sz)
 	return 0;
 }
 
+/*
+ * Take one block off the freelist of PR, which must have one.
+ */
+static
+void *
+subpage_takeblock(struct pageref *pr)
+{
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	vaddr_t fla;		// free list entry address
+	struct freelist *fl;	// free list entry
+	void *retptr;		// our result
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+	KASSERT(pr->nfree > 0);
+	KASSERT(pr->freelist_offset < PAGE_SIZE);
+
+	prpage = PR_PAGEADDR(pr);
+	fla = prpage + pr->freelist_offset;
+	fl = (struct freelist *)fla;
+
+	retptr = fl;
+	fl = fl->next;
+	pr->nfree--;
+
+	if (fl != NULL) {
+		KASSERT(pr->nfree > 0);
+		fla = (vaddr_t)fl;
+		KASSERT(fla - prpage < PAGE_SIZE);
+		pr->freelist_offset = fla - prpage;
+	}
+	else {
+		KASSERT(pr->nfree == 0);
+		pr->freelist_offset = INVALID_OFFSET;
+	}
+
+	return retptr;
+}
+
+/*
+ * Put a block back on the freelist of PR. If that makes the whole
+ * page free, take the page out of the allocator and return its
+ * address, which the caller must pass to free_kpages after releasing
+ * kmalloc_spinlock. Otherwise return 0.
+ */
+static
+vaddr_t
+subpage_putblock(struct pageref *pr, void *ptr)
+{
+	int blktype;		// index into sizes[] that we're using
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	vaddr_t offset;		// offset into page
+	struct freelist *fl;	// free list entry
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
+	offset = (vaddr_t)ptr - prpage;
+
+	fl = ptr;
+	if (pr->freelist_offset == INVALID_OFFSET) {
+		fl->next = NULL;
+	} else {
+		fl->next = (struct freelist *)(prpage + pr->freelist_offset);
+	}
+	pr->freelist_offset = offset;
+	pr->nfree++;
+
+	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
+	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
+		/* Whole page is free. */
+		remove_lists(pr, blktype);
+		kmalloc_setpagemap(prpage, NULL);
+		freepageref(pr);
+		return prpage;
+	}
+	return 0;
+}
+
+/*
+ * Check that PTR is a sensible block to free on the page managed by
+ * PR, and scribble on it.
+ */
+static
+void
+subpage_checkfree(struct pageref *pr, void *ptr)
+{
+	int blktype = PR_BLOCKTYPE(pr);
+	vaddr_t offset = (vaddr_t)ptr - PR_PAGEADDR(pr);
+
+	/* Check for proper positioning and alignment */
+	if (offset >= PAGE_SIZE || offset % sizes[blktype] != 0) {
+		panic("kfree: subpage free of invalid addr %p\n", ptr);
+	}
+
+	/*
+	 * Clear the block to 0xdeadbeef to make it easier to detect
+	 * uses of dangling pointers.
+	 */
+	fill_deadbeef(ptr, sizes[blktype]);
+
+	/*
+	 * We probably ought to check for free twice by seeing if the block
+	 * is already on the free list. But that's expensive, so we don't.
+	 */
+}
+
 static
 void *
 subpage_kmalloc(size_t sz)
@@ -423,25 +641,7 @@ subpage_kmalloc(size_t sz)
 
 		doalloc: /* comes here after getting a whole fresh page */
 
-			KASSERT(pr->freelist_offset < PAGE_SIZE);
-			prpage = PR_PAGEADDR(pr);
-			fla = prpage + pr->freelist_offset;
-			fl = (struct freelist *)fla;
-
-			retptr = fl;
-			fl = fl->next;
-			pr->nfree--;
-
-			if (fl != NULL) {
-				KASSERT(pr->nfree > 0);
-				fla = (vaddr_t)fl;
-				KASSERT(fla - prpage < PAGE_SIZE);
-				pr->freelist_offset = fla - prpage;
-			}
-			else {
-				KASSERT(pr->nfree == 0);
-				pr->freelist_offset = INVALID_OFFSET;
-			}
+			retptr = subpage_takeblock(pr);
 
 			checksubpages();
 
@@ -504,6 +704,8 @@ subpage_kmalloc(size_t sz)
 	pr->next_all = allbase;
 	allbase = pr;
 
+	kmalloc_setpagemap(prpage, pr);
+
 	/* This is kind of cheesy, but avoids duplicating the alloc code. */
 	goto doalloc;
 }
@@ -516,9 +718,6 @@ subpage_kfree(void *ptr)
 	vaddr_t ptraddr;	// same as ptr
 	struct pageref *pr;	// pageref for page we're freeing in
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
-	vaddr_t fla;		// free list entry address
-	struct freelist *fl;	// free list entry
-	vaddr_t offset;		// offset into page
 
 	ptraddr = (vaddr_t)ptr;
 
@@ -545,62 +744,394 @@ subpage_kfree(void *ptr)
 		return -1;
 	}
 
-	offset = ptraddr - prpage;
+	subpage_checkfree(pr, ptr);
 
-	/* Check for proper positioning and alignment */
-	if (offset >= PAGE_SIZE || offset % sizes[blktype] != 0) {
-		panic("kfree: subpage free of invalid addr %p\n", ptr);
+	prpage = subpage_putblock(pr, ptr);
+
+	/* Call free_kpages without kmalloc_spinlock. */
+	spinlock_release(&kmalloc_spinlock);
+	if (prpage != 0) {
+		free_kpages(prpage);
 	}
 
-	/*
-	 * Clear the block to 0xdeadbeef to make it easier to detect
-	 * uses of dangling pointers.
-	 */
-	fill_deadbeef(ptr, sizes[blktype]);
+#ifdef SLOWER /* Don't get the lock unless checksubpages does something. */
+	spinlock_acquire(&kmalloc_spinlock);
+	checksubpages();
+	spinlock_release(&kmalloc_spinlock);
+#endif
 
-	/*
-	 * We probably ought to check for free twice by seeing if the block
-	 * is already on the free list. But that's expensive, so we don't.
-	 */
+	return 0;
+}
 
-	fla = prpage + offset;
-	fl = (struct freelist *)fla;
-	if (pr->freelist_offset == INVALID_OFFSET) {
-		fl->next = NULL;
-	} else {
-		fl->next = (struct freelist *)(prpage + pr->freelist_offset);
-	}
-	pr->freelist_offset = offset;
-	pr->nfree++;
+/*
+ * Free a block whose pageref is already known (from the page map).
+ */
+static
+void
+subpage_freeblock(struct pageref *pr, void *ptr)
+{
+	vaddr_t prpage;
 
-	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
-	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
-		/* Whole page is free. */
-		remove_lists(pr, blktype);
-		freepageref(pr);
-		/* Call free_kpages without kmalloc_spinlock. */
-		spinlock_release(&kmalloc_spinlock);
+	spinlock_acquire(&kmalloc_spinlock);
+	prpage = subpage_putblock(pr, ptr);
+	checksubpages();
+	spinlock_release(&kmalloc_spinlock);
+
+	if (prpage != 0) {
 		free_kpages(prpage);
 	}
-	else {
-		spinlock_release(&kmalloc_spinlock);
+}
+
+////////////////////////////////////////
+
+/*
+ * Refill the cache list for BLKTYPE with up to a batch of blocks from
+ * pages that already exist. Doesn't get new pages; if there aren't
+ * any free blocks, the list stays empty.
+ */
+static
+void
+kmcache_refill(struct kmcache *kc, unsigned blktype)
+{
+	struct pageref *pr;
+	struct freelist *fl;
+
+	spinlock_acquire(&kmalloc_spinlock);
+	checksubpages();
+	for (pr = sizebases[blktype]; pr != NULL; pr = pr->next_samesize) {
+		KASSERT(PR_BLOCKTYPE(pr) == blktype);
+		while (pr->nfree > 0 &&
+		       kc->kc_count[blktype] < kmcache_batch[blktype]) {
+			fl = subpage_takeblock(pr);
+			fl->next = kc->kc_list[blktype];
+			kc->kc_list[blktype] = fl;
+			kc->kc_count[blktype]++;
+		}
+		if (kc->kc_count[blktype] == kmcache_batch[blktype]) {
+			break;
+		}
 	}
+	checksubpages();
+	spinlock_release(&kmalloc_spinlock);
+}
 
-#ifdef SLOWER /* Don't get the lock unless checksubpages does something. */
+/*
+ * Hand a batch of blocks from the cache list for BLKTYPE back to
+ * their pages. Pages that become free are stored in FREEPAGES (which
+ * must hold a batch) for the caller to release once interrupts are
+ * back on; returns how many.
+ */
+static
+unsigned
+kmcache_flush(struct kmcache *kc, unsigned blktype, vaddr_t *freepages)
+{
+	struct freelist *fl;
+	struct pageref *pr;
+	unsigned i, index, nfreepages;
+	vaddr_t prpage;
+
+	nfreepages = 0;
 	spinlock_acquire(&kmalloc_spinlock);
+	for (i=0; i<kmcache_batch[blktype]; i++) {
+		fl = kc->kc_list[blktype];
+		KASSERT(fl != NULL);
+		kc->kc_list[blktype] = fl->next;
+		kc->kc_count[blktype]--;
+
+		/* Only blocks on mapped pages get cached; see kfree. */
+		if (!kmalloc_pagemapped((vaddr_t)fl, &index)) {
+			panic("kmalloc: cached block %p not in page map\n",
+			      fl);
+		}
+		KASSERT(kmalloc_pagemap[index] != 0);
+		pr = &pagerefs[kmalloc_pagemap[index] - 1];
+		KASSERT(PR_BLOCKTYPE(pr) == blktype);
+
+		prpage = subpage_putblock(pr, fl);
+		if (prpage != 0) {
+			freepages[nfreepages++] = prpage;
+		}
+	}
 	checksubpages();
 	spinlock_release(&kmalloc_spinlock);
+	return nfreepages;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Allocation tracking (options kmtrack).
+//
+// Every live kmalloc block, subpage or multipage, gets a record of
+// who allocated it (the return address of the kmalloc call), how
+// big it is, when (in hardclock ticks on the allocating cpu), and
+// which generation it belongs to. kheap_nextgeneration starts a new
+// generation; the kernel does so once at the end of boot, so at
+// shutdown kheap_leakreport can list everything allocated since
+// boot that's still around.
+//
+// The records come from a fixed table so tracking never calls back
+// into kmalloc. If it fills up, further blocks go untracked and are
+// counted instead.
+//
+
+#if OPT_KMTRACK
+
+#define KMTRACK_MAX	2048	/* live blocks tracked */
+#define KMTRACK_HASH	257	/* hash buckets */
+#define KMTRACK_SITES	64	/* callsites in a report */
+
+struct kmtrack {
+	struct kmtrack *kt_next;	/* hash chain or free list */
+	void *kt_ptr;			/* the block */
+	const void *kt_caller;		/* kmalloc's return address */
+	size_t kt_size;			/* size requested */
+	unsigned kt_time;		/* hardclock ticks */
+	unsigned kt_generation;
+};
+
+struct kmsite {
+	const void *ks_caller;
+	unsigned ks_count;
+	size_t ks_bytes;
+	unsigned ks_oldest;		/* earliest kt_time */
+};
+
+static struct kmtrack kmtrack_pool[KMTRACK_MAX];
+static struct kmtrack *kmtrack_free;
+static struct kmtrack *kmtrack_table[KMTRACK_HASH];
+static bool kmtrack_inited;
+static unsigned kmtrack_generation;
+static unsigned kmtrack_untracked;	/* live blocks we couldn't record */
+static size_t kmtrack_livebytes;
+static struct kmsite kmtrack_sites[KMTRACK_SITES];
+
+/* Leaf lock; nothing else is taken while holding it. */
+static struct spinlock kmtrack_lock = SPINLOCK_INITIALIZER;
+
+static
+inline
+unsigned
+kmtrack_hash(const void *ptr)
+{
+	return ((vaddr_t)ptr >> 4) % KMTRACK_HASH;
+}
+
+static
+void
+kmtrack_init(void)
+{
+	unsigned i;
+
+	KASSERT(spinlock_do_i_hold(&kmtrack_lock));
+	kmtrack_free = NULL;
+	for (i=0; i<KMTRACK_MAX; i++) {
+		kmtrack_pool[i].kt_next = kmtrack_free;
+		kmtrack_free = &kmtrack_pool[i];
+	}
+	kmtrack_inited = true;
+}
+
+static
+void
+kmtrack_add(void *ptr, size_t size, const void *caller)
+{
+	struct kmtrack *kt;
+	unsigned h;
+
+	spinlock_acquire(&kmtrack_lock);
+	if (!kmtrack_inited) {
+		kmtrack_init();
+	}
+	kt = kmtrack_free;
+	if (kt == NULL) {
+		kmtrack_untracked++;
+		spinlock_release(&kmtrack_lock);
+		return;
+	}
+	kmtrack_free = kt->kt_next;
+
+	kt->kt_ptr = ptr;
+	kt->kt_caller = caller;
+	kt->kt_size = size;
+	kt->kt_time = CURCPU_EXISTS() ? curcpu->c_hardclocks : 0;
+	kt->kt_generation = kmtrack_generation;
+
+	h = kmtrack_hash(ptr);
+	kt->kt_next = kmtrack_table[h];
+	kmtrack_table[h] = kt;
+	kmtrack_livebytes += size;
+	spinlock_release(&kmtrack_lock);
+}
+
+static
+void
+kmtrack_remove(void *ptr)
+{
+	struct kmtrack **ktp, *kt;
+
+	spinlock_acquire(&kmtrack_lock);
+	for (ktp = &kmtrack_table[kmtrack_hash(ptr)]; *ktp != NULL;
+	     ktp = &(*ktp)->kt_next) {
+		kt = *ktp;
+		if (kt->kt_ptr == ptr) {
+			*ktp = kt->kt_next;
+			KASSERT(kmtrack_livebytes >= kt->kt_size);
+			kmtrack_livebytes -= kt->kt_size;
+			kt->kt_next = kmtrack_free;
+			kmtrack_free = kt;
+			spinlock_release(&kmtrack_lock);
+			return;
+		}
+	}
+	/* Must be one of the ones we couldn't record. */
+	if (kmtrack_untracked > 0) {
+		kmtrack_untracked--;
+	}
+	spinlock_release(&kmtrack_lock);
+}
+
+/*
+ * Print live blocks from generation MINGEN on, grouped by callsite
+ * and largest first.
+ */
+static
+void
+kmtrack_report(unsigned mingen)
+{
+	struct kmtrack *kt;
+	struct kmsite tmp;
+	unsigned i, j, nsites, other, count;
+	size_t bytes, otherbytes;
+
+	/* print the whole thing with interrupts off, like kheap_printstats */
+	spinlock_acquire(&kmtrack_lock);
+
+	nsites = 0;
+	other = 0;
+	otherbytes = 0;
+	count = 0;
+	bytes = 0;
+	for (i=0; i<KMTRACK_HASH; i++) {
+		for (kt = kmtrack_table[i]; kt != NULL; kt = kt->kt_next) {
+			if (kt->kt_generation < mingen) {
+				continue;
+			}
+			count++;
+			bytes += kt->kt_size;
+			for (j=0; j<nsites; j++) {
+				if (kmtrack_sites[j].ks_caller == kt->kt_caller) {
+					break;
+				}
+			}
+			if (j == nsites) {
+				if (nsites == KMTRACK_SITES) {
+					other++;
+					otherbytes += kt->kt_size;
+					continue;
+				}
+				kmtrack_sites[j].ks_caller = kt->kt_caller;
+				kmtrack_sites[j].ks_count = 0;
+				kmtrack_sites[j].ks_bytes = 0;
+				kmtrack_sites[j].ks_oldest = kt->kt_time;
+				nsites++;
+			}
+			kmtrack_sites[j].ks_count++;
+			kmtrack_sites[j].ks_bytes += kt->kt_size;
+			if (kt->kt_time < kmtrack_sites[j].ks_oldest) {
+				kmtrack_sites[j].ks_oldest = kt->kt_time;
+			}
+		}
+	}
+
+	/* insertion sort by bytes, descending */
+	for (i=1; i<nsites; i++) {
+		tmp = kmtrack_sites[i];
+		for (j=i; j>0 && kmtrack_sites[j-1].ks_bytes < tmp.ks_bytes;
+		     j--) {
+			kmtrack_sites[j] = kmtrack_sites[j-1];
+		}
+		kmtrack_sites[j] = tmp;
+	}
+
+	kprintf("%u blocks, %lu bytes live (generation %u on)\n",
+		count, (unsigned long)bytes, mingen);
+	if (nsites > 0) {
+		kprintf("  %-10s %7s %9s %10s\n", "caller", "blocks", "bytes",
+			"oldest");
+	}
+	for (i=0; i<nsites; i++) {
+		kprintf("  0x%08lx %7u %9lu %10u\n",
+			(unsigned long)kmtrack_sites[i].ks_caller,
+			kmtrack_sites[i].ks_count,
+			(unsigned long)kmtrack_sites[i].ks_bytes,
+			kmtrack_sites[i].ks_oldest);
+	}
+	if (other > 0) {
+		kprintf("  (other)    %7u %9lu\n", other,
+			(unsigned long)otherbytes);
+	}
+	if (kmtrack_untracked > 0) {
+		kprintf("%u live blocks not tracked (table full)\n",
+			kmtrack_untracked);
+	}
+
+	spinlock_release(&kmtrack_lock);
+}
+
+#endif /* OPT_KMTRACK */
+
+/*
+ * Start a new allocation generation.
+ */
+void
+kheap_nextgeneration(void)
+{
+#if OPT_KMTRACK
+	spinlock_acquire(&kmtrack_lock);
+	kmtrack_generation++;
+	spinlock_release(&kmtrack_lock);
 #endif
+}
 
-	return 0;
+/*
+ * Print live kmalloc usage by callsite.
+ */
+void
+kheap_dump(void)
+{
+#if OPT_KMTRACK
+	kmtrack_report(0);
+#else
+	kprintf("Enable options kmtrack in the kernel config to use this.\n");
+#endif
+}
+
+/*
+ * Print whatever allocated since boot is still live. Called at
+ * shutdown, after the file systems are unmounted.
+ */
+void
+kheap_leakreport(void)
+{
+#if OPT_KMTRACK
+	kprintf("kmalloc: blocks allocated since boot still live:\n");
+	kmtrack_report(1);
+#endif
 }
 
 //
 ////////////////////////////////////////////////////////////
 
+static
+inline
 void *
-kmalloc(size_t sz)
+kmalloc_untracked(size_t sz)
 {
+	struct kmcache *kc;
+	struct freelist *fl;
+	unsigned blktype;
+	int spl;
+
 	if (sz>=LARGEST_SUBPAGE_SIZE) {
 		unsigned long npages;
 		vaddr_t address;
@@ -615,20 +1146,114 @@ kmalloc(size_t sz)
 		return (void *)address;
 	}
 
+	blktype = blocktype(sz);
+	if (kmcache_batch[blktype] > 0) {
+		spl = splhigh();
+		kc = kmcache_get();
+		if (kc != NULL) {
+			if (kc->kc_count[blktype] == 0) {
+				kmcache_refill(kc, blktype);
+			}
+			fl = kc->kc_list[blktype];
+			if (fl != NULL) {
+				kc->kc_list[blktype] = fl->next;
+				kc->kc_count[blktype]--;
+				/* Restore the scribble kfree put there. */
+				fl->next = (void *)0xdeadbeef;
+				splx(spl);
+				return fl;
+			}
+		}
+		splx(spl);
+	}
+
 	return subpage_kmalloc(sz);
 }
 
+void *
+kmalloc(size_t sz)
+{
+	void *ptr;
+
+	ptr = kmalloc_untracked(sz);
+#if OPT_KMTRACK
+	if (ptr != NULL) {
+		kmtrack_add(ptr, sz, __builtin_return_address(0));
+	}
+#endif
+	return ptr;
+}
+
 void
 kfree(void *ptr)
 {
-	/*
-	 * Try subpage first; if that fails, assume it's a big allocation.
-	 */
+	vaddr_t freepages[16];	/* at least the largest batch */
+	struct kmcache *kc;
+	struct pageref *pr;
+	struct freelist *fl;
+	unsigned index, blktype, i, n;
+	int spl;
+
 	if (ptr == NULL) {
 		return;
-	} else if (subpage_kfree(ptr)) {
+	}
+
+#if OPT_KMTRACK
+	kmtrack_remove(ptr);
+#endif
+
+	if (!kmalloc_pagemapped((vaddr_t)ptr, &index)) {
+		/*
+		 * Not covered by the page map; try subpage first, and
+		 * if that fails, assume it's a big allocation.
+		 */
+		if (subpage_kfree(ptr)) {
+			KASSERT((vaddr_t)ptr%PAGE_SIZE==0);
+			free_kpages((vaddr_t)ptr);
+		}
+		return;
+	}
+
+	if (kmalloc_pagemap[index] == 0) {
+		/* Not on any of our pages - a big allocation */
 		KASSERT((vaddr_t)ptr%PAGE_SIZE==0);
 		free_kpages((vaddr_t)ptr);
+		return;
 	}
-}
 
+	pr = &pagerefs[kmalloc_pagemap[index] - 1];
+	blktype = PR_BLOCKTYPE(pr);
+	KASSERT(blktype < NSIZES);
+
+	subpage_checkfree(pr, ptr);
+
+	if (kmcache_batch[blktype] == 0) {
+		subpage_freeblock(pr, ptr);
+		return;
+	}
+
+	spl = splhigh();
+	kc = kmcache_get();
+	if (kc == NULL) {
+		splx(spl);
+		subpage_freeblock(pr, ptr);
+		return;
+	}
+	fl = ptr;
+	fl->next = kc->kc_list[blktype];
+	kc->kc_list[blktype] = fl;
+	kc->kc_count[blktype]++;
+
+	n = 0;
+	if (kc->kc_count[blktype] > 2 * kmcache_batch[blktype]) {
+		KASSERT(kmcache_batch[blktype] <= sizeof(freepages) /
+			sizeof(freepages[0]));
+		n = kmcache_flush(kc, blktype, freepages);
+	}
+	splx(spl);
+
+	/* Call free_kpages without kmalloc_spinlock or interrupts off. */
+	for (i=0; i<n; i++) {
+		free_kpages(freepages[i]);
+	}
+}
@@ -0,0 +1,392 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Slab object caches. See slab.h.
+ *
+ * Each slab is one page. The page starts with a struct slab, followed
+ * by a stack of the indexes of the free objects in it, followed by
+ * the objects themselves. Keeping the free list outside the objects
+ * is what lets them stay constructed while free. Since the header is
+ * at the start of the page, the slab for an object is found by
+ * rounding its address down.
+ *
+ * Slabs with free objects are kept on the cache's sc_slabs list; full
+ * slabs aren't on any list. At most SLAB_MAXEMPTY completely unused
+ * slabs are kept around; past that, an empty slab is destroyed and
+ * its page handed back.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vm.h>
+#include <slab.h>
+
+/* Completely empty slabs kept per cache */
+#define SLAB_MAXEMPTY	1
+
+/* Object alignment */
+#define SLAB_ALIGN	8
+
+struct slab {
+	struct slabcache *sl_cache;	/* cache we belong to */
+	struct slab *sl_next;		/* links on sc_slabs */
+	struct slab *sl_prev;
+	unsigned sl_nfree;		/* number of free objects */
+	uint16_t sl_free[];		/* stack of free object indexes */
+};
+
+/* All caches that have been used, for slab_printstats. */
+static struct slabcache *slab_allcaches;
+static struct spinlock slab_listlock = SPINLOCK_INITIALIZER;
+
+////////////////////////////////////////////////////////////
+// Layout and slab construction
+
+/*
+ * Work out how to lay out a page for this cache, and add it to the
+ * list of caches. Called on first use.
+ */
+static
+void
+slab_layout(struct slabcache *sc)
+{
+	size_t stride, hdr;
+	unsigned n;
+
+	stride = sc->sc_size < SLAB_ALIGN ? SLAB_ALIGN : sc->sc_size;
+	stride = ROUNDUP(stride, SLAB_ALIGN);
+
+	n = (PAGE_SIZE - sizeof(struct slab)) / (stride + sizeof(uint16_t));
+	while (n > 0) {
+		hdr = ROUNDUP(sizeof(struct slab) + n * sizeof(uint16_t),
+			      SLAB_ALIGN);
+		if (hdr + n * stride <= PAGE_SIZE) {
+			break;
+		}
+		n--;
+	}
+	if (n == 0) {
+		panic("slab: %s: object size %lu too large\n",
+		      sc->sc_name, (unsigned long)sc->sc_size);
+	}
+
+	spinlock_acquire(&sc->sc_lock);
+	if (!sc->sc_ready) {
+		sc->sc_stride = stride;
+		sc->sc_objoffset = hdr;
+		sc->sc_perslab = n;
+		sc->sc_slabs = NULL;
+		sc->sc_nslabs = 0;
+		sc->sc_nempty = 0;
+		sc->sc_inuse = 0;
+		sc->sc_allocs = 0;
+		sc->sc_grows = 0;
+		sc->sc_ready = true;
+		spinlock_release(&sc->sc_lock);
+
+		spinlock_acquire(&slab_listlock);
+		sc->sc_next = slab_allcaches;
+		slab_allcaches = sc;
+		spinlock_release(&slab_listlock);
+	}
+	else {
+		/* Someone else beat us to it. */
+		spinlock_release(&sc->sc_lock);
+	}
+}
+
+static
+inline
+void *
+slab_obj(struct slabcache *sc, struct slab *sl, unsigned index)
+{
+	return (char *)sl + sc->sc_objoffset + index * sc->sc_stride;
+}
+
+/*
+ * Get a page and construct all the objects on it. Doesn't add it to
+ * the cache. Called without sc_lock, since constructors can allocate.
+ */
+static
+struct slab *
+slab_grow(struct slabcache *sc)
+{
+	struct slab *sl;
+	vaddr_t page;
+	unsigned i, j;
+
+	page = alloc_kpages(1);
+	if (page == 0) {
+		return NULL;
+	}
+	sl = (struct slab *)page;
+	sl->sl_cache = sc;
+	sl->sl_next = sl->sl_prev = NULL;
+
+	for (i=0; i<sc->sc_perslab; i++) {
+		if (sc->sc_ctor != NULL && sc->sc_ctor(slab_obj(sc, sl, i))) {
+			if (sc->sc_dtor != NULL) {
+				for (j=0; j<i; j++) {
+					sc->sc_dtor(slab_obj(sc, sl, j));
+				}
+			}
+			free_kpages(page);
+			return NULL;
+		}
+		/* Hand out low addresses first. */
+		sl->sl_free[i] = sc->sc_perslab - 1 - i;
+	}
+	sl->sl_nfree = sc->sc_perslab;
+	return sl;
+}
+
+/*
+ * Destruct all the objects on an empty slab and free its page. It
+ * must already be off the cache's list. Called without sc_lock.
+ */
+static
+void
+slab_release(struct slabcache *sc, struct slab *sl)
+{
+	unsigned i;
+
+	KASSERT(sl->sl_nfree == sc->sc_perslab);
+	if (sc->sc_dtor != NULL) {
+		for (i=0; i<sc->sc_perslab; i++) {
+			sc->sc_dtor(slab_obj(sc, sl, i));
+		}
+	}
+	sl->sl_cache = NULL;
+	free_kpages((vaddr_t)sl);
+}
+
+static
+void
+slab_link(struct slabcache *sc, struct slab *sl)
+{
+	KASSERT(spinlock_do_i_hold(&sc->sc_lock));
+	sl->sl_prev = NULL;
+	sl->sl_next = sc->sc_slabs;
+	if (sc->sc_slabs != NULL) {
+		sc->sc_slabs->sl_prev = sl;
+	}
+	sc->sc_slabs = sl;
+}
+
+static
+void
+slab_unlink(struct slabcache *sc, struct slab *sl)
+{
+	KASSERT(spinlock_do_i_hold(&sc->sc_lock));
+	if (sl->sl_prev != NULL) {
+		sl->sl_prev->sl_next = sl->sl_next;
+	}
+	else {
+		KASSERT(sc->sc_slabs == sl);
+		sc->sc_slabs = sl->sl_next;
+	}
+	if (sl->sl_next != NULL) {
+		sl->sl_next->sl_prev = sl->sl_prev;
+	}
+	sl->sl_next = sl->sl_prev = NULL;
+}
+
+////////////////////////////////////////////////////////////
+// Cache setup and teardown
+
+void
+slab_init(struct slabcache *sc, const char *name, size_t size,
+	  int (*ctor)(void *), void (*dtor)(void *))
+{
+	KASSERT(size > 0);
+
+	sc->sc_name = name;
+	sc->sc_size = size;
+	sc->sc_ctor = ctor;
+	sc->sc_dtor = dtor;
+	spinlock_init(&sc->sc_lock);
+	sc->sc_ready = false;
+	sc->sc_next = NULL;
+}
+
+struct slabcache *
+slab_create(const char *name, size_t size,
+	    int (*ctor)(void *), void (*dtor)(void *))
+{
+	struct slabcache *sc;
+
+	sc = kmalloc(sizeof(*sc));
+	if (sc == NULL) {
+		return NULL;
+	}
+	slab_init(sc, name, size, ctor, dtor);
+	return sc;
+}
+
+void
+slab_destroy(struct slabcache *sc)
+{
+	struct slabcache **scp;
+	struct slab *sl;
+
+	if (sc->sc_ready) {
+		KASSERT(sc->sc_inuse == 0);
+
+		spinlock_acquire(&slab_listlock);
+		for (scp = &slab_allcaches; *scp != NULL;
+		     scp = &(*scp)->sc_next) {
+			if (*scp == sc) {
+				*scp = sc->sc_next;
+				break;
+			}
+		}
+		spinlock_release(&slab_listlock);
+
+		/* Nobody else may be using it, so no lock needed. */
+		while (sc->sc_slabs != NULL) {
+			sl = sc->sc_slabs;
+			sc->sc_slabs = sl->sl_next;
+			slab_release(sc, sl);
+		}
+	}
+	spinlock_cleanup(&sc->sc_lock);
+	kfree(sc);
+}
+
+////////////////////////////////////////////////////////////
+// Allocation
+
+void *
+slab_alloc(struct slabcache *sc)
+{
+	struct slab *sl;
+	unsigned index;
+
+	if (!sc->sc_ready) {
+		slab_layout(sc);
+	}
+
+	spinlock_acquire(&sc->sc_lock);
+	while (sc->sc_slabs == NULL) {
+		spinlock_release(&sc->sc_lock);
+		sl = slab_grow(sc);
+		if (sl == NULL) {
+			return NULL;
+		}
+		spinlock_acquire(&sc->sc_lock);
+		slab_link(sc, sl);
+		sc->sc_nslabs++;
+		sc->sc_nempty++;
+		sc->sc_grows++;
+	}
+
+	sl = sc->sc_slabs;
+	KASSERT(sl->sl_nfree > 0);
+	if (sl->sl_nfree == sc->sc_perslab) {
+		KASSERT(sc->sc_nempty > 0);
+		sc->sc_nempty--;
+	}
+	index = sl->sl_free[--sl->sl_nfree];
+	KASSERT(index < sc->sc_perslab);
+	if (sl->sl_nfree == 0) {
+		slab_unlink(sc, sl);
+	}
+	sc->sc_inuse++;
+	sc->sc_allocs++;
+	spinlock_release(&sc->sc_lock);
+
+	return slab_obj(sc, sl, index);
+}
+
+void
+slab_free(struct slabcache *sc, void *obj)
+{
+	struct slab *sl;
+	vaddr_t offset;
+	unsigned index;
+
+	if (obj == NULL) {
+		return;
+	}
+
+	sl = (struct slab *)((vaddr_t)obj & PAGE_FRAME);
+	offset = (vaddr_t)obj - (vaddr_t)sl;
+	if (sl->sl_cache != sc || offset < sc->sc_objoffset ||
+	    (offset - sc->sc_objoffset) % sc->sc_stride != 0) {
+		panic("slab_free: %s: bad object %p\n", sc->sc_name, obj);
+	}
+	index = (offset - sc->sc_objoffset) / sc->sc_stride;
+	KASSERT(index < sc->sc_perslab);
+
+	spinlock_acquire(&sc->sc_lock);
+	KASSERT(sl->sl_nfree < sc->sc_perslab);
+	if (sl->sl_nfree == 0) {
+		slab_link(sc, sl);
+	}
+	sl->sl_free[sl->sl_nfree++] = index;
+	KASSERT(sc->sc_inuse > 0);
+	sc->sc_inuse--;
+
+	if (sl->sl_nfree == sc->sc_perslab) {
+		if (sc->sc_nempty >= SLAB_MAXEMPTY) {
+			slab_unlink(sc, sl);
+			sc->sc_nslabs--;
+			spinlock_release(&sc->sc_lock);
+			slab_release(sc, sl);
+			return;
+		}
+		sc->sc_nempty++;
+	}
+	spinlock_release(&sc->sc_lock);
+}
+
+////////////////////////////////////////////////////////////
+// Stats
+
+void
+slab_printstats(void)
+{
+	struct slabcache *sc;
+
+	kprintf("%-16s %6s %6s %6s %6s %10s %6s\n", "cache", "size",
+		"perpg", "pages", "inuse", "allocs", "grows");
+
+	spinlock_acquire(&slab_listlock);
+	for (sc = slab_allcaches; sc != NULL; sc = sc->sc_next) {
+		spinlock_acquire(&sc->sc_lock);
+		kprintf("%-16s %6lu %6u %6u %6u %10lu %6lu\n", sc->sc_name,
+			(unsigned long)sc->sc_stride, sc->sc_perslab,
+			sc->sc_nslabs, sc->sc_inuse, sc->sc_allocs,
+			sc->sc_grows);
+		spinlock_release(&sc->sc_lock);
+	}
+	spinlock_release(&slab_listlock);
+}
@@ -354,6 +354,17 @@ docommand(char *buf)
 		__time(&startsecs, &startnsecs);
 	}
 
+#ifndef HOST
+	/*
+	 * Start the program directly instead of fork+exec, so the
+	 * kernel doesn't copy our whole image only to discard it.
+	 */
+	pid = spawn(args[0], args);
+	if (pid < 0) {
+		warn("%s", args[0]);
+		return _MKWAIT_EXIT(255);
+	}
+#else
 	pid = fork();
 	switch (pid) {
 		case -1:
@@ -375,6 +386,7 @@ docommand(char *buf)
 		default:
 			break;
 	}
+#endif
 
 	/* parent */
 	if (bg) {
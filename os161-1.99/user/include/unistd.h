@@ -44,6 +44,8 @@
 #include <kern/time.h>
 #include <kern/unistd.h>
 #include <kern/wait.h>
+#include <kern/syscallstat.h>
+#include <kern/futex.h>
 
 
 /*
@@ -154,6 +156,17 @@ int dup2(int filehandle, int newhandle);
 int pipe(int filehandles[2]);
 time_t __time(time_t *seconds, unsigned long *nanoseconds);
 int __getcwd(char *buf, size_t buflen);
+ssize_t pread(int filehandle, void *buf, size_t size, off_t pos);
+ssize_t pwrite(int filehandle, const void *buf, size_t size, off_t pos);
+
+/* OS/161 extensions. */
+pid_t spawn(const char *prog, char *const *args);
+int __syscallstat(int callno, struct syscallstat *buf);
+int __thread_create(void (*start)(int (*)(void *), void *),
+		    int (*func)(void *), void *arg);
+int thread_join(int tid, int *status);
+__DEAD void thread_exit(int status);
+int futex(volatile int *addr, int op, int val);
 /* stat - see sys/stat.h */
 /* lstat - see sys/stat.h */
 
@@ -162,6 +175,7 @@ int __getcwd(char *buf, size_t buflen);
  */
 
 char *getcwd(char *buf, size_t buflen);		/* calls __getcwd */
+int thread_create(int (*func)(void *), void *arg); /* calls __thread_create */
 time_t time(time_t *seconds);			/* calls __time */
 
 #endif /* _UNISTD_H_ */
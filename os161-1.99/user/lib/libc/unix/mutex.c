@@ -0,0 +1,132 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <unistd.h>
+#include <mutex.h>
+
+/*
+ * Futex-based mutex (after Drepper, "Futexes Are Tricky").
+ *
+ * Lock: try 0 -> 1. If that fails, mark the lock contended (2) and
+ * sleep in the kernel until we manage to take it, leaving it marked
+ * contended since others may still be waiting.
+ * Unlock: swap in 0; only if it was contended do we enter the kernel
+ * to wake a waiter.
+ */
+
+/* Atomically: prev = *p; if (prev == old) *p = new; return prev. */
+static
+inline
+int
+atomic_cas(volatile int *p, int old, int new)
+{
+	int prev, tmp;
+
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 instructions */
+		".set noreorder;"	/* we fill the delay slots */
+		"1: ll %0, 0(%3);"	/* prev = *p */
+		"bne %0, %4, 2f;"	/* if (prev != old) done */
+		" move %1, %5;"		/*   tmp = new (delay slot) */
+		"sc %1, 0(%3);"		/* *p = tmp; tmp = success? */
+		"beqz %1, 1b;"		/* retry if the store failed */
+		" nop;"
+		"2:"
+		".set pop"		/* restore assembler mode */
+		: "=&r" (prev), "=&r" (tmp), "+m" (*p)
+		: "r" (p), "r" (old), "r" (new)
+		: "memory");
+	return prev;
+}
+
+/* Atomically: prev = *p; *p = new; return prev. */
+static
+inline
+int
+atomic_swap(volatile int *p, int new)
+{
+	int prev, tmp;
+
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 instructions */
+		".set noreorder;"	/* we fill the delay slots */
+		"1: ll %0, 0(%3);"	/* prev = *p */
+		"move %1, %4;"		/* tmp = new */
+		"sc %1, 0(%3);"		/* *p = tmp; tmp = success? */
+		"beqz %1, 1b;"		/* retry if the store failed */
+		" nop;"
+		".set pop"		/* restore assembler mode */
+		: "=&r" (prev), "=&r" (tmp), "+m" (*p)
+		: "r" (p), "r" (new)
+		: "memory");
+	return prev;
+}
+
+void
+mutex_init(struct mutex *m)
+{
+	m->m_state = 0;
+}
+
+int
+mutex_trylock(struct mutex *m)
+{
+	return atomic_cas(&m->m_state, 0, 1) == 0 ? 0 : -1;
+}
+
+void
+mutex_lock(struct mutex *m)
+{
+	int c;
+
+	c = atomic_cas(&m->m_state, 0, 1);
+	if (c == 0) {
+		/* fast path: no kernel entry */
+		return;
+	}
+
+	if (c != 2) {
+		c = atomic_swap(&m->m_state, 2);
+	}
+	while (c != 0) {
+		/* sleeps only if the lock is still marked contended */
+		futex(&m->m_state, FUTEX_WAIT, 2);
+		c = atomic_swap(&m->m_state, 2);
+	}
+}
+
+void
+mutex_unlock(struct mutex *m)
+{
+	if (atomic_swap(&m->m_state, 0) == 2) {
+		futex(&m->m_state, FUTEX_WAKE, 1);
+	}
+}
@@ -56,6 +56,31 @@
 
 #include "disk.h"
 
+static
+void
+dumpjournal(uint32_t start, uint32_t nblocks)
+{
+	struct sfs_jheader jh;
+	uint32_t i, n;
+
+	diskread(&jh, start);
+	n = SWAPL(jh.jh_nblocks);
+	printf("Journal: %u blocks at %u", nblocks, start);
+	if (SWAPL(jh.jh_magic) != SFS_JMAGIC) {
+		printf(" (bad magic number)\n");
+		return;
+	}
+	if (n == 0) {
+		printf(" (clean)\n");
+		return;
+	}
+	printf(", %u blocks not yet replayed:\n", n);
+	for (i=0; i<n && i<SFS_JMAXBLOCKS; i++) {
+		printf("%u%c", SWAPL(jh.jh_blocks[i]), i%8==7 ? '\n' : ' ');
+	}
+	printf("\n");
+}
+
 static
 uint32_t
 dumpsb(void)
@@ -68,6 +93,10 @@ dumpsb(void)
 	sp.sp_volname[sizeof(sp.sp_volname)-1] = 0;
 	printf("Volume name: %-40s  %u blocks\n", sp.sp_volname, 
 	       SWAPL(sp.sp_nblocks));
+	if (SWAPL(sp.sp_journalblocks) > 0) {
+		dumpjournal(SWAPL(sp.sp_journalstart),
+			    SWAPL(sp.sp_journalblocks));
+	}
 
 	return SWAPL(sp.sp_nblocks);
 }
@@ -100,8 +129,8 @@ void
 dumpdir(uint32_t ino)
 {
 	struct sfs_inode sfi;
-	uint32_t ib[SFS_DBPERIDB];
-	int nentries, i;
+	uint32_t ib[SFS_DBPERIDB], dib[SFS_DBPERIDB];
+	int nentries, i, j;
 	uint32_t block, nblocks=0;
 
 	diskread(&sfi, ino);
@@ -110,7 +139,8 @@ dumpdir(uint32_t ino)
 	if (SWAPL(sfi.sfi_size) % sizeof(struct sfs_dir) != 0) {
 		warnx("Warning: dir size is not a multiple of dir entry size");
 	}
-	printf("Directory %u: %d entries\n", ino, nentries);
+	printf("Directory %u: %d entries%s\n", ino, nentries,
+	       (SWAPL(sfi.sfi_flags) & SFS_IFLAG_HASHDIR) ? " (hashed)" : "");
 
 	for (i=0; i<SFS_NDIRECT; i++) {
 		block = SWAPL(sfi.sfi_direct[i]);
@@ -129,6 +159,22 @@ dumpdir(uint32_t ino)
 			}
 		}
 	}
+	if (SWAPL(sfi.sfi_dindirect)) {
+		diskread(&dib, SWAPL(sfi.sfi_dindirect));
+		for (j=0; j<SFS_DBPERIDB; j++) {
+			if (SWAPL(dib[j]) == 0) {
+				continue;
+			}
+			diskread(&ib, SWAPL(dib[j]));
+			for (i=0; i<SFS_DBPERIDB; i++) {
+				block = SWAPL(ib[i]);
+				if (block) {
+					dodirblock(block);
+					nblocks++;
+				}
+			}
+		}
+	}
 	printf("    %u blocks in directory\n", nblocks);
 }
 
@@ -57,6 +57,9 @@
 
 #define MAXBITBLOCKS 32
 
+/* Volumes smaller than this many blocks don't get a journal */
+#define MINJOURNALFS (8*SFS_JOURNALSIZE)
+
 static
 void
 check(void)
@@ -64,6 +67,25 @@ check(void)
 	assert(sizeof(struct sfs_super)==SFS_BLOCKSIZE);
 	assert(sizeof(struct sfs_inode)==SFS_BLOCKSIZE);
 	assert(SFS_BLOCKSIZE % sizeof(struct sfs_dir) == 0);
+	assert(sizeof(struct sfs_jheader)==SFS_BLOCKSIZE);
+}
+
+/*
+ * Where the journal goes (just after the freemap), and how big it
+ * is; 0 if the volume is too small to bother.
+ */
+static
+uint32_t
+journalstart(uint32_t fsblocks)
+{
+	return SFS_MAP_LOCATION + SFS_BITBLOCKS(fsblocks);
+}
+
+static
+uint32_t
+journalblocks(uint32_t fsblocks)
+{
+	return fsblocks < MINJOURNALFS ? 0 : SFS_JOURNALSIZE;
 }
 
 static
@@ -81,6 +103,10 @@ writesuper(const char *volname, uint32_t nblocks)
 	sp.sp_magic = SWAPL(SFS_MAGIC);
 	sp.sp_nblocks = SWAPL(nblocks);
 	strcpy(sp.sp_volname, volname);
+	if (journalblocks(nblocks) > 0) {
+		sp.sp_journalstart = SWAPL(journalstart(nblocks));
+		sp.sp_journalblocks = SWAPL(journalblocks(nblocks));
+	}
 
 	diskwrite(&sp, SFS_SB_LOCATION);
 }
@@ -100,6 +126,23 @@ writerootdir(void)
 	diskwrite(&sfi, SFS_ROOT_LOCATION);
 }
 
+static
+void
+writejournal(uint32_t fsblocks)
+{
+	struct sfs_jheader jh;
+
+	if (journalblocks(fsblocks) == 0) {
+		return;
+	}
+
+	bzero((void *)&jh, sizeof(jh));
+	jh.jh_magic = SWAPL(SFS_JMAGIC);
+	jh.jh_nblocks = SWAPL(0);
+
+	diskwrite(&jh, journalstart(fsblocks));
+}
+
 static char bitbuf[MAXBITBLOCKS*SFS_BLOCKSIZE];
 
 static
@@ -133,6 +176,9 @@ writebitmap(uint32_t fsblocks)
 	for (i=0; i<nblocks; i++) {
 		doallocbit(SFS_MAP_LOCATION+i);
 	}
+	for (i=0; i<journalblocks(fsblocks); i++) {
+		doallocbit(journalstart(fsblocks)+i);
+	}
 	for (i=fsblocks; i<nbits; i++) {
 		doallocbit(i);
 	}
@@ -187,6 +233,7 @@ main(int argc, char **argv)
 
 	writesuper(volname, size);
 	writerootdir();
+	writejournal(size);
 	writebitmap(size);
 
 	closedisk();
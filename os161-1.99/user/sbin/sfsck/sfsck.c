@@ -83,6 +83,21 @@ swapsb(struct sfs_super *sp)
 {
 	sp->sp_magic = SWAPL(sp->sp_magic);
 	sp->sp_nblocks = SWAPL(sp->sp_nblocks);
+	sp->sp_journalstart = SWAPL(sp->sp_journalstart);
+	sp->sp_journalblocks = SWAPL(sp->sp_journalblocks);
+}
+
+static
+void
+swapjheader(struct sfs_jheader *jh)
+{
+	unsigned i;
+
+	jh->jh_magic = SWAPL(jh->jh_magic);
+	jh->jh_nblocks = SWAPL(jh->jh_nblocks);
+	for (i=0; i<SFS_JMAXBLOCKS; i++) {
+		jh->jh_blocks[i] = SWAPL(jh->jh_blocks[i]);
+	}
 }
 
 static
@@ -126,6 +141,8 @@ swapinode(struct sfs_inode *sfi)
 	sfi->sfi_tindirect = SWAPL(sfi->sfi_tindirect);
 #endif
 #endif
+
+	sfi->sfi_flags = SWAPL(sfi->sfi_flags);
 }
 
 static
@@ -172,6 +189,7 @@ domalloc(size_t len)
 typedef enum {
 	B_SUPERBLOCK,	/* Block that is the superblock */
 	B_BITBLOCK,	/* Block used by free-block bitmap */
+	B_JOURNAL,	/* Block used by the journal */
 	B_INODE,	/* Block that is an inode */
 	B_IBLOCK,	/* Indirect (or doubly-indirect etc.) block */
 	B_DIRDATA,	/* Data block of a directory */
@@ -210,6 +228,7 @@ blockusagestr(blockusage_t how, uint32_t howdesc)
 	switch (how) {
 	    case B_SUPERBLOCK: return "superblock";
 	    case B_BITBLOCK: return "bitmap block";
+	    case B_JOURNAL: return "journal block";
 	    case B_INODE: return "inode";
 	    case B_IBLOCK: 
 		snprintf(rv, sizeof(rv), "indirect block of inode %lu", 
@@ -508,6 +527,85 @@ checkbadstring(char *buf)
 
 ////////////////////////////////////////////////////////////
 
+static
+void
+clear_journal(uint32_t start)
+{
+	struct sfs_jheader jh;
+
+	bzero(&jh, sizeof(jh));
+	jh.jh_magic = SFS_JMAGIC;
+	jh.jh_nblocks = 0;
+	swapjheader(&jh);
+	diskwrite(&jh, start);
+}
+
+/*
+ * Finish any updates left in the journal (see <kern/sfs.h>), so the
+ * rest of the checks see the volume the way the kernel would after
+ * mounting it. Returns nonzero if anything was replayed.
+ */
+static
+int
+check_journal(const struct sfs_super *sp)
+{
+	struct sfs_jheader jh;
+	char buf[SFS_BLOCKSIZE];
+	uint32_t start, i, n;
+
+	if (sp->sp_journalblocks == 0) {
+		return 0;
+	}
+
+	start = sp->sp_journalstart;
+	if (start < SFS_MAP_LOCATION + SFS_BITBLOCKS(sp->sp_nblocks) ||
+	    start >= sp->sp_nblocks ||
+	    sp->sp_journalblocks > sp->sp_nblocks - start) {
+		errx(EXIT_UNRECOV, "Journal location is invalid");
+	}
+
+	diskread(&jh, start);
+	swapjheader(&jh);
+	if (jh.jh_magic != SFS_JMAGIC) {
+		warnx("Journal header has bad magic number (fixed)");
+		setbadness(EXIT_RECOV);
+		clear_journal(start);
+		return 0;
+	}
+
+	n = jh.jh_nblocks;
+	if (n == 0) {
+		return 0;
+	}
+	if (n > SFS_JMAXBLOCKS || n > sp->sp_journalblocks - 1) {
+		warnx("Journal header has invalid block count %lu "
+		      "(cleared; not replayed)", (unsigned long) n);
+		setbadness(EXIT_RECOV);
+		clear_journal(start);
+		return 0;
+	}
+	for (i=0; i<n; i++) {
+		if (jh.jh_blocks[i] >= sp->sp_nblocks) {
+			warnx("Journal entry %lu has invalid block %lu "
+			      "(cleared; not replayed)", (unsigned long) i,
+			      (unsigned long) jh.jh_blocks[i]);
+			setbadness(EXIT_RECOV);
+			clear_journal(start);
+			return 0;
+		}
+	}
+
+	for (i=0; i<n; i++) {
+		diskread(buf, start + 1 + i);
+		diskwrite(buf, jh.jh_blocks[i]);
+	}
+	clear_journal(start);
+
+	warnx("Replayed %lu blocks from journal (fixed)", (unsigned long) n);
+	setbadness(EXIT_RECOV);
+	return 1;
+}
+
 static
 void
 check_sb(void)
@@ -522,6 +620,15 @@ check_sb(void)
 		errx(EXIT_UNRECOV, "Not an sfs filesystem");
 	}
 
+	if (check_journal(&sp)) {
+		/* The superblock might have been in it */
+		diskread(&sp, SFS_SB_LOCATION);
+		swapsb(&sp);
+		if (sp.sp_magic != SFS_MAGIC) {
+			errx(EXIT_UNRECOV, "Not an sfs filesystem");
+		}
+	}
+
 	assert(nblocks==0);
 	assert(bitblocks==0);
 	nblocks = sp.sp_nblocks;
@@ -554,6 +661,9 @@ check_sb(void)
 	for (i=0; i<bitblocks; i++) {
 		bitmap_mark(SFS_MAP_LOCATION+i, B_BITBLOCK, i);
 	}
+	for (i=0; i<sp.sp_journalblocks; i++) {
+		bitmap_mark(sp.sp_journalstart+i, B_JOURNAL, i);
+	}
 }
 
 ////////////////////////////////////////////////////////////
@@ -918,6 +1028,47 @@ dir_tryadd(struct sfs_dir *d, int nd, const char *name, uint32_t ino)
 	return -1;
 }
 
+/* hash function for hashed directories; see kern/sfs.h */
+static
+uint32_t
+dirhash(const char *name)
+{
+	uint32_t hash = SFS_DIRHASH_BASIS;
+
+	while (*name) {
+		hash = (hash ^ (unsigned char)*name) * SFS_DIRHASH_PRIME;
+		name++;
+	}
+	return hash;
+}
+
+/*
+ * Check that every entry of a hashed directory can be reached from
+ * its hash slot without crossing an empty slot; returns nonzero if
+ * not.
+ */
+static
+int
+check_hashdir(struct sfs_dir *d, uint32_t nd)
+{
+	uint32_t i, j;
+
+	if (nd == 0) {
+		return 1;
+	}
+	for (i=0; i<nd; i++) {
+		if (d[i].sfd_ino == SFS_NOINO) {
+			continue;
+		}
+		for (j = dirhash(d[i].sfd_name) % nd; j != i; j = (j+1) % nd) {
+			if (d[j].sfd_ino == SFS_NOINO) {
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
 static
 int
 check_dir_entry(const char *pathsofar, uint32_t index, struct sfs_dir *sfd)
@@ -1194,6 +1345,20 @@ check_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
 		ichanged = 1;
 	}
 
+	/*
+	 * Do this last, since the fixes above can move entries around
+	 * or change the size. If the hash table is no good, the
+	 * directory is still fine as a plain linear one.
+	 */
+	if ((sfi.sfi_flags & SFS_IFLAG_HASHDIR) &&
+	    check_hashdir(direntries, ndirentries)) {
+		setbadness(EXIT_RECOV);
+		warnx("Directory /%s: Hash table out of order (made linear)",
+		      pathsofar);
+		sfi.sfi_flags &= ~SFS_IFLAG_HASHDIR;
+		ichanged = 1;
+	}
+
 	if (dchanged) {
 		dirwrite(&sfi, direntries, ndirentries);
 	}
@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <err.h>
+
+/*
+ * syscallstat - print system call counts and latency histograms.
+ * Usage: syscallstat
+ *
+ * For every system call that has been used, prints the number of
+ * calls, the mean latency in cycles, and the nonzero buckets of the
+ * log2 latency histogram. Bucket "2^N" counts calls that took from
+ * 2^N up to 2^(N+1)-1 cycles.
+ */
+
+int
+main(void)
+{
+	struct syscallstat ss;
+	int i, j;
+
+	for (i=0; i<SYSCALLSTAT_NCALLS; i++) {
+		if (__syscallstat(i, &ss) < 0) {
+			err(1, "__syscallstat %d", i);
+		}
+		if (ss.ss_calls == 0) {
+			continue;
+		}
+
+		printf("%-16s %8u calls", ss.ss_name, ss.ss_calls);
+		if (ss.ss_timed > 0) {
+			printf(", mean %llu cycles",
+			       ss.ss_cycles / ss.ss_timed);
+		}
+		printf("\n");
+
+		for (j=0; j<SYSCALLSTAT_NBUCKETS; j++) {
+			if (ss.ss_hist[j] != 0) {
+				printf("    2^%-2d %8u\n", j, ss.ss_hist[j]);
+			}
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,138 @@
+/*
+ * Copyright (c) 2013
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * copybench - time system calls whose cost is mostly copyin/copyout.
+ * Usage: copybench [iterations]
+ *
+ * Three loops, each timed with __time:
+ *
+ *   execv   execv of a long nonexistent path with several long
+ *           arguments. The kernel copies the path and every argument
+ *           in (copyin and copyinstr) before discovering the file
+ *           isn't there, so this is almost all string copying.
+ *   stat    __syscallstat, which copies a couple hundred bytes out.
+ *   time    __time, two small copyouts; the per-call baseline.
+ *
+ * Compare the per-call times across kernels to see the effect of
+ * changes to the copy routines.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <err.h>
+#include <kern/syscall.h>
+
+#define DEFAULT_ITERS 2000
+#define PATHLEN 200
+#define NARGS 8
+#define ARGLEN 120
+
+static char path[PATHLEN];
+static char argbufs[NARGS][ARGLEN];
+static char *args[NARGS+1];
+
+static
+void
+fill(char *buf, size_t len, char c)
+{
+	memset(buf, c, len-1);
+	buf[len-1] = 0;
+}
+
+/*
+ * Return microseconds elapsed since the time in *S, *NS.
+ */
+static
+unsigned long
+elapsed(time_t s, unsigned long ns)
+{
+	time_t s2;
+	unsigned long ns2;
+
+	__time(&s2, &ns2);
+	return (s2 - s) * 1000000UL + ns2 / 1000 - ns / 1000;
+}
+
+static
+void
+report(const char *name, unsigned iters, unsigned long usec)
+{
+	printf("%-6s %6u calls %10lu us %8llu ns/call\n", name, iters, usec,
+	       iters > 0 ? usec * 1000ULL / iters : 0ULL);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct syscallstat ss;
+	unsigned iters, i;
+	time_t s;
+	unsigned long ns;
+
+	iters = DEFAULT_ITERS;
+	if (argc > 1) {
+		iters = atoi(argv[1]);
+	}
+
+	path[0] = '/';
+	fill(path+1, PATHLEN-1, 'p');
+	for (i=0; i<NARGS; i++) {
+		fill(argbufs[i], ARGLEN, 'a' + i);
+		args[i] = argbufs[i];
+	}
+	args[NARGS] = NULL;
+
+	__time(&s, &ns);
+	for (i=0; i<iters; i++) {
+		if (execv(path, args) != -1 || errno != ENOENT) {
+			err(1, "execv of nonexistent file");
+		}
+	}
+	report("execv", iters, elapsed(s, ns));
+
+	__time(&s, &ns);
+	for (i=0; i<iters; i++) {
+		if (__syscallstat(SYS___time, &ss) < 0) {
+			err(1, "__syscallstat");
+		}
+	}
+	report("stat", iters, elapsed(s, ns));
+
+	__time(&s, &ns);
+	for (i=0; i<iters; i++) {
+		__time(NULL, NULL);
+	}
+	report("time", iters, elapsed(s, ns));
+
+	return 0;
+}
@@ -0,0 +1,130 @@
+/*
+ * Copyright (c) 2013
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * mutextest - contend on a libc mutex from several user threads.
+ * Usage: mutextest [iterations]
+ *
+ * Each thread bumps a shared counter under the mutex, with a system
+ * call inside the critical section so the holder is often preempted
+ * and the others pile up in futex(FUTEX_WAIT). To be sure the wait
+ * and wake paths are hit at least once, main holds the lock while
+ * the threads start and lets go only after one of them has marked it
+ * contended. A lost wakeup shows up as a hang; a broken lock as a
+ * wrong count.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <mutex.h>
+#include <err.h>
+
+#define NTHREADS 4
+#define DEFAULT_ITERS 2000
+#define MAXPOLLS 1000000
+
+static struct mutex lock = MUTEX_INITIALIZER;
+static volatile unsigned counter;
+static unsigned contended;
+static unsigned iters;
+
+static
+int
+worker(void *arg)
+{
+	unsigned i, c;
+
+	(void)arg;
+	for (i=0; i<iters; i++) {
+		mutex_lock(&lock);
+		c = counter;
+		/* give up the cpu now and then with the lock held */
+		getpid();
+		counter = c + 1;
+		if (lock.m_state == 2) {
+			contended++;
+		}
+		mutex_unlock(&lock);
+	}
+	return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+	int tids[NTHREADS];
+	unsigned i, polls;
+
+	iters = DEFAULT_ITERS;
+	if (argc > 1) {
+		iters = atoi(argv[1]);
+	}
+
+	mutex_lock(&lock);
+	if (mutex_trylock(&lock) == 0) {
+		errx(1, "trylock succeeded on a held mutex");
+	}
+
+	for (i=0; i<NTHREADS; i++) {
+		tids[i] = thread_create(worker, NULL);
+		if (tids[i] < 0) {
+			err(1, "thread_create");
+		}
+	}
+
+	/* wait for someone to block on the lock */
+	for (polls=0; lock.m_state != 2; polls++) {
+		if (polls == MAXPOLLS) {
+			errx(1, "no thread ever waited for the mutex");
+		}
+		getpid();
+	}
+	mutex_unlock(&lock);
+
+	for (i=0; i<NTHREADS; i++) {
+		if (thread_join(tids[i], NULL) < 0) {
+			err(1, "thread_join");
+		}
+	}
+
+	if (mutex_trylock(&lock) != 0) {
+		errx(1, "trylock failed on a free mutex");
+	}
+	mutex_unlock(&lock);
+
+	printf("mutextest: %u threads, %u contended acquisitions\n",
+	       NTHREADS, contended);
+	if (counter != NTHREADS * iters) {
+		errx(1, "Failed: counter is %u, expected %u",
+		     counter, NTHREADS * iters);
+	}
+	warnx("Passed.");
+	return 0;
+}
@@ -37,10 +37,11 @@
  *
  * It also makes various assumptions about the thread API. In
  * particular, it believes (1) that you create a thread by calling
- * "threadfork()" and passing the address for execution of the new
- * thread to begin at, (2) that if the parent thread exits any child
- * threads will keep running, and (3) child threads will exit if they
- * return from the function they started in. If any or all of these
+ * "thread_create()" and passing the address for execution of the new
+ * thread to begin at, (2) that the parent must thread_join() its
+ * children, since exiting the process ends all its threads, and (3)
+ * child threads will exit if they return from the function they
+ * started in. If any or all of these
  * assumptions are not met by your user-level threads, you will need
  * to patch this test accordingly.
  *
@@ -61,22 +62,32 @@
 volatile int count = 0;
 
 /* the 2 threads : */
-void ThreadRunner(void);
-void BladeRunner(void);
+int ThreadRunner(void *);
+int BladeRunner(void *);
 
 int
 main(int argc, char *argv[])
 {
     int i;
+    int tids[NTHREADS];
 
     (void)argc;
     (void)argv;
 
     for (i=0; i<NTHREADS; i++) {
 	if (i)
-	    threadfork(ThreadRunner);
+	    tids[i] = thread_create(ThreadRunner, NULL);
         else
-	    threadfork(BladeRunner);
+	    tids[i] = thread_create(BladeRunner, NULL);
+	if (tids[i] < 0) {
+	    printf("thread_create failed\n");
+	    return 1;
+	}
+    }
+
+    /* exiting the process takes its threads with it, so wait */
+    for (i=0; i<NTHREADS; i++) {
+	thread_join(tids[i], NULL);
     }
 
     printf("Parent has left.\n");
@@ -88,23 +99,27 @@ main(int argc, char *argv[])
    random results.
 */
 
-void
-BladeRunner()
+int
+BladeRunner(void *arg)
 {
+    (void)arg;
     while (count < MAX) {
 	if (count % 500 == 0)
 	    printf("Blade ");
 	count++;
     }
+    return 0;
 }
 
-void
-ThreadRunner()
+int
+ThreadRunner(void *arg)
 {
+    (void)arg;
     while (count < MAX) {
 	if (count % 513 == 0)
 	    printf(" Runner\n");
 	count++;
     }
+    return 0;
 }
     